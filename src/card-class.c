@@ -0,0 +1,205 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file card-class.c
+ * @brief Remember what RATS told about a card type
+ *
+ * 4 byte UIDs are random or made up per card, they do not tell anything
+ * about the type, which then rests on ATQA and SAK alone.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "card-class.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nfc/nfc.h>
+
+#include "nfc-utils.h"
+
+#define MAX_CLASSES 64
+
+// One card type
+struct card_class {
+  uint8_t  abtAtqa[2];
+  uint8_t  btSak;
+  bool     bPrefix;             // btManufacturer counts
+  uint8_t  btManufacturer;
+  uint8_t  uiBlocks;            // last block
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct card_class accClasses[MAX_CLASSES];
+static size_t szClasses = 0;
+
+static void
+key_of(const nfc_iso14443a_info *pnai, struct card_class *pcc)
+{
+  memcpy(pcc->abtAtqa, pnai->abtAtqa, 2);
+  pcc->btSak = pnai->btSak;
+  pcc->bPrefix = pnai->szUidLen > 4;
+  pcc->btManufacturer = pcc->bPrefix ? pnai->abtUid[0] : 0;
+}
+
+static struct card_class *
+find_class(const struct card_class *pccKey)
+{
+  for (size_t n = 0; n < szClasses; n++) {
+    if (memcmp(accClasses[n].abtAtqa, pccKey->abtAtqa, 2) == 0 && accClasses[n].btSak == pccKey->btSak
+        && accClasses[n].bPrefix == pccKey->bPrefix && accClasses[n].btManufacturer == pccKey->btManufacturer)
+      return &accClasses[n];
+  }
+  return NULL;
+}
+
+/**
+ * @brief Size of a card of a known type
+ * @return Returns false if the type has not been probed yet.
+ */
+bool
+card_class_lookup(const nfc_iso14443a_info *pnai, uint8_t *puiBlocks)
+{
+  struct card_class ccKey, *pcc;
+
+  key_of(pnai, &ccKey);
+  pthread_mutex_lock(&mutex);
+  if ((pcc = find_class(&ccKey)) != NULL)
+    *puiBlocks = pcc->uiBlocks;
+  pthread_mutex_unlock(&mutex);
+  return pcc != NULL;
+}
+
+/**
+ * @brief Remember what probing a card found for its type
+ */
+void
+card_class_store(const nfc_iso14443a_info *pnai, uint8_t uiBlocks)
+{
+  struct card_class ccKey, *pcc;
+
+  key_of(pnai, &ccKey);
+  pthread_mutex_lock(&mutex);
+  if ((pcc = find_class(&ccKey)) == NULL && szClasses < MAX_CLASSES) {
+    pcc = &accClasses[szClasses++];
+    *pcc = ccKey;
+  }
+  if (pcc != NULL)
+    pcc->uiBlocks = uiBlocks;
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Load the card types known from previous runs
+ * @return Returns false if the file exists but cannot be parsed.
+ *
+ * One line per card type, the manufacturer byte is - for 4 byte UIDs:
+ * <ATQA> TAB <SAK> TAB <manufacturer> TAB <bytes>
+ * A fifth field, the magic type older files kept, is ignored.
+ */
+bool
+card_class_load(const char *pcPath)
+{
+  char acLine[128];
+  FILE *pf = fopen(pcPath, "r");
+
+  if (pf == NULL)
+    return true;
+  pthread_mutex_lock(&mutex);
+  while (fgets(acLine, sizeof(acLine), pf) != NULL) {
+    unsigned int uiAtqa, uiSak, uiManufacturer = 0, uiBytes;
+    char acManufacturer[4];
+    struct card_class cc, *pcc;
+
+    if (sscanf(acLine, "%4x\t%2x\t%3s\t%u", &uiAtqa, &uiSak, acManufacturer, &uiBytes) != 4
+        || (strcmp(acManufacturer, "-") != 0 && sscanf(acManufacturer, "%2x", &uiManufacturer) != 1)
+        || uiBytes < 16 || uiBytes > 4096 || uiBytes % 16 != 0)
+      goto error;
+    cc.abtAtqa[0] = uiAtqa >> 8;
+    cc.abtAtqa[1] = uiAtqa & 0xff;
+    cc.btSak = uiSak;
+    cc.bPrefix = strcmp(acManufacturer, "-") != 0;
+    cc.btManufacturer = uiManufacturer;
+    cc.uiBlocks = uiBytes / 16 - 1;
+    if ((pcc = find_class(&cc)) == NULL && szClasses < MAX_CLASSES)
+      pcc = &accClasses[szClasses++];
+    if (pcc != NULL)
+      *pcc = cc;
+  }
+  pthread_mutex_unlock(&mutex);
+  fclose(pf);
+  return true;
+
+error:
+  pthread_mutex_unlock(&mutex);
+  fclose(pf);
+  ERR("Invalid card class file: %s", pcPath);
+  return false;
+}
+
+bool
+card_class_save(const char *pcPath)
+{
+  FILE *pf = fopen(pcPath, "w");
+  bool bSuccess;
+
+  if (pf == NULL) {
+    ERR("Unable to write card class file: %s", pcPath);
+    return false;
+  }
+  pthread_mutex_lock(&mutex);
+  for (size_t n = 0; n < szClasses; n++) {
+    const struct card_class *pcc = &accClasses[n];
+
+    fprintf(pf, "%02x%02x\t%02x\t", pcc->abtAtqa[0], pcc->abtAtqa[1], pcc->btSak);
+    if (pcc->bPrefix)
+      fprintf(pf, "%02x", pcc->btManufacturer);
+    else
+      fprintf(pf, "-");
+    fprintf(pf, "\t%u\n", (pcc->uiBlocks + 1) * 16);
+  }
+  pthread_mutex_unlock(&mutex);
+  bSuccess = (fclose(pf) == 0);
+  if (!bSuccess)
+    ERR("Unable to write card class file: %s", pcPath);
+  return bSuccess;
+}
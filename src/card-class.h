@@ -0,0 +1,64 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file card-class.h
+ * @brief Remember what RATS told about a card type
+ *
+ * Telling a MIFARE Plus 2K from a plain MIFARE Classic takes a RATS, a field
+ * cycle and a reselect. Card types are identified by ATQA, SAK and, for 7 and
+ * 10 byte UIDs, the manufacturer byte, so the probe for the size is only
+ * needed the first time a type is seen.
+ *
+ * A gen2 magic card answers with the ATQA and SAK of the card it copies, only
+ * its own ATS gives it away: the magic type is never cached.
+ */
+
+#ifndef _CARD_CLASS_H_
+#  define _CARD_CLASS_H_
+
+#  include <stdbool.h>
+#  include <stdint.h>
+
+#  include <nfc/nfc-types.h>
+
+bool    card_class_lookup(const nfc_iso14443a_info *pnai, uint8_t *puiBlocks);
+void    card_class_store(const nfc_iso14443a_info *pnai, uint8_t uiBlocks);
+
+bool    card_class_load(const char *pcPath);
+bool    card_class_save(const char *pcPath);
+
+#endif // _CARD_CLASS_H_
@@ -0,0 +1,341 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file iso-dep.c
+ * @brief ISO14443-4 (ISO-DEP) half-duplex block transmission protocol
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "iso-dep.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include "metrics.h"
+#include "nfc-transport.h"
+#include "nfc-utils.h"
+
+#define FSDI 8                  // we take frames of up to 256 bytes
+#define FRAME_MAX 254           // 256 less the CRC, the reader handles it
+#define FWI_DEFAULT 4
+#define FWT_UNIT_US 302         // 4096 / 13.56 MHz, FWT and SFGT are this times 2^FWI or 2^SFGI
+#define FWT_MARGIN_MS 4
+#define RATS_TIMEOUT_MS 10      // 65536 / 13.56 MHz, with margin
+#define RETRIES 3
+
+#define PCB_I 0x02
+#define PCB_R 0xa2
+#define PCB_S 0xc2
+#define PCB_BLOCK_NUMBER 0x01
+#define PCB_NAD 0x04
+#define PCB_CID 0x08
+#define PCB_CHAINING 0x10       // I-block
+#define PCB_NAK 0x10            // R-block
+#define PCB_WTX 0x30            // S-block, else DESELECT
+
+#define IS_I_BLOCK(pcb) (((pcb) & 0xe2) == PCB_I)
+#define IS_R_BLOCK(pcb) (((pcb) & 0xe6) == PCB_R)
+#define IS_S_BLOCK(pcb) (((pcb) & 0xc7) == PCB_S)
+
+struct iso_dep {
+  nfc_device *pnd;
+  uint8_t  btCid;
+  bool     bCid;                // the card takes a CID byte
+  uint8_t  btBlockNumber;
+  size_t   szFsc;               // largest frame the card takes, CRC included
+  uint32_t uiFwtUs;
+  uint8_t  abtAts[ISO_DEP_ATS_MAX];
+  size_t   szAts;
+};
+
+static const size_t aszFsc[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+
+static size_t
+header_length(uint8_t btPcb)
+{
+  return 1 + ((btPcb & PCB_CID) ? 1 : 0) + ((IS_I_BLOCK(btPcb) && (btPcb & PCB_NAD)) ? 1 : 0);
+}
+
+static size_t
+make_header(const iso_dep *pid, uint8_t *pbtBlock, uint8_t btPcb)
+{
+  if (!pid->bCid) {
+    pbtBlock[0] = btPcb;
+    return 1;
+  }
+  pbtBlock[0] = btPcb | PCB_CID;
+  pbtBlock[1] = pid->btCid;
+  return 2;
+}
+
+static int
+timeout_ms(const iso_dep *pid, uint32_t uiWtxm)
+{
+  uint32_t uiFwtUs = MIN(pid->uiFwtUs * uiWtxm, FWT_UNIT_US << 14);
+
+  return (uiFwtUs + 999) / 1000 + FWT_MARGIN_MS;
+}
+
+static int
+exchange(iso_dep *pid, const uint8_t *pbtTx, size_t szTx, uint8_t *pbtAnswer, int iTimeoutMs)
+{
+  struct timespec tsStart;
+  int res;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  res = nfct_initiator_transceive_bytes(pid->pnd, pbtTx, szTx, pbtAnswer, FRAME_MAX, iTimeoutMs);
+  metrics_time(pid->pnd, METRIC_RAW_BYTES, &tsStart);
+  if (res < 0)
+    return res;
+  // A block too short for its header, or addressed to another card, is as good as none
+  if (res == 0 || (size_t) res < header_length(pbtAnswer[0])
+      || ((pbtAnswer[0] & PCB_CID) && (pbtAnswer[1] & 0x0f) != pid->btCid))
+    return NFC_ERFTRANS;
+  return res;
+}
+
+/**
+ * Send a block and return the answer to it, granting the waiting time
+ * extensions the card asks for and asking again for lost or garbled answers
+ */
+static int
+send_block(iso_dep *pid, const uint8_t *pbtBlock, size_t szBlock, uint8_t *pbtAnswer)
+{
+  uint8_t  abtFrame[3];
+  const uint8_t *pbtTx = pbtBlock;
+  size_t   szTx = szBlock;
+  uint32_t uiWtxm = 1;
+  int      iRetries = 0;
+  int      res;
+
+  for (;;) {
+    res = exchange(pid, pbtTx, szTx, pbtAnswer, timeout_ms(pid, uiWtxm));
+    uiWtxm = 1;
+    if (res > 0 && IS_S_BLOCK(pbtAnswer[0]) && (pbtAnswer[0] & PCB_WTX) == PCB_WTX
+        && (size_t) res > header_length(pbtAnswer[0])) {
+      // Grant the extension for the next answer only, echoing its multiplier
+      uiWtxm = pbtAnswer[header_length(pbtAnswer[0])] & 0x3f;
+      szTx = make_header(pid, abtFrame, PCB_S | PCB_WTX);
+      abtFrame[szTx++] = uiWtxm;
+      pbtTx = abtFrame;
+      if (uiWtxm == 0)
+        uiWtxm = 1;
+      continue;
+    }
+    if (res > 0 && IS_R_BLOCK(pbtAnswer[0]) && !(pbtAnswer[0] & PCB_NAK)
+        && (pbtAnswer[0] & PCB_BLOCK_NUMBER) != pid->btBlockNumber && pbtTx != pbtBlock) {
+      // The card acknowledges its previous block to our R(NAK): our block was lost, send it again
+      if (++iRetries > RETRIES)
+        return NFC_ERFTRANS;
+      metrics_count(pid->pnd, METRIC_RETRIES);
+      pbtTx = pbtBlock;
+      szTx = szBlock;
+      continue;
+    }
+    // A card never sends R(NAK)
+    if (res > 0 && !(IS_R_BLOCK(pbtAnswer[0]) && (pbtAnswer[0] & PCB_NAK)))
+      return res;
+
+    if (++iRetries > RETRIES)
+      return (res < 0) ? res : NFC_ERFTRANS;
+    metrics_count(pid->pnd, METRIC_RETRIES);
+    if (IS_I_BLOCK(pbtBlock[0])) {
+      // The card resends its answer, or tells with R(ACK) it never had our block
+      szTx = make_header(pid, abtFrame, PCB_R | PCB_NAK | pid->btBlockNumber);
+      pbtTx = abtFrame;
+    } else {
+      // R(ACK) asking for the next block of a chain, and S-blocks, are simply repeated
+      pbtTx = pbtBlock;
+      szTx = szBlock;
+    }
+  }
+}
+
+iso_dep *
+iso_dep_activate(nfc_device *pnd, uint8_t btCid, int *piError)
+{
+  const uint8_t abtRats[2] = { 0xe0, (FSDI << 4) | (btCid & 0x0f) };
+  uint8_t  abtAts[FRAME_MAX];
+  uint8_t  btFsci = 2, btFwi = FWI_DEFAULT, btSfgi = 0;
+  bool     bCid = true;
+  struct timespec tsStart;
+  iso_dep *pid;
+  int      res;
+
+  if ((res = nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, false)) < 0
+      || (res = nfct_device_set_property_bool(pnd, NP_HANDLE_CRC, true)) < 0)
+    goto fail;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  res = nfct_initiator_transceive_bytes(pnd, abtRats, sizeof(abtRats), abtAts, sizeof(abtAts), RATS_TIMEOUT_MS);
+  metrics_time(pnd, METRIC_RATS, &tsStart);
+  if (res < 0)
+    goto fail;
+  if (res == 0 || abtAts[0] != res) {
+    res = NFC_EIO;
+    goto fail;
+  }
+
+  // TL T0 [TA] [TB] [TC] historical bytes, T0 telling the interface bytes present
+  if (res > 1) {
+    size_t   szPos = 2;
+
+    btFsci = abtAts[1] & 0x0f;
+    if (abtAts[1] & 0x10)
+      szPos++;
+    if ((abtAts[1] & 0x20) && szPos < (size_t) res) {
+      btFwi = abtAts[szPos] >> 4;
+      btSfgi = abtAts[szPos] & 0x0f;
+      szPos++;
+    }
+    if ((abtAts[1] & 0x40) && szPos < (size_t) res)
+      bCid = (abtAts[szPos] & 0x02) != 0;
+  }
+  if (btFwi == 15)
+    btFwi = FWI_DEFAULT;
+  if (btSfgi == 15)
+    btSfgi = 0;
+
+  if ((pid = calloc(1, sizeof(*pid))) == NULL) {
+    ERR("Unable to allocate ISO-DEP state (malloc)");
+    res = NFC_ESOFT;
+    goto fail;
+  }
+  pid->pnd = pnd;
+  pid->btCid = btCid & 0x0f;
+  pid->bCid = bCid;
+  pid->szFsc = aszFsc[MIN(btFsci, 8)];
+  pid->uiFwtUs = FWT_UNIT_US << btFwi;
+  memcpy(pid->abtAts, abtAts, res);
+  pid->szAts = res;
+
+  // The card may need a guard time before it takes its first block
+  if (btSfgi > 0) {
+    uint32_t uiSfgtUs = FWT_UNIT_US << btSfgi;
+    struct timespec ts = { uiSfgtUs / 1000000, (uiSfgtUs % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+  }
+  return pid;
+
+fail:
+  if (piError != NULL)
+    *piError = res;
+  return NULL;
+}
+
+void
+iso_dep_free(iso_dep *pid)
+{
+  free(pid);
+}
+
+const uint8_t *
+iso_dep_ats(const iso_dep *pid, size_t *pszAts)
+{
+  *pszAts = pid->szAts;
+  return pid->abtAts;
+}
+
+/**
+ * Exchange an APDU, chaining it over as many I-blocks as the card's frame
+ * size needs and gathering a chained answer. Returns the length of the
+ * answer or a libnfc error.
+ */
+int
+iso_dep_transceive(iso_dep *pid, const uint8_t *pbtTx, size_t szTx, uint8_t *pbtRx, size_t szRx)
+{
+  uint8_t  abtBlock[FRAME_MAX], abtAnswer[FRAME_MAX];
+  size_t   szInfMax = MIN(pid->szFsc - 2, FRAME_MAX) - (pid->bCid ? 2 : 1);
+  size_t   szSent = 0, szReceived = 0;
+  size_t   szBlock;
+  int      res;
+
+  do {
+    size_t   szInf = MIN(szTx - szSent, szInfMax);
+    bool     bChaining = szSent + szInf < szTx;
+
+    szBlock = make_header(pid, abtBlock, PCB_I | pid->btBlockNumber | (bChaining ? PCB_CHAINING : 0));
+    memcpy(abtBlock + szBlock, pbtTx + szSent, szInf);
+    if ((res = send_block(pid, abtBlock, szBlock + szInf, abtAnswer)) < 0)
+      return res;
+    szSent += szInf;
+    if (bChaining) {
+      if (!IS_R_BLOCK(abtAnswer[0]) || (abtAnswer[0] & PCB_BLOCK_NUMBER) != pid->btBlockNumber)
+        return NFC_EIO;
+      pid->btBlockNumber ^= PCB_BLOCK_NUMBER;
+    }
+  } while (szSent < szTx);
+
+  for (;;) {
+    size_t   szHeader = header_length(abtAnswer[0]);
+
+    if (!IS_I_BLOCK(abtAnswer[0]) || (abtAnswer[0] & PCB_BLOCK_NUMBER) != pid->btBlockNumber)
+      return NFC_EIO;
+    pid->btBlockNumber ^= PCB_BLOCK_NUMBER;
+    if (szReceived + (res - szHeader) > szRx)
+      return NFC_EOVFLOW;
+    memcpy(pbtRx + szReceived, abtAnswer + szHeader, res - szHeader);
+    szReceived += res - szHeader;
+    if (!(abtAnswer[0] & PCB_CHAINING))
+      return szReceived;
+    // Ask for the next block of the card's chain
+    szBlock = make_header(pid, abtBlock, PCB_R | pid->btBlockNumber);
+    if ((res = send_block(pid, abtBlock, szBlock, abtAnswer)) < 0)
+      return res;
+  }
+}
+
+int
+iso_dep_deselect(iso_dep *pid)
+{
+  uint8_t  abtBlock[2], abtAnswer[FRAME_MAX];
+  int      res;
+
+  res = send_block(pid, abtBlock, make_header(pid, abtBlock, PCB_S), abtAnswer);
+  if (res < 0)
+    return res;
+  if (!IS_S_BLOCK(abtAnswer[0]) || (abtAnswer[0] & PCB_WTX) != 0)
+    return NFC_EIO;
+  return NFC_SUCCESS;
+}
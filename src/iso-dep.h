@@ -0,0 +1,71 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file iso-dep.h
+ * @brief ISO14443-4 (ISO-DEP) half-duplex block transmission protocol
+ *
+ * iso_dep_activate() sends RATS to a selected ISO14443-4 card and parses its
+ * ATS for the frame size, frame waiting time and CID support. APDUs are then
+ * exchanged with iso_dep_transceive(), which splits and reassembles chained
+ * I-blocks, tracks the block number, answers waiting time extensions and
+ * recovers lost or garbled blocks with R-blocks.
+ *
+ * Activation leaves the reader in raw framing with the reader checking and
+ * appending the CRC.
+ */
+
+#ifndef _ISO_DEP_H_
+#  define _ISO_DEP_H_
+
+#  include <stddef.h>
+#  include <stdint.h>
+
+#  include <nfc/nfc-types.h>
+
+#  define ISO_DEP_ATS_MAX 254
+
+typedef struct iso_dep iso_dep;
+
+iso_dep *iso_dep_activate(nfc_device *pnd, uint8_t btCid, int *piError);
+void    iso_dep_free(iso_dep *pid);
+
+const uint8_t *iso_dep_ats(const iso_dep *pid, size_t *pszAts);
+int     iso_dep_transceive(iso_dep *pid, const uint8_t *pbtTx, size_t szTx, uint8_t *pbtRx, size_t szRx);
+int     iso_dep_deselect(iso_dep *pid);
+
+#endif // _ISO_DEP_H_
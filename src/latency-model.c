@@ -0,0 +1,341 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file latency-model.c
+ * @brief Learn command response latencies and derive transceive timeouts
+ *
+ * Bucket i counts latencies up to 100 us * 2^((i + 1) / 4), which covers
+ * 100 us to about 6.5 s with a 19% resolution. Counts are halved when a
+ * histogram gets large so the model follows a drifting reader.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "latency-model.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nfc/nfc.h>
+
+#include "nfc-transport.h"
+#include "nfc-utils.h"
+
+#define BUCKETS 64
+#define MAX_MODELS 64
+#define MAX_ATTACHED 64
+#define MIN_SAMPLES 16
+#define MAX_SAMPLES 4096
+#define MIN_TIMEOUT_MS 2
+
+static const char *acCmdNames[LATENCY_CMD_COUNT] = { "auth", "read", "write", "raw" };
+
+// One reader and card type
+struct latency_model {
+  char     acReader[128];
+  char     acCard[32];
+  uint32_t aauiBuckets[LATENCY_CMD_COUNT][BUCKETS];
+  uint32_t auiSamples[LATENCY_CMD_COUNT];
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct latency_model amModels[MAX_MODELS];
+static size_t szModels = 0;
+
+// Devices currently learning, several readers of the same name may share a model
+static struct {
+  const nfc_device *pnd;
+  struct latency_model *pm;
+} aAttached[MAX_ATTACHED];
+static size_t szAttached = 0;
+
+// Upper bound of bucket i, in microseconds
+static double
+bucket_bound(size_t i)
+{
+  double dBound = 100;
+
+  for (size_t n = 0; n <= i; n++)
+    dBound *= 1.189207115;      // 2^(1/4)
+  return dBound;
+}
+
+static size_t
+bucket_of(double dMicros)
+{
+  double dBound = 100 * 1.189207115;
+  size_t i = 0;
+
+  while (dBound < dMicros && i < BUCKETS - 1) {
+    dBound *= 1.189207115;
+    i++;
+  }
+  return i;
+}
+
+static struct latency_model *
+find_model(const char *pcReader, const char *pcCard, bool bCreate)
+{
+  for (size_t n = 0; n < szModels; n++) {
+    if (strcmp(amModels[n].acReader, pcReader) == 0 && strcmp(amModels[n].acCard, pcCard) == 0)
+      return &amModels[n];
+  }
+  if (!bCreate || szModels == MAX_MODELS)
+    return NULL;
+  memset(&amModels[szModels], 0, sizeof(amModels[szModels]));
+  snprintf(amModels[szModels].acReader, sizeof(amModels[szModels].acReader), "%s", pcReader);
+  snprintf(amModels[szModels].acCard, sizeof(amModels[szModels].acCard), "%s", pcCard);
+  return &amModels[szModels++];
+}
+
+static size_t
+attachment_of(const nfc_device *pnd)
+{
+  size_t n;
+
+  for (n = 0; n < szAttached; n++) {
+    if (aAttached[n].pnd == pnd)
+      break;
+  }
+  return n;
+}
+
+static struct latency_model *
+model_of(const nfc_device *pnd)
+{
+  size_t n = attachment_of(pnd);
+
+  return (n < szAttached) ? aAttached[n].pm : NULL;
+}
+
+static void
+detach(const nfc_device *pnd)
+{
+  size_t n = attachment_of(pnd);
+
+  if (n < szAttached)
+    aAttached[n] = aAttached[--szAttached];
+}
+
+/**
+ * @brief Start learning for the card selected on a reader, identified by ATQA and SAK
+ *
+ * Commands of a device that is not attached keep the driver default timeout.
+ */
+void
+latency_attach(nfc_device *pnd, const uint8_t *pbtAtqa, uint8_t btSak)
+{
+  char acCard[32];
+  struct latency_model *pm;
+
+  snprintf(acCard, sizeof(acCard), "atqa=%02x%02x sak=%02x", pbtAtqa[0], pbtAtqa[1], btSak);
+  pthread_mutex_lock(&mutex);
+  detach(pnd);
+  if ((pm = find_model(nfct_device_get_name(pnd), acCard, true)) != NULL && szAttached < MAX_ATTACHED) {
+    aAttached[szAttached].pnd = pnd;
+    aAttached[szAttached++].pm = pm;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void
+latency_detach(nfc_device *pnd)
+{
+  pthread_mutex_lock(&mutex);
+  detach(pnd);
+  pthread_mutex_unlock(&mutex);
+}
+
+// Half as much again as the 99th percentile, -1 while too little is known
+static int
+timeout_of(const struct latency_model *pm, latency_cmd lc)
+{
+  uint32_t uiRank = pm->auiSamples[lc] - pm->auiSamples[lc] / 100;
+  uint32_t uiCount = 0;
+  size_t i;
+
+  if (pm->auiSamples[lc] < MIN_SAMPLES)
+    return -1;
+  for (i = 0; i < BUCKETS - 1; i++) {
+    if ((uiCount += pm->aauiBuckets[lc][i]) >= uiRank)
+      break;
+  }
+  return MAX(MIN_TIMEOUT_MS, (int)(bucket_bound(i) * 1.5 / 1000) + 1);
+}
+
+/**
+ * @brief Timeout for the next command of a class
+ * @return Returns the timeout in milliseconds, or -1 (driver default) while too little is known.
+ */
+int
+latency_timeout(nfc_device *pnd, latency_cmd lc)
+{
+  struct latency_model *pm;
+  int iTimeout = -1;
+
+  pthread_mutex_lock(&mutex);
+  if ((pm = model_of(pnd)) != NULL)
+    iTimeout = timeout_of(pm, lc);
+  pthread_mutex_unlock(&mutex);
+  return iTimeout;
+}
+
+/**
+ * @brief Learn the latency of a command answered by the card
+ */
+void
+latency_record(nfc_device *pnd, latency_cmd lc, const struct timespec *ptsStart)
+{
+  struct latency_model *pm;
+  struct timespec tsNow;
+  double dMicros;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsNow);
+  dMicros = (tsNow.tv_sec - ptsStart->tv_sec) * 1e6 + (tsNow.tv_nsec - ptsStart->tv_nsec) / 1e3;
+  pthread_mutex_lock(&mutex);
+  if ((pm = model_of(pnd)) != NULL) {
+    if (pm->auiSamples[lc] == MAX_SAMPLES) {
+      pm->auiSamples[lc] = 0;
+      for (size_t i = 0; i < BUCKETS; i++)
+        pm->auiSamples[lc] += (pm->aauiBuckets[lc][i] /= 2);
+    }
+    pm->aauiBuckets[lc][bucket_of(dMicros)]++;
+    pm->auiSamples[lc]++;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Load histograms saved by a previous run
+ * @return Returns false if the file exists but cannot be parsed.
+ *
+ * One line per reader, card type and command class:
+ * <reader> TAB <card type> TAB <command> TAB <count of bucket 0> ... <count of bucket 63>
+ */
+bool
+latency_load(const char *pcPath)
+{
+  char acLine[1024];
+  FILE *pf = fopen(pcPath, "r");
+
+  if (pf == NULL)
+    return true;
+  pthread_mutex_lock(&mutex);
+  while (fgets(acLine, sizeof(acLine), pf) != NULL) {
+    char *pcReader = strtok(acLine, "\t");
+    char *pcCard = strtok(NULL, "\t");
+    char *pcCmd = strtok(NULL, "\t");
+    char *pcCount;
+    struct latency_model *pm;
+    size_t lc, i;
+
+    if (pcReader == NULL || pcCard == NULL || pcCmd == NULL)
+      goto error;
+    for (lc = 0; lc < LATENCY_CMD_COUNT && strcmp(acCmdNames[lc], pcCmd) != 0; lc++)
+      ;
+    if (lc == LATENCY_CMD_COUNT || (pm = find_model(pcReader, pcCard, true)) == NULL)
+      goto error;
+    pm->auiSamples[lc] = 0;
+    for (i = 0; i < BUCKETS && (pcCount = strtok(NULL, " \n")) != NULL; i++)
+      pm->auiSamples[lc] += (pm->aauiBuckets[lc][i] = strtoul(pcCount, NULL, 10));
+    if (i != BUCKETS)
+      goto error;
+  }
+  pthread_mutex_unlock(&mutex);
+  fclose(pf);
+  return true;
+
+error:
+  pthread_mutex_unlock(&mutex);
+  fclose(pf);
+  ERR("Invalid latency file: %s", pcPath);
+  return false;
+}
+
+bool
+latency_save(const char *pcPath)
+{
+  FILE *pf = fopen(pcPath, "w");
+  bool bSuccess;
+
+  if (pf == NULL) {
+    ERR("Unable to write latency file: %s", pcPath);
+    return false;
+  }
+  pthread_mutex_lock(&mutex);
+  for (size_t n = 0; n < szModels; n++) {
+    for (size_t lc = 0; lc < LATENCY_CMD_COUNT; lc++) {
+      if (amModels[n].auiSamples[lc] == 0)
+        continue;
+      fprintf(pf, "%s\t%s\t%s\t", amModels[n].acReader, amModels[n].acCard, acCmdNames[lc]);
+      for (size_t i = 0; i < BUCKETS; i++)
+        fprintf(pf, "%" PRIu32 "%c", amModels[n].aauiBuckets[lc][i], (i == BUCKETS - 1) ? '\n' : ' ');
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  bSuccess = (fclose(pf) == 0);
+  if (!bSuccess)
+    ERR("Unable to write latency file: %s", pcPath);
+  return bSuccess;
+}
+
+/**
+ * @brief Show the timeouts currently derived for every known reader and card type
+ */
+void
+latency_print(void)
+{
+  pthread_mutex_lock(&mutex);
+  for (size_t n = 0; n < szModels; n++) {
+    printf("%s, %s:", amModels[n].acReader, amModels[n].acCard);
+    for (size_t lc = 0; lc < LATENCY_CMD_COUNT; lc++) {
+      int iTimeout = timeout_of(&amModels[n], lc);
+
+      if (iTimeout < 0)
+        printf(" %s default (%" PRIu32 " samples)", acCmdNames[lc], amModels[n].auiSamples[lc]);
+      else
+        printf(" %s %d ms", acCmdNames[lc], iTimeout);
+    }
+    printf("\n");
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,76 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file latency-model.h
+ * @brief Learn command response latencies and derive transceive timeouts
+ *
+ * Latencies of answered commands are kept per reader, card type and command
+ * class in log-bucketed histograms. Once enough samples are known, the
+ * timeout of a command is a safe margin above their 99th percentile, so a
+ * tag that will not answer (wrong key, missing card) fails fast instead of
+ * waiting for the driver default.
+ */
+
+#ifndef _LATENCY_MODEL_H_
+#  define _LATENCY_MODEL_H_
+
+#  include <stdbool.h>
+#  include <stdint.h>
+#  include <time.h>
+
+#  include <nfc/nfc-types.h>
+
+typedef enum {
+  LATENCY_AUTH,
+  LATENCY_READ,
+  LATENCY_WRITE,
+  LATENCY_RAW,
+  LATENCY_CMD_COUNT
+} latency_cmd;
+
+void    latency_attach(nfc_device *pnd, const uint8_t *pbtAtqa, uint8_t btSak);
+void    latency_detach(nfc_device *pnd);
+
+int     latency_timeout(nfc_device *pnd, latency_cmd lc);
+void    latency_record(nfc_device *pnd, latency_cmd lc, const struct timespec *ptsStart);
+
+bool    latency_load(const char *pcPath);
+bool    latency_save(const char *pcPath);
+void    latency_print(void);
+
+#endif // _LATENCY_MODEL_H_
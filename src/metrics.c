@@ -0,0 +1,313 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file metrics.c
+ * @brief Reader command latency histograms and event counters
+ *
+ * Bucket i counts latencies up to 50 us * 2^i, the last one is unbounded.
+ * SIGUSR1 is blocked in every thread and taken by a dedicated thread with
+ * sigwait(), so the metrics are never written from a signal handler.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <nfc/nfc.h>
+
+#include "nfc-transport.h"
+#include "nfc-utils.h"
+
+#define BUCKETS 20
+#define MAX_READERS 16
+
+static const char *acTimerNames[METRIC_TIMER_COUNT] = {
+  "auth", "read", "write", "value", "raw_bytes", "raw_bits", "select", "reactivate", "rats", "transaction"
+};
+static const char *acCounterNames[METRIC_COUNTER_COUNT] = { "retries", "reselects", "auth_failures" };
+
+struct metrics_reader {
+  const nfc_device *pnd;
+  char     acName[128];
+  uint64_t aaui64Buckets[METRIC_TIMER_COUNT][BUCKETS];
+  uint64_t aui64Count[METRIC_TIMER_COUNT];
+  double   adSumSeconds[METRIC_TIMER_COUNT];
+  uint64_t aui64Counters[METRIC_COUNTER_COUNT];
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_reader amrReaders[MAX_READERS];
+static size_t szReaders = 0;
+static const char *pcMetricsPath;
+
+// Must hold the mutex
+static struct metrics_reader *
+reader_of(nfc_device *pnd)
+{
+  for (size_t n = 0; n < szReaders; n++) {
+    if (amrReaders[n].pnd == pnd)
+      return &amrReaders[n];
+  }
+  if (szReaders == MAX_READERS)
+    return NULL;
+  amrReaders[szReaders].pnd = pnd;
+  snprintf(amrReaders[szReaders].acName, sizeof(amrReaders[szReaders].acName), "%s", nfct_device_get_name(pnd));
+  return &amrReaders[szReaders++];
+}
+
+static double
+bucket_bound(size_t i)
+{
+  return 50e-6 * (1 << i);
+}
+
+void
+metrics_time(nfc_device *pnd, metric_timer mt, const struct timespec *ptsStart)
+{
+  struct metrics_reader *pmr;
+  struct timespec tsNow;
+  double dSeconds;
+  size_t i;
+
+  if (pcMetricsPath == NULL)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &tsNow);
+  dSeconds = (tsNow.tv_sec - ptsStart->tv_sec) + (tsNow.tv_nsec - ptsStart->tv_nsec) / 1e9;
+  for (i = 0; i < BUCKETS - 1 && dSeconds > bucket_bound(i); i++)
+    ;
+  pthread_mutex_lock(&mutex);
+  if ((pmr = reader_of(pnd)) != NULL) {
+    pmr->aaui64Buckets[mt][i]++;
+    pmr->aui64Count[mt]++;
+    pmr->adSumSeconds[mt] += dSeconds;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void
+metrics_count(nfc_device *pnd, metric_counter mc)
+{
+  struct metrics_reader *pmr;
+
+  if (pcMetricsPath == NULL)
+    return;
+  pthread_mutex_lock(&mutex);
+  if ((pmr = reader_of(pnd)) != NULL)
+    pmr->aui64Counters[mc]++;
+  pthread_mutex_unlock(&mutex);
+}
+
+// Reader names go inside double quotes in both formats
+static void
+print_quoted(FILE *pf, const char *pc)
+{
+  fputc('"', pf);
+  for (; *pc != '\0'; pc++) {
+    if (*pc == '"' || *pc == '\\')
+      fputc('\\', pf);
+    if (*pc == '\n')
+      fputs("\\n", pf);
+    else
+      fputc(*pc, pf);
+  }
+  fputc('"', pf);
+}
+
+// Readers of the same model share a name, the device index tells them apart
+static void
+print_labels(FILE *pf, size_t n)
+{
+  fprintf(pf, "device=\"%zu\",reader=", n);
+  print_quoted(pf, amrReaders[n].acName);
+}
+
+static void
+write_prometheus(FILE *pf)
+{
+  fprintf(pf, "# HELP nfc_command_duration_seconds Time from sending a command to the reader until its outcome.\n");
+  fprintf(pf, "# TYPE nfc_command_duration_seconds histogram\n");
+  for (size_t n = 0; n < szReaders; n++) {
+    for (size_t mt = 0; mt < METRIC_TIMER_COUNT; mt++) {
+      uint64_t ui64Cumulative = 0;
+
+      if (amrReaders[n].aui64Count[mt] == 0)
+        continue;
+      for (size_t i = 0; i < BUCKETS; i++) {
+        ui64Cumulative += amrReaders[n].aaui64Buckets[mt][i];
+        fprintf(pf, "nfc_command_duration_seconds_bucket{");
+        print_labels(pf, n);
+        if (i < BUCKETS - 1)
+          fprintf(pf, ",command=\"%s\",le=\"%g\"} %" PRIu64 "\n", acTimerNames[mt], bucket_bound(i), ui64Cumulative);
+        else
+          fprintf(pf, ",command=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", acTimerNames[mt], ui64Cumulative);
+      }
+      fprintf(pf, "nfc_command_duration_seconds_sum{");
+      print_labels(pf, n);
+      fprintf(pf, ",command=\"%s\"} %.6f\n", acTimerNames[mt], amrReaders[n].adSumSeconds[mt]);
+      fprintf(pf, "nfc_command_duration_seconds_count{");
+      print_labels(pf, n);
+      fprintf(pf, ",command=\"%s\"} %" PRIu64 "\n", acTimerNames[mt], amrReaders[n].aui64Count[mt]);
+    }
+  }
+  fprintf(pf, "# HELP nfc_events_total Retries, reselects and authentication failures.\n");
+  fprintf(pf, "# TYPE nfc_events_total counter\n");
+  for (size_t n = 0; n < szReaders; n++) {
+    for (size_t mc = 0; mc < METRIC_COUNTER_COUNT; mc++) {
+      fprintf(pf, "nfc_events_total{");
+      print_labels(pf, n);
+      fprintf(pf, ",event=\"%s\"} %" PRIu64 "\n", acCounterNames[mc], amrReaders[n].aui64Counters[mc]);
+    }
+  }
+}
+
+// Buckets are not cumulative here and only the used ones are listed
+static void
+write_json(FILE *pf)
+{
+  fprintf(pf, "{\n  \"readers\": [");
+  for (size_t n = 0; n < szReaders; n++) {
+    bool bFirst = true;
+
+    fprintf(pf, "%s\n    {\n      \"device\": %zu,\n      \"name\": ", (n > 0) ? "," : "", n);
+    print_quoted(pf, amrReaders[n].acName);
+    fprintf(pf, ",\n      \"commands\": {");
+    for (size_t mt = 0; mt < METRIC_TIMER_COUNT; mt++) {
+      bool bFirstBucket = true;
+
+      if (amrReaders[n].aui64Count[mt] == 0)
+        continue;
+      fprintf(pf, "%s\n        \"%s\": { \"count\": %" PRIu64 ", \"sum_seconds\": %.6f, \"buckets\": [",
+              bFirst ? "" : ",", acTimerNames[mt], amrReaders[n].aui64Count[mt], amrReaders[n].adSumSeconds[mt]);
+      bFirst = false;
+      for (size_t i = 0; i < BUCKETS; i++) {
+        if (amrReaders[n].aaui64Buckets[mt][i] == 0)
+          continue;
+        if (i < BUCKETS - 1)
+          fprintf(pf, "%s{ \"le\": %g, \"count\": %" PRIu64 " }", bFirstBucket ? "" : ", ", bucket_bound(i), amrReaders[n].aaui64Buckets[mt][i]);
+        else
+          fprintf(pf, "%s{ \"le\": null, \"count\": %" PRIu64 " }", bFirstBucket ? "" : ", ", amrReaders[n].aaui64Buckets[mt][i]);
+        bFirstBucket = false;
+      }
+      fprintf(pf, "] }");
+    }
+    fprintf(pf, "\n      },\n      \"counters\": {");
+    for (size_t mc = 0; mc < METRIC_COUNTER_COUNT; mc++)
+      fprintf(pf, "%s \"%s\": %" PRIu64, (mc > 0) ? "," : "", acCounterNames[mc], amrReaders[n].aui64Counters[mc]);
+    fprintf(pf, " }\n    }");
+  }
+  fprintf(pf, "\n  ]\n}\n");
+}
+
+/**
+ * @brief Write the metrics collected so far
+ *
+ * The file is replaced atomically, as a Prometheus textfile collector expects.
+ */
+bool
+metrics_write(void)
+{
+  char acTmpPath[1024];
+  size_t szLen;
+  FILE *pf;
+  bool bSuccess;
+
+  if (pcMetricsPath == NULL)
+    return true;
+  snprintf(acTmpPath, sizeof(acTmpPath), "%s.tmp", pcMetricsPath);
+  // A signal and the exit path may both write, one temporary file at a time
+  pthread_mutex_lock(&write_mutex);
+  if ((pf = fopen(acTmpPath, "w")) == NULL) {
+    pthread_mutex_unlock(&write_mutex);
+    ERR("Unable to write metrics: %s", acTmpPath);
+    return false;
+  }
+  szLen = strlen(pcMetricsPath);
+  pthread_mutex_lock(&mutex);
+  if (szLen > 5 && strcmp(pcMetricsPath + szLen - 5, ".prom") == 0)
+    write_prometheus(pf);
+  else
+    write_json(pf);
+  pthread_mutex_unlock(&mutex);
+  bSuccess = (fclose(pf) == 0) && (rename(acTmpPath, pcMetricsPath) == 0);
+  pthread_mutex_unlock(&write_mutex);
+  if (!bSuccess)
+    ERR("Unable to write metrics: %s", pcMetricsPath);
+  return bSuccess;
+}
+
+static void *
+signal_thread(void *arg)
+{
+  sigset_t *pss = arg;
+  int iSignal;
+
+  while (sigwait(pss, &iSignal) == 0)
+    metrics_write();
+  return NULL;
+}
+
+/**
+ * @brief Start collecting metrics, to be written to pcPath
+ *
+ * Must be called before any other thread is created, so that all of them
+ * inherit the blocked SIGUSR1.
+ */
+bool
+metrics_start(const char *pcPath)
+{
+  static sigset_t ss;
+  pthread_t thread;
+
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &ss, NULL) != 0 || pthread_create(&thread, NULL, signal_thread, &ss) != 0) {
+    ERR("Unable to set up metrics signal handling");
+    return false;
+  }
+  pthread_detach(thread);
+  pcMetricsPath = pcPath;
+  return true;
+}
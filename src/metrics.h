@@ -0,0 +1,82 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file metrics.h
+ * @brief Reader command latency histograms and event counters
+ *
+ * Once enabled, every timed command and counted event is accounted to the
+ * reader it ran on. The metrics are written as JSON, or as a Prometheus
+ * textfile when the file name ends in ".prom", at exit and on SIGUSR1.
+ */
+
+#ifndef _METRICS_H_
+#  define _METRICS_H_
+
+#  include <stdbool.h>
+#  include <time.h>
+
+#  include <nfc/nfc-types.h>
+
+typedef enum {
+  METRIC_AUTH,
+  METRIC_READ,
+  METRIC_WRITE,
+  METRIC_VALUE,
+  METRIC_RAW_BYTES,
+  METRIC_RAW_BITS,
+  METRIC_SELECT,
+  METRIC_REACTIVATE,
+  METRIC_RATS,
+  METRIC_TRANSACTION,
+  METRIC_TIMER_COUNT
+} metric_timer;
+
+typedef enum {
+  METRIC_RETRIES,
+  METRIC_RESELECTS,
+  METRIC_AUTH_FAILURES,
+  METRIC_COUNTER_COUNT
+} metric_counter;
+
+bool    metrics_start(const char *pcPath);
+bool    metrics_write(void);
+
+void    metrics_time(nfc_device *pnd, metric_timer mt, const struct timespec *ptsStart);
+void    metrics_count(nfc_device *pnd, metric_counter mc);
+
+#endif // _METRICS_H_
@@ -0,0 +1,351 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file mf-keydb.c
+ * @brief Memory-mapped MIFARE Classic key database, keyed by UID
+ *
+ * The file is a header followed by an open addressing table of fixed size
+ * records. Several processes may use it at once: lookups take a shared
+ * record lock, updates an exclusive one, and the table is doubled when it
+ * gets half full. The old records stay in a copy past the end of the file
+ * until the rehash is done, so a process dying halfway loses no key. A
+ * process notices the growth from the header and remaps before its next
+ * access.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "mf-keydb.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nfc/nfc.h>
+
+#include "nfc-utils.h"
+
+#define KEYDB_MAGIC "MFKEYDB1"
+#define MIN_SLOTS 1024
+
+struct keydb_header {
+  char     acMagic[8];
+  uint64_t ui64Slots;
+  uint64_t ui64Used;
+  uint64_t ui64GrowFrom;        // slots of the copy past the table while growing
+  uint8_t  abtReserved[480];
+};
+
+// An empty record has no UID
+struct keydb_record {
+  uint8_t  btUidLen;
+  uint8_t  abtUid[MF_KEYDB_UID_MAX];
+  uint8_t  abtReserved[13];
+  uint64_t ui64Hash;
+  mf_keydb_keys mkk;
+};
+
+struct mf_keydb {
+  pthread_mutex_t mutex;
+  int      iFd;
+  uint8_t *pbtMap;
+  size_t   szMap;
+};
+
+static struct keydb_header *
+header(mf_keydb *pmk)
+{
+  return (struct keydb_header *) pmk->pbtMap;
+}
+
+static struct keydb_record *
+records(mf_keydb *pmk)
+{
+  return (struct keydb_record *)(pmk->pbtMap + sizeof(struct keydb_header));
+}
+
+static size_t
+keydb_size(uint64_t ui64Slots)
+{
+  return sizeof(struct keydb_header) + ui64Slots * sizeof(struct keydb_record);
+}
+
+static bool
+lock(mf_keydb *pmk, short sType)
+{
+  struct flock fl = { .l_type = sType, .l_whence = SEEK_SET };
+
+  pthread_mutex_lock(&pmk->mutex);
+  if (fcntl(pmk->iFd, F_SETLKW, &fl) < 0) {
+    pthread_mutex_unlock(&pmk->mutex);
+    return false;
+  }
+  return true;
+}
+
+static void
+unlock(mf_keydb *pmk)
+{
+  struct flock fl = { .l_type = F_UNLCK, .l_whence = SEEK_SET };
+
+  fcntl(pmk->iFd, F_SETLK, &fl);
+  pthread_mutex_unlock(&pmk->mutex);
+}
+
+static bool
+remap(mf_keydb *pmk, size_t szMap)
+{
+  void *p;
+
+  if (pmk->pbtMap != NULL)
+    munmap(pmk->pbtMap, pmk->szMap);
+  pmk->pbtMap = NULL;
+  p = mmap(NULL, szMap, PROT_READ | PROT_WRITE, MAP_SHARED, pmk->iFd, 0);
+  if (p == MAP_FAILED)
+    return false;
+  pmk->pbtMap = p;
+  pmk->szMap = szMap;
+  return true;
+}
+
+static struct keydb_record *
+find(mf_keydb *pmk, const uint8_t *pbtUid, size_t szUidLen, uint64_t ui64Hash)
+{
+  struct keydb_record *pkr = records(pmk);
+  uint64_t ui64Mask = header(pmk)->ui64Slots - 1;
+  uint64_t i;
+
+  for (i = ui64Hash & ui64Mask; pkr[i].btUidLen != 0; i = (i + 1) & ui64Mask) {
+    if (pkr[i].ui64Hash == ui64Hash && pkr[i].btUidLen == szUidLen && memcmp(pkr[i].abtUid, pbtUid, szUidLen) == 0)
+      break;
+  }
+  return &pkr[i];
+}
+
+// Rehash the copy kept past the doubled table, must hold the exclusive lock
+static bool
+finish_grow(mf_keydb *pmk)
+{
+  uint64_t ui64Slots = header(pmk)->ui64GrowFrom;
+  size_t szTable = keydb_size(ui64Slots * 2);
+  size_t szMap = szTable + ui64Slots * sizeof(struct keydb_record);
+  struct keydb_record *pkrOld;
+
+  if (pmk->szMap != szMap && !remap(pmk, szMap))
+    return false;
+  pkrOld = (struct keydb_record *)(pmk->pbtMap + szTable);
+  memset(records(pmk), 0, ui64Slots * 2 * sizeof(struct keydb_record));
+  header(pmk)->ui64Slots = ui64Slots * 2;
+  for (uint64_t n = 0; n < ui64Slots; n++) {
+    if (pkrOld[n].btUidLen != 0)
+      *find(pmk, pkrOld[n].abtUid, pkrOld[n].btUidLen, pkrOld[n].ui64Hash) = pkrOld[n];
+  }
+  if (msync(pmk->pbtMap, szTable, MS_SYNC) < 0)
+    return false;
+  header(pmk)->ui64GrowFrom = 0;
+  if (msync(pmk->pbtMap, sizeof(struct keydb_header), MS_SYNC) < 0 || !remap(pmk, szTable))
+    return false;
+  return ftruncate(pmk->iFd, szTable) == 0;
+}
+
+// Double the table, must hold the exclusive lock
+static bool
+grow(mf_keydb *pmk)
+{
+  uint64_t ui64Slots = header(pmk)->ui64Slots;
+  size_t szRecords = ui64Slots * sizeof(struct keydb_record);
+  size_t szTable = keydb_size(ui64Slots * 2);
+
+  if (ftruncate(pmk->iFd, szTable + szRecords) < 0 || !remap(pmk, szTable + szRecords))
+    return false;
+  memcpy(pmk->pbtMap + szTable, records(pmk), szRecords);
+  if (msync(pmk->pbtMap, szTable + szRecords, MS_SYNC) < 0)
+    return false;
+  // From here on the copy is complete, whoever locks the file next finishes
+  header(pmk)->ui64GrowFrom = ui64Slots;
+  if (msync(pmk->pbtMap, sizeof(struct keydb_header), MS_SYNC) < 0)
+    return false;
+  return finish_grow(pmk);
+}
+
+// Follow a table grown by another process, must hold the lock
+static bool
+refresh(mf_keydb *pmk, bool bExclusive)
+{
+  uint64_t ui64Slots = header(pmk)->ui64Slots;
+
+  // A process died while growing the table
+  if (header(pmk)->ui64GrowFrom != 0)
+    return bExclusive && finish_grow(pmk);
+  if (keydb_size(ui64Slots) == pmk->szMap)
+    return true;
+  return remap(pmk, keydb_size(ui64Slots));
+}
+
+mf_keydb *
+mf_keydb_open(const char *pcPath)
+{
+  mf_keydb *pmk = calloc(1, sizeof(*pmk));
+  struct stat st;
+
+  if (pmk == NULL)
+    return NULL;
+  pthread_mutex_init(&pmk->mutex, NULL);
+  if ((pmk->iFd = open(pcPath, O_RDWR | O_CREAT, 0644)) < 0) {
+    ERR("Could not open key database: %s", pcPath);
+    free(pmk);
+    return NULL;
+  }
+
+  if (!lock(pmk, F_WRLCK))
+    goto error;
+  if (fstat(pmk->iFd, &st) < 0)
+    goto error_locked;
+  if (st.st_size == 0) {
+    if (ftruncate(pmk->iFd, keydb_size(MIN_SLOTS)) < 0 || !remap(pmk, keydb_size(MIN_SLOTS)))
+      goto error_locked;
+    memcpy(header(pmk)->acMagic, KEYDB_MAGIC, 8);
+    header(pmk)->ui64Slots = MIN_SLOTS;
+  } else if ((size_t) st.st_size < sizeof(struct keydb_header) || !remap(pmk, sizeof(struct keydb_header))
+             || memcmp(header(pmk)->acMagic, KEYDB_MAGIC, 8) != 0 || !refresh(pmk, true)
+             || keydb_size(header(pmk)->ui64Slots) > (size_t) st.st_size) {
+    ERR("Not a key database: %s", pcPath);
+    goto error_locked;
+  } else if (keydb_size(header(pmk)->ui64Slots) < (size_t) st.st_size
+             && ftruncate(pmk->iFd, keydb_size(header(pmk)->ui64Slots)) < 0) {
+    // Left over from a growth that did not get as far as the header
+    goto error_locked;
+  }
+  unlock(pmk);
+  return pmk;
+
+error_locked:
+  unlock(pmk);
+error:
+  mf_keydb_close(pmk);
+  return NULL;
+}
+
+void
+mf_keydb_close(mf_keydb *pmk)
+{
+  if (pmk == NULL)
+    return;
+  if (pmk->pbtMap != NULL)
+    munmap(pmk->pbtMap, pmk->szMap);
+  close(pmk->iFd);
+  pthread_mutex_destroy(&pmk->mutex);
+  free(pmk);
+}
+
+/**
+ * @brief Copy the keys known for a card
+ * @return Returns true if the UID is in the database; otherwise returns false.
+ */
+bool
+mf_keydb_get(mf_keydb *pmk, const uint8_t *pbtUid, size_t szUidLen, mf_keydb_keys *pmkk)
+{
+  struct keydb_record *pkr;
+  bool bFound = false;
+
+  if (szUidLen == 0 || szUidLen > MF_KEYDB_UID_MAX || !lock(pmk, F_RDLCK))
+    return false;
+  if (refresh(pmk, false)) {
+    pkr = find(pmk, pbtUid, szUidLen, fnv1a64(pbtUid, szUidLen));
+    if ((bFound = (pkr->btUidLen != 0)))
+      *pmkk = pkr->mkk;
+  }
+  unlock(pmk);
+  return bFound;
+}
+
+/**
+ * @brief Record one key of one sector of a card
+ * @return Returns true if the key was stored; otherwise returns false.
+ */
+bool
+mf_keydb_put(mf_keydb *pmk, const uint8_t *pbtUid, size_t szUidLen, uint8_t uiSector, bool bKeyB, const uint8_t *pbtKey)
+{
+  uint64_t ui64Hash = fnv1a64(pbtUid, szUidLen);
+  struct keydb_record *pkr;
+  bool bSuccess = false;
+
+  if (szUidLen == 0 || szUidLen > MF_KEYDB_UID_MAX || uiSector >= MF_KEYDB_SECTORS || !lock(pmk, F_WRLCK))
+    return false;
+  if (!refresh(pmk, true))
+    goto out;
+  pkr = find(pmk, pbtUid, szUidLen, ui64Hash);
+  if (pkr->btUidLen == 0) {
+    // Keep the table at most half full
+    if ((header(pmk)->ui64Used + 1) * 2 > header(pmk)->ui64Slots) {
+      if (!grow(pmk))
+        goto out;
+      pkr = find(pmk, pbtUid, szUidLen, ui64Hash);
+    }
+    pkr->btUidLen = szUidLen;
+    memcpy(pkr->abtUid, pbtUid, szUidLen);
+    pkr->ui64Hash = ui64Hash;
+    header(pmk)->ui64Used++;
+  }
+  if (bKeyB) {
+    memcpy(pkr->mkk.abtKeyB[uiSector], pbtKey, 6);
+    pkr->mkk.ui64KnownB |= 1ULL << uiSector;
+  } else {
+    memcpy(pkr->mkk.abtKeyA[uiSector], pbtKey, 6);
+    pkr->mkk.ui64KnownA |= 1ULL << uiSector;
+  }
+  bSuccess = true;
+
+out:
+  unlock(pmk);
+  return bSuccess;
+}
+
+/**
+ * @brief Sector of a MIFARE Classic block, 4K cards have 16-block sectors from block 128 on
+ */
+uint8_t
+mf_keydb_sector(uint32_t uiBlock)
+{
+  return (uiBlock < 128) ? uiBlock / 4 : 32 + (uiBlock - 128) / 16;
+}
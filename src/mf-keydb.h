@@ -0,0 +1,74 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file mf-keydb.h
+ * @brief Memory-mapped MIFARE Classic key database, keyed by UID
+ *
+ * One file shared by all tools and processes: recovered and discovered keys
+ * are stored per UID and sector, so a later session can authenticate every
+ * sector with the right key straight away.
+ */
+
+#ifndef _MF_KEYDB_H_
+#  define _MF_KEYDB_H_
+
+#  include <stdbool.h>
+#  include <stddef.h>
+#  include <stdint.h>
+
+#  define MF_KEYDB_UID_MAX 10
+#  define MF_KEYDB_SECTORS 40
+
+typedef struct mf_keydb mf_keydb;
+
+typedef struct {
+  uint64_t ui64KnownA;    // one bit per sector
+  uint64_t ui64KnownB;
+  uint8_t  abtKeyA[MF_KEYDB_SECTORS][6];
+  uint8_t  abtKeyB[MF_KEYDB_SECTORS][6];
+} mf_keydb_keys;
+
+mf_keydb *mf_keydb_open(const char *pcPath);
+void    mf_keydb_close(mf_keydb *pmk);
+
+bool    mf_keydb_get(mf_keydb *pmk, const uint8_t *pbtUid, size_t szUidLen, mf_keydb_keys *pmkk);
+bool    mf_keydb_put(mf_keydb *pmk, const uint8_t *pbtUid, size_t szUidLen, uint8_t uiSector, bool bKeyB, const uint8_t *pbtKey);
+
+uint8_t mf_keydb_sector(uint32_t uiBlock);
+
+#endif // _MF_KEYDB_H_
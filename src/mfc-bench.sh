@@ -0,0 +1,27 @@
+#!/bin/sh
+# Benchmark the card workflows of nfc-mfclassic-ex against simulated readers
+# that play the timing and the faults of a real link.
+#
+# usage: mfc-bench.sh <nfc-mfclassic-ex> [<cards>] [<link>]
+#   <cards>  cards per workflow (default 20)
+#   <link>   link profile given to -L (default usb=1000,fail=0.001,timeout=0.001)
+
+TOOL=${1:?usage: $0 <nfc-mfclassic-ex> [<cards>] [<link>]}
+CARDS=${2:-20}
+LINK=${3:-usb=1000,fail=0.001,timeout=0.001}
+# Blank 1K card keyed with the 5th key of the dictionary, so the dictionary has work to do
+CARD=1k:4d3a99c351dd
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+run() {
+  echo "== $1"
+  shift
+  "$TOOL" -L "$LINK" -B "$CARDS" "$@" 2>/dev/null | sed -n '/^Benchmark:/,$p'
+}
+
+run "dictionary read" -S $CARD r a "$DIR/keys.mfd"
+run "plain read" -S $CARD r a "$DIR/plain.mfd" "$DIR/keys.mfd"
+run "sector subset read (0-3)" -S $CARD r,0,1,2,3 a "$DIR/subset.mfd" "$DIR/keys.mfd"
+run "unlocked read" -G 1k R a "$DIR/unlocked.mfd"
+run "unlocked write" -G 1k W a "$DIR/unlocked.mfd"
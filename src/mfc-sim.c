@@ -0,0 +1,1076 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file mfc-sim.c
+ * @brief Software MIFARE Classic card and reader, for tests and benchmarks
+ *
+ * The reader half plays the PN53x: with easy framing it turns MIFARE
+ * commands into the card exchanges (three pass authentication, two phase
+ * write and value operations) and runs crypto1 on its side; without it,
+ * frames go to the card as they are, with or without CRC handling.
+ *
+ * The card half is a state machine after ISO14443-3 and the MF1S50/MF1S70
+ * datasheets: IDLE, READY, ACTIVE, AUTH, HALT, plus the gen1 backdoor
+ * (0x40 then 0x43 from HALT) that gives access to every block without
+ * authentication. Card nonces come from the 16-bit LFSR of the real card,
+ * advancing a fixed distance per authentication. Only single size (4 byte)
+ * UIDs are simulated, the UID being the first 4 bytes of block 0.
+ *
+ * Air time counts 9 bits (with parity) of 128/fc per byte each way, the
+ * frame delay time of the card, and its EEPROM programming time.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "mfc-sim.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nfc/nfc.h>
+
+#include "crapto1.h"
+#include "nfc-transport.h"
+#include "nfc-utils.h"
+
+#define ACK 0x0a
+#define NAK_NOT_ALLOWED 0x04
+#define NAK_TRANSMISSION 0x05
+#define MAX_CARD_FRAME 32
+#define NONCE_DISTANCE 160
+#define BIT_NS 9439             // 128 / 13.56 MHz
+#define FRAME_DELAY_NS 86435    // 1172 / 13.56 MHz
+#define EEPROM_WRITE_NS 2500000
+
+typedef enum {
+  CARD_IDLE,
+  CARD_READY,
+  CARD_ACTIVE,
+  CARD_AUTH_WAIT,
+  CARD_AUTH,
+  CARD_HALT,
+  CARD_MAGIC_WAIT,
+  CARD_UNLOCKED
+} card_state;
+
+typedef enum {
+  PENDING_NONE,
+  PENDING_WRITE,
+  PENDING_VALUE
+} pending_op;
+
+typedef enum {
+  OP_READ,
+  OP_WRITE,
+  OP_INCREMENT,
+  OP_DECREMENT                  // also transfer and restore
+} data_op;
+
+typedef enum {
+  TR_WRITE_KEY_A,
+  TR_READ_ACCESS,
+  TR_WRITE_ACCESS,
+  TR_READ_KEY_B,
+  TR_WRITE_KEY_B
+} trailer_op;
+
+// Keys allowed (1 = A, 2 = B) by access conditions C1C2C3 for data blocks...
+static const uint8_t aabtDataAccess[8][4] = {
+  { 3, 3, 3, 3 }, { 3, 0, 0, 3 }, { 3, 0, 0, 0 }, { 2, 2, 0, 0 },
+  { 3, 2, 0, 0 }, { 2, 0, 0, 0 }, { 3, 2, 2, 3 }, { 0, 0, 0, 0 }
+};
+
+// ...and for the sector trailer
+static const uint8_t aabtTrailerAccess[8][5] = {
+  { 1, 1, 0, 1, 1 }, { 1, 1, 1, 1, 1 }, { 0, 1, 0, 1, 0 }, { 2, 3, 2, 0, 2 },
+  { 2, 3, 0, 0, 2 }, { 0, 3, 2, 0, 0 }, { 0, 3, 0, 0, 0 }, { 0, 3, 0, 0, 0 }
+};
+
+struct mfc_sim {
+  mifare_classic_tag mt;
+  size_t   szBlocks;
+  bool     bMagic;
+  // Card
+  card_state cs;
+  struct Crypto1State *pcsCard;
+  uint32_t uiPrng;
+  uint32_t uiNonce;
+  uint8_t  btAuthSector;
+  bool     bAuthKeyB;
+  pending_op po;
+  uint8_t  btPendingCmd;
+  uint8_t  btPendingBlock;
+  uint8_t  abtValue[16];        // value register, as the image of a value block
+  bool     bValueLoaded;
+  // Reader
+  struct Crypto1State *pcsReader;
+  uint32_t uiReaderRandom;
+  bool     bEasyFraming;
+  bool     bHandleCrc;
+  bool     bField;
+  // Timing and faults
+  uint64_t ui64AirNs;
+  double   dFailureRate;
+  double   dTimeoutRate;
+  uint32_t uiFaultRandom;
+  int      iFault;              // error of the exchange in progress, 0 if none
+  bool     bProgrammed;         // the last frame wrote to EEPROM
+};
+
+static uint32_t
+get32(const uint8_t *pbt)
+{
+  return (uint32_t) pbt[0] << 24 | (uint32_t) pbt[1] << 16 | (uint32_t) pbt[2] << 8 | pbt[3];
+}
+
+static void
+put32(uint8_t *pbt, uint32_t ui)
+{
+  pbt[0] = ui >> 24;
+  pbt[1] = ui >> 16;
+  pbt[2] = ui >> 8;
+  pbt[3] = ui;
+}
+
+static uint64_t
+key_of(const uint8_t *pbtKey)
+{
+  uint64_t ui64Key = 0;
+  for (size_t n = 0; n < 6; n++)
+    ui64Key = ui64Key << 8 | pbtKey[n];
+  return ui64Key;
+}
+
+static void
+crc_a(const uint8_t *pbtData, size_t szLen, uint8_t *pbtCrc)
+{
+  uint32_t wCrc = 0x6363;
+
+  while (szLen-- > 0) {
+    uint8_t bt = *pbtData++ ^ (uint8_t)(wCrc & 0xff);
+    bt ^= bt << 4;
+    wCrc = (wCrc >> 8) ^ ((uint32_t) bt << 8) ^ ((uint32_t) bt << 3) ^ ((uint32_t) bt >> 4);
+  }
+  pbtCrc[0] = wCrc & 0xff;
+  pbtCrc[1] = (wCrc >> 8) & 0xff;
+}
+
+static bool
+crc_ok(const uint8_t *pbtFrame, size_t szLen)
+{
+  uint8_t abtCrc[2];
+
+  if (szLen < 3)
+    return false;
+  crc_a(pbtFrame, szLen - 2, abtCrc);
+  return memcmp(abtCrc, pbtFrame + szLen - 2, 2) == 0;
+}
+
+// Encrypt or decrypt a frame with the keystream, 4-bit frames are ACK/NAK
+static void
+crypt_frame(struct Crypto1State *pcs, uint8_t *pbtFrame, size_t szBits)
+{
+  if (szBits == 4) {
+    for (size_t n = 0; n < 4; n++)
+      pbtFrame[0] ^= crypto1_bit(pcs, 0, 0) << n;
+    return;
+  }
+  for (size_t n = 0; n < szBits / 8; n++)
+    pbtFrame[n] ^= crypto1_byte(pcs, 0, 0);
+}
+
+static uint8_t
+sector_of(uint8_t btBlock)
+{
+  return (btBlock < 128) ? btBlock / 4 : 32 + (btBlock - 128) / 16;
+}
+
+static uint8_t
+trailer_of(uint8_t btBlock)
+{
+  return (btBlock < 128) ? (btBlock | 3) : (btBlock | 15);
+}
+
+// Access conditions group of a block: 0 to 2 for data, 3 for the trailer
+static int
+group_of(uint8_t btBlock)
+{
+  if (btBlock < 128)
+    return btBlock % 4;
+  return ((btBlock % 16) == 15) ? 3 : (btBlock % 16) / 5;
+}
+
+// C1C2C3 of a group as a 3-bit number, -1 when the access bits are not consistent
+static int
+access_conditions(const uint8_t *pbtAccessBits, int iGroup)
+{
+  uint8_t b6 = pbtAccessBits[0], b7 = pbtAccessBits[1], b8 = pbtAccessBits[2];
+
+  if (((b6 ^ (b7 >> 4)) & 0x0f) != 0x0f || (((b6 >> 4) ^ b8) & 0x0f) != 0x0f || ((b7 ^ (b8 >> 4)) & 0x0f) != 0x0f)
+    return -1;
+  return ((b7 >> (4 + iGroup)) & 1) << 2 | ((b8 >> iGroup) & 1) << 1 | ((b8 >> (4 + iGroup)) & 1);
+}
+
+static uint8_t
+trailer_access(const mfc_sim *ps, uint8_t btBlock, trailer_op to)
+{
+  int iCond = access_conditions(ps->mt.amb[trailer_of(btBlock)].mbt.abtAccessBits, 3);
+  return (iCond < 0) ? 0 : aabtTrailerAccess[iCond][to];
+}
+
+static bool
+data_allowed(const mfc_sim *ps, uint8_t btBlock, data_op dop)
+{
+  uint8_t btKey = ps->bAuthKeyB ? 2 : 1;
+  int iCond;
+
+  if (ps->cs == CARD_UNLOCKED)
+    return true;
+  if (ps->cs != CARD_AUTH || sector_of(btBlock) != ps->btAuthSector)
+    return false;
+  // A readable key B is no key, authenticating with it grants nothing
+  if (ps->bAuthKeyB && (trailer_access(ps, btBlock, TR_READ_KEY_B) & 1))
+    return false;
+  if (btBlock == trailer_of(btBlock)) {
+    if (dop == OP_READ)
+      return true;
+    return dop == OP_WRITE && ((trailer_access(ps, btBlock, TR_WRITE_KEY_A) | trailer_access(ps, btBlock, TR_WRITE_ACCESS)
+                                | trailer_access(ps, btBlock, TR_WRITE_KEY_B)) & btKey);
+  }
+  // The manufacturer block is read-only on genuine cards
+  if (btBlock == 0 && dop != OP_READ)
+    return false;
+  iCond = access_conditions(ps->mt.amb[trailer_of(btBlock)].mbt.abtAccessBits, group_of(btBlock));
+  return iCond >= 0 && (aabtDataAccess[iCond][dop] & btKey);
+}
+
+static void
+card_reset(mfc_sim *ps, card_state cs)
+{
+  crypto1_destroy(ps->pcsCard);
+  ps->pcsCard = NULL;
+  ps->po = PENDING_NONE;
+  ps->bValueLoaded = false;
+  ps->cs = cs;
+}
+
+// Send a card answer, encrypted while a sector is authenticated
+static size_t
+card_respond(mfc_sim *ps, uint8_t *pbtOut, size_t szBits)
+{
+  if (ps->cs == CARD_AUTH)
+    crypt_frame(ps->pcsCard, pbtOut, szBits);
+  return szBits;
+}
+
+static size_t
+card_nak(mfc_sim *ps, uint8_t *pbtOut, uint8_t btNak)
+{
+  pbtOut[0] = btNak;
+  card_respond(ps, pbtOut, 4);
+  card_reset(ps, CARD_IDLE);
+  return 4;
+}
+
+static size_t
+card_ack(mfc_sim *ps, uint8_t *pbtOut)
+{
+  pbtOut[0] = ACK;
+  return card_respond(ps, pbtOut, 4);
+}
+
+static size_t
+card_data(mfc_sim *ps, const uint8_t *pbtData, size_t szLen, uint8_t *pbtOut)
+{
+  memcpy(pbtOut, pbtData, szLen);
+  crc_a(pbtOut, szLen, pbtOut + szLen);
+  return card_respond(ps, pbtOut, (szLen + 2) * 8);
+}
+
+static bool
+value_block_ok(const uint8_t *pbt)
+{
+  for (size_t n = 0; n < 4; n++) {
+    if (pbt[n] != pbt[n + 8] || (pbt[n] ^ pbt[n + 4]) != 0xff)
+      return false;
+  }
+  return pbt[12] == pbt[14] && (pbt[12] ^ pbt[13]) == 0xff && pbt[13] == pbt[15];
+}
+
+static void
+write_trailer(mfc_sim *ps, uint8_t btBlock, const uint8_t *pbtData)
+{
+  mifare_classic_block_trailer *pmbt = &ps->mt.amb[btBlock].mbt;
+  const mifare_classic_block_trailer *pmbtNew = (const mifare_classic_block_trailer *) pbtData;
+  uint8_t btKey = ps->bAuthKeyB ? 2 : 1;
+
+  // Only the parts the key may write change
+  if (ps->cs == CARD_UNLOCKED || (trailer_access(ps, btBlock, TR_WRITE_KEY_A) & btKey))
+    memcpy(pmbt->abtKeyA, pmbtNew->abtKeyA, 6);
+  if (ps->cs == CARD_UNLOCKED || (trailer_access(ps, btBlock, TR_WRITE_KEY_B) & btKey))
+    memcpy(pmbt->abtKeyB, pmbtNew->abtKeyB, 6);
+  if (ps->cs == CARD_UNLOCKED || (trailer_access(ps, btBlock, TR_WRITE_ACCESS) & btKey))
+    memcpy(pmbt->abtAccessBits, pmbtNew->abtAccessBits, 4);
+}
+
+static size_t
+card_read(mfc_sim *ps, uint8_t btBlock, uint8_t *pbtOut)
+{
+  uint8_t abtBlock[16];
+  uint8_t btKey = ps->bAuthKeyB ? 2 : 1;
+
+  memcpy(abtBlock, ps->mt.amb[btBlock].mbd.abtData, 16);
+  if (ps->cs != CARD_UNLOCKED && btBlock == trailer_of(btBlock)) {
+    memset(abtBlock, 0, 6);
+    if (!(trailer_access(ps, btBlock, TR_READ_ACCESS) & btKey))
+      memset(abtBlock + 6, 0, 4);
+    if (!(trailer_access(ps, btBlock, TR_READ_KEY_B) & btKey))
+      memset(abtBlock + 10, 0, 6);
+  }
+  return card_data(ps, abtBlock, 16, pbtOut);
+}
+
+static size_t
+card_auth_start(mfc_sim *ps, uint8_t btCmd, uint8_t btBlock, uint8_t *pbtOut)
+{
+  const mifare_classic_block_trailer *pmbt = &ps->mt.amb[trailer_of(btBlock)].mbt;
+  uint32_t uiUid = get32(ps->mt.amb[0].mbm.abtUID);
+  bool bNested = (ps->cs == CARD_AUTH);
+
+  crypto1_destroy(ps->pcsCard);
+  ps->btAuthSector = sector_of(btBlock);
+  ps->bAuthKeyB = (btCmd == MC_AUTH_B);
+  ps->uiNonce = ps->uiPrng = prng_successor(ps->uiPrng, NONCE_DISTANCE);
+  ps->pcsCard = crypto1_create(key_of(ps->bAuthKeyB ? pmbt->abtKeyB : pmbt->abtKeyA));
+  ps->po = PENDING_NONE;
+  ps->cs = CARD_AUTH_WAIT;
+  // A nested authentication sends the nonce encrypted with the new key
+  put32(pbtOut, ps->uiNonce ^ (bNested ? crypto1_word(ps->pcsCard, uiUid ^ ps->uiNonce, 0) : 0));
+  if (!bNested)
+    crypto1_word(ps->pcsCard, uiUid ^ ps->uiNonce, 0);
+  return 32;
+}
+
+static size_t
+card_auth_answer(mfc_sim *ps, const uint8_t *pbtIn, size_t szLen, uint8_t *pbtOut)
+{
+  uint32_t uiAr;
+
+  if (szLen != 8) {
+    card_reset(ps, CARD_IDLE);
+    return 0;
+  }
+  crypto1_word(ps->pcsCard, get32(pbtIn), 1);
+  uiAr = get32(pbtIn + 4) ^ crypto1_word(ps->pcsCard, 0, 0);
+  if (uiAr != prng_successor(ps->uiNonce, 64)) {
+    card_reset(ps, CARD_IDLE);
+    return 0;
+  }
+  put32(pbtOut, prng_successor(ps->uiNonce, 96) ^ crypto1_word(ps->pcsCard, 0, 0));
+  ps->cs = CARD_AUTH;
+  return 32;
+}
+
+static size_t
+card_value_operand(mfc_sim *ps, const uint8_t *pbtOperand, uint8_t *pbtOut)
+{
+  const uint8_t *pbtBlock = ps->mt.amb[ps->btPendingBlock].mbd.abtData;
+  int32_t iValue, iOperand;
+
+  ps->po = PENDING_NONE;
+  if (!value_block_ok(pbtBlock))
+    return card_nak(ps, pbtOut, NAK_NOT_ALLOWED);
+  iValue = (int32_t)((uint32_t) pbtBlock[0] | (uint32_t) pbtBlock[1] << 8 | (uint32_t) pbtBlock[2] << 16 | (uint32_t) pbtBlock[3] << 24);
+  iOperand = (int32_t)((uint32_t) pbtOperand[0] | (uint32_t) pbtOperand[1] << 8 | (uint32_t) pbtOperand[2] << 16 | (uint32_t) pbtOperand[3] << 24);
+  if (ps->btPendingCmd == MC_INCREMENT)
+    iValue += iOperand;
+  else if (ps->btPendingCmd == MC_DECREMENT)
+    iValue -= iOperand;
+  for (size_t n = 0; n < 4; n++) {
+    ps->abtValue[n] = ps->abtValue[n + 8] = (uint8_t)((uint32_t) iValue >> (8 * n));
+    ps->abtValue[n + 4] = ~ps->abtValue[n];
+  }
+  memcpy(ps->abtValue + 12, pbtBlock + 12, 4);
+  ps->bValueLoaded = true;
+  // Success is silence
+  return 0;
+}
+
+// Frames for a card in ACTIVE, AUTH or UNLOCKED state
+static size_t
+card_command(mfc_sim *ps, uint8_t *pbtIn, size_t szLen, uint8_t *pbtOut)
+{
+  uint8_t btBlock;
+
+  if (ps->cs == CARD_AUTH)
+    crypt_frame(ps->pcsCard, pbtIn, szLen * 8);
+  if (!crc_ok(pbtIn, szLen))
+    return card_nak(ps, pbtOut, NAK_TRANSMISSION);
+  szLen -= 2;
+
+  switch (ps->po) {
+    case PENDING_WRITE:
+      ps->po = PENDING_NONE;
+      if (szLen != 16)
+        return card_nak(ps, pbtOut, NAK_TRANSMISSION);
+      if (ps->btPendingBlock == trailer_of(ps->btPendingBlock))
+        write_trailer(ps, ps->btPendingBlock, pbtIn);
+      else
+        memcpy(ps->mt.amb[ps->btPendingBlock].mbd.abtData, pbtIn, 16);
+      ps->bProgrammed = true;
+      return card_ack(ps, pbtOut);
+    case PENDING_VALUE:
+      if (szLen != 4)
+        return card_nak(ps, pbtOut, NAK_TRANSMISSION);
+      return card_value_operand(ps, pbtIn, pbtOut);
+    case PENDING_NONE:
+      break;
+  }
+
+  if (szLen == 2 && pbtIn[0] == 0x50 && pbtIn[1] == 0x00) {
+    card_reset(ps, CARD_HALT);
+    return 0;
+  }
+  if (szLen != 2 || pbtIn[1] >= ps->szBlocks) {
+    card_reset(ps, CARD_IDLE);
+    return 0;
+  }
+  btBlock = pbtIn[1];
+  switch (pbtIn[0]) {
+    case MC_AUTH_A:
+    case MC_AUTH_B:
+      return card_auth_start(ps, pbtIn[0], btBlock, pbtOut);
+    case MC_READ:
+      if (!data_allowed(ps, btBlock, OP_READ))
+        return card_nak(ps, pbtOut, NAK_NOT_ALLOWED);
+      return card_read(ps, btBlock, pbtOut);
+    case MC_WRITE:
+      if (!data_allowed(ps, btBlock, OP_WRITE))
+        return card_nak(ps, pbtOut, NAK_NOT_ALLOWED);
+      ps->po = PENDING_WRITE;
+      ps->btPendingBlock = btBlock;
+      return card_ack(ps, pbtOut);
+    case MC_INCREMENT:
+    case MC_DECREMENT:
+    case MC_STORE:
+      if (!data_allowed(ps, btBlock, (pbtIn[0] == MC_INCREMENT) ? OP_INCREMENT : OP_DECREMENT))
+        return card_nak(ps, pbtOut, NAK_NOT_ALLOWED);
+      ps->po = PENDING_VALUE;
+      ps->btPendingCmd = pbtIn[0];
+      ps->btPendingBlock = btBlock;
+      return card_ack(ps, pbtOut);
+    case MC_TRANSFER:
+      if (!ps->bValueLoaded || !data_allowed(ps, btBlock, OP_DECREMENT))
+        return card_nak(ps, pbtOut, NAK_NOT_ALLOWED);
+      memcpy(ps->mt.amb[btBlock].mbd.abtData, ps->abtValue, 16);
+      ps->bProgrammed = true;
+      return card_ack(ps, pbtOut);
+  }
+  // Anything else, RATS included, is not understood
+  card_reset(ps, CARD_IDLE);
+  return 0;
+}
+
+static size_t
+card_select(mfc_sim *ps, const uint8_t *pbtIn, size_t szLen, uint8_t *pbtOut)
+{
+  const uint8_t *pbtUid = ps->mt.amb[0].mbm.abtUID;
+  uint8_t btBcc = pbtUid[0] ^ pbtUid[1] ^ pbtUid[2] ^ pbtUid[3];
+
+  if (szLen == 2 && pbtIn[0] == 0x93 && pbtIn[1] == 0x20) {
+    memcpy(pbtOut, pbtUid, 4);
+    pbtOut[4] = btBcc;
+    return 40;
+  }
+  if (szLen == 9 && pbtIn[0] == 0x93 && pbtIn[1] == 0x70 && crc_ok(pbtIn, 9)
+      && memcmp(pbtIn + 2, pbtUid, 4) == 0 && pbtIn[6] == btBcc) {
+    ps->cs = CARD_ACTIVE;
+    pbtOut[0] = (ps->szBlocks > 64) ? 0x18 : 0x08;
+    crc_a(pbtOut, 1, pbtOut + 1);
+    return 24;
+  }
+  ps->cs = CARD_IDLE;
+  return 0;
+}
+
+// Short frames: REQA, WUPA and the first gen1 unlock command
+static size_t
+card_short_frame(mfc_sim *ps, uint8_t btCmd, uint8_t *pbtOut)
+{
+  switch (btCmd) {
+    case 0x26:
+    case 0x52:
+      if (ps->cs == CARD_IDLE || (btCmd == 0x52 && ps->cs == CARD_HALT)) {
+        card_reset(ps, CARD_READY);
+        pbtOut[0] = (ps->szBlocks > 64) ? 0x02 : 0x04;
+        pbtOut[1] = 0x00;
+        return 16;
+      }
+      break;
+    case 0x40:
+      if (ps->bMagic && ps->cs == CARD_HALT) {
+        ps->cs = CARD_MAGIC_WAIT;
+        pbtOut[0] = ACK;
+        return 4;
+      }
+      break;
+  }
+  if (ps->cs != CARD_HALT)
+    card_reset(ps, CARD_IDLE);
+  return 0;
+}
+
+// One frame from the reader to the card, returns the length of the answer in bits
+static size_t
+card_receive(mfc_sim *ps, const uint8_t *pbtIn, size_t szBits, uint8_t *pbtOut)
+{
+  uint8_t abtIn[MAX_CARD_FRAME];
+  size_t szLen = szBits / 8;
+
+  if (!ps->bField)
+    return 0;
+  if (szBits == 7)
+    return card_short_frame(ps, pbtIn[0] & 0x7f, pbtOut);
+  if (szBits % 8 != 0 || szLen > sizeof(abtIn)) {
+    card_reset(ps, (ps->cs == CARD_HALT) ? CARD_HALT : CARD_IDLE);
+    return 0;
+  }
+  memcpy(abtIn, pbtIn, szLen);
+
+  switch (ps->cs) {
+    case CARD_READY:
+      return card_select(ps, abtIn, szLen, pbtOut);
+    case CARD_MAGIC_WAIT:
+      if (szLen == 1 && abtIn[0] == 0x43) {
+        ps->cs = CARD_UNLOCKED;
+        pbtOut[0] = ACK;
+        return 4;
+      }
+      ps->cs = CARD_HALT;
+      return 0;
+    case CARD_AUTH_WAIT:
+      return card_auth_answer(ps, abtIn, szLen, pbtOut);
+    case CARD_ACTIVE:
+    case CARD_AUTH:
+    case CARD_UNLOCKED:
+      return card_command(ps, abtIn, szLen, pbtOut);
+    case CARD_IDLE:
+    case CARD_HALT:
+      break;
+  }
+  return 0;
+}
+
+static uint32_t
+xorshift32(uint32_t *pui)
+{
+  *pui ^= *pui << 13;
+  *pui ^= *pui >> 17;
+  *pui ^= *pui << 5;
+  return *pui;
+}
+
+static uint64_t
+frame_ns(size_t szBits)
+{
+  return (szBits + szBits / 8) * (uint64_t) BIT_NS;
+}
+
+// Draw whether the frame on air is lost or corrupted, sets iFault if so
+static bool
+inject_fault(mfc_sim *ps)
+{
+  double dDraw;
+
+  if (ps->dFailureRate <= 0 && ps->dTimeoutRate <= 0)
+    return false;
+  dDraw = (xorshift32(&ps->uiFaultRandom) >> 8) / 16777216.0;
+  if (dDraw < ps->dTimeoutRate) {
+    ps->iFault = NFC_ETIMEOUT;
+    return true;
+  }
+  if (dDraw < ps->dTimeoutRate + ps->dFailureRate) {
+    ps->iFault = NFC_ERFTRANS;
+    card_reset(ps, (ps->cs == CARD_HALT) ? CARD_HALT : CARD_IDLE);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief One frame on air: card_receive() with its timing and the injected faults
+ *
+ * A lost frame never reaches the card; a corrupted one reaches it garbled,
+ * which a card takes as a reason to go back to IDLE.
+ */
+static size_t
+card_exchange(mfc_sim *ps, const uint8_t *pbtIn, size_t szBits, uint8_t *pbtOut)
+{
+  size_t szAnswerBits;
+
+  ps->ui64AirNs += frame_ns(szBits);
+  if (ps->iFault != 0 || inject_fault(ps))
+    return 0;
+  szAnswerBits = card_receive(ps, pbtIn, szBits, pbtOut);
+  if (szAnswerBits > 0)
+    ps->ui64AirNs += FRAME_DELAY_NS + frame_ns(szAnswerBits);
+  if (ps->bProgrammed)
+    ps->ui64AirNs += EEPROM_WRITE_NS;
+  ps->bProgrammed = false;
+  return szAnswerBits;
+}
+
+static void
+reader_crypto_off(mfc_sim *ps)
+{
+  crypto1_destroy(ps->pcsReader);
+  ps->pcsReader = NULL;
+}
+
+// Send a frame through the reader's cipher, returns the answer length in bits
+static size_t
+reader_exchange(mfc_sim *ps, const uint8_t *pbtFrame, size_t szBits, uint8_t *pbtAnswer)
+{
+  uint8_t abtFrame[MAX_CARD_FRAME];
+  size_t szAnswerBits;
+
+  memcpy(abtFrame, pbtFrame, (szBits + 7) / 8);
+  if (ps->pcsReader != NULL && szBits % 8 == 0)
+    crypt_frame(ps->pcsReader, abtFrame, szBits);
+  szAnswerBits = card_exchange(ps, abtFrame, szBits, pbtAnswer);
+  if (ps->pcsReader != NULL && szAnswerBits > 0)
+    crypt_frame(ps->pcsReader, pbtAnswer, szAnswerBits);
+  return szAnswerBits;
+}
+
+// A command with its CRC, the answer must be an ACK
+static bool
+reader_command_ack(mfc_sim *ps, const uint8_t *pbtCmd, size_t szLen)
+{
+  uint8_t abtFrame[MAX_CARD_FRAME];
+  uint8_t abtAnswer[MAX_CARD_FRAME];
+
+  memcpy(abtFrame, pbtCmd, szLen);
+  crc_a(abtFrame, szLen, abtFrame + szLen);
+  return reader_exchange(ps, abtFrame, (szLen + 2) * 8, abtAnswer) == 4 && (abtAnswer[0] & 0x0f) == ACK;
+}
+
+static int
+reader_auth(mfc_sim *ps, const uint8_t *pbtTx)
+{
+  const struct mifare_param_auth *pmpa = (const struct mifare_param_auth *)(pbtTx + 2);
+  uint32_t uiUid = get32(pmpa->abtAuthUid);
+  uint8_t abtFrame[8];
+  uint8_t abtAnswer[MAX_CARD_FRAME];
+  bool bNested = (ps->pcsReader != NULL);
+  uint32_t uiNonce, uiReaderNonce;
+
+  memcpy(abtFrame, pbtTx, 2);
+  crc_a(abtFrame, 2, abtFrame + 2);
+  if (bNested)
+    crypt_frame(ps->pcsReader, abtFrame, 32);
+  reader_crypto_off(ps);
+  if (card_exchange(ps, abtFrame, 32, abtAnswer) != 32)
+    return (ps->iFault != 0) ? ps->iFault : NFC_EMFCAUTHFAIL;
+
+  ps->pcsReader = crypto1_create(key_of(pmpa->abtKey));
+  uiNonce = get32(abtAnswer);
+  if (bNested)
+    uiNonce ^= crypto1_word(ps->pcsReader, uiUid ^ uiNonce, 1);
+  else
+    crypto1_word(ps->pcsReader, uiUid ^ uiNonce, 0);
+
+  // Reader nonces are the same sequence on every run
+  uiReaderNonce = xorshift32(&ps->uiReaderRandom);
+  put32(abtFrame, uiReaderNonce ^ crypto1_word(ps->pcsReader, uiReaderNonce, 0));
+  put32(abtFrame + 4, prng_successor(uiNonce, 64) ^ crypto1_word(ps->pcsReader, 0, 0));
+  if (card_exchange(ps, abtFrame, 64, abtAnswer) != 32
+      || (get32(abtAnswer) ^ crypto1_word(ps->pcsReader, 0, 0)) != prng_successor(uiNonce, 96)) {
+    reader_crypto_off(ps);
+    return (ps->iFault != 0) ? ps->iFault : NFC_EMFCAUTHFAIL;
+  }
+  return 0;
+}
+
+// MIFARE Classic commands as the PN53x runs them with easy framing
+static int
+reader_mifare(mfc_sim *ps, const uint8_t *pbtTx, size_t szTx, uint8_t *pbtRx, size_t szRx)
+{
+  uint8_t abtFrame[MAX_CARD_FRAME];
+  uint8_t abtAnswer[MAX_CARD_FRAME];
+  size_t szAnswerBits;
+
+  switch (pbtTx[0]) {
+    case MC_AUTH_A:
+    case MC_AUTH_B:
+      if (szTx != 2 + sizeof(struct mifare_param_auth))
+        return NFC_EINVARG;
+      return reader_auth(ps, pbtTx);
+    case MC_READ:
+      memcpy(abtFrame, pbtTx, 2);
+      crc_a(abtFrame, 2, abtFrame + 2);
+      szAnswerBits = reader_exchange(ps, abtFrame, 32, abtAnswer);
+      if (szAnswerBits == 144 && crc_ok(abtAnswer, 18)) {
+        if (szRx < 16)
+          return NFC_EOVFLOW;
+        memcpy(pbtRx, abtAnswer, 16);
+        return 16;
+      }
+      break;
+    case MC_WRITE:
+      if (szTx == 18 && reader_command_ack(ps, pbtTx, 2) && reader_command_ack(ps, pbtTx + 2, 16))
+        return 0;
+      break;
+    case MC_INCREMENT:
+    case MC_DECREMENT:
+    case MC_STORE:
+      if (szTx != 6 || !reader_command_ack(ps, pbtTx, 2))
+        break;
+      memcpy(abtFrame, pbtTx + 2, 4);
+      crc_a(abtFrame, 4, abtFrame + 4);
+      if (reader_exchange(ps, abtFrame, 48, abtAnswer) == 0)
+        return 0;
+      break;
+    case MC_TRANSFER:
+      if (reader_command_ack(ps, pbtTx, 2))
+        return 0;
+      break;
+  }
+  reader_crypto_off(ps);
+  if (ps->iFault != 0)
+    return ps->iFault;
+  return (ps->cs == CARD_IDLE) ? NFC_ERFTRANS : NFC_ETIMEOUT;
+}
+
+static void
+factory_card(mfc_sim *ps, size_t szBlocks, const uint8_t *pbtKey)
+{
+  static const uint8_t abtBlock0[16] = {
+    0xc0, 0xff, 0xee, 0x01, 0xc0 ^ 0xff ^ 0xee ^ 0x01, 0x08, 0x04, 0x00,
+    0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69
+  };
+  static const uint8_t abtTrailer[16] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x07, 0x80, 0x69, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+  };
+
+  memset(&ps->mt, 0, sizeof(ps->mt));
+  memcpy(ps->mt.amb[0].mbd.abtData, abtBlock0, 16);
+  if (szBlocks > 64)
+    ps->mt.amb[0].mbd.abtData[5] = 0x18;
+  for (size_t n = 0; n < szBlocks; n++) {
+    if (n == trailer_of(n)) {
+      memcpy(ps->mt.amb[n].mbd.abtData, abtTrailer, 16);
+      memcpy(ps->mt.amb[n].mbt.abtKeyA, pbtKey, 6);
+      memcpy(ps->mt.amb[n].mbt.abtKeyB, pbtKey, 6);
+    }
+  }
+}
+
+/**
+ * @brief Create a simulated reader with a card in its field
+ * @param pcCard A 1K or 4K MFD dump holding the card content, or "1k" / "4k" for a blank card with transport keys,
+ *               "1k:<key>" / "4k:<key>" for a blank card with the 12 hex digit key as key A and B of every sector
+ * @param bMagic The card is a gen1 magic card
+ */
+mfc_sim *
+mfc_sim_new(const char *pcCard, bool bMagic)
+{
+  mfc_sim *ps = calloc(1, sizeof(*ps));
+  uint8_t abtKey[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+  unsigned int uiByte;
+  FILE *pf;
+  long lSize;
+
+  if (ps == NULL)
+    return NULL;
+  if ((pcCard[0] == '1' || pcCard[0] == '4') && pcCard[1] == 'k' && (pcCard[2] == '\0' || pcCard[2] == ':')) {
+    if (pcCard[2] == ':') {
+      for (size_t n = 0; n < 6; n++) {
+        if (sscanf(pcCard + 3 + 2 * n, "%2x", &uiByte) != 1) {
+          ERR("Invalid key in simulated card: %s", pcCard);
+          free(ps);
+          return NULL;
+        }
+        abtKey[n] = uiByte;
+      }
+    }
+    ps->szBlocks = (pcCard[0] == '1') ? 64 : 256;
+    factory_card(ps, ps->szBlocks, abtKey);
+  } else {
+    if ((pf = fopen(pcCard, "rb")) == NULL || fseek(pf, 0, SEEK_END) != 0 || ((lSize = ftell(pf)) != 1024 && lSize != 4096)
+        || fseek(pf, 0, SEEK_SET) != 0 || fread(&ps->mt, 1, lSize, pf) != (size_t) lSize) {
+      ERR("Unable to load a 1K or 4K card dump: %s", pcCard);
+      if (pf != NULL)
+        fclose(pf);
+      free(ps);
+      return NULL;
+    }
+    fclose(pf);
+    ps->szBlocks = lSize / 16;
+  }
+  ps->bMagic = bMagic;
+  ps->cs = CARD_IDLE;
+  ps->uiPrng = get32(ps->mt.amb[0].mbm.abtUID) | 1;
+  ps->uiReaderRandom = 0x2545f491;
+  ps->bEasyFraming = true;
+  ps->bHandleCrc = true;
+  ps->bField = true;
+  return ps;
+}
+
+void
+mfc_sim_free(mfc_sim *ps)
+{
+  if (ps == NULL)
+    return;
+  crypto1_destroy(ps->pcsCard);
+  crypto1_destroy(ps->pcsReader);
+  free(ps);
+}
+
+/**
+ * @brief Lose or corrupt frames on air at random
+ * @param dFailureRate Share of frames corrupted, the call fails with NFC_ERFTRANS
+ * @param dTimeoutRate Share of frames lost, the call fails with NFC_ETIMEOUT
+ * @param uiSeed Seed of the draws, a run is repeatable for a given seed
+ */
+void
+mfc_sim_set_faults(mfc_sim *ps, double dFailureRate, double dTimeoutRate, uint32_t uiSeed)
+{
+  ps->dFailureRate = dFailureRate;
+  ps->dTimeoutRate = dTimeoutRate;
+  ps->uiFaultRandom = uiSeed | 1;
+}
+
+/**
+ * @brief Air time of the exchanges since the last call, in microseconds
+ */
+uint32_t
+mfc_sim_air_time_us(mfc_sim *ps)
+{
+  uint32_t uiUs = ps->ui64AirNs / 1000;
+
+  ps->ui64AirNs %= 1000;
+  return uiUs;
+}
+
+/**
+ * @brief Current content of the simulated card
+ */
+const mifare_classic_tag *
+mfc_sim_content(const mfc_sim *ps, size_t *pszBlocks)
+{
+  if (pszBlocks != NULL)
+    *pszBlocks = ps->szBlocks;
+  return &ps->mt;
+}
+
+int
+mfc_sim_set_property_bool(mfc_sim *ps, const nfc_property property, const bool bEnable)
+{
+  switch (property) {
+    case NP_EASY_FRAMING:
+      ps->bEasyFraming = bEnable;
+      break;
+    case NP_HANDLE_CRC:
+      ps->bHandleCrc = bEnable;
+      break;
+    case NP_ACTIVATE_CRYPTO1:
+      if (!bEnable)
+        reader_crypto_off(ps);
+      break;
+    case NP_ACTIVATE_FIELD:
+      // Switching the field off powers the card down
+      if (!bEnable) {
+        reader_crypto_off(ps);
+        card_reset(ps, CARD_IDLE);
+      }
+      ps->bField = bEnable;
+      break;
+    default:
+      break;
+  }
+  return NFC_SUCCESS;
+}
+
+/**
+ * @brief REQA, anticollision and SELECT in one go, as the PN53x does
+ *
+ * A halted card does not answer REQA and is not found.
+ */
+int
+mfc_sim_select_passive_target(mfc_sim *ps, const nfc_modulation nm, const uint8_t *pbtInitData, const size_t szInitData, nfc_target *pnt)
+{
+  const uint8_t *pbtUid = ps->mt.amb[0].mbm.abtUID;
+
+  if (nm.nmt != NMT_ISO14443A || !ps->bField || ps->cs == CARD_HALT || ps->cs == CARD_MAGIC_WAIT)
+    return 0;
+  if (pbtInitData != NULL && (szInitData != 4 || memcmp(pbtInitData, pbtUid, 4) != 0))
+    return 0;
+  // REQA, ATQA, anticollision, UID, SELECT, SAK
+  ps->ui64AirNs += frame_ns(7) + frame_ns(16) + frame_ns(16) + frame_ns(40) + frame_ns(72) + frame_ns(24) + 3 * FRAME_DELAY_NS;
+  ps->iFault = 0;
+  if (inject_fault(ps))
+    return 0;
+  reader_crypto_off(ps);
+  card_reset(ps, CARD_ACTIVE);
+  if (pnt != NULL) {
+    memset(pnt, 0, sizeof(*pnt));
+    pnt->nm = nm;
+    pnt->nti.nai.abtAtqa[0] = 0x00;
+    pnt->nti.nai.abtAtqa[1] = (ps->szBlocks > 64) ? 0x02 : 0x04;
+    pnt->nti.nai.btSak = (ps->szBlocks > 64) ? 0x18 : 0x08;
+    pnt->nti.nai.szUidLen = 4;
+    memcpy(pnt->nti.nai.abtUid, pbtUid, 4);
+  }
+  return 1;
+}
+
+int
+mfc_sim_transceive_bytes(mfc_sim *ps, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx, const size_t szRx)
+{
+  uint8_t abtFrame[MAX_CARD_FRAME];
+  uint8_t abtAnswer[MAX_CARD_FRAME];
+  size_t szFrame = szTx, szAnswerBits, szAnswer;
+
+  if (szTx == 0 || szTx + 2 > sizeof(abtFrame))
+    return NFC_EINVARG;
+  ps->iFault = 0;
+  if (ps->bEasyFraming && (pbtTx[0] == MC_AUTH_A || pbtTx[0] == MC_AUTH_B || pbtTx[0] == MC_READ || pbtTx[0] == MC_WRITE
+                           || pbtTx[0] == MC_INCREMENT || pbtTx[0] == MC_DECREMENT || pbtTx[0] == MC_STORE || pbtTx[0] == MC_TRANSFER))
+    return reader_mifare(ps, pbtTx, szTx, pbtRx, szRx);
+
+  memcpy(abtFrame, pbtTx, szTx);
+  if (ps->bHandleCrc) {
+    crc_a(abtFrame, szTx, abtFrame + szTx);
+    szFrame += 2;
+  }
+  if ((szAnswerBits = reader_exchange(ps, abtFrame, szFrame * 8, abtAnswer)) == 0)
+    return (ps->iFault != 0) ? ps->iFault : NFC_ETIMEOUT;
+  szAnswer = (szAnswerBits + 7) / 8;
+  if (ps->bHandleCrc && szAnswerBits % 8 == 0 && crc_ok(abtAnswer, szAnswer))
+    szAnswer -= 2;
+  if (szAnswer > szRx)
+    return NFC_EOVFLOW;
+  memcpy(pbtRx, abtAnswer, szAnswer);
+  return szAnswer;
+}
+
+int
+mfc_sim_transceive_bits(mfc_sim *ps, const uint8_t *pbtTx, const size_t szTxBits, uint8_t *pbtRx, const size_t szRx)
+{
+  uint8_t abtAnswer[MAX_CARD_FRAME];
+  size_t szAnswerBits;
+
+  if (szTxBits == 0 || szTxBits > 8 * MAX_CARD_FRAME)
+    return NFC_EINVARG;
+  ps->iFault = 0;
+  if ((szAnswerBits = reader_exchange(ps, pbtTx, szTxBits, abtAnswer)) == 0)
+    return (ps->iFault != 0) ? ps->iFault : NFC_ETIMEOUT;
+  if ((szAnswerBits + 7) / 8 > szRx)
+    return NFC_EOVFLOW;
+  memcpy(pbtRx, abtAnswer, (szAnswerBits + 7) / 8);
+  return szAnswerBits;
+}
+
+static const char *pcInstalledCards;
+static bool bInstalledMagic;
+
+// Card in the field of simulated reader szReader, true when the readers after it have cards of their own
+static bool
+installed_card(size_t szReader, char *pcCard, size_t szCard)
+{
+  const char *pcStart = pcInstalledCards, *pcEnd;
+  size_t n;
+
+  for (n = 0; n < szReader && (pcEnd = strchr(pcStart, ',')) != NULL; n++)
+    pcStart = pcEnd + 1;
+  pcEnd = strchr(pcStart, ',');
+  snprintf(pcCard, szCard, "%.*s", (int)((pcEnd != NULL) ? (size_t)(pcEnd - pcStart) : strlen(pcStart)), pcStart);
+  return n == szReader && pcEnd != NULL;
+}
+
+static mfc_sim *
+open_installed(size_t szReader)
+{
+  char acCard[PATH_MAX];
+
+  installed_card(szReader, acCard, sizeof(acCard));
+  return mfc_sim_new(acCard, bInstalledMagic);
+}
+
+static const nfct_simulator nsInstalled = {
+  .open = open_installed,
+  .close = mfc_sim_free,
+  .set_faults = mfc_sim_set_faults,
+  .air_time_us = mfc_sim_air_time_us,
+  .set_property_bool = mfc_sim_set_property_bool,
+  .select_passive_target = mfc_sim_select_passive_target,
+  .transceive_bytes = mfc_sim_transceive_bytes,
+  .transceive_bits = mfc_sim_transceive_bits
+};
+
+/**
+ * @brief Replace the readers of the transport with simulators, each with a card in its field
+ * @param pcCard Card content, see mfc_sim_new(), or a comma separated list giving each reader its own card,
+ *               the last one is in the field of the remaining readers
+ * @param bMagic The cards are gen1 magic cards
+ * @param szReaders Number of readers found by nfct_list_devices()
+ */
+bool
+mfc_sim_install(const char *pcCard, bool bMagic, size_t szReaders)
+{
+  char acCard[PATH_MAX];
+  size_t n = 0;
+  bool bMore;
+  mfc_sim *ps;
+
+  // Fail now rather than at the first open
+  pcInstalledCards = pcCard;
+  do {
+    bMore = installed_card(n++, acCard, sizeof(acCard));
+    if ((ps = mfc_sim_new(acCard, bMagic)) == NULL)
+      return false;
+    mfc_sim_free(ps);
+  } while (bMore);
+  bInstalledMagic = bMagic;
+  nfct_simulate(&nsInstalled, szReaders);
+  return true;
+}
@@ -0,0 +1,82 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file mfc-sim.h
+ * @brief Software MIFARE Classic card and reader, for tests and benchmarks
+ *
+ * One simulator is a reader with one MIFARE Classic 1K or 4K card in its
+ * field. It takes the same calls a libnfc device does and answers them the
+ * way a PN53x with that card would: the card runs the real three pass
+ * authentication with crypto1 and card nonces, encrypts its traffic,
+ * enforces the access bits, and knows HLTA/WUPA and the gen1 magic unlock.
+ *
+ * It also keeps the time the exchanges would take on air at 106 kbps, and
+ * can lose or corrupt frames at random, so the transport can play the
+ * timing of a real reader.
+ *
+ * mfc_sim_install() puts simulators in place of the readers of the
+ * transport; only the tools that offer it link the simulator in.
+ */
+
+#ifndef _MFC_SIM_H_
+#  define _MFC_SIM_H_
+
+#  include <stdbool.h>
+#  include <stddef.h>
+#  include <stdint.h>
+
+#  include <nfc/nfc-types.h>
+
+#  include "mifare.h"
+
+typedef struct mfc_sim mfc_sim;
+
+mfc_sim *mfc_sim_new(const char *pcCard, bool bMagic);
+void    mfc_sim_free(mfc_sim *ps);
+const mifare_classic_tag *mfc_sim_content(const mfc_sim *ps, size_t *pszBlocks);
+void    mfc_sim_set_faults(mfc_sim *ps, double dFailureRate, double dTimeoutRate, uint32_t uiSeed);
+uint32_t mfc_sim_air_time_us(mfc_sim *ps);
+
+int     mfc_sim_set_property_bool(mfc_sim *ps, const nfc_property property, const bool bEnable);
+int     mfc_sim_select_passive_target(mfc_sim *ps, const nfc_modulation nm, const uint8_t *pbtInitData, const size_t szInitData, nfc_target *pnt);
+int     mfc_sim_transceive_bytes(mfc_sim *ps, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx, const size_t szRx);
+int     mfc_sim_transceive_bits(mfc_sim *ps, const uint8_t *pbtTx, const size_t szTxBits, uint8_t *pbtRx, const size_t szRx);
+
+bool    mfc_sim_install(const char *pcCard, bool bMagic, size_t szReaders);
+
+#endif // _MFC_SIM_H_
@@ -0,0 +1,521 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file mfd-archive.c
+ * @brief Store many MIFARE Classic dumps in one archive, indexed by UID
+ *
+ * The data file is an array of 16-byte cells. Cells 0-1 hold the header, the
+ * other ones are either a unique block or part of a dump record: one cell
+ * with the UID and block count, followed by the 32-bit cell numbers of its
+ * blocks. Identical blocks (default trailers, empty sectors...) are stored
+ * once. Both files grow by remapping; an index rebuild is written aside and
+ * renamed over the old one.
+ *
+ * An append writes its cells past the end the index covers, then moves that
+ * end, and only then points the UID at the new dump. Cells past the end are
+ * left over from an append that did not finish: readers ignore them, the
+ * next writer drops them.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "mfd-archive.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nfc/nfc.h>
+
+#include "nfc-utils.h"
+
+#define CELL_SIZE 16
+#define DATA_MAGIC "MFDARC01"
+#define INDEX_MAGIC "MFDIDX01"
+#define FIRST_CELL 2
+#define MIN_DATA_CELLS 65536
+#define MIN_SLOTS 1024
+
+struct mfa_data_header {
+  char     acMagic[8];
+  uint32_t uiCellSize;
+  uint32_t uiReserved;
+  uint64_t ui64Cells;     // cells in use, header included
+  uint64_t ui64Dumps;     // dump records, superseded ones included
+};
+
+struct mfa_dump_cell {
+  uint8_t  btUidLen;
+  uint8_t  abtUid[MFD_ARCHIVE_UID_MAX];
+  uint8_t  btReserved;
+  uint16_t ui16Blocks;
+  uint16_t ui16Reserved;
+};
+
+struct mfa_index_header {
+  char     acMagic[8];
+  uint64_t ui64UidSlots;
+  uint64_t ui64UidUsed;
+  uint64_t ui64BlockSlots;
+  uint64_t ui64BlockUsed;
+  uint64_t ui64DataCells; // data cells covered by this index
+  uint64_t aui64Reserved[2];
+};
+
+// An empty slot has cell 0, which is always the header
+struct mfa_uid_slot {
+  uint64_t ui64Hash;
+  uint32_t uiCell;
+  uint32_t uiReserved;
+};
+
+struct mfa_block_slot {
+  uint32_t uiHash;
+  uint32_t uiCell;
+};
+
+struct mfd_archive {
+  pthread_mutex_t mutex;
+  bool     bWritable;
+  int      iDataFd;
+  int      iIndexFd;
+  char    *pcIndexPath;
+  uint8_t *pbtData;
+  size_t   szDataMap;
+  uint8_t *pbtIndex;
+  size_t   szIndexMap;
+};
+
+static struct mfa_data_header *
+data_header(mfd_archive *pma)
+{
+  return (struct mfa_data_header *) pma->pbtData;
+}
+
+static uint8_t *
+cell(mfd_archive *pma, uint64_t ui64Cell)
+{
+  return pma->pbtData + ui64Cell * CELL_SIZE;
+}
+
+static struct mfa_index_header *
+index_header(uint8_t *pbtIndex)
+{
+  return (struct mfa_index_header *) pbtIndex;
+}
+
+static struct mfa_uid_slot *
+uid_slots(uint8_t *pbtIndex)
+{
+  return (struct mfa_uid_slot *)(pbtIndex + sizeof(struct mfa_index_header));
+}
+
+static struct mfa_block_slot *
+block_slots(uint8_t *pbtIndex)
+{
+  return (struct mfa_block_slot *)(uid_slots(pbtIndex) + index_header(pbtIndex)->ui64UidSlots);
+}
+
+static size_t
+index_size(uint64_t ui64UidSlots, uint64_t ui64BlockSlots)
+{
+  return sizeof(struct mfa_index_header) + ui64UidSlots * sizeof(struct mfa_uid_slot)
+         + ui64BlockSlots * sizeof(struct mfa_block_slot);
+}
+
+static uint8_t *
+map_file(int iFd, size_t szLen, bool bWritable)
+{
+  void *p = mmap(NULL, szLen, bWritable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, iFd, 0);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+static bool
+grow_data(mfd_archive *pma, uint64_t ui64Cells)
+{
+  size_t szNeeded = (data_header(pma)->ui64Cells + ui64Cells) * CELL_SIZE;
+  size_t szMap = pma->szDataMap;
+  uint8_t *pbt;
+
+  if (szNeeded <= szMap)
+    return true;
+  while (szMap < szNeeded)
+    szMap *= 2;
+  if (ftruncate(pma->iDataFd, szMap) < 0)
+    return false;
+  munmap(pma->pbtData, pma->szDataMap);
+  if ((pbt = map_file(pma->iDataFd, szMap, true)) == NULL) {
+    pma->pbtData = NULL;
+    return false;
+  }
+  pma->pbtData = pbt;
+  pma->szDataMap = szMap;
+  return true;
+}
+
+static uint32_t
+find_uid(mfd_archive *pma, const uint8_t *pbtIndex, const uint8_t *pbtUid, size_t szUidLen, uint64_t *pui64Slot)
+{
+  const struct mfa_index_header *pih = (const struct mfa_index_header *) pbtIndex;
+  const struct mfa_uid_slot *pus = uid_slots((uint8_t *) pbtIndex);
+  uint64_t ui64Hash = fnv1a64(pbtUid, szUidLen);
+  uint64_t ui64Mask = pih->ui64UidSlots - 1;
+  uint64_t i;
+
+  for (i = ui64Hash & ui64Mask; pus[i].uiCell != 0; i = (i + 1) & ui64Mask) {
+    const struct mfa_dump_cell *pdc = (const struct mfa_dump_cell *) cell(pma, pus[i].uiCell);
+    if (pus[i].ui64Hash == ui64Hash && pdc->btUidLen == szUidLen && memcmp(pdc->abtUid, pbtUid, szUidLen) == 0)
+      break;
+  }
+  if (pui64Slot)
+    *pui64Slot = i;
+  return pus[i].uiCell;
+}
+
+static bool
+create_index(const char *pcPath, uint64_t ui64UidSlots, uint64_t ui64BlockSlots, int *piFd, uint8_t **ppbtIndex)
+{
+  size_t szLen = index_size(ui64UidSlots, ui64BlockSlots);
+  int iFd = open(pcPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (iFd < 0)
+    return false;
+  if (ftruncate(iFd, szLen) < 0 || (*ppbtIndex = map_file(iFd, szLen, true)) == NULL) {
+    close(iFd);
+    return false;
+  }
+  memcpy(index_header(*ppbtIndex)->acMagic, INDEX_MAGIC, 8);
+  index_header(*ppbtIndex)->ui64UidSlots = ui64UidSlots;
+  index_header(*ppbtIndex)->ui64BlockSlots = ui64BlockSlots;
+  *piFd = iFd;
+  return true;
+}
+
+// Rehash into bigger tables, written aside and renamed over the current index
+//
+// Slots of cells past the end of the index are left over from an unfinished
+// append, they do not make it into the new tables.
+static bool
+grow_index(mfd_archive *pma, uint64_t ui64UidSlots, uint64_t ui64BlockSlots)
+{
+  struct mfa_index_header *pihOld = index_header(pma->pbtIndex);
+  size_t szTmpPath = strlen(pma->pcIndexPath) + 5;
+  char *pcTmpPath = malloc(szTmpPath);
+  uint8_t *pbtIndex;
+  int iFd;
+
+  if (pcTmpPath == NULL)
+    return false;
+  snprintf(pcTmpPath, szTmpPath, "%s.new", pma->pcIndexPath);
+  if (!create_index(pcTmpPath, ui64UidSlots, ui64BlockSlots, &iFd, &pbtIndex)) {
+    free(pcTmpPath);
+    return false;
+  }
+
+  struct mfa_uid_slot *pusOld = uid_slots(pma->pbtIndex), *pus = uid_slots(pbtIndex);
+  for (uint64_t n = 0; n < pihOld->ui64UidSlots; n++) {
+    if (pusOld[n].uiCell == 0 || pusOld[n].uiCell >= pihOld->ui64DataCells)
+      continue;
+    uint64_t i = pusOld[n].ui64Hash & (ui64UidSlots - 1);
+    while (pus[i].uiCell != 0)
+      i = (i + 1) & (ui64UidSlots - 1);
+    pus[i] = pusOld[n];
+    index_header(pbtIndex)->ui64UidUsed++;
+  }
+  struct mfa_block_slot *pbsOld = block_slots(pma->pbtIndex), *pbs = block_slots(pbtIndex);
+  for (uint64_t n = 0; n < pihOld->ui64BlockSlots; n++) {
+    if (pbsOld[n].uiCell == 0 || pbsOld[n].uiCell >= pihOld->ui64DataCells)
+      continue;
+    uint64_t i = pbsOld[n].uiHash & (ui64BlockSlots - 1);
+    while (pbs[i].uiCell != 0)
+      i = (i + 1) & (ui64BlockSlots - 1);
+    pbs[i] = pbsOld[n];
+    index_header(pbtIndex)->ui64BlockUsed++;
+  }
+  index_header(pbtIndex)->ui64DataCells = pihOld->ui64DataCells;
+
+  if (msync(pbtIndex, index_size(ui64UidSlots, ui64BlockSlots), MS_SYNC) < 0 || rename(pcTmpPath, pma->pcIndexPath) < 0) {
+    munmap(pbtIndex, index_size(ui64UidSlots, ui64BlockSlots));
+    close(iFd);
+    unlink(pcTmpPath);
+    free(pcTmpPath);
+    return false;
+  }
+  free(pcTmpPath);
+  munmap(pma->pbtIndex, pma->szIndexMap);
+  close(pma->iIndexFd);
+  pma->pbtIndex = pbtIndex;
+  pma->szIndexMap = index_size(ui64UidSlots, ui64BlockSlots);
+  pma->iIndexFd = iFd;
+  return true;
+}
+
+static uint32_t
+intern_block(mfd_archive *pma, const mifare_classic_block *pmb)
+{
+  struct mfa_index_header *pih = index_header(pma->pbtIndex);
+  struct mfa_block_slot *pbs = block_slots(pma->pbtIndex);
+  uint64_t ui64Hash = fnv1a64((const uint8_t *) pmb, CELL_SIZE);
+  uint32_t uiHash = (uint32_t)(ui64Hash ^ (ui64Hash >> 32));
+  uint64_t ui64Mask = pih->ui64BlockSlots - 1;
+  uint64_t i;
+
+  for (i = uiHash & ui64Mask; pbs[i].uiCell != 0; i = (i + 1) & ui64Mask) {
+    if (pbs[i].uiHash == uiHash && memcmp(cell(pma, pbs[i].uiCell), pmb, CELL_SIZE) == 0)
+      return pbs[i].uiCell;
+  }
+  memcpy(cell(pma, data_header(pma)->ui64Cells), pmb, CELL_SIZE);
+  pbs[i].uiHash = uiHash;
+  pbs[i].uiCell = (uint32_t) data_header(pma)->ui64Cells++;
+  pih->ui64BlockUsed++;
+  return pbs[i].uiCell;
+}
+
+mfd_archive *
+mfd_archive_open(const char *pcPath, bool bWritable)
+{
+  mfd_archive *pma = calloc(1, sizeof(*pma));
+  size_t szPath = strlen(pcPath) + 5;
+  struct stat st;
+
+  if (pma == NULL)
+    return NULL;
+  pthread_mutex_init(&pma->mutex, NULL);
+  pma->bWritable = bWritable;
+  pma->iIndexFd = -1;
+  if ((pma->pcIndexPath = malloc(szPath)) == NULL)
+    goto error;
+  snprintf(pma->pcIndexPath, szPath, "%s.idx", pcPath);
+
+  if ((pma->iDataFd = open(pcPath, bWritable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0) {
+    ERR("Could not open archive: %s", pcPath);
+    goto error;
+  }
+  if (bWritable) {
+    // Only one process may append to an archive
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    if (fcntl(pma->iDataFd, F_SETLK, &fl) < 0) {
+      ERR("Archive is in use by another process: %s", pcPath);
+      goto error;
+    }
+  }
+  if (fstat(pma->iDataFd, &st) < 0)
+    goto error;
+
+  if (st.st_size == 0) {
+    if (!bWritable) {
+      ERR("Empty archive: %s", pcPath);
+      goto error;
+    }
+    pma->szDataMap = MIN_DATA_CELLS * CELL_SIZE;
+    if (ftruncate(pma->iDataFd, pma->szDataMap) < 0 || (pma->pbtData = map_file(pma->iDataFd, pma->szDataMap, true)) == NULL)
+      goto error;
+    memcpy(data_header(pma)->acMagic, DATA_MAGIC, 8);
+    data_header(pma)->uiCellSize = CELL_SIZE;
+    data_header(pma)->ui64Cells = FIRST_CELL;
+    if (!create_index(pma->pcIndexPath, MIN_SLOTS, MIN_SLOTS, &pma->iIndexFd, &pma->pbtIndex))
+      goto error;
+    pma->szIndexMap = index_size(MIN_SLOTS, MIN_SLOTS);
+    index_header(pma->pbtIndex)->ui64DataCells = FIRST_CELL;
+    return pma;
+  }
+
+  pma->szDataMap = st.st_size;
+  if ((pma->pbtData = map_file(pma->iDataFd, pma->szDataMap, bWritable)) == NULL)
+    goto error;
+  if (memcmp(data_header(pma)->acMagic, DATA_MAGIC, 8) != 0 || data_header(pma)->uiCellSize != CELL_SIZE) {
+    ERR("Not an MFD archive: %s", pcPath);
+    goto error;
+  }
+
+  if ((pma->iIndexFd = open(pma->pcIndexPath, bWritable ? O_RDWR : O_RDONLY)) < 0 || fstat(pma->iIndexFd, &st) < 0) {
+    ERR("Could not open archive index: %s", pma->pcIndexPath);
+    goto error;
+  }
+  pma->szIndexMap = st.st_size;
+  if ((size_t) st.st_size < sizeof(struct mfa_index_header)
+      || (pma->pbtIndex = map_file(pma->iIndexFd, pma->szIndexMap, bWritable)) == NULL
+      || memcmp(index_header(pma->pbtIndex)->acMagic, INDEX_MAGIC, 8) != 0
+      || index_size(index_header(pma->pbtIndex)->ui64UidSlots, index_header(pma->pbtIndex)->ui64BlockSlots) != pma->szIndexMap) {
+    ERR("Invalid archive index: %s", pma->pcIndexPath);
+    goto error;
+  }
+  if (index_header(pma->pbtIndex)->ui64DataCells > data_header(pma)->ui64Cells) {
+    ERR("Archive index is out of date: %s", pma->pcIndexPath);
+    goto error;
+  }
+  if (bWritable && index_header(pma->pbtIndex)->ui64DataCells < data_header(pma)->ui64Cells) {
+    // An append did not finish: forget its slots, then its cells
+    if (!grow_index(pma, index_header(pma->pbtIndex)->ui64UidSlots, index_header(pma->pbtIndex)->ui64BlockSlots)) {
+      ERR("Could not rebuild archive index: %s", pma->pcIndexPath);
+      goto error;
+    }
+    data_header(pma)->ui64Cells = index_header(pma->pbtIndex)->ui64DataCells;
+  }
+  return pma;
+
+error:
+  mfd_archive_close(pma);
+  return NULL;
+}
+
+void
+mfd_archive_close(mfd_archive *pma)
+{
+  if (pma == NULL)
+    return;
+  if (pma->pbtData != NULL) {
+    if (pma->bWritable)
+      msync(pma->pbtData, pma->szDataMap, MS_SYNC);
+    munmap(pma->pbtData, pma->szDataMap);
+  }
+  if (pma->pbtIndex != NULL) {
+    if (pma->bWritable)
+      msync(pma->pbtIndex, pma->szIndexMap, MS_SYNC);
+    munmap(pma->pbtIndex, pma->szIndexMap);
+  }
+  if (pma->iIndexFd >= 0)
+    close(pma->iIndexFd);
+  if (pma->iDataFd >= 0)
+    close(pma->iDataFd);
+  pthread_mutex_destroy(&pma->mutex);
+  free(pma->pcIndexPath);
+  free(pma);
+}
+
+/**
+ * @brief Append a dump, replacing any earlier dump with the same UID
+ * @return Returns true if the dump was stored; otherwise returns false.
+ */
+bool
+mfd_archive_put(mfd_archive *pma, const uint8_t *pbtUid, size_t szUidLen, const mifare_classic_tag *pmt, size_t szBlocks)
+{
+  uint32_t auiRefs[256];
+  uint64_t ui64RefCells = (szBlocks * sizeof(uint32_t) + CELL_SIZE - 1) / CELL_SIZE;
+  uint64_t ui64Slot;
+  struct mfa_index_header *pih;
+  bool bSuccess = false;
+
+  if (!pma->bWritable || szUidLen == 0 || szUidLen > MFD_ARCHIVE_UID_MAX || szBlocks == 0 || szBlocks > 256)
+    return false;
+
+  pthread_mutex_lock(&pma->mutex);
+  pih = index_header(pma->pbtIndex);
+  // Keep both tables at most half full
+  if ((pih->ui64UidUsed + 1) * 2 > pih->ui64UidSlots || (pih->ui64BlockUsed + szBlocks) * 2 > pih->ui64BlockSlots) {
+    uint64_t ui64UidSlots = pih->ui64UidSlots, ui64BlockSlots = pih->ui64BlockSlots;
+    while ((pih->ui64UidUsed + 1) * 2 > ui64UidSlots)
+      ui64UidSlots *= 2;
+    while ((pih->ui64BlockUsed + szBlocks) * 2 > ui64BlockSlots)
+      ui64BlockSlots *= 2;
+    if (!grow_index(pma, ui64UidSlots, ui64BlockSlots))
+      goto out;
+    pih = index_header(pma->pbtIndex);
+  }
+  if (!grow_data(pma, szBlocks + 1 + ui64RefCells))
+    goto out;
+
+  for (size_t n = 0; n < szBlocks; n++)
+    auiRefs[n] = intern_block(pma, &pmt->amb[n]);
+
+  uint32_t uiDumpCell = (uint32_t) data_header(pma)->ui64Cells;
+  struct mfa_dump_cell *pdc = (struct mfa_dump_cell *) cell(pma, uiDumpCell);
+  memset(pdc, 0, CELL_SIZE);
+  pdc->btUidLen = szUidLen;
+  memcpy(pdc->abtUid, pbtUid, szUidLen);
+  pdc->ui16Blocks = szBlocks;
+  memset(cell(pma, uiDumpCell + 1), 0, ui64RefCells * CELL_SIZE);
+  memcpy(cell(pma, uiDumpCell + 1), auiRefs, szBlocks * sizeof(uint32_t));
+  data_header(pma)->ui64Cells += 1 + ui64RefCells;
+  data_header(pma)->ui64Dumps++;
+  // Commit: until here the index covers none of the new cells
+  pih->ui64DataCells = data_header(pma)->ui64Cells;
+
+  if (find_uid(pma, pma->pbtIndex, pbtUid, szUidLen, &ui64Slot) == 0) {
+    uid_slots(pma->pbtIndex)[ui64Slot].ui64Hash = fnv1a64(pbtUid, szUidLen);
+    pih->ui64UidUsed++;
+  }
+  uid_slots(pma->pbtIndex)[ui64Slot].uiCell = uiDumpCell;
+  bSuccess = true;
+
+out:
+  pthread_mutex_unlock(&pma->mutex);
+  return bSuccess;
+}
+
+/**
+ * @brief Look up the latest dump of a card
+ * @return Returns the number of blocks copied into pmt, 0 when the UID is unknown.
+ */
+size_t
+mfd_archive_get(mfd_archive *pma, const uint8_t *pbtUid, size_t szUidLen, mifare_classic_tag *pmt)
+{
+  size_t szBlocks = 0;
+  uint32_t uiDumpCell;
+
+  if (szUidLen == 0 || szUidLen > MFD_ARCHIVE_UID_MAX)
+    return 0;
+
+  pthread_mutex_lock(&pma->mutex);
+  if ((uiDumpCell = find_uid(pma, pma->pbtIndex, pbtUid, szUidLen, NULL)) != 0) {
+    const struct mfa_dump_cell *pdc = (const struct mfa_dump_cell *) cell(pma, uiDumpCell);
+    const uint8_t *pbtRefs = cell(pma, uiDumpCell + 1);
+    szBlocks = pdc->ui16Blocks;
+    for (size_t n = 0; n < szBlocks; n++) {
+      uint32_t uiRef;
+      memcpy(&uiRef, pbtRefs + n * sizeof(uint32_t), sizeof(uint32_t));
+      memcpy(&pmt->amb[n], cell(pma, uiRef), CELL_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&pma->mutex);
+  return szBlocks;
+}
+
+void
+mfd_archive_stats(mfd_archive *pma, size_t *pszDumps, size_t *pszUniqueBlocks)
+{
+  pthread_mutex_lock(&pma->mutex);
+  *pszDumps = index_header(pma->pbtIndex)->ui64UidUsed;
+  *pszUniqueBlocks = index_header(pma->pbtIndex)->ui64BlockUsed;
+  pthread_mutex_unlock(&pma->mutex);
+}
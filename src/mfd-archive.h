@@ -0,0 +1,69 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file mfd-archive.h
+ * @brief Store many MIFARE Classic dumps in one archive, indexed by UID
+ *
+ * An archive is two files: <archive> holds 16-byte cells (the unique blocks
+ * and one record per dump referencing them) and <archive>.idx holds the
+ * memory-mapped hash tables used to find a dump by UID and to de-duplicate
+ * blocks. Both files are needed, back them up together.
+ */
+
+#ifndef _MFD_ARCHIVE_H_
+#  define _MFD_ARCHIVE_H_
+
+#  include <stdbool.h>
+#  include <stddef.h>
+#  include <stdint.h>
+
+#  include "mifare.h"
+
+#  define MFD_ARCHIVE_UID_MAX 10
+
+typedef struct mfd_archive mfd_archive;
+
+mfd_archive *mfd_archive_open(const char *pcPath, bool bWritable);
+void    mfd_archive_close(mfd_archive *pma);
+
+bool    mfd_archive_put(mfd_archive *pma, const uint8_t *pbtUid, size_t szUidLen, const mifare_classic_tag *pmt, size_t szBlocks);
+size_t  mfd_archive_get(mfd_archive *pma, const uint8_t *pbtUid, size_t szUidLen, mifare_classic_tag *pmt);
+
+void    mfd_archive_stats(mfd_archive *pma, size_t *pszDumps, size_t *pszUniqueBlocks);
+
+#endif // _MFD_ARCHIVE_H_
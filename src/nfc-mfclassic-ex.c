@@ -59,24 +59,180 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <nfc/nfc.h>
 
+#include "card-class.h"
+#include "iso-dep.h"
 #include "mifare.h"
+#include "mfd-archive.h"
+#include "mfc-sim.h"
+#include "mf-keydb.h"
+#include "latency-model.h"
+#include "metrics.h"
+#include "nfc-transport.h"
 #include "nfc-utils.h"
 
+#define MAX_DEVICE_COUNT 16
+#define MAX_FRAME_LEN 264
+
+// Dump or keys file name standing for the archive entry of the presented card
+#define ARCHIVE_ENTRY "@"
+
+#define LINE_POLL_MS 20
+
+// Where the time of a card goes on an encoding line
+typedef enum {
+  PHASE_WAIT,                    // for the card to arrive, and to leave again
+  PHASE_SETUP,                   // select, classification, dump and keys
+  PHASE_ENCODE,
+  PHASE_VERIFY,
+  PHASE_COUNT
+} line_phase;
+
+static const char *apcPhases[PHASE_COUNT] = { "waiting for the card", "setup", "encode", "verify" };
+
+// READ retries of a single block, the pause before each doubles
+#define BLOCK_RETRIES 3
+#define RETRY_BACKOFF_MS 5
+
+// Header of a read journal, followed by the number of the last block of the card
+#define JOURNAL_MAGIC "MFJ1"
+
+// Why a block is missing from a dump
+typedef enum {
+  GAP_NONE,
+  GAP_AUTH,                      // no key at hand opened the sector
+  GAP_READ,                      // the card kept failing the READ or the authentication again
+  GAP_LOST,                      // the card is gone, never left in a dump
+  GAP_COUNT
+} gap_cause;
+
+static const char *apcGapCauses[GAP_COUNT] = { "", "no key", "read failed", "card lost" };
+
+// Everything that belongs to one reader and the card presented to it
+struct mfc_session {
+  nfc_device *pnd;
+  size_t szDevice;
+  nfc_target nt;
+  mifare_param mp;
+  mifare_classic_tag mtKeys;
+  mifare_classic_tag mtDump;
+  mifare_classic_tag mtCard;     // current card content, for differential writes
+  bool abDiffer[256];
+  bool abWritten[256];
+  uint8_t abtGaps[256];          // gap_cause of each block a read left out
+  uint8_t aabtMagicData[256][18];  // WRITE data frames of the unlocked fast path
+  uint8_t abtRx[MAX_FRAME_LEN];
+  int szRxBits;
+  uint8_t uiBlocks;
+  mf_keydb_keys mkkCard;         // keys the key database knows for this card
+  uint8_t aabtAccessBits[MF_KEYDB_SECTORS][4];  // as read from the sector trailers of the card
+  uint64_t ui64AccessKnown;      // one bit per sector
+  uint64_t ui64KeyFailedA;       // sectors the key at hand did not open
+  uint64_t ui64KeyFailedB;
+  bool bAuthKeyA;                // key of the current authentication
+  bool magic2;
+  bool bSelected;                // the line already selected the card
+  double adPhaseMs[PHASE_COUNT];
+  uint32_t uiBlocksDone;
+  uint32_t uiBlocksSkipped;
+  uint32_t uiBlocksDoomed;       // left alone, the access bits would refuse them
+  uint32_t uiBlocksVerified;
+  uint32_t uiMismatches;
+  uint32_t uiReactivations;
+  uint32_t uiFullSelects;        // reactivations that needed the anticollision after all
+  double dReactivationMs;
+  double dReactivationMaxMs;
+  double dHandoverMs;            // the copy of a clone waited for the source
+  FILE *pfJournal;               // sectors read so far, see -J
+  char acJournal[1024];
+  uint64_t ui64Journaled;        // one bit per sector in the journal
+  bool bSuccess;
+};
+
+// Results aggregated over all sessions of a multi-device run
+struct mfc_totals {
+  pthread_mutex_t mutex;
+  size_t szCardsOk;
+  size_t szCardsFailed;
+  uint32_t uiBlocks;
+  double adPhaseMs[PHASE_COUNT];
+};
+
+// Sectors handed over from the session reading the source of a clone to the one writing the copy
+struct mfc_handover {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct mfc_session *psSource;  // NULL unless cloning
+  uint64_t ui64Ready;            // one bit per sector read in full, both keys included
+  bool bClassified;              // the size of the source is known
+  bool bDone;                    // no more sectors to come
+};
+
+typedef enum {
+  ACTION_READ,
+  ACTION_WRITE,
+  ACTION_VALUE,
+  ACTION_CLONE,
+  ACTION_USAGE
+} action_t;
+
+typedef enum {
+  VALUE_CHECK,
+  VALUE_SET,
+  VALUE_CREDIT,
+  VALUE_DEBIT
+} value_op;
+
 static nfc_context *context;
-static nfc_device *pnd;
-static nfc_target nt;
-static mifare_param mp;
-static mifare_classic_tag mtKeys;
-static mifare_classic_tag mtDump;
+static action_t atAction = ACTION_USAGE;
+static int unlock = 0;
+static const char *pcDumpFile;
+static const char *pcKeysFile;
+static uint8_t abtKeyFileUid[4];
+static const char *pcDevice;
+static const char *pcArchive;
+static mfd_archive *pmaArchive;
+static bool bDumpInArchive = false;
+static bool bKeysInArchive = false;
+static const char *pcKeyDb;
+static mf_keydb *pmkKeyDb;
+static const char *pcClassFile;
+static const char *pcLatencyFile;
+static const char *pcMetricsFile;
+static const char *pcRecordTrace;
+static const char *pcReplayTrace;
+static bool bReplayPaced = false;
+static const char *pcSimCard;
+static bool bSimMagic = false;
+static const char *pcSimLink;
+static size_t szBenchCards = 0;
+static bool bLineMode = false;
+static size_t szLineCards = 0;
+static volatile sig_atomic_t bStopLine = 0;
+static mifare_classic_tag mtLineDump;
+static mifare_classic_tag mtLineKeys;
+static size_t szLineDumpBlocks = 0;
+static size_t szLineKeyBlocks = 0;
+static value_op voValue;
+static int32_t iValueAmount;
+static uint8_t btValueBlock;
+static int iValueBackup = -1;
 static bool bUseKeyA;
+static bool bBothKeys = false;
 static bool bUseKeyFile;
 static bool bForceKeyFile;
 static bool bTolerateFailures;
-static bool magic2 = false;
-static uint8_t uiBlocks;
+static bool bMultiDevice = false;
+static bool bDiffWrite = false;
+static bool bVerifyWrite = false;
+static bool bJournal = false;
+static struct mfc_totals totals = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static struct mfc_handover handover = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
 static uint8_t keys[] = {
   0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
   0xd3, 0xf7, 0xd3, 0xf7, 0xd3, 0xf7,
@@ -89,7 +245,7 @@ static uint8_t keys[] = {
   0xab, 0xcd, 0xef, 0x12, 0x34, 0x56
 };
 //Operate block
-static bool blocks[0xFF];
+static bool blocks[0x100];
 static bool bSkip = false;
 
 static const nfc_modulation nmMifare = {
@@ -99,49 +255,58 @@ static const nfc_modulation nmMifare = {
 
 static size_t num_keys = sizeof(keys) / 6;
 
-#define MAX_FRAME_LEN 264
-
-static uint8_t abtRx[MAX_FRAME_LEN];
-static int szRxBits;
-
-uint8_t  abtHalt[4] = { 0x50, 0x00, 0x00, 0x00 };
+static const uint8_t abtHaltCmd[2] = { 0x50, 0x00 };
 
 // special unlock command
-uint8_t  abtUnlock1[1] = { 0x40 };
-uint8_t  abtUnlock2[1] = { 0x43 };
+static const uint8_t  abtUnlock1[1] = { 0x40 };
+static const uint8_t  abtUnlock2[1] = { 0x43 };
+
+// Unlocked fast path frames with their CRC, built once: HLTA, READ and WRITE of every block
+static uint8_t abtMagicHalt[4];
+static uint8_t aabtMagicRead[256][4];
+static uint8_t aabtMagicWrite[256][4];
 
 static  bool
-transmit_bits(const uint8_t *pbtTx, const size_t szTxBits)
+transmit_bits(struct mfc_session *s, const uint8_t *pbtTx, const size_t szTxBits)
 {
   // Show transmitted command
   printf("Sent bits:     ");
   print_hex_bits(pbtTx, szTxBits);
   // Transmit the bit frame command, we don't use the arbitrary parity feature
-  if ((szRxBits = nfc_initiator_transceive_bits(pnd, pbtTx, szTxBits, NULL, abtRx, sizeof(abtRx), NULL)) < 0)
+  struct timespec tsStart;
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  s->szRxBits = nfct_initiator_transceive_bits(s->pnd, pbtTx, szTxBits, NULL, s->abtRx, sizeof(s->abtRx), NULL);
+  metrics_time(s->pnd, METRIC_RAW_BITS, &tsStart);
+  if (s->szRxBits < 0)
     return false;
 
   // Show received answer
   printf("Received bits: ");
-  print_hex_bits(abtRx, szRxBits);
+  print_hex_bits(s->abtRx, s->szRxBits);
   // Succesful transfer
   return true;
 }
 
 
 static  bool
-transmit_bytes(const uint8_t *pbtTx, const size_t szTx)
+transmit_bytes(struct mfc_session *s, const uint8_t *pbtTx, const size_t szTx)
 {
   // Show transmitted command
   printf("Sent bits:     ");
   print_hex(pbtTx, szTx);
   // Transmit the command bytes
   int res;
-  if ((res = nfc_initiator_transceive_bytes(pnd, pbtTx, szTx, abtRx, sizeof(abtRx), 0)) < 0)
+  struct timespec tsStart;
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  res = nfct_initiator_transceive_bytes(s->pnd, pbtTx, szTx, s->abtRx, sizeof(s->abtRx), latency_timeout(s->pnd, LATENCY_RAW));
+  metrics_time(s->pnd, METRIC_RAW_BYTES, &tsStart);
+  if (res < 0)
     return false;
+  latency_record(s->pnd, LATENCY_RAW, &tsStart);
 
   // Show received answer
   printf("Received bits: ");
-  print_hex(abtRx, res);
+  print_hex(s->abtRx, res);
   // Succesful transfer
   return true;
 }
@@ -149,11 +314,44 @@ transmit_bytes(const uint8_t *pbtTx, const size_t szTx)
 static void
 print_success_or_failure(bool bFailure, uint32_t *uiBlockCounter)
 {
-  printf("%c", (bFailure) ? 'x' : '.');
+  // Per block progress of concurrent sessions would only interleave
+  if (!bMultiDevice)
+    printf("%c", (bFailure) ? 'x' : '.');
   if (uiBlockCounter && !bFailure)
     *uiBlockCounter += 1;
 }
 
+static double
+elapsed_seconds(const struct timespec *ptsStart)
+{
+  struct timespec tsNow;
+  clock_gettime(CLOCK_MONOTONIC, &tsNow);
+  return (tsNow.tv_sec - ptsStart->tv_sec) + (tsNow.tv_nsec - ptsStart->tv_nsec) / 1e9;
+}
+
+// Wake the card muted by a failed command, a full select is only the fallback
+static bool
+reactivate(struct mfc_session *s)
+{
+  struct timespec tsStart;
+  double dMs;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if (!nfc_initiator_mifare_reactivate(s->pnd, &s->nt)) {
+    s->uiFullSelects++;
+    if (nfct_initiator_select_passive_target(s->pnd, nmMifare, NULL, 0, &s->nt) <= 0)
+      return false;
+  }
+  metrics_time(s->pnd, METRIC_REACTIVATE, &tsStart);
+  metrics_count(s->pnd, METRIC_RESELECTS);
+  dMs = elapsed_seconds(&tsStart) * 1000;
+  s->uiReactivations++;
+  s->dReactivationMs += dMs;
+  if (dMs > s->dReactivationMaxMs)
+    s->dReactivationMaxMs = dMs;
+  return true;
+}
+
 static  bool
 is_first_block(uint32_t uiBlock)
 {
@@ -187,17 +385,54 @@ get_trailer_block(uint32_t uiFirstBlock)
   return trailer_block;
 }
 
+// Keep a key that opened a sector of the card, for the dump, the key map and later authentications
+static void
+remember_key(struct mfc_session *s, uint32_t uiBlock, bool bKeyA, const uint8_t *pbtKey)
+{
+  uint32_t uiTrailerBlock = get_trailer_block(uiBlock);
+  uint8_t uiSector = mf_keydb_sector(uiBlock);
+
+  if (bKeyA) {
+    memcpy(s->mtKeys.amb[uiTrailerBlock].mbt.abtKeyA, pbtKey, 6);
+    memcpy(s->mkkCard.abtKeyA[uiSector], pbtKey, 6);
+    s->mkkCard.ui64KnownA |= 1ULL << uiSector;
+  } else {
+    memcpy(s->mtKeys.amb[uiTrailerBlock].mbt.abtKeyB, pbtKey, 6);
+    memcpy(s->mkkCard.abtKeyB[uiSector], pbtKey, 6);
+    s->mkkCard.ui64KnownB |= 1ULL << uiSector;
+  }
+}
+
 static  bool
-authenticate(uint32_t uiBlock)
+authenticate(struct mfc_session *s, uint32_t uiBlock, bool bKeyA)
 {
   mifare_cmd mc;
   uint32_t uiTrailerBlock;
+  uint32_t uiAttempts = 0;
 
   // Set the authentication information (uid)
-  memcpy(mp.mpa.abtAuthUid, nt.nti.nai.abtUid + nt.nti.nai.szUidLen - 4, 4);
+  memcpy(s->mp.mpa.abtAuthUid, s->nt.nti.nai.abtUid + s->nt.nti.nai.szUidLen - 4, 4);
 
   // Should we use key A or B?
-  mc = (bUseKeyA) ? MC_AUTH_A : MC_AUTH_B;
+  mc = (bKeyA) ? MC_AUTH_A : MC_AUTH_B;
+  s->bAuthKeyA = bKeyA;
+
+  // A key recorded for this card and sector is tried before anything else
+  uint8_t uiSector = mf_keydb_sector(uiBlock);
+  if ((bKeyA ? s->mkkCard.ui64KnownA : s->mkkCard.ui64KnownB) & (1ULL << uiSector)) {
+    memcpy(s->mp.mpa.abtKey, bKeyA ? s->mkkCard.abtKeyA[uiSector] : s->mkkCard.abtKeyB[uiSector], 6);
+    uiAttempts++;
+    if (nfc_initiator_mifare_cmd(s->pnd, mc, uiBlock, &s->mp)) {
+      remember_key(s, uiBlock, bKeyA, s->mp.mpa.abtKey);
+      return true;
+    }
+    reactivate(s);
+    // Wrong for this card after all, keep it out of the key map
+    if (bKeyA)
+      s->mkkCard.ui64KnownA &= ~(1ULL << uiSector);
+    else
+      s->mkkCard.ui64KnownB &= ~(1ULL << uiSector);
+  }
 
   // Key file authentication.
   if (bUseKeyFile) {
@@ -206,220 +441,1207 @@ authenticate(uint32_t uiBlock)
     uiTrailerBlock = get_trailer_block(uiBlock);
 
     // Extract the right key from dump file
-    if (bUseKeyA)
-      memcpy(mp.mpa.abtKey, mtKeys.amb[uiTrailerBlock].mbt.abtKeyA, 6);
+    if (bKeyA)
+      memcpy(s->mp.mpa.abtKey, s->mtKeys.amb[uiTrailerBlock].mbt.abtKeyA, 6);
     else
-      memcpy(mp.mpa.abtKey, mtKeys.amb[uiTrailerBlock].mbt.abtKeyB, 6);
+      memcpy(s->mp.mpa.abtKey, s->mtKeys.amb[uiTrailerBlock].mbt.abtKeyB, 6);
 
     // Try to authenticate for the current sector
-    if (nfc_initiator_mifare_cmd(pnd, mc, uiBlock, &mp))
+    if (uiAttempts++ > 0)
+      metrics_count(s->pnd, METRIC_RETRIES);
+    if (nfc_initiator_mifare_cmd(s->pnd, mc, uiBlock, &s->mp)) {
+      remember_key(s, uiBlock, bKeyA, s->mp.mpa.abtKey);
       return true;
-    nfc_initiator_select_passive_target (pnd, nmMifare, nt.nti.nai.abtUid, nt.nti.nai.szUidLen, NULL);
+    }
+    reactivate(s);
   } else {
     // Try to guess the right key
     for (size_t key_index = 0; key_index < num_keys; key_index++) {
-      memcpy(mp.mpa.abtKey, keys + (key_index * 6), 6);
-      if (nfc_initiator_mifare_cmd(pnd, mc, uiBlock, &mp)) {
-        if (bUseKeyA)
-          memcpy(mtKeys.amb[uiBlock].mbt.abtKeyA, &mp.mpa.abtKey, 6);
-        else
-          memcpy(mtKeys.amb[uiBlock].mbt.abtKeyB, &mp.mpa.abtKey, 6);
+      memcpy(s->mp.mpa.abtKey, keys + (key_index * 6), 6);
+      if (uiAttempts++ > 0)
+        metrics_count(s->pnd, METRIC_RETRIES);
+      if (nfc_initiator_mifare_cmd(s->pnd, mc, uiBlock, &s->mp)) {
+        // Later authentications of the sector go straight to the key found
+        remember_key(s, uiBlock, bKeyA, s->mp.mpa.abtKey);
+        if (pmkKeyDb != NULL)
+          mf_keydb_put(pmkKeyDb, s->nt.nti.nai.abtUid, s->nt.nti.nai.szUidLen, uiSector, !bKeyA, s->mp.mpa.abtKey);
         return true;
       }
-      nfc_initiator_select_passive_target(pnd, nmMifare, nt.nti.nai.abtUid, nt.nti.nai.szUidLen, NULL);
+      reactivate(s);
     }
   }
 
+  if (bKeyA)
+    s->ui64KeyFailedA |= 1ULL << uiSector;
+  else
+    s->ui64KeyFailedB |= 1ULL << uiSector;
   return false;
 }
 
+static  uint32_t
+get_first_block(uint32_t uiTrailerBlock)
+{
+  // Test if we are in the small or big sectors
+  if (uiTrailerBlock < 128)
+    return uiTrailerBlock - 3;
+  else
+    return uiTrailerBlock - 15;
+}
+
+static  uint32_t
+get_sector_trailer(uint32_t uiSector)
+{
+  return (uiSector < 32) ? uiSector * 4 + 3 : 128 + (uiSector - 32) * 16 + 15;
+}
+
+static  bool
+is_key_b_readable(const uint8_t *pbtAccessBits)
+{
+  // Key B can be read (and then not used to authenticate) for trailer C1C2C3 000, 010 and 001,
+  // the only conditions where key A alone reads the access bits
+  return mifare_classic_access_keys(pbtAccessBits, 3, MA_READ) == MIFARE_KEY_A;
+}
+
+typedef enum {
+  PLAN_GO,                       // the current authentication may do it
+  PLAN_DOOMED,                   // no key at hand may, nothing was sent
+  PLAN_LOST                      // switching keys failed and the card did not take the old one back
+} plan_result;
+
+// Keep the access bits of a sector trailer the card handed out, unless it withheld them
+static void
+learn_access(struct mfc_session *s, uint32_t uiTrailerBlock, const uint8_t *pbtAccessBits)
+{
+  uint8_t uiSector = mf_keydb_sector(uiTrailerBlock);
+
+  // Key A reads the access bits under any condition, no key means they are not consistent
+  if (mifare_classic_access_keys(pbtAccessBits, uiTrailerBlock, MA_READ) == 0)
+    return;
+  memcpy(s->aabtAccessBits[uiSector], pbtAccessBits, 4);
+  s->ui64AccessKnown |= 1ULL << uiSector;
+}
+
+// Keys the card lets do ma on uiBlock, both as long as its sector trailer was not read
+static uint8_t
+planned_keys(struct mfc_session *s, uint32_t uiBlock, mifare_access ma)
+{
+  uint8_t uiSector = mf_keydb_sector(uiBlock);
+
+  if (!(s->ui64AccessKnown & (1ULL << uiSector)))
+    return MIFARE_KEY_A | MIFARE_KEY_B;
+  return mifare_classic_access_keys(s->aabtAccessBits[uiSector], uiBlock, ma);
+}
+
+// Keys that may write the trailer of the dump: its keys, or its access bits when they change
+static uint8_t
+planned_trailer_keys(struct mfc_session *s, uint32_t uiTrailerBlock)
+{
+  uint8_t uiSector = mf_keydb_sector(uiTrailerBlock);
+
+  if (!(s->ui64AccessKnown & (1ULL << uiSector)))
+    return MIFARE_KEY_A | MIFARE_KEY_B;
+  if (memcmp(s->aabtAccessBits[uiSector], s->mtDump.amb[uiTrailerBlock].mbt.abtAccessBits, 4) != 0)
+    return mifare_classic_access_keys(s->aabtAccessBits[uiSector], uiTrailerBlock, MA_WRITE);
+  return mifare_classic_access_keys(s->aabtAccessBits[uiSector], uiTrailerBlock, MA_WRITE_KEYS);
+}
+
+// Whether a key of the sector is at hand without a dictionary search
+static bool
+key_at_hand(struct mfc_session *s, uint32_t uiBlock, bool bKeyA)
+{
+  uint64_t ui64Sector = 1ULL << mf_keydb_sector(uiBlock);
+
+  if ((bKeyA ? s->ui64KeyFailedA : s->ui64KeyFailedB) & ui64Sector)
+    return false;
+  return bUseKeyFile || ((bKeyA ? s->mkkCard.ui64KnownA : s->mkkCard.ui64KnownB) & ui64Sector);
+}
+
+/*
+ * Key to open a sector with: the asked one, unless the access bits let only
+ * the other key, when it is at hand, do ma on the blocks of the sector.
+ */
+static bool
+plan_key_a(struct mfc_session *s, uint32_t uiBlock, mifare_access ma)
+{
+  uint32_t uiTrailerBlock = get_trailer_block(uiBlock);
+  const uint8_t *pbtAccessBits;
+  uint8_t btKeys;
+
+  if (s->ui64AccessKnown & (1ULL << mf_keydb_sector(uiBlock)))
+    pbtAccessBits = s->aabtAccessBits[mf_keydb_sector(uiBlock)];
+  else if (bUseKeyFile)
+    // Until the card tells, a key file taken from it is the best guess
+    pbtAccessBits = s->mtKeys.amb[uiTrailerBlock].mbt.abtAccessBits;
+  else
+    return bUseKeyA;
+
+  // Whatever else, the key has to get at the trailer
+  if ((btKeys = mifare_classic_access_keys(pbtAccessBits, uiTrailerBlock, MA_READ)) == 0)
+    return bUseKeyA;
+  // Blocks no key may touch have no say
+  for (uint32_t uiData = get_first_block(uiTrailerBlock); uiData < uiTrailerBlock; uiData++) {
+    uint8_t btDataKeys = mifare_classic_access_keys(pbtAccessBits, uiData, ma);
+
+    if ((bSkip && !blocks[uiData]) || (uiData == 0 && ma == MA_WRITE) || btDataKeys == 0)
+      continue;
+    btKeys &= btDataKeys;
+  }
+  if ((btKeys & (bUseKeyA ? MIFARE_KEY_A : MIFARE_KEY_B)) || !(btKeys & (bUseKeyA ? MIFARE_KEY_B : MIFARE_KEY_A)))
+    return bUseKeyA;
+  return key_at_hand(s, uiBlock, !bUseKeyA) ? !bUseKeyA : bUseKeyA;
+}
+
+/*
+ * Get the authentication ready for an operation the keys btKeys may do on
+ * uiBlock. The other key of the sector takes over with a nested
+ * authentication, an operation no key at hand may do is not sent at all.
+ */
+static plan_result
+plan_block(struct mfc_session *s, uint32_t uiBlock, uint8_t btKeys)
+{
+  bool bKeyA = s->bAuthKeyA;
+
+  if (btKeys & (bKeyA ? MIFARE_KEY_A : MIFARE_KEY_B))
+    return PLAN_GO;
+  if ((btKeys & (bKeyA ? MIFARE_KEY_B : MIFARE_KEY_A)) && key_at_hand(s, uiBlock, !bKeyA)) {
+    if (authenticate(s, uiBlock, !bKeyA))
+      return PLAN_GO;
+    if (!authenticate(s, uiBlock, bKeyA))
+      return PLAN_LOST;
+  }
+  s->uiBlocksDoomed++;
+  return PLAN_DOOMED;
+}
+
+// Whether the access bits of the key file let the current key write all the dump asks of the sector
+static bool
+expect_writable(struct mfc_session *s, uint32_t uiBlock)
+{
+  uint32_t uiTrailerBlock = get_trailer_block(uiBlock);
+  const uint8_t *pbtAccessBits = s->mtKeys.amb[uiTrailerBlock].mbt.abtAccessBits;
+  uint8_t btKey = s->bAuthKeyA ? MIFARE_KEY_A : MIFARE_KEY_B;
+  mifare_access ma = (memcmp(pbtAccessBits, s->mtDump.amb[uiTrailerBlock].mbt.abtAccessBits, 4) != 0) ? MA_WRITE : MA_WRITE_KEYS;
+
+  if (!bUseKeyFile)
+    return false;
+  if ((!bSkip || blocks[uiTrailerBlock]) && !(mifare_classic_access_keys(pbtAccessBits, uiTrailerBlock, ma) & btKey))
+    return false;
+  for (uint32_t uiData = get_first_block(uiTrailerBlock); uiData < uiTrailerBlock; uiData++) {
+    if ((bSkip && !blocks[uiData]) || (uiData == 0 && !s->magic2))
+      continue;
+    if (!(mifare_classic_access_keys(pbtAccessBits, uiData, MA_WRITE) & btKey))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Read the trailer of the authenticated sector, its access bits plan the
+ * sector. A write needs no plan when the key file, taken from the card,
+ * expects nothing to be refused.
+ */
+static bool
+plan_sector(struct mfc_session *s, uint32_t uiBlock)
+{
+  uint32_t uiTrailerBlock = get_trailer_block(uiBlock);
+
+  if (!bDiffWrite && expect_writable(s, uiBlock))
+    return true;
+  if (nfc_initiator_mifare_cmd(s->pnd, MC_READ, uiTrailerBlock, &s->mp)) {
+    memcpy(s->mtCard.amb[uiTrailerBlock].mbd.abtData, s->mp.mpd.abtData, 16);
+    learn_access(s, uiTrailerBlock, s->mp.mpd.abtData + 6);
+    return true;
+  }
+  // The sector goes unplanned, its operations are tried as they come
+  return reactivate(s) && authenticate(s, uiBlock, s->bAuthKeyA);
+}
+
+static  bool
+trailer_matches(struct mfc_session *s, uint32_t uiBlock, const uint8_t *pbtCard, const uint8_t *pbtAuthKey, int unlocked)
+{
+  const mifare_classic_block_trailer *pmbt = &s->mtDump.amb[uiBlock].mbt;
+
+  // Unlocked cards hand out the trailer as it is stored
+  if (unlocked)
+    return memcmp(pbtCard, pmbt, 16) == 0;
+  if (memcmp(pbtCard + 6, pmbt->abtAccessBits, 4) != 0)
+    return false;
+  // Key A never reads back, it is only known to match when it got us in
+  if (pbtAuthKey == NULL || !s->bAuthKeyA || memcmp(pbtAuthKey, pmbt->abtKeyA, 6) != 0)
+    return false;
+  return is_key_b_readable(pmbt->abtAccessBits) && memcmp(pbtCard + 10, pmbt->abtKeyB, 6) == 0;
+}
+
+static bool unlock_card(struct mfc_session *s);
+
+/*
+ * Read what an authenticated sector currently holds and flag the blocks the
+ * dump would change. The trailer was read when planning the sector, blocks
+ * the access bits keep from being read count as changed. A refused read ends
+ * the authentication, in that case the sector is reactivated and written in
+ * full.
+ */
+static  bool
+diff_sector(struct mfc_session *s, uint32_t uiFirstBlock, int write_unlocked)
+{
+  uint32_t uiTrailerBlock = get_trailer_block(uiFirstBlock);
+  uint8_t abtAuthKey[6];
+  uint32_t uiBlock;
+
+  memcpy(abtAuthKey, s->mp.mpa.abtKey, 6);
+  for (uiBlock = uiFirstBlock; uiBlock <= uiTrailerBlock; uiBlock++)
+    s->abDiffer[uiBlock] = true;
+
+  for (uiBlock = uiFirstBlock; uiBlock <= uiTrailerBlock; uiBlock++) {
+    bool bPlanned = !write_unlocked && (s->ui64AccessKnown & (1ULL << mf_keydb_sector(uiBlock)));
+
+    if (bSkip && !blocks[uiBlock])
+      continue;
+    if (bPlanned && is_trailer_block(uiBlock)) {
+      s->abDiffer[uiBlock] = !trailer_matches(s, uiBlock, s->mtCard.amb[uiBlock].mbd.abtData, abtAuthKey, write_unlocked);
+      continue;
+    }
+    if (bPlanned && !(planned_keys(s, uiBlock, MA_READ) & (s->bAuthKeyA ? MIFARE_KEY_A : MIFARE_KEY_B)))
+      continue;
+    if (!nfc_initiator_mifare_cmd(s->pnd, MC_READ, uiBlock, &s->mp)) {
+      for (uiBlock = uiFirstBlock; uiBlock <= uiTrailerBlock; uiBlock++)
+        s->abDiffer[uiBlock] = true;
+      if (!reactivate(s))
+        return false;
+      return write_unlocked ? unlock_card(s) : authenticate(s, uiFirstBlock, s->bAuthKeyA);
+    }
+    memcpy(s->mtCard.amb[uiBlock].mbd.abtData, s->mp.mpd.abtData, 16);
+    if (is_trailer_block(uiBlock))
+      s->abDiffer[uiBlock] = !trailer_matches(s, uiBlock, s->mp.mpd.abtData, abtAuthKey, write_unlocked);
+    else
+      s->abDiffer[uiBlock] = memcmp(s->mp.mpd.abtData, s->mtDump.amb[uiBlock].mbd.abtData, 16) != 0;
+  }
+  return true;
+}
+
+// Read back what was written to the sector ending with uiTrailerBlock
+static  bool
+verify_sector(struct mfc_session *s, uint32_t uiTrailerBlock, int write_unlocked)
+{
+  uint32_t uiBlock;
+  bool bMatch = true;
+  struct timespec tsStart;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  for (uiBlock = get_first_block(uiTrailerBlock); uiBlock <= uiTrailerBlock; uiBlock++) {
+    if (!s->abWritten[uiBlock])
+      continue;
+    // What the access bits keep from the key is not read back
+    if (!write_unlocked && !(planned_keys(s, uiBlock, MA_READ) & (s->bAuthKeyA ? MIFARE_KEY_A : MIFARE_KEY_B)))
+      continue;
+    if (!nfc_initiator_mifare_cmd(s->pnd, MC_READ, uiBlock, &s->mp)) {
+      printf("!\nError: unable to read back block 0x%02x\n", uiBlock);
+      s->uiMismatches++;
+      bMatch = false;
+      break;
+    }
+    if (is_trailer_block(uiBlock)) {
+      const mifare_classic_block_trailer *pmbt = &s->mtDump.amb[uiBlock].mbt;
+      if (write_unlocked)
+        bMatch = memcmp(s->mp.mpd.abtData, pmbt, 16) == 0;
+      else
+        bMatch = memcmp(s->mp.mpd.abtData + 6, pmbt->abtAccessBits, 4) == 0
+                 && (!is_key_b_readable(pmbt->abtAccessBits) || memcmp(s->mp.mpd.abtData + 10, pmbt->abtKeyB, 6) == 0);
+    } else {
+      bMatch = memcmp(s->mp.mpd.abtData, s->mtDump.amb[uiBlock].mbd.abtData, 16) == 0;
+    }
+    if (!bMatch) {
+      printf("!\nError: block 0x%02x does not read back as written\n", uiBlock);
+      s->uiMismatches++;
+      break;
+    }
+    s->uiBlocksVerified++;
+  }
+  s->adPhaseMs[PHASE_VERIFY] += elapsed_seconds(&tsStart) * 1000;
+  return bMatch;
+}
+
 static bool
-unlock_card(void)
+unlock_card(struct mfc_session *s)
 {
-  if (magic2) {
+  uint8_t abtHalt[4];
+
+  if (s->magic2) {
     printf("Don't use R/W with this card, this is not required!\n");
     return false;
   }
 
   // Configure the CRC
-  if (nfc_device_set_property_bool(pnd, NP_HANDLE_CRC, false) < 0) {
-    nfc_perror(pnd, "nfc_configure");
+  if (nfct_device_set_property_bool(s->pnd, NP_HANDLE_CRC, false) < 0) {
+    nfct_perror(s->pnd, "nfc_configure");
     return false;
   }
   // Use raw send/receive methods
-  if (nfc_device_set_property_bool(pnd, NP_EASY_FRAMING, false) < 0) {
-    nfc_perror(pnd, "nfc_configure");
+  if (nfct_device_set_property_bool(s->pnd, NP_EASY_FRAMING, false) < 0) {
+    nfct_perror(s->pnd, "nfc_configure");
     return false;
   }
 
+  memcpy(abtHalt, abtHaltCmd, 2);
   iso14443a_crc_append(abtHalt, 2);
-  transmit_bytes(abtHalt, 4);
+  transmit_bytes(s, abtHalt, 4);
   // now send unlock
-  if (!transmit_bits(abtUnlock1, 7)) {
+  if (!transmit_bits(s, abtUnlock1, 7)) {
     printf("unlock failure!\n");
     return false;
   }
-  if (!transmit_bytes(abtUnlock2, 1)) {
+  if (!transmit_bytes(s, abtUnlock2, 1)) {
     printf("unlock failure!\n");
     return false;
   }
 
   // reset reader
   // Configure the CRC
-  if (nfc_device_set_property_bool(pnd, NP_HANDLE_CRC, true) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
+  if (nfct_device_set_property_bool(s->pnd, NP_HANDLE_CRC, true) < 0) {
+    nfct_perror(s->pnd, "nfc_device_set_property_bool");
     return false;
   }
   // Switch off raw send/receive methods
-  if (nfc_device_set_property_bool(pnd, NP_EASY_FRAMING, true) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
+  if (nfct_device_set_property_bool(s->pnd, NP_EASY_FRAMING, true) < 0) {
+    nfct_perror(s->pnd, "nfc_device_set_property_bool");
     return false;
   }
   return true;
 }
 
 static int
-get_rats(void)
+get_rats(struct mfc_session *s)
 {
   int res;
-  uint8_t  abtRats[2] = { 0xe0, 0x50};
-  // Use raw send/receive methods
-  if (nfc_device_set_property_bool(pnd, NP_EASY_FRAMING, false) < 0) {
-    nfc_perror(pnd, "nfc_configure");
-    return -1;
-  }
-  res = nfc_initiator_transceive_bytes(pnd, abtRats, sizeof(abtRats), abtRx, sizeof(abtRx), 0);
-  if (res > 0) {
+  size_t szAts;
+  iso_dep *pid;
+
+  // Only the ATS is wanted, ISO-DEP does the RATS and leaves raw framing on
+  if ((pid = iso_dep_activate(s->pnd, 0, &res)) != NULL) {
+    memcpy(s->abtRx, iso_dep_ats(pid, &szAts), szAts);
+    res = szAts;
+    iso_dep_free(pid);
     // ISO14443-4 card, turn RF field off/on to access ISO14443-3 again
-    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
-    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true);
+    nfct_device_set_property_bool(s->pnd, NP_ACTIVATE_FIELD, false);
+    nfct_device_set_property_bool(s->pnd, NP_ACTIVATE_FIELD, true);
   }
   // Reselect tag
-  if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) <= 0) {
+  metrics_count(s->pnd, METRIC_RESELECTS);
+  if (nfct_initiator_select_passive_target(s->pnd, nmMifare, NULL, 0, &s->nt) <= 0) {
     printf("Error: tag disappeared\n");
-    nfc_close(pnd);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+    return NFC_ETGRELEASED;
   }
   return res;
 }
 
+static void
+build_magic_frames(void)
+{
+  memcpy(abtMagicHalt, abtHaltCmd, 2);
+  iso14443a_crc_append(abtMagicHalt, 2);
+  for (int i = 0; i < 256; i++) {
+    aabtMagicRead[i][0] = MC_READ;
+    aabtMagicRead[i][1] = i;
+    iso14443a_crc_append(aabtMagicRead[i], 2);
+    aabtMagicWrite[i][0] = MC_WRITE;
+    aabtMagicWrite[i][1] = i;
+    iso14443a_crc_append(aabtMagicWrite[i], 2);
+  }
+}
+
+/*
+ * Gen1 backdoor for the fast path: unlike unlock_card() the reader stays in
+ * raw framing with the CRC done by the host, so that blocks follow each other
+ * without property changes
+ */
 static  bool
-read_card(int read_unlocked)
+magic_unlock(struct mfc_session *s)
 {
-  int32_t iBlock;
-  char    bFailure = false;
-  uint32_t uiReadBlocks = 0;
+  if (nfct_device_set_property_bool(s->pnd, NP_HANDLE_CRC, false) < 0
+      || nfct_device_set_property_bool(s->pnd, NP_EASY_FRAMING, false) < 0) {
+    nfct_perror(s->pnd, "nfc_device_set_property_bool");
+    return false;
+  }
+  nfct_initiator_transceive_bytes(s->pnd, abtMagicHalt, sizeof(abtMagicHalt), NULL, 0, 0);
+  return nfct_initiator_transceive_bits(s->pnd, abtUnlock1, 7, NULL, s->abtRx, sizeof(s->abtRx), NULL) >= 0
+         && nfct_initiator_transceive_bytes(s->pnd, abtUnlock2, 1, s->abtRx, sizeof(s->abtRx), 0) >= 0;
+}
 
-  if (read_unlocked)
-    if (!unlock_card())
-      return false;
+// Back to the framing the other commands expect
+static void
+magic_finish(struct mfc_session *s)
+{
+  nfct_device_set_property_bool(s->pnd, NP_HANDLE_CRC, true);
+  nfct_device_set_property_bool(s->pnd, NP_EASY_FRAMING, true);
+}
 
-  printf("Reading out %d blocks |", uiBlocks + 1);
-  // Read the card from end to begin
-  for (iBlock = uiBlocks; iBlock >= 0; iBlock--) {
-    // Authenticate everytime we reach a trailer block
-    if (is_trailer_block (iBlock)) {
-      // Skip this the first time, bFailure it means nothing (yet)
-      if (iBlock != uiBlocks)
-        print_success_or_failure (bFailure, &uiReadBlocks);
+// A failed frame mutes the card: wake it and unlock it again
+static  bool
+magic_recover(struct mfc_session *s)
+{
+  metrics_count(s->pnd, METRIC_RETRIES);
+  return reactivate(s) && magic_unlock(s);
+}
 
-      if (bSkip)
-      {
-          for (int i=iBlock;get_trailer_block(i)==iBlock;--i)
-            if (blocks[i])
-              goto next;
-          bFailure = -1;
-          continue ;    
-      }
-next:
-      // Show if the readout went well
-      if (bFailure) {
-        // When a failure occured we need to redo the anti-collision
-        if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) <= 0) {
-          printf("!\nError: tag was removed\n");
-          return false;
-        }
-        bFailure = false;
-      }
+static  bool
+magic_read_block(struct mfc_session *s, uint32_t uiBlock, uint8_t *pbtData)
+{
+  uint8_t abtCrc[2];
+  int res;
 
-      fflush(stdout);
+  res = nfct_initiator_transceive_bytes(s->pnd, aabtMagicRead[uiBlock], 4, s->abtRx, sizeof(s->abtRx), latency_timeout(s->pnd, LATENCY_READ));
+  if (res != 18)
+    return false;
+  iso14443a_crc(s->abtRx, 16, abtCrc);
+  if (memcmp(abtCrc, s->abtRx + 16, 2) != 0)
+    return false;
+  memcpy(pbtData, s->abtRx, 16);
+  return true;
+}
 
-      // Try to authenticate for the current sector
-      if (!read_unlocked && !authenticate (iBlock)) {
-//        printf ("!\nError: authentication failed for block 0x%02x\n", iBlock);
-        bFailure = true;
-        continue ;
-        //return false;
-      }
+// WRITE command and data frame, each acknowledged in 4 bits
+static  bool
+magic_write_block(struct mfc_session *s, uint32_t uiBlock)
+{
+  int iTimeout = latency_timeout(s->pnd, LATENCY_WRITE);
 
-      if (bSkip && !blocks[iBlock])
-        continue ;    
-      // Try to read out the trailer
-      if (nfc_initiator_mifare_cmd(pnd, MC_READ, iBlock, &mp)) {
-        if (read_unlocked) {
-          memcpy(mtDump.amb[iBlock].mbd.abtData, mp.mpd.abtData, 16);
-        } else {
-          // Copy the keys over from our key dump and store the retrieved access bits
-          memcpy(mtDump.amb[iBlock].mbt.abtKeyA, mtKeys.amb[iBlock].mbt.abtKeyA, 6);
-          memcpy(mtDump.amb[iBlock].mbt.abtAccessBits, mp.mpd.abtData + 6, 4);
-          memcpy(mtDump.amb[iBlock].mbt.abtKeyB, mtKeys.amb[iBlock].mbt.abtKeyB, 6);
-        }
-        uiReadBlocks++;
-      } else {
-        printf("!\nfailed to read trailer block 0x%02x\n", iBlock);
-        bFailure = true;
-      }
-    } else {
+  return nfct_initiator_transceive_bytes(s->pnd, aabtMagicWrite[uiBlock], 4, s->abtRx, sizeof(s->abtRx), iTimeout) == 1
+         && (s->abtRx[0] & 0x0f) == 0x0a
+         && nfct_initiator_transceive_bytes(s->pnd, s->aabtMagicData[uiBlock], 18, s->abtRx, sizeof(s->abtRx), iTimeout) == 1
+         && (s->abtRx[0] & 0x0f) == 0x0a;
+}
 
-      if (bSkip && !blocks[iBlock])
-        continue ;    
-      // Make sure a earlier readout did not fail
-      if (!bFailure) {
-        // Try to read out the data block
-        if (nfc_initiator_mifare_cmd(pnd, MC_READ, iBlock, &mp)) {
-          memcpy(mtDump.amb[iBlock].mbd.abtData, mp.mpd.abtData, 16);
-        } else {
-          printf("!\nError: unable to read block 0x%02x\n", iBlock);
-          bFailure = true;
-        }
-      }
-    }
-    // Show if the readout went well for each block
-    print_success_or_failure(bFailure, &uiReadBlocks);
-    if ((! bTolerateFailures) && bFailure)
+// Unlocked read of a whole gen1 card in one stream, a block failing twice is fatal
+static  bool
+magic_read_card(struct mfc_session *s)
+{
+  uint32_t uiBlock, uiReadBlocks = 0;
+
+  if (!magic_unlock(s)) {
+    printf("unlock failure!\n");
+    magic_finish(s);
+    return false;
+  }
+  for (uiBlock = 0; uiBlock <= s->uiBlocks; uiBlock++) {
+    if (magic_read_block(s, uiBlock, s->mtDump.amb[uiBlock].mbd.abtData)
+        || (magic_recover(s) && magic_read_block(s, uiBlock, s->mtDump.amb[uiBlock].mbd.abtData))) {
+      uiReadBlocks++;
+    } else if (!bTolerateFailures) {
+      printf("Error: unable to read block 0x%02x\n", uiBlock);
+      magic_finish(s);
       return false;
+    }
   }
-  printf("|\n");
-  printf("Done, %d of %d blocks read.\n", uiReadBlocks, uiBlocks + 1);
+  magic_finish(s);
+  s->uiBlocksDone = uiReadBlocks;
+  if (bMultiDevice)
+    printf("[%zu] ", s->szDevice);
+  printf("Done, %u of %d blocks read.\n", uiReadBlocks, s->uiBlocks + 1);
   fflush(stdout);
-
   return true;
 }
 
+/*
+ * Unlocked write of a whole gen1 card in one stream: every frame is built
+ * before the first one goes out, then all blocks are written and read back
+ * in a single pass
+ */
 static  bool
-write_card(int write_block_zero)
+magic_write_card(struct mfc_session *s)
 {
-  uint32_t uiBlock;
-  char    bFailure = false;
-  uint32_t uiWriteBlocks = 0;
+  const uint8_t *pbtBlock0 = s->mtDump.amb[0].mbd.abtData;
+  uint32_t uiBlock, uiWriteBlocks = 0;
+  uint8_t abtData[16];
+  struct timespec tsVerify;
+  bool bSuccess = true;
+
+  // do not write a block 0 with incorrect BCC - card will be made invalid!
+  if ((pbtBlock0[0] ^ pbtBlock0[1] ^ pbtBlock0[2] ^ pbtBlock0[3] ^ pbtBlock0[4]) != 0x00) {
+    printf("Error: incorrect BCC in MFD file!\n");
+    printf("Expecting BCC=%02X\n", pbtBlock0[0] ^ pbtBlock0[1] ^ pbtBlock0[2] ^ pbtBlock0[3]);
+    return false;
+  }
+  for (uiBlock = 0; uiBlock <= s->uiBlocks; uiBlock++) {
+    memcpy(s->aabtMagicData[uiBlock], s->mtDump.amb[uiBlock].mbd.abtData, 16);
+    iso14443a_crc_append(s->aabtMagicData[uiBlock], 16);
+  }
 
-  if (write_block_zero)
-    if (!unlock_card())
+  if (!magic_unlock(s)) {
+    printf("unlock failure!\n");
+    magic_finish(s);
+    return false;
+  }
+  for (uiBlock = 0; uiBlock <= s->uiBlocks; uiBlock++) {
+    if (magic_write_block(s, uiBlock) || (magic_recover(s) && magic_write_block(s, uiBlock))) {
+      uiWriteBlocks++;
+    } else if (!bTolerateFailures) {
+      printf("Error: unable to write block 0x%02x\n", uiBlock);
+      magic_finish(s);
       return false;
+    }
+  }
 
-  printf("Writing %d blocks |", uiBlocks + 1);
-  // Write the card from begin to end;
-  for (uiBlock = 0; uiBlock <= uiBlocks; uiBlock++) {
-    // Authenticate everytime we reach the first sector of a new block
-    if (is_first_block (uiBlock)) {
-      // Skip this the first time, bFailure it means nothing (yet)
-      if (uiBlock != 0)
-        print_success_or_failure (bFailure, &uiWriteBlocks);
+  clock_gettime(CLOCK_MONOTONIC, &tsVerify);
+  for (uiBlock = 0; uiBlock <= s->uiBlocks; uiBlock++) {
+    if (!magic_read_block(s, uiBlock, abtData) && !(magic_recover(s) && magic_read_block(s, uiBlock, abtData))) {
+      printf("Error: unable to read back block 0x%02x\n", uiBlock);
+    } else if (memcmp(abtData, s->mtDump.amb[uiBlock].mbd.abtData, 16) != 0) {
+      printf("Error: block 0x%02x does not read back as written\n", uiBlock);
+    } else {
+      s->uiBlocksVerified++;
+      continue;
+    }
+    s->uiMismatches++;
+    bSuccess = false;
+  }
+  s->adPhaseMs[PHASE_VERIFY] += elapsed_seconds(&tsVerify) * 1000;
+  magic_finish(s);
+
+  s->uiBlocksDone = uiWriteBlocks;
+  if (bMultiDevice)
+    printf("[%zu] ", s->szDevice);
+  printf("Done, %u of %d blocks written, %u blocks verified, %u mismatches.\n",
+         uiWriteBlocks, s->uiBlocks + 1, s->uiBlocksVerified, s->uiMismatches);
+  fflush(stdout);
+  return bSuccess;
+}
 
-      if (bSkip)
-      {
-          for (int i=get_trailer_block(uiBlock);i>uiBlock;--i)
+// A value command, counted for the transaction report
+static  bool
+value_cmd(struct mfc_session *s, mifare_cmd mc, uint8_t btBlock, int32_t iOperand, uint32_t *puiCommands)
+{
+  (*puiCommands)++;
+  for (size_t n = 0; n < 4; n++)
+    s->mp.mpv.abtValue[n] = (uint8_t)((uint32_t) iOperand >> (8 * n));
+  return nfc_initiator_mifare_cmd(s->pnd, mc, btBlock, &s->mp);
+}
+
+static  bool
+value_read(struct mfc_session *s, uint8_t btBlock, int32_t *piValue, uint32_t *puiCommands)
+{
+  (*puiCommands)++;
+  return nfc_initiator_mifare_cmd(s->pnd, MC_READ, btBlock, &s->mp)
+         && mifare_classic_value_decode(s->mp.mpd.abtData, piValue, NULL);
+}
+
+/*
+ * One ticketing transaction under a single sector authentication: read and
+ * validate the value, apply the operation in the value register and transfer
+ * it, copy it to the backup block, and read the result back. A torn value
+ * block is first restored from its backup.
+ */
+static  bool
+value_transaction(struct mfc_session *s)
+{
+  const char *apcOps[] = { "check", "set", "credit", "debit" };
+  uint8_t btBlock = btValueBlock;
+  int32_t iBefore = 0, iExpected, iAfter;
+  uint32_t uiCommands = 1;
+  struct timespec tsStart;
+  double dMs;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if (!authenticate(s, btBlock, bUseKeyA)) {
+    printf("Error: authentication failed for block 0x%02x\n", btBlock);
+    return false;
+  }
+
+  if (voValue == VALUE_SET) {
+    iExpected = iValueAmount;
+    uiCommands++;
+    mifare_classic_value_encode(iValueAmount, btBlock, s->mp.mpd.abtData);
+    if (!nfc_initiator_mifare_cmd(s->pnd, MC_WRITE, btBlock, &s->mp)) {
+      printf("Error: unable to write value block 0x%02x\n", btBlock);
+      return false;
+    }
+    if (iValueBackup >= 0) {
+      uiCommands++;
+      mifare_classic_value_encode(iValueAmount, btBlock, s->mp.mpd.abtData);
+      if (!nfc_initiator_mifare_cmd(s->pnd, MC_WRITE, iValueBackup, &s->mp)) {
+        printf("Error: unable to write backup block 0x%02x\n", iValueBackup);
+        return false;
+      }
+    }
+  } else {
+    uiCommands++;
+    if (!nfc_initiator_mifare_cmd(s->pnd, MC_READ, btBlock, &s->mp)) {
+      printf("Error: unable to read value block 0x%02x\n", btBlock);
+      return false;
+    }
+    if (!mifare_classic_value_decode(s->mp.mpd.abtData, &iBefore, NULL)) {
+      // Torn by a card pulled away mid transaction, or not a value block at all
+      if (iValueBackup < 0 || !value_read(s, iValueBackup, &iBefore, &uiCommands)
+          || !value_cmd(s, MC_STORE, iValueBackup, 0, &uiCommands)
+          || !value_cmd(s, MC_TRANSFER, btBlock, 0, &uiCommands)) {
+        printf("Error: block 0x%02x is not a valid value block\n", btBlock);
+        return false;
+      }
+      printf("Block 0x%02x restored from backup block 0x%02x\n", btBlock, iValueBackup);
+    }
+    iExpected = iBefore;
+    if (voValue == VALUE_DEBIT && iBefore < iValueAmount) {
+      printf("Error: value %d of block 0x%02x is below the debit of %d\n", iBefore, btBlock, iValueAmount);
+      return false;
+    }
+    if (voValue == VALUE_CREDIT && iBefore > 0 && iValueAmount > INT32_MAX - iBefore) {
+      printf("Error: value %d of block 0x%02x would overflow with the credit of %d\n", iBefore, btBlock, iValueAmount);
+      return false;
+    }
+    if (voValue == VALUE_CREDIT || voValue == VALUE_DEBIT) {
+      iExpected = (voValue == VALUE_CREDIT) ? iBefore + iValueAmount : iBefore - iValueAmount;
+      if (!value_cmd(s, (voValue == VALUE_CREDIT) ? MC_INCREMENT : MC_DECREMENT, btBlock, iValueAmount, &uiCommands)
+          || !value_cmd(s, MC_TRANSFER, btBlock, 0, &uiCommands)) {
+        printf("Error: value operation refused on block 0x%02x\n", btBlock);
+        return false;
+      }
+      // The backup gets the new value through the value register, without a write
+      if (iValueBackup >= 0
+          && (!value_cmd(s, MC_STORE, btBlock, 0, &uiCommands) || !value_cmd(s, MC_TRANSFER, iValueBackup, 0, &uiCommands))) {
+        printf("Error: unable to copy block 0x%02x to backup block 0x%02x\n", btBlock, iValueBackup);
+        return false;
+      }
+    }
+  }
+
+  // A check already read the block, everything else reads it back
+  iAfter = iBefore;
+  if (voValue != VALUE_CHECK && !value_read(s, btBlock, &iAfter, &uiCommands)) {
+    printf("Error: unable to read back value block 0x%02x\n", btBlock);
+    return false;
+  }
+  metrics_time(s->pnd, METRIC_TRANSACTION, &tsStart);
+  dMs = elapsed_seconds(&tsStart) * 1000;
+  s->uiBlocksDone = (iValueBackup >= 0) ? 2 : 1;
+
+  if (bMultiDevice)
+    printf("[%zu] ", s->szDevice);
+  if (voValue == VALUE_CHECK || voValue == VALUE_SET)
+    printf("Value block 0x%02x: %d (%s)", btBlock, iAfter, apcOps[voValue]);
+  else
+    printf("Value block 0x%02x: %d -> %d (%s %d)", btBlock, iBefore, iAfter, apcOps[voValue], iValueAmount);
+  if (iValueBackup >= 0 && voValue != VALUE_CHECK)
+    printf(", backup 0x%02x", iValueBackup);
+  printf(", %u commands in %.1f ms\n", uiCommands, dMs);
+  if (iAfter != iExpected) {
+    printf("Error: block 0x%02x reads back %d, expected %d\n", btBlock, iAfter, iExpected);
+    s->uiMismatches++;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Complete the key map of a sector opened with key A. Key B comes along with
+ * the trailer when the access bits let key A read it, otherwise the keys at
+ * hand are tried on it. The sector is left authenticated either way.
+ */
+static  bool
+find_key_b(struct mfc_session *s, uint32_t uiTrailerBlock, const uint8_t *pbtTrailer)
+{
+  if (!s->bAuthKeyA)
+    return true;
+  if (is_key_b_readable(pbtTrailer + 6)) {
+    remember_key(s, uiTrailerBlock, false, pbtTrailer + 10);
+    if (pmkKeyDb != NULL)
+      mf_keydb_put(pmkKeyDb, s->nt.nti.nai.abtUid, s->nt.nti.nai.szUidLen, mf_keydb_sector(uiTrailerBlock), true, pbtTrailer + 10);
+    return true;
+  }
+  if (authenticate(s, uiTrailerBlock, false))
+    return true;
+  // No key B, key A reads on
+  return authenticate(s, uiTrailerBlock, true);
+}
+
+static void
+print_key_map(struct mfc_session *s)
+{
+  uint32_t uiTrailerBlock;
+
+  // One map at a time when several readers finish together
+  flockfile(stdout);
+  if (bMultiDevice)
+    printf("[%zu] ", s->szDevice);
+  printf("Sector  Key A         Key B\n");
+  for (uiTrailerBlock = 3; uiTrailerBlock <= s->uiBlocks; uiTrailerBlock = get_trailer_block(uiTrailerBlock + 1)) {
+    uint8_t uiSector = mf_keydb_sector(uiTrailerBlock);
+
+    printf("%6u", uiSector);
+    for (int n = 0; n < 2; n++) {
+      const uint8_t *pbtKey = n ? s->mkkCard.abtKeyB[uiSector] : s->mkkCard.abtKeyA[uiSector];
+
+      if ((n ? s->mkkCard.ui64KnownB : s->mkkCard.ui64KnownA) & (1ULL << uiSector))
+        printf("  %02x%02x%02x%02x%02x%02x", pbtKey[0], pbtKey[1], pbtKey[2], pbtKey[3], pbtKey[4], pbtKey[5]);
+      else
+        printf("  ------------");
+    }
+    printf("\n");
+  }
+  funlockfile(stdout);
+}
+
+// Wake the card when a failure muted it, then authenticate for the sector or unlock the card again
+static gap_cause
+open_sector(struct mfc_session *s, uint32_t uiTrailerBlock, int read_unlocked, bool *pbMuted)
+{
+  bool bWoken = *pbMuted;
+
+  if (*pbMuted) {
+    if (!reactivate(s))
+      return GAP_LOST;
+    *pbMuted = false;
+  }
+  if (read_unlocked)
+    return (!bWoken || unlock_card(s)) ? GAP_NONE : GAP_READ;
+  // A sector without key A found still has a chance with key B
+  if (authenticate(s, uiTrailerBlock, bBothKeys || plan_key_a(s, uiTrailerBlock, MA_READ))
+      || (bBothKeys && authenticate(s, uiTrailerBlock, false)))
+    return GAP_NONE;
+  return GAP_AUTH;
+}
+
+// Authenticate again with the key that just opened the sector, or unlock the card again
+static bool
+reopen_sector(struct mfc_session *s, uint32_t uiBlock, bool bKeyA, int read_unlocked)
+{
+  uint8_t uiSector = mf_keydb_sector(uiBlock);
+
+  if (read_unlocked)
+    return unlock_card(s);
+  memcpy(s->mp.mpa.abtAuthUid, s->nt.nti.nai.abtUid + s->nt.nti.nai.szUidLen - 4, 4);
+  memcpy(s->mp.mpa.abtKey, bKeyA ? s->mkkCard.abtKeyA[uiSector] : s->mkkCard.abtKeyB[uiSector], 6);
+  s->bAuthKeyA = bKeyA;
+  return nfc_initiator_mifare_cmd(s->pnd, bKeyA ? MC_AUTH_A : MC_AUTH_B, uiBlock, &s->mp);
+}
+
+/*
+ * READ a block of the open sector. A failed READ mutes the card, so the block
+ * alone is tried again after a growing pause: wake the card, open the sector
+ * again with the same key and READ. The card stays muted on GAP_READ.
+ */
+static gap_cause
+read_block(struct mfc_session *s, uint32_t uiBlock, int read_unlocked)
+{
+  bool bKeyA = s->bAuthKeyA;
+  uint32_t uiRetry = 0;
+
+  while (!nfc_initiator_mifare_cmd(s->pnd, MC_READ, uiBlock, &s->mp)) {
+    do {
+      struct timespec ts;
+
+      if (uiRetry == BLOCK_RETRIES)
+        return GAP_READ;
+      ts.tv_sec = 0;
+      ts.tv_nsec = (RETRY_BACKOFF_MS << uiRetry++) * 1000000L;
+      metrics_count(s->pnd, METRIC_RETRIES);
+      nanosleep(&ts, NULL);
+      if (!reactivate(s))
+        return GAP_LOST;
+    } while (!reopen_sector(s, uiBlock, bKeyA, read_unlocked));
+  }
+  return GAP_NONE;
+}
+
+/*
+ * Read the blocks of a sector from the trailer down, the access bits of the
+ * trailer plan the others. A block that still fails after its retries is left
+ * as a gap and the sector is opened again for the next one. With bGapsOnly
+ * only the gaps worth another try are read.
+ */
+static bool
+read_sector(struct mfc_session *s, uint32_t uiTrailerBlock, int read_unlocked, bool bGapsOnly, bool *pbMuted, uint32_t *puiReadBlocks)
+{
+  uint32_t uiFirstBlock = get_first_block(uiTrailerBlock);
+  gap_cause gcOpen = GAP_NONE;
+  bool bOpen = false;
+  int32_t iBlock;
+
+  if (bSkip && !bGapsOnly) {
+    for (iBlock = uiTrailerBlock; iBlock >= (int32_t) uiFirstBlock && !blocks[iBlock]; iBlock--)
+      ;
+    if (iBlock < (int32_t) uiFirstBlock)
+      return true;
+  }
+  for (iBlock = uiTrailerBlock; iBlock >= (int32_t) uiFirstBlock; iBlock--) {
+    bool bWanted = bGapsOnly ? s->abtGaps[iBlock] != GAP_NONE : !(bSkip && !blocks[iBlock]);
+    gap_cause gc;
+
+    // The trailer is read first in any case, its access bits plan the sector
+    if (!bWanted && (bGapsOnly || iBlock != (int32_t) uiTrailerBlock || read_unlocked))
+      continue;
+    if (!bOpen && gcOpen == GAP_NONE) {
+      fflush(stdout);
+      gcOpen = open_sector(s, uiTrailerBlock, read_unlocked, pbMuted);
+      bOpen = (gcOpen == GAP_NONE);
+    }
+    if (!bOpen) {
+      gc = gcOpen;
+    } else if (iBlock == (int32_t) uiTrailerBlock) {
+      if ((gc = read_block(s, iBlock, read_unlocked)) == GAP_NONE) {
+        uint8_t abtTrailer[16];
+
+        memcpy(abtTrailer, s->mp.mpd.abtData, 16);
+        if (!read_unlocked)
+          learn_access(s, iBlock, abtTrailer + 6);
+        if (bBothKeys && !find_key_b(s, iBlock, abtTrailer)) {
+          printf("!\nError: lost the sector of block 0x%02x looking for key B\n", iBlock);
+          bOpen = false;
+        }
+        if (!bWanted) {
+          continue;
+        } else if (read_unlocked) {
+          memcpy(s->mtDump.amb[iBlock].mbd.abtData, abtTrailer, 16);
+        } else {
+          // Copy the keys over from our key dump and store the retrieved access bits
+          memcpy(s->mtDump.amb[iBlock].mbt.abtKeyA, s->mtKeys.amb[iBlock].mbt.abtKeyA, 6);
+          memcpy(s->mtDump.amb[iBlock].mbt.abtAccessBits, abtTrailer + 6, 4);
+          memcpy(s->mtDump.amb[iBlock].mbt.abtKeyB, s->mtKeys.amb[iBlock].mbt.abtKeyB, 6);
+        }
+      } else if (gc == GAP_READ && !read_unlocked) {
+        // Without its access bits the sector may just refuse the key, spare the others the retries
+        gcOpen = GAP_READ;
+      }
+    } else {
+      plan_result pr = read_unlocked ? PLAN_GO : plan_block(s, iBlock, planned_keys(s, iBlock, MA_READ));
+
+      if (pr == PLAN_DOOMED) {
+        if (!bTolerateFailures) {
+          printf("!\nError: the access bits of block 0x%02x keep it from the keys at hand\n", iBlock);
+          return false;
+        }
+        if (!bMultiDevice)
+          printf("-");
+        continue;
+      }
+      if (pr == PLAN_LOST) {
+        printf("!\nError: lost the sector of block 0x%02x switching keys\n", iBlock);
+        // Open again like after a failed READ
+        gc = GAP_READ;
+        *pbMuted = true;
+      } else if ((gc = read_block(s, iBlock, read_unlocked)) == GAP_NONE) {
+        memcpy(s->mtDump.amb[iBlock].mbd.abtData, s->mp.mpd.abtData, 16);
+      }
+    }
+    if (gc == GAP_LOST || gcOpen == GAP_LOST) {
+      printf("!\nError: tag was removed\n");
+      return false;
+    }
+    if (gc == GAP_READ) {
+      *pbMuted = true;
+      bOpen = false;
+    }
+    if (!bWanted)
+      continue;
+    s->abtGaps[iBlock] = gc;
+    // Show if the readout went well for each block
+    print_success_or_failure(gc != GAP_NONE, puiReadBlocks);
+  }
+  return true;
+}
+
+// Tell the copy of a clone what it waits for
+static void
+handover_post(bool *pbEvent)
+{
+  pthread_mutex_lock(&handover.mutex);
+  *pbEvent = true;
+  pthread_cond_broadcast(&handover.cond);
+  pthread_mutex_unlock(&handover.mutex);
+}
+
+// Let the copy have a sector of the source once all its blocks and both keys are read
+static void
+handover_sector(struct mfc_session *s, uint32_t uiTrailerBlock)
+{
+  uint8_t uiSector = mf_keydb_sector(uiTrailerBlock);
+
+  if (s != handover.psSource)
+    return;
+  for (uint32_t uiBlock = get_first_block(uiTrailerBlock); uiBlock <= uiTrailerBlock; uiBlock++)
+    if (s->abtGaps[uiBlock] != GAP_NONE)
+      return;
+  if (!(s->mkkCard.ui64KnownA & s->mkkCard.ui64KnownB & (1ULL << uiSector)))
+    return;
+  pthread_mutex_lock(&handover.mutex);
+  handover.ui64Ready |= 1ULL << uiSector;
+  pthread_cond_broadcast(&handover.cond);
+  pthread_mutex_unlock(&handover.mutex);
+}
+
+// Give the copy the size of the source, as long as the card presented for it is large enough
+static bool
+handover_size(struct mfc_session *s)
+{
+  uint8_t uiBlocks = 0;
+
+  pthread_mutex_lock(&handover.mutex);
+  while (!handover.bClassified && !handover.bDone)
+    pthread_cond_wait(&handover.cond, &handover.mutex);
+  if (handover.bClassified)
+    uiBlocks = handover.psSource->uiBlocks;
+  pthread_mutex_unlock(&handover.mutex);
+  if (uiBlocks == 0) {
+    printf("[%zu] Error: no source card to clone\n", s->szDevice);
+    return false;
+  }
+  if (uiBlocks > s->uiBlocks) {
+    printf("[%zu] Error: the %i-byte source does not fit this card\n", s->szDevice, (uiBlocks + 1) * 16);
+    return false;
+  }
+  s->uiBlocks = uiBlocks;
+  return true;
+}
+
+// Wait for a sector of the source and copy it into the dump to write, false when it will not come whole
+static bool
+handover_take(struct mfc_session *s, uint32_t uiFirstBlock)
+{
+  uint64_t ui64Sector = 1ULL << mf_keydb_sector(uiFirstBlock);
+  struct timespec tsStart;
+  bool bReady;
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  pthread_mutex_lock(&handover.mutex);
+  while (!(handover.ui64Ready & ui64Sector) && !handover.bDone)
+    pthread_cond_wait(&handover.cond, &handover.mutex);
+  // The source is done with a sector it handed over, its blocks stay as they are
+  bReady = (handover.ui64Ready & ui64Sector) != 0;
+  if (bReady)
+    memcpy(&s->mtDump.amb[uiFirstBlock], &handover.psSource->mtDump.amb[uiFirstBlock],
+           (get_trailer_block(uiFirstBlock) - uiFirstBlock + 1) * sizeof(mifare_classic_block));
+  pthread_mutex_unlock(&handover.mutex);
+  s->dHandoverMs += elapsed_seconds(&tsStart) * 1000;
+  return bReady;
+}
+
+// <dump.mfd>.<UID> followed by pcSuffix, the archive stands for the dump when it holds it
+static void
+uid_file_name(struct mfc_session *s, const char *pcSuffix, char *pcFile, size_t szFile)
+{
+  int n = snprintf(pcFile, szFile, "%s.", bDumpInArchive ? pcArchive : pcDumpFile);
+
+  for (size_t i = 0; i < s->nt.nti.nai.szUidLen && n > 0 && (size_t) n < szFile; i++)
+    n += snprintf(pcFile + n, szFile - n, "%02x", s->nt.nti.nai.abtUid[i]);
+  if (n > 0 && (size_t) n < szFile)
+    snprintf(pcFile + n, szFile - n, "%s", pcSuffix);
+}
+
+// Append a sector read without gaps to the journal, a failing journal is given up but not the read
+static void
+journal_sector(struct mfc_session *s, uint32_t uiTrailerBlock)
+{
+  uint32_t uiFirstBlock = get_first_block(uiTrailerBlock);
+  uint8_t uiSector = mf_keydb_sector(uiTrailerBlock);
+
+  if (s->pfJournal == NULL || (s->ui64Journaled & (1ULL << uiSector)))
+    return;
+  for (uint32_t uiBlock = uiFirstBlock; uiBlock <= uiTrailerBlock; uiBlock++)
+    if (s->abtGaps[uiBlock] != GAP_NONE)
+      return;
+  if (fwrite(&uiSector, 1, 1, s->pfJournal) != 1
+      || fwrite(&s->mtDump.amb[uiFirstBlock], sizeof(mifare_classic_block), uiTrailerBlock - uiFirstBlock + 1, s->pfJournal) != uiTrailerBlock - uiFirstBlock + 1
+      || fflush(s->pfJournal) != 0) {
+    printf("!\nCould not write to journal, reading on without: %s\n", s->acJournal);
+    fclose(s->pfJournal);
+    s->pfJournal = NULL;
+    return;
+  }
+  s->ui64Journaled |= 1ULL << uiSector;
+}
+
+/*
+ * Open the journal of the card, <dump.mfd>.<UID>.journal. Sectors an earlier
+ * attempt on the card left in it go into the dump and are not read again; a
+ * record cut short is left out. The journal is written anew with them first,
+ * under a temporary name until complete.
+ */
+static bool
+journal_open(struct mfc_session *s)
+{
+  char acTmp[sizeof(s->acJournal) + 4];
+  uint8_t abtHeader[5];
+  mifare_classic_block ambSector[16];
+  uint8_t uiSector;
+  FILE *pf;
+
+  s->ui64Journaled = 0;
+  uid_file_name(s, ".journal", s->acJournal, sizeof(s->acJournal));
+  if ((pf = fopen(s->acJournal, "rb")) != NULL) {
+    // A journal of the card read as another type starts over
+    if (fread(abtHeader, 1, sizeof(abtHeader), pf) == sizeof(abtHeader)
+        && memcmp(abtHeader, JOURNAL_MAGIC, 4) == 0 && abtHeader[4] == s->uiBlocks) {
+      while (fread(&uiSector, 1, 1, pf) == 1 && uiSector <= mf_keydb_sector(s->uiBlocks)) {
+        uint32_t uiFirstBlock = get_first_block(get_sector_trailer(uiSector));
+        size_t szBlocks = get_sector_trailer(uiSector) - uiFirstBlock + 1;
+
+        if (fread(ambSector, sizeof(mifare_classic_block), szBlocks, pf) != szBlocks)
+          break;
+        memcpy(&s->mtDump.amb[uiFirstBlock], ambSector, szBlocks * sizeof(mifare_classic_block));
+        s->ui64Journaled |= 1ULL << uiSector;
+      }
+    }
+    fclose(pf);
+  }
+
+  snprintf(acTmp, sizeof(acTmp), "%s.tmp", s->acJournal);
+  if ((s->pfJournal = fopen(acTmp, "wb")) == NULL) {
+    printf("Could not open journal: %s\n", acTmp);
+    return false;
+  }
+  memcpy(abtHeader, JOURNAL_MAGIC, 4);
+  abtHeader[4] = s->uiBlocks;
+  fwrite(abtHeader, 1, sizeof(abtHeader), s->pfJournal);
+  for (uiSector = 0; uiSector <= mf_keydb_sector(s->uiBlocks); uiSector++) {
+    uint32_t uiTrailerBlock = get_sector_trailer(uiSector);
+
+    if (!(s->ui64Journaled & (1ULL << uiSector)))
+      continue;
+    fwrite(&uiSector, 1, 1, s->pfJournal);
+    fwrite(&s->mtDump.amb[get_first_block(uiTrailerBlock)], sizeof(mifare_classic_block),
+           uiTrailerBlock - get_first_block(uiTrailerBlock) + 1, s->pfJournal);
+  }
+  if (fflush(s->pfJournal) != 0 || ferror(s->pfJournal) || rename(acTmp, s->acJournal) != 0) {
+    printf("Could not write journal: %s\n", s->acJournal);
+    fclose(s->pfJournal);
+    s->pfJournal = NULL;
+    remove(acTmp);
+    return false;
+  }
+  if (s->ui64Journaled != 0)
+    printf("Resuming from journal: %zu sectors read before\n", bit_count64(s->ui64Journaled));
+  return true;
+}
+
+// Done with the journal: it goes once the dump is saved, else it stays for the next attempt
+static void
+journal_close(struct mfc_session *s, bool bSaved)
+{
+  if (s->pfJournal != NULL) {
+    fclose(s->pfJournal);
+    s->pfJournal = NULL;
+  }
+  if (s->acJournal[0] == '\0')
+    return;
+  if (bSaved || s->ui64Journaled == 0)
+    remove(s->acJournal);
+  else
+    printf("Kept %zu sectors in journal: %s, run again with -J to resume\n", bit_count64(s->ui64Journaled), s->acJournal);
+  s->acJournal[0] = '\0';
+}
+
+static  bool
+read_card(struct mfc_session *s, int read_unlocked)
+{
+  uint32_t uiTrailerBlock;
+  uint32_t uiSectors = mf_keydb_sector(s->uiBlocks) + 1;
+  uint32_t uiReadBlocks = 0;
+  uint32_t uiGaps = 0;
+  uint32_t uiDoomed;
+  uint64_t ui64Doomed = 0;
+  bool bMuted = false;
+
+  // A whole gen1 card is streamed, without the per sector loop
+  if (read_unlocked && !bSkip && !s->magic2 && !bJournal)
+    return magic_read_card(s);
+  if (read_unlocked)
+    if (!unlock_card(s))
+      return false;
+
+  memset(s->abtGaps, GAP_NONE, sizeof(s->abtGaps));
+  if (bJournal && !journal_open(s))
+    return false;
+  if (!bMultiDevice)
+    printf("Reading out %d blocks |", s->uiBlocks + 1);
+  // Read the card from end to begin, the source of a clone in the order the copy is written
+  for (uint32_t n = 0; n < uiSectors; n++) {
+    uiTrailerBlock = get_sector_trailer((s == handover.psSource) ? n : uiSectors - 1 - n);
+    if (s->ui64Journaled & (1ULL << mf_keydb_sector(uiTrailerBlock))) {
+      uiReadBlocks += uiTrailerBlock - get_first_block(uiTrailerBlock) + 1;
+      continue;
+    }
+    uiDoomed = s->uiBlocksDoomed;
+    if (!read_sector(s, uiTrailerBlock, read_unlocked, false, &bMuted, &uiReadBlocks))
+      return false;
+    if (s->uiBlocksDoomed != uiDoomed) {
+      ui64Doomed |= 1ULL << mf_keydb_sector(uiTrailerBlock);
+    } else {
+      handover_sector(s, uiTrailerBlock);
+      journal_sector(s, uiTrailerBlock);
+    }
+  }
+  // A targeted pass over the gaps, a noisy moment has likely passed by now
+  for (uint32_t uiBlock = 0; uiBlock <= s->uiBlocks; uiBlock++)
+    uiGaps += (s->abtGaps[uiBlock] != GAP_NONE);
+  if (uiGaps > 0) {
+    if (!bMultiDevice)
+      printf("|\nRetrying %u missing blocks |", uiGaps);
+    for (uint32_t n = 0; n < uiSectors; n++) {
+      uiTrailerBlock = get_sector_trailer(n);
+      if (!read_sector(s, uiTrailerBlock, read_unlocked, true, &bMuted, &uiReadBlocks))
+        return false;
+      if (!(ui64Doomed & (1ULL << n))) {
+        handover_sector(s, uiTrailerBlock);
+        journal_sector(s, uiTrailerBlock);
+      }
+    }
+  }
+  s->uiBlocksDone = uiReadBlocks;
+  if (bMultiDevice) {
+    printf("[%zu] Done, %d of %d blocks read", s->szDevice, uiReadBlocks, s->uiBlocks + 1);
+  } else {
+    printf("|\n");
+    printf("Done, %d of %d blocks read", uiReadBlocks, s->uiBlocks + 1);
+  }
+  if (s->uiBlocksDoomed > 0)
+    printf(", %u blocks the access bits keep from the keys at hand", s->uiBlocksDoomed);
+  printf(".\n");
+  uiGaps = 0;
+  for (uint32_t uiBlock = 0; uiBlock <= s->uiBlocks; uiBlock++) {
+    if (s->abtGaps[uiBlock] == GAP_NONE)
+      continue;
+    printf("%s 0x%02x (%s)", (uiGaps++ == 0) ? "Missing blocks:" : ",", uiBlock, apcGapCauses[s->abtGaps[uiBlock]]);
+  }
+  if (uiGaps > 0)
+    printf("\n");
+  if (bBothKeys)
+    print_key_map(s);
+  fflush(stdout);
+
+  return bTolerateFailures || uiGaps == 0;
+}
+
+static  bool
+write_card(struct mfc_session *s, int write_block_zero)
+{
+  uint32_t uiBlock;
+  char    bFailure = false;
+  uint32_t uiWriteBlocks = 0;
+  mifare_classic_tag *pmtDump = &s->mtDump;
+  plan_result pr;
+
+  // The fast path needs the whole dump up front, a clone only has it sector by sector
+  if (write_block_zero && !bSkip && !bDiffWrite && !s->magic2 && handover.psSource == NULL)
+    return magic_write_card(s);
+  if (write_block_zero)
+    if (!unlock_card(s))
+      return false;
+
+  if (!bMultiDevice)
+    printf("Writing %d blocks |", s->uiBlocks + 1);
+  // Write the card from begin to end;
+  for (uiBlock = 0; uiBlock <= s->uiBlocks; uiBlock++) {
+    // Authenticate everytime we reach the first sector of a new block
+    if (is_first_block (uiBlock)) {
+      // Read back the previous sector while still authenticated for it
+      if (bVerifyWrite && uiBlock != 0 && !bFailure && !verify_sector(s, uiBlock - 1, write_block_zero))
+        bFailure = true;
+
+      // Skip this the first time, bFailure it means nothing (yet)
+      if (uiBlock != 0)
+        print_success_or_failure (bFailure, &uiWriteBlocks);
+
+      if (bSkip)
+      {
+          for (uint32_t i=get_trailer_block(uiBlock);i>uiBlock;--i)
             if (blocks[i])
               goto next;
           bFailure = -1;
@@ -427,146 +1649,741 @@ write_card(int write_block_zero)
       }
 next:
 
-      // Show if the readout went well
-      if (bFailure) {
-        // When a failure occured we need to redo the anti-collision
-        if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) <= 0) {
-          printf("!\nError: tag was removed\n");
-          return false;
-        }
-        bFailure = false;
-      }
+      // A sector of a clone is written once the source has all of it
+      if (handover.psSource != NULL && !handover_take(s, uiBlock)) {
+        if (!bTolerateFailures) {
+          printf("!\nError: the source gave no complete sector for block 0x%02x\n", uiBlock);
+          return false;
+        }
+        memset(s->abWritten + uiBlock, false, get_trailer_block(uiBlock) - uiBlock + 1);
+        uiBlock = get_trailer_block(uiBlock);
+        continue;
+      }
+
+      // Show if the readout went well
+      if (bFailure) {
+        // When a failure occured we need to wake the tag up again
+        if (!reactivate(s)) {
+          printf("!\nError: tag was removed\n");
+          return false;
+        }
+        bFailure = false;
+      }
+
+      fflush(stdout);
+
+      // Try to authenticate for the current sector
+      if (!write_block_zero && !authenticate(s, uiBlock, plan_key_a(s, uiBlock, MA_WRITE))) {
+        printf("!\nError: authentication failed for block %02x\n", uiBlock);
+        return false;
+      }
+      // The access bits the card has now decide which key writes what
+      if (!write_block_zero && !plan_sector(s, uiBlock)) {
+        printf("!\nError: lost the card while planning sector at block %02x\n", uiBlock);
+        return false;
+      }
+
+      memset(s->abWritten + uiBlock, false, get_trailer_block(uiBlock) - uiBlock + 1);
+      if (bDiffWrite && !diff_sector(s, uiBlock, write_block_zero)) {
+        printf("!\nError: lost the card while comparing sector at block %02x\n", uiBlock);
+        return false;
+      }
+    }
+
+    if (bSkip && !blocks[uiBlock])
+      continue ; 
+    // A switch of keys reuses the command parameters, so plan before filling them
+    pr = PLAN_GO;
+    if (!write_block_zero && !bFailure && !(bDiffWrite && !s->abDiffer[uiBlock]) && (uiBlock != 0 || s->magic2))
+      pr = plan_block(s, uiBlock, is_trailer_block(uiBlock) ? planned_trailer_keys(s, uiBlock) : planned_keys(s, uiBlock, MA_WRITE));
+    if (pr == PLAN_DOOMED) {
+      if (!bTolerateFailures) {
+        printf("!\nError: the access bits of block 0x%02x keep it from the keys at hand\n", uiBlock);
+        return false;
+      }
+      if (!bMultiDevice)
+        printf("-");
+      continue;
+    }
+    if (pr == PLAN_LOST) {
+      printf("!\nError: lost the sector of block 0x%02x switching keys\n", uiBlock);
+      bFailure = true;
+    }
+    if (is_trailer_block (uiBlock)) {
+      // VERY INPORTENT! Verify the AccessBits
+      if ( BYTE_HIGH_NOT(pmtDump->amb[uiBlock].mbt.abtAccessBits[0]) != BYTE_LOW(pmtDump->amb[uiBlock].mbt.abtAccessBits[2])
+        || BYTE_LOW_NOT(pmtDump->amb[uiBlock].mbt.abtAccessBits[0]) != BYTE_HIGH(pmtDump->amb[uiBlock].mbt.abtAccessBits[1])
+        || BYTE_LOW_NOT(pmtDump->amb[uiBlock].mbt.abtAccessBits[1]) != BYTE_HIGH(pmtDump->amb[uiBlock].mbt.abtAccessBits[2])
+      
+      )
+      {
+        printf ("\nNOT valid AccessBits! block:%d AccessBits:%02X %02X %02X %02X\n",uiBlock,pmtDump->amb[uiBlock].mbt.abtAccessBits[0],
+        pmtDump->amb[uiBlock].mbt.abtAccessBits[1],
+        pmtDump->amb[uiBlock].mbt.abtAccessBits[2],
+        pmtDump->amb[uiBlock].mbt.abtAccessBits[3]);
+        return false;
+      }
+      
+      if ( 
+          GET_CX_BIT/*C3*/(BYTE_HIGH(pmtDump->amb[uiBlock].mbt.abtAccessBits[2]),3)==0 ||
+      
+           GET_CX_BIT(/*C1*/BYTE_HIGH(pmtDump->amb[uiBlock].mbt.abtAccessBits[1]),3)==1 &&
+           GET_CX_BIT(/*C2*/BYTE_LOW(pmtDump->amb[uiBlock].mbt.abtAccessBits[2]),3)==1
+          )
+      {
+          printf ("\nThe AccessBits for 'access bits writable' didn't set,This means that you will never be able to change AccessBits again\
+,if you really want to do this,use f option(haven't implement now) AccessBits:%02X %02X %02X %02X  C1C2C3:%1X %1X %1X\n",pmtDump->amb[uiBlock].mbt.abtAccessBits[0],
+        pmtDump->amb[uiBlock].mbt.abtAccessBits[1],
+        pmtDump->amb[uiBlock].mbt.abtAccessBits[2],
+        pmtDump->amb[uiBlock].mbt.abtAccessBits[3],
+        BYTE_HIGH(pmtDump->amb[uiBlock].mbt.abtAccessBits[1]),
+        BYTE_LOW(pmtDump->amb[uiBlock].mbt.abtAccessBits[2]),
+        BYTE_HIGH(pmtDump->amb[uiBlock].mbt.abtAccessBits[2])
+        );
+          return false;
+      }
+      
+      // Copy the keys over from our key dump and store the retrieved access bits
+      memcpy (s->mp.mpd.abtData, pmtDump->amb[uiBlock].mbt.abtKeyA, 6);
+      memcpy (s->mp.mpd.abtData + 6, pmtDump->amb[uiBlock].mbt.abtAccessBits, 4);
+      memcpy (s->mp.mpd.abtData + 10, pmtDump->amb[uiBlock].mbt.abtKeyB, 6);
+
+      // Try to write the trailer
+      if (bDiffWrite && !s->abDiffer[uiBlock]) {
+        s->uiBlocksSkipped++;
+      } else if (pr == PLAN_LOST || nfc_initiator_mifare_cmd (s->pnd, MC_WRITE, uiBlock, &s->mp) == false) {
+//        printf ("failed to write trailer block %d \n", uiBlock);
+        bFailure = true;
+      }
+      else {
+        // Reading back goes by the access bits just written
+        if (!write_block_zero)
+          learn_access(s, uiBlock, pmtDump->amb[uiBlock].mbt.abtAccessBits);
+        s->abWritten[uiBlock] = true;
+        uiWriteBlocks++;
+      }
+    } else {
+    
+      if (bSkip && !blocks[uiBlock])
+        continue ;    
+      // The first block 0x00 is read only, skip this
+      if (uiBlock == 0 && ! write_block_zero && ! s->magic2)
+        continue;
+
+      // Make sure a earlier write did not fail
+      if (!bFailure) {
+        // Try to write the data block
+        memcpy(s->mp.mpd.abtData, pmtDump->amb[uiBlock].mbd.abtData, 16);
+        // do not write a block 0 with incorrect BCC - card will be made invalid!
+        if (uiBlock == 0) {
+          if ((s->mp.mpd.abtData[0] ^ s->mp.mpd.abtData[1] ^ s->mp.mpd.abtData[2] ^ s->mp.mpd.abtData[3] ^ s->mp.mpd.abtData[4]) != 0x00 && !s->magic2) {
+            printf("!\nError: incorrect BCC in MFD file!\n");
+            printf("Expecting BCC=%02X\n", s->mp.mpd.abtData[0] ^ s->mp.mpd.abtData[1] ^ s->mp.mpd.abtData[2] ^ s->mp.mpd.abtData[3]);
+            return false;
+          }
+        }
+        if (bDiffWrite && !s->abDiffer[uiBlock]) {
+          s->uiBlocksSkipped++;
+        } else if (!nfc_initiator_mifare_cmd(s->pnd, MC_WRITE, uiBlock, &s->mp)) {
+          bFailure = true;
+        } else {
+          s->abWritten[uiBlock] = true;
+          uiWriteBlocks++;
+        }
+      }
+    }
+    // Show if the write went well for each block
+    print_success_or_failure(bFailure, &uiWriteBlocks);
+    if ((! bTolerateFailures) && bFailure)
+      return false;
+  }
+  if (bVerifyWrite && !bFailure && !verify_sector(s, s->uiBlocks, write_block_zero) && !bTolerateFailures)
+    return false;
+  s->uiBlocksDone = uiWriteBlocks;
+  if (bMultiDevice) {
+    printf("[%zu] ", s->szDevice);
+  } else {
+    printf("|\n");
+  }
+  printf("Done, %d of %d blocks written", uiWriteBlocks, s->uiBlocks + 1);
+  if (bDiffWrite)
+    printf(", %u unchanged blocks skipped", s->uiBlocksSkipped);
+  if (s->uiBlocksDoomed > 0)
+    printf(", %u blocks the access bits keep from the keys at hand", s->uiBlocksDoomed);
+  if (bVerifyWrite)
+    printf(", %u blocks verified, %u mismatches", s->uiBlocksVerified, s->uiMismatches);
+  printf(".\n");
+  fflush(stdout);
+  if (s->uiMismatches > 0)
+    return false;
+
+  return true;
+}
+
+static void
+print_usage(const char *pcProgramName)
+{
+  printf ("Usage: ");
+  printf ("%s [-m | -c <device>] [-D] [-V] [-J] [-A <archive>] [-K <keydb>] [-C <classes>] [-T <latency>] [-M <metrics>] [-O <trace> | -I <trace> [-P] | -S|-G <card> [-L <link>] [-B <cards>]] [-E <cards>] r|R|w|W[<,sector[t]>[...]] a|b|ab <dump.mfd> [<keys.mfd>]\n", pcProgramName);
+  printf ("       %s [options] v,<block>[,<backup>] a|b ?|=<value>|+<amount>|-<amount> [<keys.mfd>]\n", pcProgramName);
+  printf ("       %s [options] c|C[<,sector[t]>[...]] a|b [<dump.mfd>]\n", pcProgramName);
+  printf ("  -m                           - Use every attached reader, one worker thread per reader\n");
+  printf ("                                 *** each card read is saved as <dump.mfd>.<UID>\n");
+  printf ("  -c <device>                  - Open the reader with this libnfc connection string, by default the reader\n");
+  printf ("                                 that last opened on this host is tried before scanning for one\n");
+  printf ("  -D                           - Differential write: read each sector first and only write blocks that differ\n");
+  printf ("  -V                           - Verify written blocks by reading them back\n");
+  printf ("  -J                           - Journal a read: each sector goes to <dump.mfd>.<UID>.journal as it is read,\n");
+  printf ("                                 a read of the card cut short resumes with the sectors still missing\n");
+  printf ("  -A <archive>                 - Dump archive indexed by UID, use %s as <dump.mfd> or <keys.mfd>\n", ARCHIVE_ENTRY);
+  printf ("                                 to read or write the archive entry of the presented card\n");
+  printf ("  -K <keydb>                   - Key database indexed by UID: keys known for the card are tried first,\n");
+  printf ("                                 keys found by the dictionary are added\n");
+  printf ("  -C <classes>                 - Keep the size RATS tells for each card type (ATQA, SAK, UID manufacturer)\n");
+  printf ("                                 in <classes>, and skip probing cards of a known type when reading\n");
+  printf ("  -T <latency>                 - Learn command latencies per reader and card type, and time out\n");
+  printf ("                                 silent commands early; learned values are kept in <latency>\n");
+  printf ("  -M <metrics>                 - Write command latency histograms and event counters at exit and on SIGUSR1,\n");
+  printf ("                                 as a Prometheus textfile if <metrics> ends in .prom, as JSON otherwise\n");
+  printf ("  -O <trace>                   - Record every reader exchange to <trace>\n");
+  printf ("  -I <trace>                   - Replay <trace> instead of using readers, as fast as possible\n");
+  printf ("  -P                           - Replay with the recorded timing\n");
+  printf ("  -S <card>                    - Use simulated readers holding a MIFARE Classic card instead of real ones,\n");
+  printf ("                                 <card> is a 1K or 4K dump, or 1k or 4k for a blank card; 4 readers with -m,\n");
+  printf ("                                 2 to clone; a comma separated list gives each reader its own card\n");
+  printf ("  -G <card>                    - Same with a gen1 magic card, that R and W can unlock\n");
+  printf ("                                 1k:<key> or 4k:<key> is a blank card with the 12 hex digit key for every sector\n");
+  printf ("  -L <link>                    - Give simulated readers the timing and faults of a real link, comma separated:\n");
+  printf ("                                 usb=<us> per command, wait=<ms> per silent card, fail=<rate>, timeout=<rate>\n");
+  printf ("  -B <cards>                   - Benchmark: run the action on <cards> cards per simulated reader, then report\n");
+  printf ("                                 cards/min, round trips per card, waiting and host CPU time\n");
+  printf ("  -E <cards>                   - Encoding line: keep the reader and the files loaded, write and verify\n");
+  printf ("                                 each card as it is presented, until <cards> are done (0: until interrupted)\n");
+  printf ("  <r|R|w|W>[<,sector[t|f]]>[...]] - Perform read from (r) or unlocked read from (R) or write to (w) or unlocked write to (W) card\n");
+  printf ("                                 the sector to be read or write ,include or exclude trailer block ,can be specified,omit means all sectors include trailer block\n");
+  printf ("                                 example: r,0,15t means only read sector 0 and sector 15 include trailer block\n");
+  printf ("                                 *** note that unlocked write will attempt to overwrite block 0 including UID\n");
+  printf ("                                 *** unlocked read does not require authentication and will reveal A and B keys\n");
+  printf ("                                 *** unlocking only works with special Mifare 1K cards (Chinese clones)\n");
+  printf ("  v,<block>[,<backup>]         - Value block transaction under one authentication: check (?), set (=),\n");
+  printf ("                                 credit (+) or debit (-), copied to <backup> of the same sector, and read back;\n");
+  printf ("                                 a torn <block> is restored from <backup> first\n");
+  printf ("  c|C                          - Clone the card on the first reader to the card on the second: each sector\n");
+  printf ("                                 is written as soon as it is read, while the next one is read; the source is\n");
+  printf ("                                 read with key A finding key B, the copy is read back (C: unlocked, block 0 too)\n");
+  printf ("                                 a|b is the key that writes the copy, <dump.mfd> also keeps the source\n");
+  printf ("  a|b                          - Use A or B keys for action\n");
+  printf ("  ab                           - Read with key A and find key B of every sector along, from the trailer\n");
+  printf ("                                 when key A may read it and else from the keys at hand, then print the key map\n");
+  printf ("  <dump.mfd>                   - MiFare Dump (MFD) used to write (card to MFD) or (MFD to card)\n");
+  printf ("  <keys.mfd>                   - MiFare Dump (MFD) that contain the keys (optional)\n");
+  printf ("  f                            - Force using the keyfile even if UID does not match (optional)\n");
+}
+
+static bool
+init_device(nfc_device *pnd)
+{
+  if (nfct_initiator_init(pnd) < 0) {
+    nfct_perror(pnd, "nfc_initiator_init");
+    return false;
+  }
+
+// Let the reader only try once to find a tag
+  if (nfct_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0) {
+    nfct_perror(pnd, "nfc_device_set_property_bool");
+    return false;
+  }
+// Disable ISO14443-4 switching in order to read devices that emulate Mifare Classic with ISO14443-4 compliance.
+  nfct_device_set_property_bool(pnd, NP_AUTO_ISO14443_4, false);
+
+  printf("NFC reader: %s opened\n", nfct_device_get_name(pnd));
+  return true;
+}
+
+static bool
+save_dump(struct mfc_session *s)
+{
+  char acDumpFile[1024];
+  const char *pcFile = pcDumpFile;
+
+  if (bDumpInArchive) {
+    printf("Writing data to archive: %s ...", pcArchive);
+    if (!mfd_archive_put(pmaArchive, s->nt.nti.nai.abtUid, s->nt.nti.nai.szUidLen, &s->mtDump, s->uiBlocks + 1)) {
+      printf("\nCould not write to archive: %s\n", pcArchive);
+      return false;
+    }
+    printf("Done.\n");
+    return true;
+  }
+
+  // Several cards are read at once, keep them apart by UID
+  if (bMultiDevice && atAction == ACTION_READ) {
+    uid_file_name(s, "", acDumpFile, sizeof(acDumpFile));
+    pcFile = acDumpFile;
+  }
+
+  printf("Writing data to file: %s ...", pcFile);
+  fflush(stdout);
+  FILE *pfDump = fopen(pcFile, "wb");
+  if (pfDump == NULL) {
+    printf("Could not open dump file: %s\n", pcFile);
+    return false;
+  }
+  if (fwrite(&s->mtDump, 1, (s->uiBlocks + 1) * sizeof(mifare_classic_block), pfDump) != ((s->uiBlocks + 1) * sizeof(mifare_classic_block))) {
+    printf("\nCould not write to file: %s\n", pcFile);
+    fclose(pfDump);
+    return false;
+  }
+  printf("Done.\n");
+  fclose(pfDump);
+  return true;
+}
+
+// Size and magic card type from ATQA, SAK and, where needed, the ATS
+static bool
+classify_card(struct mfc_session *s)
+{
+  int res;
+
+  s->magic2 = false;
+// Guessing size
+  if ((s->nt.nti.nai.abtAtqa[1] & 0x02) == 0x02)
+// 4K
+    s->uiBlocks = 0xff;
+  else if ((s->nt.nti.nai.btSak & 0x01) == 0x01)
+// 320b
+    s->uiBlocks = 0x13;
+  else
+// 1K/2K, checked through RATS
+    s->uiBlocks = 0x3f;
+// Testing RATS
+  if ((res = get_rats(s)) > 0) {
+    if ((res >= 10) && (s->abtRx[5] == 0xc1) && (s->abtRx[6] == 0x05)
+        && (s->abtRx[7] == 0x2f) && (s->abtRx[8] == 0x2f)
+        && ((s->nt.nti.nai.abtAtqa[1] & 0x02) == 0x00)) {
+      // MIFARE Plus 2K
+      s->uiBlocks = 0x7f;
+    }
+    // Chinese magic emulation card, ATS=0978009102:dabc1910
+    if ((res == 9)  && (s->abtRx[5] == 0xda) && (s->abtRx[6] == 0xbc)
+        && (s->abtRx[7] == 0x19) && (s->abtRx[8] == 0x10)) {
+      s->magic2 = true;
+    }
+  } else if (res == NFC_ETGRELEASED) {
+    return false;
+  }
+  return true;
+}
+
+static bool
+process_card(struct mfc_session *s)
+{
+  uint8_t *pbtUID;
+
+// Try to find a MIFARE Classic tag
+  struct timespec tsStart;
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if (s->bSelected) {
+    s->bSelected = false;
+  } else if (nfct_initiator_select_passive_target(s->pnd, nmMifare, NULL, 0, &s->nt) <= 0) {
+    printf("Error: no tag was found\n");
+    return false;
+  } else {
+    metrics_time(s->pnd, METRIC_SELECT, &tsStart);
+  }
+// Test if we are dealing with a MIFARE compatible tag
+  if ((s->nt.nti.nai.btSak & 0x08) == 0) {
+    printf("Warning: tag is probably not a MFC!\n");
+  }
+  if (pcLatencyFile != NULL)
+    latency_attach(s->pnd, s->nt.nti.nai.abtAtqa, s->nt.nti.nai.btSak);
+
+// Get the info from the current tag
+  pbtUID = s->nt.nti.nai.abtUid;
+
+  memset(&s->mkkCard, 0, sizeof(s->mkkCard));
+  s->ui64AccessKnown = 0;
+  s->ui64KeyFailedA = 0;
+  s->ui64KeyFailedB = 0;
+  if (pmkKeyDb != NULL && mf_keydb_get(pmkKeyDb, pbtUID, s->nt.nti.nai.szUidLen, &s->mkkCard))
+    printf("Using keys known for this card from key database: %s\n", pcKeyDb);
+
+  // Archive entries are looked up by the full UID, nothing to compare
+  if (bUseKeyFile && !bKeysInArchive) {
+// Compare if key dump UID is the same as the current tag UID, at least for the first 4 bytes
+    if (memcmp(pbtUID, abtKeyFileUid, 4) != 0) {
+      printf("Expected MIFARE Classic card with UID starting as: %02x%02x%02x%02x\n",
+             abtKeyFileUid[0], abtKeyFileUid[1], abtKeyFileUid[2], abtKeyFileUid[3]);
+      printf("Got card with UID starting as:                     %02x%02x%02x%02x\n",
+             pbtUID[0], pbtUID[1], pbtUID[2], pbtUID[3]);
+      if (! bForceKeyFile) {
+        printf("Aborting!\n");
+        return false;
+      }
+    }
+  }
+  printf("Found MIFARE Classic card:\n");
+  print_nfc_target(&s->nt, false);
+
+  // A gen2 magic card has the ATQA and SAK of the card it copies, only its ATS
+  // tells: writing block 0 and unlocking ask every card
+  if (pcClassFile != NULL && !unlock && atAction != ACTION_WRITE && atAction != ACTION_CLONE
+      && card_class_lookup(&s->nt.nti.nai, &s->uiBlocks)) {
+    // Card type seen before, RATS would only tell the same size again
+    s->magic2 = false;
+  } else if (!classify_card(s)) {
+    return false;
+  } else if (pcClassFile != NULL) {
+    card_class_store(&s->nt.nti.nai, s->uiBlocks);
+  }
+  printf("Guessing size: seems to be a %i-byte card\n", (s->uiBlocks + 1) * 16);
+  if (s == handover.psSource)
+    handover_post(&handover.bClassified);
+  else if (atAction == ACTION_CLONE && !handover_size(s))
+    return false;
+
+  if (bKeysInArchive) {
+    if (mfd_archive_get(pmaArchive, pbtUID, s->nt.nti.nai.szUidLen, &s->mtKeys) < (size_t) s->uiBlocks + 1) {
+      printf("No keys for this card in archive: %s\n", pcArchive);
+      return false;
+    }
+  } else if (szLineKeyBlocks > 0) {
+    if (szLineKeyBlocks < (size_t) s->uiBlocks + 1) {
+      printf("Keys file too small for this card: %s\n", pcKeysFile);
+      return false;
+    }
+    memcpy(&s->mtKeys, &mtLineKeys, sizeof(s->mtKeys));
+  } else if (bUseKeyFile) {
+    FILE *pfKeys = fopen(pcKeysFile, "rb");
+    if (pfKeys == NULL) {
+      printf("Could not open keys file: %s\n", pcKeysFile);
+      return false;
+    }
+    if (fread(&s->mtKeys, 1, (s->uiBlocks + 1) * sizeof(mifare_classic_block), pfKeys) != (s->uiBlocks + 1) * sizeof(mifare_classic_block)) {
+      printf("Could not read keys file: %s\n", pcKeysFile);
+      fclose(pfKeys);
+      return false;
+    }
+    fclose(pfKeys);
+  }
+
+  if (atAction != ACTION_WRITE) {
+    memset(&s->mtDump, 0x00, sizeof(s->mtDump));
+  } else if (bDumpInArchive) {
+    if (mfd_archive_get(pmaArchive, pbtUID, s->nt.nti.nai.szUidLen, &s->mtDump) < (size_t) s->uiBlocks + 1) {
+      printf("No dump for this card in archive: %s\n", pcArchive);
+      return false;
+    }
+  } else if (szLineDumpBlocks > 0) {
+    if (szLineDumpBlocks < (size_t) s->uiBlocks + 1) {
+      printf("Dump file too small for this card: %s\n", pcDumpFile);
+      return false;
+    }
+    memcpy(&s->mtDump, &mtLineDump, sizeof(s->mtDump));
+  } else {
+    FILE *pfDump = fopen(pcDumpFile, "rb");
+
+    if (pfDump == NULL) {
+      printf("Could not open dump file: %s\n", pcDumpFile);
+      return false;
+    }
+
+    if (fread(&s->mtDump, 1, (s->uiBlocks + 1) * sizeof(mifare_classic_block), pfDump) != (s->uiBlocks + 1) * sizeof(mifare_classic_block)) {
+      printf("Could not read dump file: %s\n", pcDumpFile);
+      fclose(pfDump);
+      return false;
+    }
+    fclose(pfDump);
+  }
+// printf("Successfully opened required files\n");
+
+  if (atAction == ACTION_VALUE)
+    return value_transaction(s);
+  if (atAction == ACTION_READ) {
+    bool bSaved = read_card(s, unlock) && save_dump(s);
 
-      fflush(stdout);
+    journal_close(s, bSaved);
+    return bSaved;
+  }
+  s->adPhaseMs[PHASE_SETUP] = elapsed_seconds(&tsStart) * 1000;
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if (s == handover.psSource) {
+    // The source of a clone is only read, locked whatever the copy is
+    bool bRead = read_card(s, 0);
+    s->adPhaseMs[PHASE_ENCODE] = elapsed_seconds(&tsStart) * 1000;
+    return bRead && (pcDumpFile == NULL || save_dump(s));
+  }
+  bool bWritten = write_card(s, unlock);
+  s->adPhaseMs[PHASE_ENCODE] = elapsed_seconds(&tsStart) * 1000 - s->adPhaseMs[PHASE_VERIFY];
+  return bWritten;
+}
 
-      // Try to authenticate for the current sector
-      if (!write_block_zero && !authenticate(uiBlock)) {
-        printf("!\nError: authentication failed for block %02x\n", uiBlock);
-        return false;
-      }
-    }
+static void
+stop_line(int sig)
+{
+  (void) sig;
+  bStopLine = 1;
+}
 
-    if (bSkip && !blocks[uiBlock])
-      continue ; 
-    if (is_trailer_block (uiBlock)) {
-      // Copy the keys over from our key dump and store the retrieved access bits
-      memcpy (mp.mpd.abtData, mtDump.amb[uiBlock].mbt.abtKeyA, 6);
-      // VERY INPORTENT! Verify the AccessBits
-      if ( BYTE_HIGH_NOT(mtDump.amb[uiBlock].mbt.abtAccessBits[0]) != BYTE_LOW(mtDump.amb[uiBlock].mbt.abtAccessBits[2])
-        || BYTE_LOW_NOT(mtDump.amb[uiBlock].mbt.abtAccessBits[0]) != BYTE_HIGH(mtDump.amb[uiBlock].mbt.abtAccessBits[1])
-        || BYTE_LOW_NOT(mtDump.amb[uiBlock].mbt.abtAccessBits[1]) != BYTE_HIGH(mtDump.amb[uiBlock].mbt.abtAccessBits[2])
-      
-      )
-      {
-        printf ("\nNOT valid AccessBits! block:%d AccessBits:%02X %02X %02X %02X\n",uiBlock,mtDump.amb[uiBlock].mbt.abtAccessBits[0],
-        mtDump.amb[uiBlock].mbt.abtAccessBits[1],
-        mtDump.amb[uiBlock].mbt.abtAccessBits[2],
-        mtDump.amb[uiBlock].mbt.abtAccessBits[3]);
-        return false;
-      }
-      
-      if ( 
-          GET_CX_BIT/*C3*/(BYTE_HIGH(mtDump.amb[uiBlock].mbt.abtAccessBits[2]),3)==0 ||
-      
-           GET_CX_BIT(/*C1*/BYTE_HIGH(mtDump.amb[uiBlock].mbt.abtAccessBits[1]),3)==1 &&
-           GET_CX_BIT(/*C2*/BYTE_LOW(mtDump.amb[uiBlock].mbt.abtAccessBits[2]),3)==1
-          )
-      {
-          printf ("\nThe AccessBits for 'access bits writable' didn't set,This means that you will never be able to change AccessBits again\
-,if you really want to do this,use f option(haven't implement now) AccessBits:%02X %02X %02X %02X  C1C2C3:%1X %1X %1X\n",mtDump.amb[uiBlock].mbt.abtAccessBits[0],
-        mtDump.amb[uiBlock].mbt.abtAccessBits[1],
-        mtDump.amb[uiBlock].mbt.abtAccessBits[2],
-        mtDump.amb[uiBlock].mbt.abtAccessBits[3],
-        BYTE_HIGH(mtDump.amb[uiBlock].mbt.abtAccessBits[1]),
-        BYTE_LOW(mtDump.amb[uiBlock].mbt.abtAccessBits[2]),
-        BYTE_HIGH(mtDump.amb[uiBlock].mbt.abtAccessBits[2])
-        );
-          return false;
-      }
-      
-      memcpy (mp.mpd.abtData + 6, mtDump.amb[uiBlock].mbt.abtAccessBits, 4);
-      memcpy (mp.mpd.abtData + 10, mtDump.amb[uiBlock].mbt.abtKeyB, 6);
+// Poll for the next card of a line and leave it selected for process_card
+static bool
+wait_for_card(struct mfc_session *s)
+{
+  struct timespec ts = { .tv_sec = 0, .tv_nsec = LINE_POLL_MS * 1000000 };
+  int res;
 
-      // Try to write the trailer
-      if (nfc_initiator_mifare_cmd (pnd, MC_WRITE, uiBlock, &mp) == false) {
-//        printf ("failed to write trailer block %d \n", uiBlock);
-        bFailure = true;
-      }
-      else
-        uiWriteBlocks++;
+  while (!s->bSelected && !bStopLine) {
+    res = nfct_initiator_select_passive_target(s->pnd, nmMifare, NULL, 0, &s->nt);
+    if (res > 0) {
+      s->bSelected = true;
+    } else if (res == 0 || res == NFC_ETIMEOUT) {
+      nanosleep(&ts, NULL);
     } else {
-    
-      if (bSkip && !blocks[uiBlock])
-        continue ;    
-      // The first block 0x00 is read only, skip this
-      if (uiBlock == 0 && ! write_block_zero && ! magic2)
-        continue;
+      if (res != NFC_EOPABORTED)
+        nfct_perror(s->pnd, "nfc_initiator_select_passive_target");
+      return false;
+    }
+  }
+  return s->bSelected;
+}
 
-      // Make sure a earlier write did not fail
-      if (!bFailure) {
-        // Try to write the data block
-        memcpy(mp.mpd.abtData, mtDump.amb[uiBlock].mbd.abtData, 16);
-        // do not write a block 0 with incorrect BCC - card will be made invalid!
-        if (uiBlock == 0) {
-          if ((mp.mpd.abtData[0] ^ mp.mpd.abtData[1] ^ mp.mpd.abtData[2] ^ mp.mpd.abtData[3] ^ mp.mpd.abtData[4]) != 0x00 && !magic2) {
-            printf("!\nError: incorrect BCC in MFD file!\n");
-            printf("Expecting BCC=%02X\n", mp.mpd.abtData[0] ^ mp.mpd.abtData[1] ^ mp.mpd.abtData[2] ^ mp.mpd.abtData[3]);
-            return false;
-          }
-        }
-        if (!nfc_initiator_mifare_cmd(pnd, MC_WRITE, uiBlock, &mp))
-          bFailure = true;
-        else
-          uiWriteBlocks++;
-      }
+// Wait for the card just done to leave the field, the next one may already be there
+static void
+wait_for_removal(struct mfc_session *s)
+{
+  struct timespec ts = { .tv_sec = 0, .tv_nsec = LINE_POLL_MS * 1000000 };
+  uint8_t abtUid[10];
+  size_t szUidLen = s->nt.nti.nai.szUidLen;
+
+  memcpy(abtUid, s->nt.nti.nai.abtUid, szUidLen);
+  while (!bStopLine) {
+    // A field cycle wakes the card whatever state the encoding left it in
+    nfct_device_set_property_bool(s->pnd, NP_ACTIVATE_FIELD, false);
+    nfct_device_set_property_bool(s->pnd, NP_ACTIVATE_FIELD, true);
+    // Simulated cards never leave, the field cycle presents the same card as a new one
+    if (pcSimCard != NULL)
+      return;
+    if (nfct_initiator_select_passive_target(s->pnd, nmMifare, NULL, 0, &s->nt) <= 0)
+      return;
+    // An unlocked write may have given the card the UID of the dump
+    if (!(s->nt.nti.nai.szUidLen == szUidLen && memcmp(s->nt.nti.nai.abtUid, abtUid, szUidLen) == 0)
+        && !(unlock && s->nt.nti.nai.szUidLen == 4 && memcmp(s->nt.nti.nai.abtUid, s->mtDump.amb[0].mbd.abtData, 4) == 0)) {
+      s->bSelected = true;
+      return;
     }
-    // Show if the write went well for each block
-    print_success_or_failure(bFailure, &uiWriteBlocks);
-    if ((! bTolerateFailures) && bFailure)
-      return false;
+    nanosleep(&ts, NULL);
   }
-  printf("|\n");
-  printf("Done, %d of %d blocks written.\n", uiWriteBlocks, uiBlocks + 1);
+}
+
+// One result line per card, for the operator and for whatever drives the line
+static void
+report_card(struct mfc_session *s, size_t szCard)
+{
+  pthread_mutex_lock(&totals.mutex);
+  if (bMultiDevice)
+    printf("[%zu] ", s->szDevice);
+  printf("Card %zu ", szCard + 1);
+  for (size_t i = 0; i < s->nt.nti.nai.szUidLen; i++)
+    printf("%02x", s->nt.nti.nai.abtUid[i]);
+  printf(": %s", s->bSuccess ? "OK" : "FAILED");
+  for (int p = 0; p < PHASE_COUNT; p++)
+    printf(", %s %.1f ms", apcPhases[p], s->adPhaseMs[p]);
+  printf("\n");
   fflush(stdout);
+  pthread_mutex_unlock(&totals.mutex);
+}
 
-  return true;
+static void *
+session_thread(void *arg)
+{
+  struct mfc_session *s = arg;
+  struct timespec tsWait;
+
+  // A benchmark takes the card out and presents it again, as a new card, until done
+  for (size_t n = 0; bLineMode ? (szLineCards == 0 || n < szLineCards) : n < MAX(szBenchCards, 1); n++) {
+    memset(s->adPhaseMs, 0, sizeof(s->adPhaseMs));
+    if (bLineMode) {
+      clock_gettime(CLOCK_MONOTONIC, &tsWait);
+      if (bStopLine || !wait_for_card(s))
+        break;
+      s->adPhaseMs[PHASE_WAIT] = elapsed_seconds(&tsWait) * 1000;
+    } else if (n > 0) {
+      nfct_device_set_property_bool(s->pnd, NP_ACTIVATE_FIELD, false);
+      nfct_device_set_property_bool(s->pnd, NP_ACTIVATE_FIELD, true);
+    }
+    s->uiBlocksDone = 0;
+    s->uiBlocksSkipped = 0;
+    s->uiBlocksDoomed = 0;
+    s->uiBlocksVerified = 0;
+    s->uiMismatches = 0;
+    s->bSuccess = process_card(s);
+    // The copy of a clone stops waiting for sectors that did not come
+    if (s == handover.psSource)
+      handover_post(&handover.bDone);
+    if (bLineMode) {
+      report_card(s, n);
+      clock_gettime(CLOCK_MONOTONIC, &tsWait);
+      wait_for_removal(s);
+      s->adPhaseMs[PHASE_WAIT] += elapsed_seconds(&tsWait) * 1000;
+    }
+    pthread_mutex_lock(&totals.mutex);
+    if (s->bSuccess)
+      totals.szCardsOk++;
+    else
+      totals.szCardsFailed++;
+    totals.uiBlocks += s->uiBlocksDone;
+    for (int p = 0; p < PHASE_COUNT; p++)
+      totals.adPhaseMs[p] += s->adPhaseMs[p];
+    pthread_mutex_unlock(&totals.mutex);
+  }
+  if (s->uiReactivations > 0)
+    printf("Reader %zu: %u reactivation(s), %u by full select, %.1f ms average, %.1f ms max\n",
+           s->szDevice, s->uiReactivations, s->uiFullSelects,
+           s->dReactivationMs / s->uiReactivations, s->dReactivationMaxMs);
+  return NULL;
 }
 
-typedef enum {
-  ACTION_READ,
-  ACTION_WRITE,
-  ACTION_USAGE
-} action_t;
+// Where the time of a benchmark run went: waiting on the (simulated) readers or computing
+static void
+print_benchmark(size_t szDevices, double dElapsed, const struct timespec *ptsCpuStart)
+{
+  struct timespec tsCpu;
+  size_t szCards = totals.szCardsOk + totals.szCardsFailed;
+  uint64_t ui64RoundTrips, ui64WaitUs;
+  double dCpu;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tsCpu);
+  dCpu = (tsCpu.tv_sec - ptsCpuStart->tv_sec) + (tsCpu.tv_nsec - ptsCpuStart->tv_nsec) / 1e9;
+  nfct_simulate_stats(&ui64RoundTrips, &ui64WaitUs);
+  printf("Benchmark: %zu card(s), %zu failed, on %zu reader(s) in %.2f s", szCards, totals.szCardsFailed, szDevices, dElapsed);
+  if (dElapsed > 0)
+    printf(", %.1f cards/min", totals.szCardsOk * 60.0 / dElapsed);
+  printf("\n");
+  if (szCards > 0)
+    printf("  %.1f round trips per card, %.1f ms waiting and %.2f ms host CPU per card\n",
+           (double) ui64RoundTrips / szCards, ui64WaitUs / 1000.0 / szCards, dCpu * 1000 / szCards);
+  if (dElapsed > 0)
+    printf("  readers waiting %.1f%% of the time, host CPU busy %.1f%%\n",
+           ui64WaitUs / 1e4 / (dElapsed * szDevices), dCpu * 100 / dElapsed);
+}
 
+// Throughput of an encoding line, and where the time of a card went
 static void
-print_usage(const char *pcProgramName)
+print_line_report(size_t szDevices, double dElapsed)
 {
-  printf ("Usage: ");
-  printf ("%s r|R|w|W[<,sector[t]>[...]] a|b <dump.mfd> [<keys.mfd>]\n", pcProgramName);
-  printf ("  <r|R|w|W>[<,sector[t|f]]>[...]] - Perform read from (r) or unlocked read from (R) or write to (w) or unlocked write to (W) card\n");
-  printf ("                                 the sector to be read or write ,include or exclude trailer block ,can be specified,omit means all sectors include trailer block\n");
-  printf ("                                 example: r,0,15t means only read sector 0 and sector 15 include trailer block\n");
-  printf ("                                 *** note that unlocked write will attempt to overwrite block 0 including UID\n");
-  printf ("                                 *** unlocked read does not require authentication and will reveal A and B keys\n");
-  printf ("                                 *** unlocking only works with special Mifare 1K cards (Chinese clones)\n");
-  printf ("  a|b                          - Use A or B keys for action\n");
-  printf ("  <dump.mfd>                   - MiFare Dump (MFD) used to write (card to MFD) or (MFD to card)\n");
-  printf ("  <keys.mfd>                   - MiFare Dump (MFD) that contain the keys (optional)\n");
-  printf ("  f                            - Force using the keyfile even if UID does not match (optional)\n");
+  size_t szCards = totals.szCardsOk + totals.szCardsFailed;
+  double dBusyMs = 0;
+
+  printf("Line: %zu card(s) encoded, %zu failed, on %zu reader(s) in %.1f s", szCards, totals.szCardsFailed, szDevices, dElapsed);
+  if (dElapsed > 0)
+    printf(", %.1f cards/min", totals.szCardsOk * 60.0 / dElapsed);
+  printf("\n");
+  if (szCards == 0)
+    return;
+  printf("  per card:");
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    printf("%s %s %.1f ms", (p > 0) ? "," : "", apcPhases[p], totals.adPhaseMs[p] / szCards);
+    if (p != PHASE_WAIT)
+      dBusyMs += totals.adPhaseMs[p];
+  }
+  printf("\n");
+  if (dBusyMs > 0)
+    printf("  %.1f cards/min per reader not counting the wait for cards\n", szCards * 60000.0 / dBusyMs);
+}
+
+// Read a whole dump file, up to 4K, and tell how many blocks it holds
+static size_t
+load_tag(const char *pcFile, mifare_classic_tag *pmt)
+{
+  FILE *pfDump = fopen(pcFile, "rb");
+  size_t szRead;
+
+  if (pfDump == NULL) {
+    printf("Could not open dump file: %s\n", pcFile);
+    return 0;
+  }
+  szRead = fread(pmt, 1, sizeof(*pmt), pfDump);
+  fclose(pfDump);
+  if (szRead < sizeof(mifare_classic_block)) {
+    printf("Could not read dump file: %s\n", pcFile);
+    return 0;
+  }
+  return szRead / sizeof(mifare_classic_block);
 }
 
 int
 main(int argc, const char *argv[])
 {
-  action_t atAction = ACTION_USAGE;
-  uint8_t *pbtUID;
-  int    unlock = 0;
+  struct mfc_session *sessions;
+  pthread_t threads[MAX_DEVICE_COUNT];
+  size_t szDevices = 0;
+  struct timespec tsStart, tsCpuStart;
+
+  // Options come first and are stripped, the positional syntax stays as it was
+  while (argc > 1 && argv[1][0] == '-') {
+    int iShift = 1;
+    if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+      pcDevice = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-m") == 0) {
+      bMultiDevice = true;
+    } else if (strcmp(argv[1], "-D") == 0) {
+      bDiffWrite = true;
+    } else if (strcmp(argv[1], "-V") == 0) {
+      bVerifyWrite = true;
+    } else if (strcmp(argv[1], "-J") == 0) {
+      bJournal = true;
+    } else if (strcmp(argv[1], "-A") == 0 && argc > 2) {
+      pcArchive = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-K") == 0 && argc > 2) {
+      pcKeyDb = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-C") == 0 && argc > 2) {
+      pcClassFile = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-T") == 0 && argc > 2) {
+      pcLatencyFile = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-M") == 0 && argc > 2) {
+      pcMetricsFile = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-O") == 0 && argc > 2) {
+      pcRecordTrace = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-I") == 0 && argc > 2) {
+      pcReplayTrace = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-P") == 0) {
+      bReplayPaced = true;
+    } else if ((strcmp(argv[1], "-S") == 0 || strcmp(argv[1], "-G") == 0) && argc > 2) {
+      pcSimCard = argv[2];
+      bSimMagic = (argv[1][1] == 'G');
+      iShift = 2;
+    } else if (strcmp(argv[1], "-L") == 0 && argc > 2) {
+      pcSimLink = argv[2];
+      iShift = 2;
+    } else if (strcmp(argv[1], "-B") == 0 && argc > 2 && atoi(argv[2]) > 0) {
+      szBenchCards = atoi(argv[2]);
+      iShift = 2;
+    } else if (strcmp(argv[1], "-E") == 0 && argc > 2 && (atoi(argv[2]) > 0 || strcmp(argv[2], "0") == 0)) {
+      bLineMode = true;
+      szLineCards = atoi(argv[2]);
+      iShift = 2;
+    } else {
+      print_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    argv[iShift] = argv[0];
+    argv += iShift;
+    argc -= iShift;
+  }
 
   if (argc < 2) {
     print_usage(argv[0]);
     exit(EXIT_FAILURE);
   }
-  const char *command = strtok(argv[1], ",");
+  const char *command = strtok((char *) argv[1], ",");
 
   if (strcmp(command, "r") == 0 || strcmp(command, "R") == 0) {
     if (argc < 4) { 
@@ -578,6 +2395,8 @@ main(int argc, const char *argv[])
       unlock = 1;
     bUseKeyA = tolower((int)((unsigned char) * (argv[2]))) == 'a';
     bTolerateFailures = tolower((int)((unsigned char) * (argv[2]))) != (int)((unsigned char) * (argv[2]));
+    // Unlocked reads hand out both keys anyway
+    bBothKeys = !unlock && bUseKeyA && tolower((int)((unsigned char) argv[2][1])) == 'b';
     bUseKeyFile = (argc > 4);
     bForceKeyFile = ((argc > 5) && (strcmp((char *)argv[5], "f") == 0));
   } else if (strcmp(command, "w") == 0 || strcmp(command, "W") == 0) {
@@ -592,13 +2411,84 @@ main(int argc, const char *argv[])
     bTolerateFailures = tolower((int)((unsigned char) * (argv[2]))) != (int)((unsigned char) * (argv[2]));
     bUseKeyFile = (argc > 4);
     bForceKeyFile = ((argc > 5) && (strcmp((char *)argv[5], "f") == 0));
+  } else if (strcmp(command, "c") == 0 || strcmp(command, "C") == 0) {
+    if (argc < 3) {
+      print_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    atAction = ACTION_CLONE;
+    if (strcmp(command, "C") == 0)
+      unlock = 1;
+    bUseKeyA = tolower((int)((unsigned char) * (argv[2]))) == 'a';
+    bTolerateFailures = tolower((int)((unsigned char) * (argv[2]))) != (int)((unsigned char) * (argv[2]));
+    // The copy needs both keys of every sector and is read back
+    bBothKeys = true;
+    bVerifyWrite = true;
+    // One worker thread reads the source, one writes the copy
+    bMultiDevice = true;
+  } else if (strcmp(command, "v") == 0) {
+    const char *pcBlock = strtok(NULL, ",");
+    const char *pcBackup = strtok(NULL, ",");
+    char *pcEnd;
+    long long llAmount = 0;
+    long lBlock;
+
+    if (argc < 4 || pcBlock == NULL) {
+      print_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    atAction = ACTION_VALUE;
+    lBlock = strtol(pcBlock, &pcEnd, 0);
+    if (*pcEnd != '\0' || lBlock <= 0 || lBlock > 0xff || is_trailer_block(lBlock)) {
+      printf("invalid value block: %s\n", pcBlock);
+      exit(EXIT_FAILURE);
+    }
+    btValueBlock = lBlock;
+    if (pcBackup != NULL) {
+      // The backup is reached under the same authentication
+      lBlock = strtol(pcBackup, &pcEnd, 0);
+      if (*pcEnd != '\0' || lBlock <= 0 || lBlock > 0xff || is_trailer_block(lBlock) || lBlock == btValueBlock
+          || get_trailer_block(lBlock) != get_trailer_block(btValueBlock)) {
+        printf("invalid backup block, it must be another data block of the same sector: %s\n", pcBackup);
+        exit(EXIT_FAILURE);
+      }
+      iValueBackup = lBlock;
+    }
+    switch (argv[3][0]) {
+      case '?':
+        voValue = VALUE_CHECK;
+        break;
+      case '=':
+        voValue = VALUE_SET;
+        break;
+      case '+':
+        voValue = VALUE_CREDIT;
+        break;
+      case '-':
+        voValue = VALUE_DEBIT;
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (voValue != VALUE_CHECK) {
+      llAmount = strtoll(argv[3] + 1, &pcEnd, 0);
+      if (argv[3][1] == '\0' || *pcEnd != '\0' || llAmount > INT32_MAX || llAmount < ((voValue == VALUE_SET) ? INT32_MIN : 0)) {
+        printf("invalid value operation: %s\n", argv[3]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    iValueAmount = llAmount;
+    bUseKeyA = tolower((int)((unsigned char) * (argv[2]))) == 'a';
+    bUseKeyFile = (argc > 4);
+    bForceKeyFile = ((argc > 5) && (strcmp((char *)argv[5], "f") == 0));
   }
 
   char *sector = NULL;
   int isector;
   while ( (sector=strtok(NULL, ",")) != NULL )
   {
-    if ( (isector=atoi(sector))==0 && sector[0]!='0' || isector<0 || isector>39)
+    if ( ((isector=atoi(sector))==0 && sector[0]!='0') || isector<0 || isector>39)
     {
         printf("invalid sector argument: %s\n",sector);
         exit (EXIT_FAILURE);
@@ -615,175 +2505,217 @@ main(int argc, const char *argv[])
     print_usage(argv[0]);
     exit(EXIT_FAILURE);
   }
+  pcDumpFile = (atAction == ACTION_VALUE) ? NULL : argv[3];
+  pcKeysFile = bUseKeyFile ? argv[4] : NULL;
+  bDumpInArchive = (pcDumpFile != NULL && strcmp(pcDumpFile, ARCHIVE_ENTRY) == 0);
+  bKeysInArchive = bUseKeyFile && (strcmp(pcKeysFile, ARCHIVE_ENTRY) == 0);
+
+  if (bDumpInArchive || bKeysInArchive) {
+    if (pcArchive == NULL) {
+      printf("%s needs an archive, see -A\n", ARCHIVE_ENTRY);
+      exit(EXIT_FAILURE);
+    }
+    if ((pmaArchive = mfd_archive_open(pcArchive, bDumpInArchive && (atAction == ACTION_READ || atAction == ACTION_CLONE))) == NULL)
+      exit(EXIT_FAILURE);
+  }
+
+  if (pcKeyDb != NULL && (pmkKeyDb = mf_keydb_open(pcKeyDb)) == NULL)
+    exit(EXIT_FAILURE);
+  if (pcClassFile != NULL && !card_class_load(pcClassFile))
+    exit(EXIT_FAILURE);
+  if (pcLatencyFile != NULL && !latency_load(pcLatencyFile))
+    exit(EXIT_FAILURE);
+  if (pcMetricsFile != NULL && !metrics_start(pcMetricsFile))
+    exit(EXIT_FAILURE);
+  if (pcRecordTrace != NULL && !nfct_record(pcRecordTrace))
+    exit(EXIT_FAILURE);
+  if (pcReplayTrace != NULL && !nfct_replay(pcReplayTrace, bReplayPaced))
+    exit(EXIT_FAILURE);
+  if (pcSimCard != NULL && !mfc_sim_install(pcSimCard, bSimMagic, (atAction == ACTION_CLONE) ? 2 : bMultiDevice ? 4 : 1))
+    exit(EXIT_FAILURE);
+  if ((pcSimLink != NULL || szBenchCards > 0) && pcSimCard == NULL) {
+    ERR("-L and -B need simulated readers (-S or -G)");
+    exit(EXIT_FAILURE);
+  }
+  if (bJournal && (atAction != ACTION_READ || bSkip)) {
+    ERR("-J journals whole sectors of r and R, without a sector list");
+    exit(EXIT_FAILURE);
+  }
+  if (atAction == ACTION_CLONE && (pcDevice != NULL || szBenchCards > 0 || bLineMode)) {
+    ERR("c and C clone from the first reader to the second, without -c, -B or -E");
+    exit(EXIT_FAILURE);
+  }
+  if (bMultiDevice && pcDevice != NULL) {
+    ERR("-c opens a single reader, -m all of them");
+    exit(EXIT_FAILURE);
+  }
+  if (pcSimLink != NULL && !nfct_simulate_link(pcSimLink))
+    exit(EXIT_FAILURE);
+  if (bLineMode && (atAction != ACTION_WRITE || szBenchCards > 0)) {
+    ERR("-E encodes cards, use it with w or W and without -B");
+    exit(EXIT_FAILURE);
+  }
+  // Every card of a line is read back
+  if (bLineMode)
+    bVerifyWrite = true;
+
   // We don't know yet the card size so let's read only the UID from the keyfile for the moment
-  if (bUseKeyFile) {
-    FILE *pfKeys = fopen(argv[4], "rb");
+  if (bUseKeyFile && !bKeysInArchive) {
+    FILE *pfKeys = fopen(pcKeysFile, "rb");
     if (pfKeys == NULL) {
-      printf("Could not open keys file: %s\n", argv[4]);
+      printf("Could not open keys file: %s\n", pcKeysFile);
       exit(EXIT_FAILURE);
     }
-    if (fread(&mtKeys, 1, 4, pfKeys) != 4) {
-      printf("Could not read UID from key file: %s\n", argv[4]);
+    if (fread(abtKeyFileUid, 1, 4, pfKeys) != 4) {
+      printf("Could not read UID from key file: %s\n", pcKeysFile);
       fclose(pfKeys);
       exit(EXIT_FAILURE);
     }
     fclose(pfKeys);
   }
+  if (unlock)
+    build_magic_frames();
+  // A line reads its files once, not once per card
+  if (bLineMode) {
+    if (!bDumpInArchive && (szLineDumpBlocks = load_tag(pcDumpFile, &mtLineDump)) == 0)
+      exit(EXIT_FAILURE);
+    if (bUseKeyFile && !bKeysInArchive && (szLineKeyBlocks = load_tag(pcKeysFile, &mtLineKeys)) == 0)
+      exit(EXIT_FAILURE);
+    signal(SIGINT, stop_line);
+    signal(SIGTERM, stop_line);
+  }
   nfc_init(&context);
   if (context == NULL) {
     ERR("Unable to init libnfc (malloc)");
     exit(EXIT_FAILURE);
   }
 
-// Try to open the NFC reader
-  pnd = nfc_open(context, NULL);
-  if (pnd == NULL) {
-    ERR("Error opening NFC reader");
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
-  }
-
-  if (nfc_initiator_init(pnd) < 0) {
-    nfc_perror(pnd, "nfc_initiator_init");
-    nfc_close(pnd);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
-  };
-
-// Let the reader only try once to find a tag
-  if (nfc_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
-    nfc_close(pnd);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
-  }
-// Disable ISO14443-4 switching in order to read devices that emulate Mifare Classic with ISO14443-4 compliance.
-  nfc_device_set_property_bool(pnd, NP_AUTO_ISO14443_4, false);
-
-  printf("NFC reader: %s opened\n", nfc_device_get_name(pnd));
-
-// Try to find a MIFARE Classic tag
-  if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) <= 0) {
-    printf("Error: no tag was found\n");
-    nfc_close(pnd);
+  // Sessions hold several full 4K images each, keep them off the stack
+  sessions = calloc(MAX_DEVICE_COUNT, sizeof(struct mfc_session));
+  if (sessions == NULL) {
+    ERR("Unable to allocate sessions (malloc)");
     nfc_exit(context);
     exit(EXIT_FAILURE);
   }
-// Test if we are dealing with a MIFARE compatible tag
-  if ((nt.nti.nai.btSak & 0x08) == 0) {
-    printf("Warning: tag is probably not a MFC!\n");
-  }
 
-// Get the info from the current tag
-  pbtUID = nt.nti.nai.abtUid;
+  if (bMultiDevice) {
+    nfc_connstring connstrings[MAX_DEVICE_COUNT];
+    size_t szFound = nfct_list_devices(context, connstrings, MAX_DEVICE_COUNT);
 
-  if (bUseKeyFile) {
-    uint8_t fileUid[4];
-    memcpy(fileUid, mtKeys.amb[0].mbm.abtUID, 4);
-// Compare if key dump UID is the same as the current tag UID, at least for the first 4 bytes
-    if (memcmp(pbtUID, fileUid, 4) != 0) {
-      printf("Expected MIFARE Classic card with UID starting as: %02x%02x%02x%02x\n",
-             fileUid[0], fileUid[1], fileUid[2], fileUid[3]);
-      printf("Got card with UID starting as:                     %02x%02x%02x%02x\n",
-             pbtUID[0], pbtUID[1], pbtUID[2], pbtUID[3]);
-      if (! bForceKeyFile) {
-        printf("Aborting!\n");
-        nfc_close(pnd);
+    for (size_t i = 0; i < szFound && !(atAction == ACTION_CLONE && szDevices == 2); i++) {
+      nfc_device *pnd = nfct_open(context, connstrings[i]);
+      if (pnd == NULL) {
+        ERR("Unable to open NFC device: %s", connstrings[i]);
+        continue;
+      }
+      if (!init_device(pnd)) {
+        nfct_close(pnd);
+        continue;
+      }
+      sessions[szDevices].pnd = pnd;
+      sessions[szDevices].szDevice = szDevices;
+      szDevices++;
+    }
+  } else {
+// Try to open the NFC reader
+    nfc_device *pnd = nfct_open_cached(context, pcDevice);
+    if (pnd != NULL) {
+      if (init_device(pnd)) {
+        sessions[0].pnd = pnd;
+        szDevices = 1;
+      } else {
+        nfct_close(pnd);
+        free(sessions);
         nfc_exit(context);
         exit(EXIT_FAILURE);
       }
     }
   }
-  printf("Found MIFARE Classic card:\n");
-  print_nfc_target(&nt, false);
 
-// Guessing size
-  if ((nt.nti.nai.abtAtqa[1] & 0x02) == 0x02)
-// 4K
-    uiBlocks = 0xff;
-  else if ((nt.nti.nai.btSak & 0x01) == 0x01)
-// 320b
-    uiBlocks = 0x13;
-  else
-// 1K/2K, checked through RATS
-    uiBlocks = 0x3f;
-// Testing RATS
-  int res;
-  if ((res = get_rats()) > 0) {
-    if ((res >= 10) && (abtRx[5] == 0xc1) && (abtRx[6] == 0x05)
-        && (abtRx[7] == 0x2f) && (abtRx[8] == 0x2f)
-        && ((nt.nti.nai.abtAtqa[1] & 0x02) == 0x00)) {
-      // MIFARE Plus 2K
-      uiBlocks = 0x7f;
-    }
-    // Chinese magic emulation card, ATS=0978009102:dabc1910
-    if ((res == 9)  && (abtRx[5] == 0xda) && (abtRx[6] == 0xbc)
-        && (abtRx[7] == 0x19) && (abtRx[8] == 0x10)) {
-      magic2 = true;
-    }
+  if (szDevices == 0) {
+    ERR("Error opening NFC reader");
+    free(sessions);
+    nfc_exit(context);
+    exit(EXIT_FAILURE);
   }
-  printf("Guessing size: seems to be a %i-byte card\n", (uiBlocks + 1) * 16);
-
-  if (bUseKeyFile) {
-    FILE *pfKeys = fopen(argv[4], "rb");
-    if (pfKeys == NULL) {
-      printf("Could not open keys file: %s\n", argv[4]);
-      exit(EXIT_FAILURE);
-    }
-    if (fread(&mtKeys, 1, (uiBlocks + 1) * sizeof(mifare_classic_block), pfKeys) != (uiBlocks + 1) * sizeof(mifare_classic_block)) {
-      printf("Could not read keys file: %s\n", argv[4]);
-      fclose(pfKeys);
+  if (atAction == ACTION_CLONE) {
+    if (szDevices < 2) {
+      ERR("Cloning needs two readers, %zu opened", szDevices);
+      nfct_close(sessions[0].pnd);
+      free(sessions);
+      nfc_exit(context);
       exit(EXIT_FAILURE);
     }
-    fclose(pfKeys);
+    handover.psSource = &sessions[0];
+    printf("Cloning the card on reader 0 to the card on reader 1\n");
   }
 
-  if (atAction == ACTION_READ) {
-    memset(&mtDump, 0x00, sizeof(mtDump));
-  } else {
-    FILE *pfDump = fopen(argv[3], "rb");
-
-    if (pfDump == NULL) {
-      printf("Could not open dump file: %s\n", argv[3]);
-      exit(EXIT_FAILURE);
-
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tsCpuStart);
+  if (bMultiDevice) {
+    for (size_t i = 0; i < szDevices; i++) {
+      if (pthread_create(&threads[i], NULL, session_thread, &sessions[i]) != 0) {
+        ERR("Unable to start worker for reader %zu", i);
+        nfct_close(sessions[i].pnd);
+        sessions[i].pnd = NULL;
+        totals.szCardsFailed++;
+        // Nothing will be handed over, do not leave the destination waiting
+        if (handover.psSource == &sessions[i])
+          handover_post(&handover.bDone);
+      }
     }
-
-    if (fread(&mtDump, 1, (uiBlocks + 1) * sizeof(mifare_classic_block), pfDump) != (uiBlocks + 1) * sizeof(mifare_classic_block)) {
-      printf("Could not read dump file: %s\n", argv[3]);
-      fclose(pfDump);
-      exit(EXIT_FAILURE);
+    for (size_t i = 0; i < szDevices; i++) {
+      if (sessions[i].pnd != NULL)
+        pthread_join(threads[i], NULL);
     }
-    fclose(pfDump);
+  } else {
+    session_thread(&sessions[0]);
   }
-// printf("Successfully opened required files\n");
 
-  if (atAction == ACTION_READ) {
-    if (read_card(unlock)) {
-      printf("Writing data to file: %s ...", argv[3]);
-      fflush(stdout);
-      FILE *pfDump = fopen(argv[3], "wb");
-      if (pfDump == NULL) {
-        printf("Could not open dump file: %s\n", argv[3]);
-        nfc_close(pnd);
-        nfc_exit(context);
-        exit(EXIT_FAILURE);
-      }
-      if (fwrite(&mtDump, 1, (uiBlocks + 1) * sizeof(mifare_classic_block), pfDump) != ((uiBlocks + 1) * sizeof(mifare_classic_block))) {
-        printf("\nCould not write to file: %s\n", argv[3]);
-        fclose(pfDump);
-        nfc_close(pnd);
-        nfc_exit(context);
-        exit(EXIT_FAILURE);
-      }
-      printf("Done.\n");
-      fclose(pfDump);
-    }
-  } else if (atAction == ACTION_WRITE) {
-    write_card(unlock);
+  if (bMultiDevice) {
+    double dElapsed = elapsed_seconds(&tsStart);
+    printf("%zu reader(s): %zu card(s) done, %zu failed, %u blocks in %.2f s",
+           szDevices, totals.szCardsOk, totals.szCardsFailed, totals.uiBlocks, dElapsed);
+    if (dElapsed > 0)
+      printf(" (%.1f cards/min)", totals.szCardsOk * 60.0 / dElapsed);
+    printf("\n");
+    // Overlapped, the clone takes about as long as the slower of the two cards
+    if (atAction == ACTION_CLONE)
+      printf("Clone in %.2f s: reading the source %.2f s, writing the copy %.2f s besides %.2f s waiting for the source\n",
+             dElapsed, (sessions[0].adPhaseMs[PHASE_SETUP] + sessions[0].adPhaseMs[PHASE_ENCODE]) / 1000,
+             (sessions[1].adPhaseMs[PHASE_SETUP] + sessions[1].adPhaseMs[PHASE_ENCODE] + sessions[1].adPhaseMs[PHASE_VERIFY]
+              - sessions[1].dHandoverMs) / 1000, sessions[1].dHandoverMs / 1000);
   }
+  if (szBenchCards > 0)
+    print_benchmark(szDevices, elapsed_seconds(&tsStart), &tsCpuStart);
+  if (bLineMode)
+    print_line_report(szDevices, elapsed_seconds(&tsStart));
+
+  if (bDumpInArchive && (atAction == ACTION_READ || atAction == ACTION_CLONE)) {
+    size_t szDumps, szUniqueBlocks;
+    mfd_archive_stats(pmaArchive, &szDumps, &szUniqueBlocks);
+    printf("Archive %s: %zu card(s), %zu unique blocks\n", pcArchive, szDumps, szUniqueBlocks);
+  }
+  mfd_archive_close(pmaArchive);
+  mf_keydb_close(pmkKeyDb);
+
+  if (pcClassFile != NULL)
+    card_class_save(pcClassFile);
+  if (pcLatencyFile != NULL) {
+    printf("Learned timeouts:\n");
+    latency_print();
+    latency_save(pcLatencyFile);
+  }
+  metrics_write();
 
-  nfc_close(pnd);
+  for (size_t i = 0; i < szDevices; i++) {
+    if (sessions[i].pnd != NULL) {
+      latency_detach(sessions[i].pnd);
+      nfct_close(sessions[i].pnd);
+    }
+  }
+  nfct_finish();
+  free(sessions);
   nfc_exit(context);
-  exit(EXIT_SUCCESS);
+  exit((totals.szCardsFailed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
 }
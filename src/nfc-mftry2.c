@@ -43,26 +43,711 @@
 #endif // HAVE_CONFIG_H
 
 #include <err.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <nfc/nfc.h>
 
 #include "nfc-utils.h"
+#include "crapto1.h"
+#include "iso-dep.h"
+#include "mfc-sim.h"
 #include "mifare.h"
+#include "nfc-transport.h"
 
 #define MAX_DEVICE_COUNT 16
 #define MAX_TARGET_COUNT 16
 
+// AutoPoll counts its period in units of 150 ms
+#define POLL_PERIOD_UNIT_MS 150
+#define DEFAULT_POLL_PERIOD_MS 50
+
+// Audit polls for the next card and for the last one to leave this often
+#define AUDIT_POLL_MS 20
+#define AUDIT_MAX_SECTORS 40
+
 static nfc_device *pnd;
+static volatile sig_atomic_t bStopInventory = 0;
+static bool bSimulated = false;
+
+static const nfc_modulation nmAudit = {
+  .nmt = NMT_ISO14443A,
+  .nbr = NBR_106,
+};
+
+// Audit dictionary when no other is given
+static uint8_t abtDefaultKeys[] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xd3, 0xf7, 0xd3, 0xf7, 0xd3, 0xf7,
+  0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5,
+  0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5,
+  0x4d, 0x3a, 0x99, 0xc3, 0x51, 0xdd,
+  0x1a, 0x98, 0x2c, 0x7e, 0x45, 0x9a,
+  0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xab, 0xcd, 0xef, 0x12, 0x34, 0x56
+};
+
+static uint8_t *pbtKeys = abtDefaultKeys;
+static size_t szKeys = sizeof(abtDefaultKeys) / 6;
+static size_t *pszKeyHits;       // sectors each key opened on the cards audited so far
+static size_t *pszKeyOrder;      // dictionary order of the sweep, most hits first
+
+typedef enum {
+  PRNG_UNKNOWN,
+  PRNG_WEAK,                     // 16-bit LFSR nonces, open to the nested and darkside attacks
+  PRNG_HARDENED
+} audit_prng;
+
+static const char *apcPrng[] = { "-", "weak", "hardened" };
+
+// What the audit found out about a card
+struct audit_card {
+  nfc_target nt;
+  uint8_t uiBlocks;
+  uint32_t uiSectors;
+  bool bGen1;
+  bool bGen2;
+  audit_prng ap;
+  uint64_t aui64Found[2];        // one bit per sector with key A, key B found
+  uint8_t aaabtKeys[AUDIT_MAX_SECTORS][2][6];
+  uint8_t aabtLast[2][6];        // the key A, key B that opened a sector last
+  bool abLast[2];
+  uint32_t uiAuths;
+  uint32_t uiWakes;
+};
+
+struct modulation_name {
+  const char *pcName;
+  nfc_modulation nm;
+};
+
+// Same sweep, in the same order, as the one-shot listing
+static const struct modulation_name anmInventory[] = {
+  { "a",     { .nmt = NMT_ISO14443A,    .nbr = NBR_106 } },
+  { "f212",  { .nmt = NMT_FELICA,       .nbr = NBR_212 } },
+  { "f424",  { .nmt = NMT_FELICA,       .nbr = NBR_424 } },
+  { "b",     { .nmt = NMT_ISO14443B,    .nbr = NBR_106 } },
+  { "bi",    { .nmt = NMT_ISO14443BI,   .nbr = NBR_106 } },
+  { "sr",    { .nmt = NMT_ISO14443B2SR, .nbr = NBR_106 } },
+  { "ct",    { .nmt = NMT_ISO14443B2CT, .nbr = NBR_106 } },
+  { "jewel", { .nmt = NMT_JEWEL,        .nbr = NBR_106 } },
+};
+#define INVENTORY_MODULATION_COUNT (sizeof(anmInventory) / sizeof(anmInventory[0]))
 
 static void
 print_usage(const char *progname)
 {
-  printf("usage: %s [-v]\n", progname);
+  printf("usage: %s [-c <device>] [-v|-t [-S|-G <card>]|-i [-m <list>] [-p <ms>]|-a <log> [-k <keys>] [-n <cards>] [-S|-G <card>]]\n", progname);
+  printf("  -c\t open the reader with this libnfc connection string instead of listing every reader,\n");
+  printf("    \t without it -t, -i and -a try the reader that last opened on this host before scanning\n");
   printf("  -v\t verbose display\n");
+  printf("  -t\t test the default key on block 0 of a MIFARE Classic 1K\n");
+  printf("  -S\t run the test against a simulated reader and card instead,\n");
+  printf("    \t <card> is a 1K or 4K dump, or 1k or 4k for a blank card\n");
+  printf("  -G\t same with a gen1 magic card\n");
+  printf("  -i\t inventory mode: keep the reader open and report tag arrivals and departures\n");
+  printf("  -m\t comma separated modulations to poll in inventory mode (default: all)\n");
+  printf("    \t a, f212, f424, b, bi, sr, ct, jewel\n");
+  printf("  -p\t inventory poll period in milliseconds (default: %d)\n", DEFAULT_POLL_PERIOD_MS);
+  printf("  -a\t audit mode: keep the reader open, classify each MIFARE Classic card presented (size, magic\n");
+  printf("    \t type, PRNG), look for key A and B of every sector and append a line to <log>\n");
+  printf("  -k\t audit dictionary, one 12 hex digit key per line (default: %zu common keys)\n", sizeof(abtDefaultKeys) / 6);
+  printf("  -n\t stop the audit after <cards> cards (default: when interrupted)\n");
+}
+
+static void
+stop_inventory(int sig)
+{
+  (void) sig;
+  bStopInventory = 1;
+  if (pnd != NULL)
+    nfc_abort_command(pnd);
+}
+
+static size_t
+parse_modulations(char *pcList, nfc_modulation *pnm)
+{
+  size_t szCount = 0;
+  char *pcName;
+
+  for (pcName = strtok(pcList, ","); pcName != NULL; pcName = strtok(NULL, ",")) {
+    size_t n;
+    for (n = 0; n < INVENTORY_MODULATION_COUNT; n++) {
+      if (strcmp(pcName, anmInventory[n].pcName) == 0)
+        break;
+    }
+    if (n == INVENTORY_MODULATION_COUNT || szCount == INVENTORY_MODULATION_COUNT)
+      return 0;
+    pnm[szCount++] = anmInventory[n].nm;
+  }
+  return szCount;
+}
+
+static size_t
+target_id(const nfc_target *pnt, char *pcId, size_t szId)
+{
+  const uint8_t *pbtId;
+  size_t szLen, n;
+  int w = 0;
+
+  switch (pnt->nm.nmt) {
+    case NMT_ISO14443A:
+      pbtId = pnt->nti.nai.abtUid;
+      szLen = pnt->nti.nai.szUidLen;
+      break;
+    case NMT_FELICA:
+      pbtId = pnt->nti.nfi.abtId;
+      szLen = sizeof(pnt->nti.nfi.abtId);
+      break;
+    case NMT_ISO14443B:
+      pbtId = pnt->nti.nbi.abtPupi;
+      szLen = sizeof(pnt->nti.nbi.abtPupi);
+      break;
+    case NMT_ISO14443BI:
+      pbtId = pnt->nti.nii.abtDIV;
+      szLen = sizeof(pnt->nti.nii.abtDIV);
+      break;
+    case NMT_ISO14443B2SR:
+      pbtId = pnt->nti.nsi.abtUID;
+      szLen = sizeof(pnt->nti.nsi.abtUID);
+      break;
+    case NMT_ISO14443B2CT:
+      pbtId = pnt->nti.nci.abtUID;
+      szLen = sizeof(pnt->nti.nci.abtUID);
+      break;
+    case NMT_JEWEL:
+      pbtId = pnt->nti.nji.btId;
+      szLen = sizeof(pnt->nti.nji.btId);
+      break;
+    default:
+      szLen = 0;
+      pbtId = NULL;
+      break;
+  }
+  pcId[0] = '\0';
+  for (n = 0; n < szLen && (size_t)(w + 3) <= szId; n++)
+    w += snprintf(pcId + w, szId - w, "%02x", pbtId[n]);
+  return n;
+}
+
+static void
+print_event(const char *pcEvent, const nfc_target *pnt, long lDwellMs)
+{
+  struct timespec ts;
+  struct tm tm;
+  char acTime[32];
+  char acId[32];
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  localtime_r(&ts.tv_sec, &tm);
+  strftime(acTime, sizeof(acTime), "%Y-%m-%dT%H:%M:%S", &tm);
+  target_id(pnt, acId, sizeof(acId));
+
+  printf("%s.%03ld %s %s %s", acTime, ts.tv_nsec / 1000000, pcEvent,
+         str_nfc_modulation_type(pnt->nm.nmt), acId);
+  if (lDwellMs >= 0)
+    printf(" dwell=%ldms", lDwellMs);
+  printf("\n");
+  // Consumers read events from a pipe, don't let them sit in a buffer
+  fflush(stdout);
+}
+
+static long
+elapsed_ms(const struct timespec *ptsFrom)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - ptsFrom->tv_sec) * 1000 + (ts.tv_nsec - ptsFrom->tv_nsec) / 1000000;
+}
+
+static void
+sleep_ms(long lMs)
+{
+  struct timespec ts = { .tv_sec = lMs / 1000, .tv_nsec = (lMs % 1000) * 1000000 };
+  while (nanosleep(&ts, &ts) < 0 && !bStopInventory)
+    ;
+}
+
+/*
+ * Inventory loop: wait for a tag with the configured modulations, then watch
+ * it with a presence check (no full poll) until it leaves the field.
+ *
+ * AutoPoll cannot wait less than one 150 ms period per modulation, which is
+ * too slow for tap-to-event latency, so shorter periods single-shot select
+ * each modulation in turn, like libnfc does on chips without AutoPoll.
+ */
+static int
+run_inventory(const nfc_modulation *pnm, size_t szModulations, long lPeriodMs)
+{
+  nfc_target nt;
+  struct timespec tsArrival;
+  bool bPresent = false;
+  // 1 to 15 polling periods, clamped before the sum can overflow or the count be narrowed
+  long lPeriods = (lPeriodMs < 15 * POLL_PERIOD_UNIT_MS) ? (lPeriodMs + POLL_PERIOD_UNIT_MS - 1) / POLL_PERIOD_UNIT_MS : 15;
+  uint8_t uiPeriod = (lPeriods < 1) ? 1 : (uint8_t) lPeriods;
+  int res;
+
+  if (nfc_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0) {
+    nfc_perror(pnd, "nfc_device_set_property_bool");
+    return -1;
+  }
+
+  signal(SIGINT, stop_inventory);
+  signal(SIGTERM, stop_inventory);
+
+  while (!bStopInventory) {
+    if (bPresent) {
+      if (nfc_initiator_target_is_present(pnd, &nt) == NFC_SUCCESS) {
+        sleep_ms(lPeriodMs);
+        continue;
+      }
+      if (bStopInventory)
+        break;
+      print_event("departed", &nt, elapsed_ms(&tsArrival));
+      bPresent = false;
+      continue;
+    }
+
+    res = 0;
+    if (lPeriodMs < POLL_PERIOD_UNIT_MS) {
+      for (size_t n = 0; n < szModulations && res <= 0 && !bStopInventory; n++)
+        res = nfc_initiator_select_passive_target(pnd, pnm[n], NULL, 0, &nt);
+      if (res <= 0)
+        sleep_ms(lPeriodMs);
+    } else {
+      res = nfc_initiator_poll_target(pnd, pnm, szModulations, 1, uiPeriod, &nt);
+    }
+
+    if (res > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &tsArrival);
+      print_event("arrived", &nt, -1);
+      bPresent = true;
+    } else if (res < 0 && res != NFC_ETIMEOUT && res != NFC_EOPABORTED) {
+      nfc_perror(pnd, "nfc_initiator_poll_target");
+      return res;
+    }
+  }
+  if (bPresent)
+    print_event("departed", &nt, elapsed_ms(&tsArrival));
+  return 0;
+}
+
+// Dictionary order of the audit: keys that opened more sectors first, else as listed
+static int
+compare_key_hits(const void *pv1, const void *pv2)
+{
+  size_t sz1 = *(const size_t *) pv1, sz2 = *(const size_t *) pv2;
+
+  if (pszKeyHits[sz1] != pszKeyHits[sz2])
+    return (pszKeyHits[sz1] > pszKeyHits[sz2]) ? -1 : 1;
+  return (sz1 > sz2) - (sz1 < sz2);
+}
+
+// One 12 hex digit key per line, # starts a comment
+static bool
+load_dictionary(const char *pcPath)
+{
+  char acLine[128];
+  FILE *pf;
+
+  if ((pf = fopen(pcPath, "r")) == NULL) {
+    ERR("Could not open dictionary: %s", pcPath);
+    return false;
+  }
+  pbtKeys = NULL;
+  szKeys = 0;
+  while (fgets(acLine, sizeof(acLine), pf) != NULL) {
+    char *pc = acLine + strspn(acLine, " \t");
+    unsigned int auiKey[6];
+    uint8_t *pbt;
+
+    pc[strcspn(pc, "\r\n")] = '\0';
+    if (*pc == '#' || *pc == '\0')
+      continue;
+    if (strspn(pc, "0123456789abcdefABCDEF") != 12
+        || sscanf(pc, "%2x%2x%2x%2x%2x%2x", &auiKey[0], &auiKey[1], &auiKey[2], &auiKey[3], &auiKey[4], &auiKey[5]) != 6) {
+      ERR("Invalid key in dictionary %s: %s", pcPath, pc);
+      fclose(pf);
+      return false;
+    }
+    if ((pbt = realloc(pbtKeys, (szKeys + 1) * 6)) == NULL) {
+      ERR("Unable to allocate dictionary (malloc)");
+      fclose(pf);
+      return false;
+    }
+    pbtKeys = pbt;
+    for (int n = 0; n < 6; n++)
+      pbtKeys[szKeys * 6 + n] = auiKey[n];
+    szKeys++;
+  }
+  fclose(pf);
+  if (szKeys == 0) {
+    ERR("No keys in dictionary: %s", pcPath);
+    return false;
+  }
+  return true;
+}
+
+static uint32_t
+sector_trailer(uint32_t uiSector)
+{
+  return (uiSector < 32) ? uiSector * 4 + 3 : 128 + (uiSector - 32) * 16 + 15;
+}
+
+// Wake the card muted by a wrong key or a probe, a full select is only the fallback
+static bool
+audit_wake(struct audit_card *pac)
+{
+  pac->uiWakes++;
+  if (nfc_initiator_mifare_reactivate(pnd, &pac->nt))
+    return true;
+  return nfct_initiator_select_passive_target(pnd, nmAudit, pac->nt.nti.nai.abtUid, pac->nt.nti.nai.szUidLen, &pac->nt) > 0;
+}
+
+// Size from ATQA and SAK, MIFARE Plus 2K and gen2 magic cards from the ATS
+//
+// A gen2 card has the ATQA and SAK of the card it copies, so every card is asked.
+static bool
+audit_classify(struct audit_card *pac)
+{
+  iso_dep *pid;
+  const uint8_t *pbtAts;
+  size_t szAts;
+  int res;
+
+  pac->bGen2 = false;
+  if ((pac->nt.nti.nai.abtAtqa[1] & 0x02) == 0x02)
+    pac->uiBlocks = 0xff;
+  else if ((pac->nt.nti.nai.btSak & 0x01) == 0x01)
+    pac->uiBlocks = 0x13;
+  else
+    pac->uiBlocks = 0x3f;
+  if ((pid = iso_dep_activate(pnd, 0, &res)) != NULL) {
+    pbtAts = iso_dep_ats(pid, &szAts);
+    if (szAts >= 10 && pbtAts[5] == 0xc1 && pbtAts[6] == 0x05 && pbtAts[7] == 0x2f && pbtAts[8] == 0x2f
+        && (pac->nt.nti.nai.abtAtqa[1] & 0x02) == 0x00)
+      pac->uiBlocks = 0x7f;
+    if (szAts == 9 && pbtAts[5] == 0xda && pbtAts[6] == 0xbc && pbtAts[7] == 0x19 && pbtAts[8] == 0x10)
+      pac->bGen2 = true;
+    iso_dep_free(pid);
+    // Back from ISO14443-4 to ISO14443-3
+    nfct_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
+    nfct_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true);
+  }
+  pac->uiWakes++;
+  return nfct_initiator_select_passive_target(pnd, nmAudit, NULL, 0, &pac->nt) > 0;
+}
+
+// Gen1 magic cards acknowledge the backdoor command 0x40 after HLTA
+static bool
+audit_probe_gen1(struct audit_card *pac)
+{
+  uint8_t abtHalt[4] = { 0x50, 0x00 };
+  uint8_t abtUnlock[1] = { 0x40 };
+  uint8_t abtRx[4];
+  int res = -1;
+
+  if (nfct_device_set_property_bool(pnd, NP_HANDLE_CRC, false) >= 0
+      && nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, false) >= 0) {
+    iso14443a_crc_append(abtHalt, 2);
+    nfct_initiator_transceive_bytes(pnd, abtHalt, sizeof(abtHalt), NULL, 0, 0);
+    res = nfct_initiator_transceive_bits(pnd, abtUnlock, 7, NULL, abtRx, sizeof(abtRx), NULL);
+  }
+  nfct_device_set_property_bool(pnd, NP_HANDLE_CRC, true);
+  nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, true);
+  pac->bGen1 = (res == 4 && (abtRx[0] & 0x0f) == 0x0a);
+  return audit_wake(pac);
+}
+
+// The nonce of the classic PRNG is 32 bits of a 16-bit LFSR, its low half follows from the high half
+static bool
+audit_probe_prng(struct audit_card *pac)
+{
+  uint8_t abtAuth[2] = { MC_AUTH_A, 0x00 };
+  uint8_t abtNonce[4];
+  uint32_t uiNonce;
+  int res = -1;
+
+  if (nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, false) >= 0)
+    res = nfct_initiator_transceive_bytes(pnd, abtAuth, sizeof(abtAuth), abtNonce, sizeof(abtNonce), 0);
+  nfct_device_set_property_bool(pnd, NP_EASY_FRAMING, true);
+  pac->ap = PRNG_UNKNOWN;
+  if (res == 4) {
+    uiNonce = (uint32_t) abtNonce[0] << 24 | (uint32_t) abtNonce[1] << 16 | (uint32_t) abtNonce[2] << 8 | abtNonce[3];
+    pac->ap = ((prng_successor(uiNonce >> 16, 16) & 0xffff) == (uiNonce & 0xffff)) ? PRNG_WEAK : PRNG_HARDENED;
+  }
+  // The card waits for the answer of the reader, it takes nothing else
+  return audit_wake(pac);
+}
+
+// Try one key on a sector, the card is awake again after a wrong one
+static bool
+audit_auth(struct audit_card *pac, uint32_t uiSector, int iKey, const uint8_t *pbtKey, bool *pbLost)
+{
+  mifare_param mp;
+
+  memcpy(mp.mpa.abtKey, pbtKey, 6);
+  memcpy(mp.mpa.abtAuthUid, pac->nt.nti.nai.abtUid + pac->nt.nti.nai.szUidLen - 4, 4);
+  pac->uiAuths++;
+  if (nfc_initiator_mifare_cmd(pnd, iKey ? MC_AUTH_B : MC_AUTH_A, sector_trailer(uiSector), &mp)) {
+    memcpy(pac->aaabtKeys[uiSector][iKey], pbtKey, 6);
+    pac->aui64Found[iKey] |= 1ULL << uiSector;
+    memcpy(pac->aabtLast[iKey], pbtKey, 6);
+    pac->abLast[iKey] = true;
+    return true;
+  }
+  if (!audit_wake(pac))
+    *pbLost = true;
+  return false;
+}
+
+/*
+ * Keys A and B of a sector, false when the card is gone.
+ *
+ * A wrong key mutes the card and costs a wake-up besides the authentication,
+ * so keys likely to open the sector go first: the one that opened the
+ * previous sector, key A of the sector when looking for key B, then the
+ * dictionary in order of the sectors each key opened on the cards audited so
+ * far. Key B is read from the trailer instead when the access bits hand it out.
+ */
+static bool
+audit_sector(struct audit_card *pac, uint32_t uiSector)
+{
+  const uint8_t *apbtFirst[2];
+  mifare_param mp;
+  bool bLost = false;
+
+  for (int iKey = 0; iKey < 2; iKey++) {
+    size_t szFirst = 0;
+
+    if (pac->aui64Found[iKey] & (1ULL << uiSector))
+      continue;
+    if (pac->abLast[iKey])
+      apbtFirst[szFirst++] = pac->aabtLast[iKey];
+    if (iKey == 1 && (pac->aui64Found[0] & (1ULL << uiSector))
+        && !(szFirst > 0 && memcmp(apbtFirst[0], pac->aaabtKeys[uiSector][0], 6) == 0))
+      apbtFirst[szFirst++] = pac->aaabtKeys[uiSector][0];
+    for (size_t n = 0; n < szFirst; n++) {
+      if (audit_auth(pac, uiSector, iKey, apbtFirst[n], &bLost))
+        break;
+      if (bLost)
+        return false;
+    }
+    for (size_t n = 0; n < szKeys && !(pac->aui64Found[iKey] & (1ULL << uiSector)); n++) {
+      const uint8_t *pbtKey = pbtKeys + pszKeyOrder[n] * 6;
+      bool bTried = false;
+
+      for (size_t m = 0; m < szFirst; m++)
+        bTried = bTried || memcmp(pbtKey, apbtFirst[m], 6) == 0;
+      if (bTried)
+        continue;
+      if (audit_auth(pac, uiSector, iKey, pbtKey, &bLost))
+        pszKeyHits[pszKeyOrder[n]]++;
+      else if (bLost)
+        return false;
+    }
+    if (iKey == 0 && (pac->aui64Found[0] & (1ULL << uiSector))) {
+      // Key A reads the trailer, key B comes along when the access bits hand it out
+      if (!nfc_initiator_mifare_cmd(pnd, MC_READ, sector_trailer(uiSector), &mp)) {
+        if (!audit_wake(pac))
+          return false;
+      } else if ((mp.mpd.abtData[7] & 0x80) == 0 && (mp.mpd.abtData[8] & 0x88) != 0x88) {
+        memcpy(pac->aaabtKeys[uiSector][1], mp.mpd.abtData + 10, 6);
+        pac->aui64Found[1] |= 1ULL << uiSector;
+      }
+    }
+  }
+  return true;
+}
+
+// Classify the selected card and sweep its sectors, false when it left before the end
+static bool
+audit_card(struct audit_card *pac)
+{
+  pac->uiAuths = 0;
+  pac->uiWakes = 0;
+  pac->bGen1 = false;
+  pac->ap = PRNG_UNKNOWN;
+  pac->aui64Found[0] = pac->aui64Found[1] = 0;
+  pac->abLast[0] = pac->abLast[1] = false;
+  pac->uiSectors = 0;
+  if (!audit_classify(pac) || !audit_probe_gen1(pac) || !audit_probe_prng(pac))
+    return false;
+  for (size_t n = 0; n < szKeys; n++)
+    pszKeyOrder[n] = n;
+  qsort(pszKeyOrder, szKeys, sizeof(size_t), compare_key_hits);
+  pac->uiSectors = (pac->uiBlocks < 128) ? (pac->uiBlocks + 1) / 4 : 32 + (pac->uiBlocks + 1 - 128) / 16;
+  for (uint32_t uiSector = 0; uiSector < pac->uiSectors; uiSector++) {
+    if (!audit_sector(pac, uiSector))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * One tab separated line per card: time, UID, ATQA, SAK, bytes, magic type,
+ * PRNG, whether the sweep got to the end, keys found, the distinct keys and
+ * for each sector the place of its keys A and B among them.
+ */
+static void
+audit_log(FILE *pfLog, const struct audit_card *pac, bool bDone)
+{
+  static const char acPlaces[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  const uint8_t *apbtDistinct[sizeof(acPlaces) - 1];
+  size_t szDistinct = 0;
+  char acMap[2 * AUDIT_MAX_SECTORS + 1];
+  char acTime[32];
+  struct tm tm;
+  time_t t = time(NULL);
+  int iFound = 0;
+
+  for (uint32_t uiSector = 0; uiSector < pac->uiSectors; uiSector++) {
+    for (int iKey = 0; iKey < 2; iKey++) {
+      const uint8_t *pbtKey = pac->aaabtKeys[uiSector][iKey];
+      size_t n;
+
+      acMap[uiSector * 2 + iKey] = '-';
+      if (!(pac->aui64Found[iKey] & (1ULL << uiSector)))
+        continue;
+      iFound++;
+      for (n = 0; n < szDistinct && memcmp(apbtDistinct[n], pbtKey, 6) != 0; n++)
+        ;
+      if (n == szDistinct && szDistinct < sizeof(apbtDistinct) / sizeof(apbtDistinct[0]))
+        apbtDistinct[szDistinct++] = pbtKey;
+      acMap[uiSector * 2 + iKey] = (n < szDistinct) ? acPlaces[n] : '*';
+    }
+  }
+  acMap[pac->uiSectors * 2] = '\0';
+
+  localtime_r(&t, &tm);
+  strftime(acTime, sizeof(acTime), "%Y-%m-%dT%H:%M:%S", &tm);
+  fprintf(pfLog, "%s\t", acTime);
+  for (size_t n = 0; n < pac->nt.nti.nai.szUidLen; n++)
+    fprintf(pfLog, "%02x", pac->nt.nti.nai.abtUid[n]);
+  fprintf(pfLog, "\t%02x%02x\t%02x\t%d\t%s\t%s\t%s\t%d/%u\t", pac->nt.nti.nai.abtAtqa[0], pac->nt.nti.nai.abtAtqa[1],
+          pac->nt.nti.nai.btSak, (pac->uiBlocks + 1) * 16, pac->bGen1 ? "gen1" : pac->bGen2 ? "gen2" : "-",
+          apcPrng[pac->ap], bDone ? "done" : "lost", iFound, pac->uiSectors * 2);
+  for (size_t n = 0; n < szDistinct; n++)
+    fprintf(pfLog, "%s%02x%02x%02x%02x%02x%02x", (n > 0) ? "," : "", apbtDistinct[n][0], apbtDistinct[n][1],
+            apbtDistinct[n][2], apbtDistinct[n][3], apbtDistinct[n][4], apbtDistinct[n][5]);
+  fprintf(pfLog, "%s\t%s\n", (szDistinct == 0) ? "-" : "", (pac->uiSectors > 0) ? acMap : "-");
+  fflush(pfLog);
+}
+
+static void
+stop_audit(int sig)
+{
+  (void) sig;
+  bStopInventory = 1;
+}
+
+// Wait for the card just audited to leave, true when another one is already selected
+static bool
+audit_wait_removal(struct audit_card *pac)
+{
+  uint8_t abtUid[10];
+  size_t szUidLen = pac->nt.nti.nai.szUidLen;
+
+  memcpy(abtUid, pac->nt.nti.nai.abtUid, szUidLen);
+  while (!bStopInventory) {
+    // A field cycle wakes the card whatever state the sweep left it in
+    nfct_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
+    nfct_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true);
+    // Simulated cards never leave, the field cycle presents the same card as a new one
+    if (bSimulated || nfct_initiator_select_passive_target(pnd, nmAudit, NULL, 0, &pac->nt) <= 0)
+      return false;
+    if (!(pac->nt.nti.nai.szUidLen == szUidLen && memcmp(pac->nt.nti.nai.abtUid, abtUid, szUidLen) == 0))
+      return true;
+    sleep_ms(AUDIT_POLL_MS);
+  }
+  return false;
+}
+
+static int
+run_audit(const char *pcLog, size_t szCards)
+{
+  struct audit_card *pac;
+  struct timespec tsStart, tsCard;
+  size_t szDone = 0, szLost = 0, szWeak = 0;
+  bool bSelected = false;
+  FILE *pfLog;
+  int res = 0;
+
+  if ((pac = calloc(1, sizeof(*pac))) == NULL || (pszKeyHits = calloc(szKeys, sizeof(size_t))) == NULL
+      || (pszKeyOrder = calloc(szKeys, sizeof(size_t))) == NULL) {
+    ERR("Unable to allocate audit (malloc)");
+    res = -1;
+    goto out;
+  }
+  if ((pfLog = fopen(pcLog, "a")) == NULL) {
+    ERR("Could not open audit log: %s", pcLog);
+    res = -1;
+    goto out;
+  }
+  if (ftell(pfLog) == 0)
+    fprintf(pfLog, "# time\tuid\tatqa\tsak\tbytes\tmagic\tprng\tsweep\tfound\tkeys\tsector keys a,b\n");
+  if (nfct_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0) {
+    nfct_perror(pnd, "nfc_device_set_property_bool");
+    res = -1;
+    goto out_log;
+  }
+  nfct_device_set_property_bool(pnd, NP_AUTO_ISO14443_4, false);
+  signal(SIGINT, stop_audit);
+  signal(SIGTERM, stop_audit);
+
+  printf("Auditing with %zu keys, log: %s\n", szKeys, pcLog);
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  while (!bStopInventory && (szCards == 0 || szDone < szCards)) {
+    if (!bSelected) {
+      res = nfct_initiator_select_passive_target(pnd, nmAudit, NULL, 0, &pac->nt);
+      if (res < 0 && res != NFC_ETIMEOUT && res != NFC_EOPABORTED) {
+        nfct_perror(pnd, "nfc_initiator_select_passive_target");
+        break;
+      }
+      if (res <= 0) {
+        sleep_ms(AUDIT_POLL_MS);
+        res = 0;
+        continue;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tsCard);
+    bool bDone = audit_card(pac);
+    long lMs = elapsed_ms(&tsCard);
+
+    audit_log(pfLog, pac, bDone);
+    szDone++;
+    szLost += !bDone;
+    szWeak += (pac->aui64Found[0] | pac->aui64Found[1]) != 0;
+    printf("Card %zu ", szDone);
+    for (size_t n = 0; n < pac->nt.nti.nai.szUidLen; n++)
+      printf("%02x", pac->nt.nti.nai.abtUid[n]);
+    printf(": %d bytes%s%s, %s PRNG, %zu/%u keys, %u authentications, %u wake-ups, %ld ms%s\n",
+           (pac->uiBlocks + 1) * 16, pac->bGen1 ? " gen1" : "", pac->bGen2 ? " gen2" : "", apcPrng[pac->ap],
+           bit_count64(pac->aui64Found[0]) + bit_count64(pac->aui64Found[1]), pac->uiSectors * 2,
+           pac->uiAuths, pac->uiWakes, lMs, bDone ? "" : ", card lost");
+    fflush(stdout);
+    bSelected = audit_wait_removal(pac);
+  }
+
+  long lElapsedMs = elapsed_ms(&tsStart);
+  printf("Audit: %zu card(s), %zu with dictionary keys, %zu lost, in %.1f s", szDone, szWeak, szLost, lElapsedMs / 1000.0);
+  if (lElapsedMs > 0)
+    printf(", %.1f cards/min", szDone * 60000.0 / lElapsedMs);
+  printf("\n");
+
+out_log:
+  fclose(pfLog);
+out:
+  free(pszKeyOrder);
+  free(pszKeyHits);
+  pszKeyOrder = pszKeyHits = NULL;
+  free(pac);
+  return res;
 }
 
 int
@@ -73,6 +758,14 @@ main(int argc, const char *argv[])
   size_t  i;
   bool verbose = false;
   bool testMode = false;
+  bool inventoryMode = false;
+  const char *pcAuditLog = NULL;
+  size_t szAuditCards = 0;
+  nfc_modulation anm[INVENTORY_MODULATION_COUNT];
+  size_t szModulations = 0;
+  long lPeriodMs = DEFAULT_POLL_PERIOD_MS;
+  const char *pcDevice = NULL;
+  bool bOneReader;
   int res = 0;
 
   nfc_context *context;
@@ -85,16 +778,70 @@ main(int argc, const char *argv[])
   // Display libnfc version
   acLibnfcVersion = nfc_version();
   printf("%s uses libnfc %s\n", argv[0], acLibnfcVersion);
+  if ((argc > 2) && (0 == strcmp("-c", argv[1]))) {
+    pcDevice = argv[2];
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
   if (argc != 1) {
     if ((argc == 2) && (0 == strcmp("-v", argv[1]))) {
       verbose = true;
     } else if((argc == 2) && (0 == strcmp("-t", argv[1]))) {
 	  testMode = true;
-	} else {
+    } else if ((argc == 4) && (0 == strcmp("-t", argv[1])) && ((0 == strcmp("-S", argv[2])) || (0 == strcmp("-G", argv[2])))) {
+      testMode = true;
+      if (!mfc_sim_install(argv[3], argv[2][1] == 'G', 1))
+        exit(EXIT_FAILURE);
+	} else if (0 == strcmp("-i", argv[1])) {
+      inventoryMode = true;
+      for (int arg = 2; arg < argc; arg++) {
+        if ((0 == strcmp("-m", argv[arg])) && (arg + 1 < argc)) {
+          szModulations = parse_modulations((char *) argv[++arg], anm);
+          if (szModulations == 0) {
+            ERR("Invalid modulation list: %s", argv[arg]);
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+          }
+        } else if ((0 == strcmp("-p", argv[arg])) && (arg + 1 < argc)) {
+          lPeriodMs = strtol(argv[++arg], NULL, 10);
+          if (lPeriodMs <= 0) {
+            ERR("Invalid poll period: %s", argv[arg]);
+            exit(EXIT_FAILURE);
+          }
+        } else {
+          print_usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+      }
+    } else if ((0 == strcmp("-a", argv[1])) && (argc > 2)) {
+      pcAuditLog = argv[2];
+      for (int arg = 3; arg < argc; arg++) {
+        if ((0 == strcmp("-k", argv[arg])) && (arg + 1 < argc)) {
+          if (!load_dictionary(argv[++arg]))
+            exit(EXIT_FAILURE);
+        } else if ((0 == strcmp("-n", argv[arg])) && (arg + 1 < argc) && (atoi(argv[arg + 1]) > 0)) {
+          szAuditCards = atoi(argv[++arg]);
+        } else if (((0 == strcmp("-S", argv[arg])) || (0 == strcmp("-G", argv[arg]))) && (arg + 1 < argc)) {
+          bSimulated = true;
+          if (!mfc_sim_install(argv[arg + 1], argv[arg][1] == 'G', 1))
+            exit(EXIT_FAILURE);
+          arg++;
+        } else {
+          print_usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+      }
+    } else {
       print_usage(argv[0]);
       exit(EXIT_FAILURE);
     }
   }
+  if (inventoryMode && szModulations == 0) {
+    for (i = 0; i < INVENTORY_MODULATION_COUNT; i++)
+      anm[i] = anmInventory[i].nm;
+    szModulations = INVENTORY_MODULATION_COUNT;
+  }
 
   /* Lazy way to open an NFC device */
 #if 0
@@ -118,7 +865,9 @@ main(int argc, const char *argv[])
   pnd = nfc_open(context, &ndd);
 #endif
   nfc_connstring connstrings[MAX_DEVICE_COUNT];
-  size_t szDeviceFound = nfc_list_devices(context, connstrings, MAX_DEVICE_COUNT);
+  // Testing, polling and auditing use one reader, that one opens without a scan when it can
+  bOneReader = testMode || inventoryMode || (pcAuditLog != NULL) || (pcDevice != NULL);
+  size_t szDeviceFound = bOneReader ? 1 : nfct_list_devices(context, connstrings, MAX_DEVICE_COUNT);
 
   if (szDeviceFound == 0) {
     printf("No NFC device found.\n");
@@ -126,19 +875,38 @@ main(int argc, const char *argv[])
 
   for (i = 0; i < szDeviceFound; i++) {
     nfc_target ant[MAX_TARGET_COUNT];
-    pnd = nfc_open(context, connstrings[i]);
+    pnd = bOneReader ? nfct_open_cached(context, pcDevice) : nfct_open(context, connstrings[i]);
 
     if (pnd == NULL) {
-      ERR("Unable to open NFC device: %s", connstrings[i]);
+      if (bOneReader && (pcDevice == NULL))
+        printf("No NFC device found.\n");
+      else
+        ERR("Unable to open NFC device: %s", bOneReader ? pcDevice : connstrings[i]);
       continue;
     }
-    if (nfc_initiator_init(pnd) < 0) {
-      nfc_perror(pnd, "nfc_initiator_init");
+    if (nfct_initiator_init(pnd) < 0) {
+      nfct_perror(pnd, "nfc_initiator_init");
       nfc_exit(context);
       exit(EXIT_FAILURE);
     }
 
-    printf("NFC device: %s opened\n", nfc_device_get_name(pnd));
+    printf("NFC device: %s opened\n", nfct_device_get_name(pnd));
+
+    if (inventoryMode) {
+      // Inventory stays on the first usable reader until interrupted
+      res = run_inventory(anm, szModulations, lPeriodMs);
+      nfct_close(pnd);
+      nfc_exit(context);
+      exit((res < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (pcAuditLog != NULL) {
+      // Audit stays on the first usable reader until interrupted or done
+      res = run_audit(pcAuditLog, szAuditCards);
+      nfct_close(pnd);
+      nfct_finish();
+      nfc_exit(context);
+      exit((res < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
     nfc_modulation nm;
 	
@@ -153,21 +921,21 @@ static nfc_target nt;
 static uint8_t uiBlocks;
 
 		// Let the reader only try once to find a tag
-  if (nfc_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0) {
-    nfc_perror(pnd, "nfc_device_set_property_bool");
-    nfc_close(pnd);
+  if (nfct_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0) {
+    nfct_perror(pnd, "nfc_device_set_property_bool");
+    nfct_close(pnd);
     nfc_exit(context);
     exit(EXIT_FAILURE);
   }
 
   // Disable ISO14443-4 switching in order to read devices that emulate Mifare Classic with ISO14443-4 compliance.
-  nfc_device_set_property_bool(pnd, NP_AUTO_ISO14443_4, false);
+  nfct_device_set_property_bool(pnd, NP_AUTO_ISO14443_4, false);
 
 
   // Try to find a MIFARE Classic tag
-  if (nfc_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) <= 0) {
+  if (nfct_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) <= 0) {
     printf("Error: no tag was found\n");
-    nfc_close(pnd);
+    nfct_close(pnd);
     nfc_exit(context);
     exit(EXIT_FAILURE);
   }
@@ -217,6 +985,7 @@ else {
 
 
 	printf("end!\n");
+	nfct_close(pnd);
 	goto end;
 	}
 
@@ -330,9 +1099,10 @@ else {
         printf("\n");
       }
     }
-    nfc_close(pnd);
+    nfct_close(pnd);
   }
 end:
+  nfct_finish();
   nfc_exit(context);
   exit(EXIT_SUCCESS);
 }
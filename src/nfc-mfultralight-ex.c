@@ -0,0 +1,335 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file nfc-mfultralight-ex.c
+ * @brief MIFARE Ultralight and NTAG21x dump example
+ *
+ * The variant comes from GET_VERSION, tags that do not know it are told apart
+ * by how far READ goes. Tags with FAST_READ hand their memory out in a few
+ * large ranges, the others four pages per READ.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include "mifare.h"
+#include "latency-model.h"
+#include "metrics.h"
+#include "nfc-transport.h"
+#include "nfc-utils.h"
+
+// Ultralight C keeps its key in the last four of its 48 pages
+#define ULTRALIGHT_PAGES 16
+#define ULTRALIGHT_C_PAGES 44
+
+struct ul_variant {
+  uint8_t btProduct;             // GET_VERSION product type
+  uint8_t btStorage;             // GET_VERSION storage size
+  const char *pcName;
+  uint8_t uiPages;
+};
+
+static const struct ul_variant aulVariants[] = {
+  { 0x03, 0x0b, "MIFARE Ultralight EV1 (MF0UL11)", 20 },
+  { 0x03, 0x0e, "MIFARE Ultralight EV1 (MF0UL21)", 41 },
+  { 0x04, 0x0b, "NTAG210", 20 },
+  { 0x04, 0x0e, "NTAG212", 41 },
+  { 0x04, 0x0f, "NTAG213", 45 },
+  { 0x04, 0x11, "NTAG215", 135 },
+  { 0x04, 0x13, "NTAG216", 231 },
+};
+#define UL_VARIANT_COUNT (sizeof(aulVariants) / sizeof(aulVariants[0]))
+
+static const nfc_modulation nmMifare = {
+  .nmt = NMT_ISO14443A,
+  .nbr = NBR_106,
+};
+
+static nfc_device *pnd;
+static nfc_target nt;
+static mifareul_tag mtDump;
+static uint32_t uiExchanges = 0;
+
+static void
+print_usage(const char *pcProgramName)
+{
+  printf("Usage: %s [-c <device>] [-T <latency>] [-M <metrics>] [-O <trace> | -I <trace> [-P]] r <dump.mfd>\n", pcProgramName);
+  printf("  r                            - Read the MIFARE Ultralight or NTAG21x tag to <dump.mfd>\n");
+  printf("  -c <device>                  - Open the reader with this libnfc connection string, by default the reader\n");
+  printf("                                 that last opened on this host is tried before scanning for one\n");
+  printf("  -T <latency>                 - Learn response latencies and time out silent commands early, keep them in <latency>\n");
+  printf("  -M <metrics>                 - Write latency histograms and counters at exit (Prometheus if *.prom, else JSON)\n");
+  printf("  -O <trace>                   - Record every reader exchange to <trace>\n");
+  printf("  -I <trace>                   - Replay <trace> instead of using readers, -P keeps the recorded timing\n");
+}
+
+static double
+elapsed_ms(const struct timespec *ptsStart)
+{
+  struct timespec tsNow;
+  clock_gettime(CLOCK_MONOTONIC, &tsNow);
+  return (tsNow.tv_sec - ptsStart->tv_sec) * 1000.0 + (tsNow.tv_nsec - ptsStart->tv_nsec) / 1e6;
+}
+
+// Wake the tag a refused command muted
+static bool
+reactivate(void)
+{
+  metrics_count(pnd, METRIC_RESELECTS);
+  if (nfc_initiator_mifare_reactivate(pnd, &nt))
+    return true;
+  return nfct_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) > 0;
+}
+
+/*
+ * Tell the variant and its number of pages. Without GET_VERSION it is an
+ * Ultralight, or an Ultralight C when READ goes past page 15.
+ */
+static const char *
+detect_variant(uint8_t *puiPages, bool *pbFastRead)
+{
+  uint8_t abtVersion[8];
+  uint8_t abtData[16];
+
+  uiExchanges++;
+  if (nfc_initiator_mifareul_get_version(pnd, abtVersion)) {
+    *pbFastRead = true;
+    for (size_t n = 0; n < UL_VARIANT_COUNT; n++) {
+      if (aulVariants[n].btProduct == abtVersion[2] && aulVariants[n].btStorage == abtVersion[6]) {
+        *puiPages = aulVariants[n].uiPages;
+        return aulVariants[n].pcName;
+      }
+    }
+    // Where the memory ends shows when reading it
+    *puiPages = MIFAREUL_MAX_PAGES;
+    printf("Unknown variant, GET_VERSION: ");
+    print_hex(abtVersion, sizeof(abtVersion));
+    return "MIFARE Ultralight family";
+  }
+  *pbFastRead = false;
+  if (!reactivate())
+    return NULL;
+  uiExchanges++;
+  if (nfc_initiator_mifareul_read(pnd, ULTRALIGHT_PAGES, abtData)) {
+    *puiPages = ULTRALIGHT_C_PAGES;
+    return "MIFARE Ultralight C";
+  }
+  if (!reactivate())
+    return NULL;
+  *puiPages = ULTRALIGHT_PAGES;
+  return "MIFARE Ultralight";
+}
+
+// Read from uiPage on, four pages at a time, up to uiEnd or the first refused READ
+static uint8_t
+read_pages(uint8_t uiPage, uint8_t uiEnd)
+{
+  uint8_t *pbtDump = (uint8_t *) &mtDump;
+  uint8_t abtData[16];
+
+  for (; uiPage < uiEnd; uiPage += 4) {
+    uiExchanges++;
+    if (!nfc_initiator_mifareul_read(pnd, uiPage, abtData)) {
+      reactivate();
+      return uiPage;
+    }
+    // The last READ wraps around to page 0, only the pages that exist count
+    memcpy(pbtDump + 4 * uiPage, abtData, 4 * ((uiEnd - uiPage < 4) ? uiEnd - uiPage : 4));
+  }
+  return uiEnd;
+}
+
+/*
+ * Dump uiPages pages, in FAST_READ ranges when the tag has it. A refused
+ * range is read again with READ, which finds where the readable memory ends.
+ */
+static uint8_t
+read_tag(uint8_t uiPages, bool bFastRead)
+{
+  uint8_t *pbtDump = (uint8_t *) &mtDump;
+  uint8_t uiPage = 0;
+
+  while (bFastRead && uiPage < uiPages) {
+    uint8_t uiEnd = (uiPages - uiPage > MIFAREUL_FAST_READ_PAGES) ? uiPage + MIFAREUL_FAST_READ_PAGES - 1 : uiPages - 1;
+
+    uiExchanges++;
+    if (!nfc_initiator_mifareul_fast_read(pnd, uiPage, uiEnd, pbtDump + 4 * uiPage)) {
+      if (!reactivate())
+        return uiPage;
+      return read_pages(uiPage, uiEnd + 1);
+    }
+    uiPage = uiEnd + 1;
+  }
+  return read_pages(uiPage, uiPages);
+}
+
+int
+main(int argc, const char *argv[])
+{
+  nfc_context *context;
+  const char *pcDumpFile;
+  const char *pcDevice = NULL;
+  const char *pcLatencyFile = NULL;
+  const char *pcMetricsFile = NULL;
+  const char *pcRecordTrace = NULL;
+  const char *pcReplayTrace = NULL;
+  bool bReplayPaced = false;
+  const char *pcVariant;
+  struct timespec tsStart;
+  uint8_t uiPages = 0, uiRead;
+  bool bFastRead = false;
+  bool bSuccess = false;
+  FILE *pfDump;
+  int arg;
+
+  for (arg = 1; arg < argc; arg++) {
+    if (0 == strcmp(argv[arg], "-c") && arg + 1 < argc) {
+      pcDevice = argv[++arg];
+    } else if (0 == strcmp(argv[arg], "-T") && arg + 1 < argc) {
+      pcLatencyFile = argv[++arg];
+    } else if (0 == strcmp(argv[arg], "-M") && arg + 1 < argc) {
+      pcMetricsFile = argv[++arg];
+    } else if (0 == strcmp(argv[arg], "-O") && arg + 1 < argc) {
+      pcRecordTrace = argv[++arg];
+    } else if (0 == strcmp(argv[arg], "-I") && arg + 1 < argc) {
+      pcReplayTrace = argv[++arg];
+    } else if (0 == strcmp(argv[arg], "-P")) {
+      bReplayPaced = true;
+    } else {
+      break;
+    }
+  }
+  if (arg + 2 != argc || strcmp(argv[arg], "r") != 0 || (pcRecordTrace != NULL && pcReplayTrace != NULL)) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  pcDumpFile = argv[arg + 1];
+
+  if (pcLatencyFile != NULL && !latency_load(pcLatencyFile))
+    exit(EXIT_FAILURE);
+  if (pcMetricsFile != NULL && !metrics_start(pcMetricsFile))
+    exit(EXIT_FAILURE);
+  if (pcRecordTrace != NULL && !nfct_record(pcRecordTrace))
+    exit(EXIT_FAILURE);
+  if (pcReplayTrace != NULL && !nfct_replay(pcReplayTrace, bReplayPaced))
+    exit(EXIT_FAILURE);
+
+  nfc_init(&context);
+  if (context == NULL) {
+    ERR("Unable to init libnfc (malloc)");
+    exit(EXIT_FAILURE);
+  }
+  pnd = nfct_open_cached(context, pcDevice);
+  if (pnd == NULL) {
+    ERR("Error opening NFC reader");
+    nfc_exit(context);
+    exit(EXIT_FAILURE);
+  }
+  if (nfct_initiator_init(pnd) < 0 || nfct_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0) {
+    nfct_perror(pnd, "nfc_initiator_init");
+    goto close;
+  }
+  printf("NFC reader: %s opened\n", nfct_device_get_name(pnd));
+
+  if (nfct_initiator_select_passive_target(pnd, nmMifare, NULL, 0, &nt) <= 0) {
+    printf("Error: no tag was found\n");
+    goto close;
+  }
+  // The whole family answers SAK 00
+  if (nt.nti.nai.btSak != 0x00) {
+    printf("Error: not a MIFARE Ultralight family tag, SAK %02x\n", nt.nti.nai.btSak);
+    goto close;
+  }
+  if (pcLatencyFile != NULL)
+    latency_attach(pnd, nt.nti.nai.abtAtqa, nt.nti.nai.btSak);
+  printf("Found tag with UID: ");
+  print_hex(nt.nti.nai.abtUid, nt.nti.nai.szUidLen);
+
+  clock_gettime(CLOCK_MONOTONIC, &tsStart);
+  if ((pcVariant = detect_variant(&uiPages, &bFastRead)) == NULL) {
+    printf("Error: tag was removed\n");
+    goto close;
+  }
+  printf("%s, %u pages%s\n", pcVariant, uiPages, bFastRead ? ", FAST_READ" : "");
+
+  uiRead = read_tag(uiPages, bFastRead);
+  metrics_time(pnd, METRIC_TRANSACTION, &tsStart);
+  printf("Done, %u of %u pages read in %u exchanges, %.1f ms.\n", uiRead, uiPages, uiExchanges, elapsed_ms(&tsStart));
+  // An unknown variant reads up to where its memory ends
+  bSuccess = (uiRead == uiPages) || (uiRead > 0 && uiPages == MIFAREUL_MAX_PAGES);
+  if (!bSuccess)
+    printf("Warning: pages from %u on are read protected or gone, they are left out\n", uiRead);
+
+  printf("Writing data to file: %s ...", pcDumpFile);
+  fflush(stdout);
+  if ((pfDump = fopen(pcDumpFile, "wb")) == NULL) {
+    printf("\nCould not open file: %s\n", pcDumpFile);
+    bSuccess = false;
+    goto close;
+  }
+  if (fwrite(&mtDump, 4, uiRead, pfDump) != uiRead) {
+    printf("\nCould not write to file: %s\n", pcDumpFile);
+    bSuccess = false;
+  } else {
+    printf("Done.\n");
+  }
+  fclose(pfDump);
+
+close:
+  if (pcLatencyFile != NULL) {
+    printf("Learned timeouts:\n");
+    latency_print();
+    latency_save(pcLatencyFile);
+  }
+  metrics_write();
+  latency_detach(pnd);
+  nfct_close(pnd);
+  nfct_finish();
+  nfc_exit(context);
+  exit(bSuccess ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,768 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file nfc-transport.c
+ * @brief Reader I/O shim: pass through to libnfc, record a trace or replay one
+ *
+ * A trace starts with "NFCTRC01" followed by one record per call:
+ *   u8 call, u8 device, u16 reserved, i32 result, u64 start (us since the
+ *   trace began), u32 duration (us), u32 argument, u32 tx length,
+ *   u32 rx length, tx bytes, rx bytes
+ * all little endian. The argument is the bit count of a bit frame, the
+ * timeout of a byte frame, property << 1 | value for a property and
+ * modulation type << 8 | baud rate for a select. A select stores the
+ * nfc_target as received, so a trace only replays on the platform and
+ * libnfc version that recorded it. Parity bits are not recorded.
+ *
+ * Replay serves the records of each device in order and checks that every
+ * call is the one recorded, with the same frame. A session that diverges
+ * gets NFC_EIO from then on.
+ *
+ * After nfct_simulate() the devices are MIFARE Classic simulators (see
+ * mfc-sim.c, which registers itself), and nothing is recorded. With a link
+ * profile from nfct_simulate_link() each call takes as long as it would on
+ * a real reader: one USB round trip, the air time of the exchanges and, when
+ * the card stays silent, the whole timeout.
+ *
+ * nfct_open_cached() spares a single reader tool the bus scan of
+ * nfc_open(context, NULL): the connection string of the reader that last
+ * opened is kept per host in ~/.nfc-foo-devices, one "<host> TAB <connstring>"
+ * line each, and tried first.
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include "nfc-transport.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nfc-utils.h"
+
+#define TRACE_MAGIC "NFCTRC01"
+#define RECORD_HEADER_LEN 32
+#define MAX_DEVICES 16
+#define DEVICE_CACHE ".nfc-foo-devices"
+
+typedef enum {
+  NFCT_LIVE,
+  NFCT_RECORD,
+  NFCT_REPLAY,
+  NFCT_SIMULATE
+} nfct_mode;
+
+typedef enum {
+  CALL_LIST = 1,
+  CALL_OPEN,
+  CALL_CLOSE,
+  CALL_INIT,
+  CALL_PROPERTY,
+  CALL_SELECT,
+  CALL_BYTES,
+  CALL_BITS
+} nfct_call;
+
+struct trace_record {
+  uint8_t  btCall;
+  uint8_t  btDevice;
+  int32_t  iResult;
+  uint64_t ui64StartUs;
+  uint32_t uiDurationUs;
+  uint32_t uiArg;
+  uint32_t uiTxLen;
+  uint32_t uiRxLen;
+  const uint8_t *pbtTx;
+  const uint8_t *pbtRx;
+};
+
+struct nfct_device {
+  nfc_device *pnd;              // the real device, NULL when replaying or simulating
+  struct mfc_sim *psim;
+  char     acName[256];
+  size_t   szNext;              // next record to replay
+  int      iLastError;
+  bool     bDiverged;
+  uint64_t ui64RoundTrips;      // simulated calls
+  uint64_t ui64WaitUs;          // time spent waiting on them
+};
+
+static nfct_mode tmMode = NFCT_LIVE;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct nfct_device adDevices[MAX_DEVICES];
+static size_t szDevices = 0;
+static struct timespec tsTraceStart;
+static FILE *pfTrace;
+static bool bReplayPaced;
+static uint8_t *pbtTrace;
+static struct trace_record *ptrRecords;
+static size_t szRecords;
+static size_t szNextList;       // replay cursor of calls made before any device exists
+static const nfct_simulator *pnsSim;
+static size_t szSimReaders;
+static bool bSimLink = false;
+static uint32_t uiSimUsbUs = 1000;
+static uint32_t uiSimWaitMs = 50;
+static double dSimFailureRate = 0;
+static double dSimTimeoutRate = 0;
+
+static uint64_t
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - tsTraceStart.tv_sec) * 1000000ULL + (ts.tv_nsec - tsTraceStart.tv_nsec) / 1000;
+}
+
+static void
+put_le(uint8_t *pbt, uint64_t ui64Value, size_t szLen)
+{
+  for (size_t n = 0; n < szLen; n++)
+    pbt[n] = (uint8_t)(ui64Value >> (8 * n));
+}
+
+static uint64_t
+get_le(const uint8_t *pbt, size_t szLen)
+{
+  uint64_t ui64Value = 0;
+  for (size_t n = 0; n < szLen; n++)
+    ui64Value |= (uint64_t) pbt[n] << (8 * n);
+  return ui64Value;
+}
+
+// Fake handles given out when replaying point into adDevices
+static struct nfct_device *
+device_of(const nfc_device *pnd)
+{
+  if ((const void *) pnd >= (const void *) adDevices && (const void *) pnd < (const void *)(adDevices + MAX_DEVICES))
+    return (struct nfct_device *) pnd;
+  for (size_t n = 0; n < szDevices; n++) {
+    if (adDevices[n].pnd == pnd)
+      return &adDevices[n];
+  }
+  return NULL;
+}
+
+static void
+record(nfct_call call, const struct nfct_device *pd, int iResult, uint64_t ui64StartUs, uint32_t uiArg,
+       const void *pTx, size_t szTx, const void *pRx, size_t szRx)
+{
+  uint8_t abtHeader[RECORD_HEADER_LEN];
+  uint64_t ui64EndUs = now_us();
+
+  abtHeader[0] = call;
+  abtHeader[1] = (pd != NULL) ? (uint8_t)(pd - adDevices) : 0xff;
+  put_le(abtHeader + 2, 0, 2);
+  put_le(abtHeader + 4, (uint32_t) iResult, 4);
+  put_le(abtHeader + 8, ui64StartUs, 8);
+  put_le(abtHeader + 16, ui64EndUs - ui64StartUs, 4);
+  put_le(abtHeader + 20, uiArg, 4);
+  put_le(abtHeader + 24, szTx, 4);
+  put_le(abtHeader + 28, szRx, 4);
+  pthread_mutex_lock(&mutex);
+  if (fwrite(abtHeader, 1, sizeof(abtHeader), pfTrace) != sizeof(abtHeader)
+      || (szTx > 0 && fwrite(pTx, 1, szTx, pfTrace) != szTx)
+      || (szRx > 0 && fwrite(pRx, 1, szRx, pfTrace) != szRx))
+    ERR("Unable to write trace");
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Find the next recorded call of a device, NULL if the session diverged
+ *
+ * The caller's frame must match the recorded one: same call, argument and
+ * transmitted bytes.
+ */
+static const struct trace_record *
+replay(nfct_call call, struct nfct_device *pd, uint32_t uiArg, bool bCheckArg, const void *pTx, size_t szTx)
+{
+  uint8_t btDevice = (pd != NULL) ? (uint8_t)(pd - adDevices) : 0xff;
+  size_t *pszNext = (pd != NULL) ? &pd->szNext : &szNextList;
+  const struct trace_record *ptr = NULL;
+
+  if (pd != NULL && pd->bDiverged)
+    return NULL;
+  while (*pszNext < szRecords && ptrRecords[*pszNext].btDevice != btDevice)
+    (*pszNext)++;
+  if (*pszNext < szRecords)
+    ptr = &ptrRecords[(*pszNext)++];
+  if (ptr == NULL || ptr->btCall != call || (bCheckArg && ptr->uiArg != uiArg)
+      || ptr->uiTxLen != szTx || (szTx > 0 && memcmp(ptr->pbtTx, pTx, szTx) != 0)) {
+    ERR("Replay diverged from the trace on device %d, record %zu", (pd != NULL) ? (int) btDevice : -1, *pszNext);
+    if (pd != NULL)
+      pd->bDiverged = true;
+    return NULL;
+  }
+  if (bReplayPaced) {
+    struct timespec ts = { .tv_sec = ptr->uiDurationUs / 1000000, .tv_nsec = (ptr->uiDurationUs % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+  }
+  return ptr;
+}
+
+/**
+ * @brief Record every call from now on to a trace file
+ */
+bool
+nfct_record(const char *pcPath)
+{
+  if ((pfTrace = fopen(pcPath, "wb")) == NULL || fwrite(TRACE_MAGIC, 1, 8, pfTrace) != 8) {
+    ERR("Unable to write trace: %s", pcPath);
+    return false;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tsTraceStart);
+  tmMode = NFCT_RECORD;
+  return true;
+}
+
+/**
+ * @brief Answer every call from a trace file instead of a reader
+ * @param bPaced Take as long as the recorded calls did, otherwise answer immediately
+ */
+bool
+nfct_replay(const char *pcPath, bool bPaced)
+{
+  FILE *pf = fopen(pcPath, "rb");
+  long lSize;
+  size_t szOffset = 8, szAllocated = 0;
+
+  if (pf == NULL || fseek(pf, 0, SEEK_END) != 0 || (lSize = ftell(pf)) < 8 || fseek(pf, 0, SEEK_SET) != 0
+      || (pbtTrace = malloc(lSize)) == NULL || fread(pbtTrace, 1, lSize, pf) != (size_t) lSize
+      || memcmp(pbtTrace, TRACE_MAGIC, 8) != 0) {
+    ERR("Unable to read trace: %s", pcPath);
+    if (pf != NULL)
+      fclose(pf);
+    return false;
+  }
+  fclose(pf);
+
+  while (szOffset + RECORD_HEADER_LEN <= (size_t) lSize) {
+    const uint8_t *pbt = pbtTrace + szOffset;
+    struct trace_record tr = {
+      .btCall = pbt[0],
+      .btDevice = pbt[1],
+      .iResult = (int32_t) get_le(pbt + 4, 4),
+      .ui64StartUs = get_le(pbt + 8, 8),
+      .uiDurationUs = get_le(pbt + 16, 4),
+      .uiArg = get_le(pbt + 20, 4),
+      .uiTxLen = get_le(pbt + 24, 4),
+      .uiRxLen = get_le(pbt + 28, 4),
+    };
+    if (szOffset + RECORD_HEADER_LEN + tr.uiTxLen + tr.uiRxLen > (size_t) lSize)
+      break;
+    tr.pbtTx = pbt + RECORD_HEADER_LEN;
+    tr.pbtRx = tr.pbtTx + tr.uiTxLen;
+    if (szRecords == szAllocated) {
+      struct trace_record *ptr = realloc(ptrRecords, (szAllocated = szAllocated * 2 + 1024) * sizeof(*ptr));
+      if (ptr == NULL) {
+        ERR("Unable to allocate trace (malloc)");
+        return false;
+      }
+      ptrRecords = ptr;
+    }
+    ptrRecords[szRecords++] = tr;
+    szOffset += RECORD_HEADER_LEN + tr.uiTxLen + tr.uiRxLen;
+  }
+  if (szOffset != (size_t) lSize)
+    ERR("Trace is truncated, replaying %zu complete records: %s", szRecords, pcPath);
+  bReplayPaced = bPaced;
+  tmMode = NFCT_REPLAY;
+  return true;
+}
+
+/**
+ * @brief Replace the readers with simulated ones
+ * @param pns Entry points of the simulator, reader n is opened with pns->open(n)
+ * @param szReaders Number of readers found by nfct_list_devices()
+ */
+void
+nfct_simulate(const nfct_simulator *pns, size_t szReaders)
+{
+  pnsSim = pns;
+  szSimReaders = MIN(szReaders, MAX_DEVICES);
+  tmMode = NFCT_SIMULATE;
+}
+
+/**
+ * @brief Give the simulated readers the timing and the faults of a real link
+ * @param pcProfile Comma separated settings, any of
+ *   usb=<us>      USB round trip of a reader command (default 1000)
+ *   wait=<ms>     time a silent card costs when the caller gives no timeout (default 50)
+ *   fail=<rate>   share of frames corrupted on air (default 0)
+ *   timeout=<rate> share of frames lost on air (default 0)
+ */
+bool
+nfct_simulate_link(const char *pcProfile)
+{
+  char acProfile[256];
+  char *pcSetting, *pcSave = NULL;
+
+  snprintf(acProfile, sizeof(acProfile), "%s", pcProfile);
+  for (pcSetting = strtok_r(acProfile, ",", &pcSave); pcSetting != NULL; pcSetting = strtok_r(NULL, ",", &pcSave)) {
+    char *pcValue = strchr(pcSetting, '='), *pcEnd;
+    double dValue;
+
+    if (pcValue == NULL || (dValue = strtod(pcValue + 1, &pcEnd)) < 0 || pcEnd == pcValue + 1 || *pcEnd != '\0') {
+      ERR("Invalid link setting: %s", pcSetting);
+      return false;
+    }
+    *pcValue = '\0';
+    if (strcmp(pcSetting, "usb") == 0) {
+      uiSimUsbUs = dValue;
+    } else if (strcmp(pcSetting, "wait") == 0) {
+      uiSimWaitMs = dValue;
+    } else if (strcmp(pcSetting, "fail") == 0 && dValue <= 1) {
+      dSimFailureRate = dValue;
+    } else if (strcmp(pcSetting, "timeout") == 0 && dValue <= 1) {
+      dSimTimeoutRate = dValue;
+    } else {
+      ERR("Invalid link setting: %s", pcSetting);
+      return false;
+    }
+  }
+  bSimLink = true;
+  return true;
+}
+
+/**
+ * @brief Calls made to the simulated readers, and time spent waiting on them
+ */
+void
+nfct_simulate_stats(uint64_t *pui64RoundTrips, uint64_t *pui64WaitUs)
+{
+  *pui64RoundTrips = 0;
+  *pui64WaitUs = 0;
+  for (size_t n = 0; n < szDevices; n++) {
+    *pui64RoundTrips += adDevices[n].ui64RoundTrips;
+    *pui64WaitUs += adDevices[n].ui64WaitUs;
+  }
+}
+
+// Play the time a simulated call takes, see nfct_simulate_link()
+static int
+simulated(struct nfct_device *pd, int iResult, int iTimeoutMs)
+{
+  uint64_t ui64Us = uiSimUsbUs + pnsSim->air_time_us(pd->psim);
+
+  if (iResult < 0)
+    pd->iLastError = iResult;
+  pd->ui64RoundTrips++;
+  if (!bSimLink)
+    return iResult;
+  if (iResult == NFC_ETIMEOUT)
+    ui64Us += ((iTimeoutMs > 0) ? (uint64_t) iTimeoutMs : uiSimWaitMs) * 1000;
+  pd->ui64WaitUs += ui64Us;
+  struct timespec ts = { .tv_sec = ui64Us / 1000000, .tv_nsec = (ui64Us % 1000000) * 1000 };
+  nanosleep(&ts, NULL);
+  return iResult;
+}
+
+/**
+ * @brief Close the trace being recorded or release the one replayed
+ */
+void
+nfct_finish(void)
+{
+  if (pfTrace != NULL && fclose(pfTrace) != 0)
+    ERR("Unable to write trace");
+  pfTrace = NULL;
+  free(ptrRecords);
+  free(pbtTrace);
+  ptrRecords = NULL;
+  pbtTrace = NULL;
+  szRecords = 0;
+  szNextList = 0;
+  for (size_t n = 0; n < szDevices; n++) {
+    if (adDevices[n].psim != NULL)
+      pnsSim->close(adDevices[n].psim);
+    adDevices[n].psim = NULL;
+  }
+  szDevices = 0;
+  tmMode = NFCT_LIVE;
+}
+
+size_t
+nfct_list_devices(nfc_context *context, nfc_connstring connstrings[], size_t connstrings_len)
+{
+  const struct trace_record *ptr;
+  uint64_t ui64Start;
+  size_t szFound;
+
+  switch (tmMode) {
+    case NFCT_LIVE:
+      return nfc_list_devices(context, connstrings, connstrings_len);
+    case NFCT_RECORD:
+      ui64Start = now_us();
+      szFound = nfc_list_devices(context, connstrings, connstrings_len);
+      record(CALL_LIST, NULL, szFound, ui64Start, connstrings_len, NULL, 0, connstrings, szFound * sizeof(nfc_connstring));
+      return szFound;
+    case NFCT_REPLAY:
+      if ((ptr = replay(CALL_LIST, NULL, 0, false, NULL, 0)) == NULL)
+        return 0;
+      szFound = MIN(connstrings_len, ptr->uiRxLen / sizeof(nfc_connstring));
+      memcpy(connstrings, ptr->pbtRx, szFound * sizeof(nfc_connstring));
+      return szFound;
+    case NFCT_SIMULATE:
+      szFound = MIN(connstrings_len, szSimReaders);
+      for (size_t n = 0; n < szFound; n++)
+        snprintf(connstrings[n], sizeof(connstrings[n]), "sim:%zu", n);
+      return szFound;
+  }
+  return 0;
+}
+
+nfc_device *
+nfct_open(nfc_context *context, const nfc_connstring connstring)
+{
+  const struct trace_record *ptr;
+  struct nfct_device *pd;
+  uint64_t ui64Start;
+  size_t szConnstring = (connstring != NULL) ? strlen(connstring) : 0;
+  nfc_device *pnd;
+
+  if (tmMode == NFCT_LIVE)
+    return nfc_open(context, connstring);
+
+  pthread_mutex_lock(&mutex);
+  pd = (szDevices < MAX_DEVICES) ? &adDevices[szDevices] : NULL;
+  pthread_mutex_unlock(&mutex);
+  if (pd == NULL) {
+    ERR("Too many devices for the transport");
+    return NULL;
+  }
+  memset(pd, 0, sizeof(*pd));
+
+  if (tmMode == NFCT_RECORD) {
+    ui64Start = now_us();
+    if ((pnd = nfc_open(context, connstring)) != NULL) {
+      pd->pnd = pnd;
+      snprintf(pd->acName, sizeof(pd->acName), "%s", nfc_device_get_name(pnd));
+    }
+    // Opens are in the stream of calls not bound to a device, they come in order from one thread
+    record(CALL_OPEN, NULL, (pnd != NULL) ? 0 : -1, ui64Start, 0, connstring, szConnstring,
+           pd->acName, strlen(pd->acName));
+    if (pnd == NULL)
+      return NULL;
+  } else if (tmMode == NFCT_SIMULATE) {
+    if ((pd->psim = pnsSim->open(szDevices)) == NULL)
+      return NULL;
+    pnsSim->set_faults(pd->psim, dSimFailureRate, dSimTimeoutRate, 0x9e3779b9 * (uint32_t)(szDevices + 1));
+    snprintf(pd->acName, sizeof(pd->acName), "MIFARE Classic simulator");
+    pnd = (nfc_device *) pd;
+  } else {
+    if ((ptr = replay(CALL_OPEN, NULL, 0, false, connstring, szConnstring)) == NULL || ptr->iResult < 0)
+      return NULL;
+    snprintf(pd->acName, sizeof(pd->acName), "%.*s", (int) MIN(ptr->uiRxLen, sizeof(pd->acName) - 1), (const char *) ptr->pbtRx);
+    pnd = (nfc_device *) pd;
+  }
+  pthread_mutex_lock(&mutex);
+  szDevices++;
+  pthread_mutex_unlock(&mutex);
+  return pnd;
+}
+
+static bool
+device_cache_path(char *pcPath, size_t szPath)
+{
+  const char *pcHome = getenv("HOME");
+
+  return pcHome != NULL && (size_t) snprintf(pcPath, szPath, "%s/" DEVICE_CACHE, pcHome) < szPath;
+}
+
+// Connection string of the reader that last opened on this host
+static bool
+cached_connstring(const char *pcHost, nfc_connstring connstring)
+{
+  char acPath[1024];
+  char acLine[sizeof(nfc_connstring) + 256];
+  bool bFound = false;
+  FILE *pf;
+
+  if (!device_cache_path(acPath, sizeof(acPath)) || (pf = fopen(acPath, "r")) == NULL)
+    return false;
+  while (!bFound && fgets(acLine, sizeof(acLine), pf) != NULL) {
+    char *pcConnstring = strchr(acLine, '\t');
+
+    if (pcConnstring == NULL)
+      continue;
+    *pcConnstring++ = '\0';
+    pcConnstring[strcspn(pcConnstring, "\n")] = '\0';
+    if (strcmp(acLine, pcHost) == 0 && *pcConnstring != '\0' && strlen(pcConnstring) < sizeof(nfc_connstring)) {
+      strcpy(connstring, pcConnstring);
+      bFound = true;
+    }
+  }
+  fclose(pf);
+  return bFound;
+}
+
+// Replace the line of this host, the file is rewritten aside and renamed over
+static void
+cache_connstring(const char *pcHost, const char *pcConnstring)
+{
+  char acPath[1024], acNew[1040];
+  char acLine[sizeof(nfc_connstring) + 256];
+  FILE *pfOld, *pfNew;
+
+  if (!device_cache_path(acPath, sizeof(acPath)))
+    return;
+  snprintf(acNew, sizeof(acNew), "%s.%ld", acPath, (long) getpid());
+  if ((pfNew = fopen(acNew, "w")) == NULL)
+    return;
+  if ((pfOld = fopen(acPath, "r")) != NULL) {
+    while (fgets(acLine, sizeof(acLine), pfOld) != NULL) {
+      size_t szHost = strcspn(acLine, "\t");
+
+      if (acLine[szHost] == '\t' && !(szHost == strlen(pcHost) && strncmp(acLine, pcHost, szHost) == 0))
+        fputs(acLine, pfNew);
+    }
+    fclose(pfOld);
+  }
+  fprintf(pfNew, "%s\t%s\n", pcHost, pcConnstring);
+  if (fclose(pfNew) != 0 || rename(acNew, acPath) != 0)
+    remove(acNew);
+}
+
+/**
+ * @brief Open one reader, without scanning the buses when possible
+ * @param pcDevice Connection string the user asked for, or NULL for any reader
+ *
+ * Without pcDevice the reader that last opened on this host is tried first,
+ * the scan of nfc_open(context, NULL) only runs when it does not open and
+ * the reader it finds is remembered. LIBNFC_DEFAULT_DEVICE, traces and
+ * simulated readers take the plain nfct_open() path.
+ */
+nfc_device *
+nfct_open_cached(nfc_context *context, const char *pcDevice)
+{
+  char acHost[256] = "";
+  nfc_connstring connstring;
+  nfc_device *pnd;
+
+  if (tmMode != NFCT_LIVE || (pcDevice == NULL && getenv("LIBNFC_DEFAULT_DEVICE") != NULL))
+    return nfct_open(context, pcDevice);
+  if (gethostname(acHost, sizeof(acHost) - 1) < 0)
+    acHost[0] = '\0';
+  if (pcDevice != NULL) {
+    if (strlen(pcDevice) >= sizeof(nfc_connstring) || (pnd = nfc_open(context, pcDevice)) == NULL)
+      return NULL;
+  } else if (!cached_connstring(acHost, connstring) || (pnd = nfc_open(context, connstring)) == NULL) {
+    if ((pnd = nfc_open(context, NULL)) == NULL)
+      return NULL;
+  } else {
+    return pnd;
+  }
+  cache_connstring(acHost, nfc_device_get_connstring(pnd));
+  return pnd;
+}
+
+void
+nfct_close(nfc_device *pnd)
+{
+  struct nfct_device *pd = device_of(pnd);
+
+  if (tmMode == NFCT_LIVE || pd == NULL) {
+    nfc_close(pnd);
+    return;
+  }
+  if (tmMode == NFCT_RECORD) {
+    record(CALL_CLOSE, pd, 0, now_us(), 0, NULL, 0, NULL, 0);
+    nfc_close(pnd);
+  } else if (tmMode == NFCT_SIMULATE) {
+    pnsSim->close(pd->psim);
+    pd->psim = NULL;
+  } else {
+    replay(CALL_CLOSE, pd, 0, false, NULL, 0);
+  }
+  pd->pnd = NULL;
+}
+
+const char *
+nfct_device_get_name(nfc_device *pnd)
+{
+  struct nfct_device *pd;
+
+  if ((tmMode == NFCT_REPLAY || tmMode == NFCT_SIMULATE) && (pd = device_of(pnd)) != NULL)
+    return pd->acName;
+  return nfc_device_get_name(pnd);
+}
+
+void
+nfct_perror(const nfc_device *pnd, const char *pcString)
+{
+  struct nfct_device *pd;
+
+  if ((tmMode == NFCT_REPLAY || tmMode == NFCT_SIMULATE) && (pd = device_of(pnd)) != NULL)
+    fprintf(stderr, "%s: error %d (%s)\n", pcString, pd->iLastError, (tmMode == NFCT_REPLAY) ? "replayed" : "simulated");
+  else
+    nfc_perror(pnd, pcString);
+}
+
+// Outcome of a replayed call, to be returned to the caller
+static int
+replayed_result(struct nfct_device *pd, const struct trace_record *ptr)
+{
+  int iResult = (ptr != NULL) ? ptr->iResult : NFC_EIO;
+
+  if (iResult < 0)
+    pd->iLastError = iResult;
+  return iResult;
+}
+
+int
+nfct_initiator_init(nfc_device *pnd)
+{
+  struct nfct_device *pd = device_of(pnd);
+  uint64_t ui64Start;
+  int res;
+
+  if (tmMode == NFCT_LIVE || pd == NULL)
+    return nfc_initiator_init(pnd);
+  if (tmMode == NFCT_SIMULATE)
+    return NFC_SUCCESS;
+  if (tmMode == NFCT_REPLAY)
+    return replayed_result(pd, replay(CALL_INIT, pd, 0, false, NULL, 0));
+  ui64Start = now_us();
+  res = nfc_initiator_init(pnd);
+  record(CALL_INIT, pd, res, ui64Start, 0, NULL, 0, NULL, 0);
+  return res;
+}
+
+int
+nfct_device_set_property_bool(nfc_device *pnd, const nfc_property property, const bool bEnable)
+{
+  struct nfct_device *pd = device_of(pnd);
+  uint32_t uiArg = ((uint32_t) property << 1) | (bEnable ? 1 : 0);
+  uint64_t ui64Start;
+  int res;
+
+  if (tmMode == NFCT_LIVE || pd == NULL)
+    return nfc_device_set_property_bool(pnd, property, bEnable);
+  if (tmMode == NFCT_SIMULATE)
+    return simulated(pd, pnsSim->set_property_bool(pd->psim, property, bEnable), 0);
+  if (tmMode == NFCT_REPLAY)
+    return replayed_result(pd, replay(CALL_PROPERTY, pd, uiArg, true, NULL, 0));
+  ui64Start = now_us();
+  res = nfc_device_set_property_bool(pnd, property, bEnable);
+  record(CALL_PROPERTY, pd, res, ui64Start, uiArg, NULL, 0, NULL, 0);
+  return res;
+}
+
+int
+nfct_initiator_select_passive_target(nfc_device *pnd, const nfc_modulation nm, const uint8_t *pbtInitData, const size_t szInitData, nfc_target *pnt)
+{
+  struct nfct_device *pd = device_of(pnd);
+  const struct trace_record *ptr;
+  uint32_t uiArg = ((uint32_t) nm.nmt << 8) | (uint32_t) nm.nbr;
+  nfc_target nt;
+  uint64_t ui64Start;
+  int res;
+
+  if (tmMode == NFCT_LIVE || pd == NULL)
+    return nfc_initiator_select_passive_target(pnd, nm, pbtInitData, szInitData, pnt);
+  if (tmMode == NFCT_SIMULATE)
+    return simulated(pd, pnsSim->select_passive_target(pd->psim, nm, pbtInitData, szInitData, pnt), 0);
+  if (tmMode == NFCT_REPLAY) {
+    ptr = replay(CALL_SELECT, pd, uiArg, true, pbtInitData, szInitData);
+    res = replayed_result(pd, ptr);
+    if (res > 0 && pnt != NULL && ptr->uiRxLen == sizeof(nfc_target))
+      memcpy(pnt, ptr->pbtRx, sizeof(nfc_target));
+    return res;
+  }
+  ui64Start = now_us();
+  res = nfc_initiator_select_passive_target(pnd, nm, pbtInitData, szInitData, &nt);
+  record(CALL_SELECT, pd, res, ui64Start, uiArg, pbtInitData, szInitData, &nt, (res > 0) ? sizeof(nt) : 0);
+  if (res > 0 && pnt != NULL)
+    *pnt = nt;
+  return res;
+}
+
+int
+nfct_initiator_transceive_bytes(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx, const size_t szRx, int timeout)
+{
+  struct nfct_device *pd = device_of(pnd);
+  const struct trace_record *ptr;
+  uint64_t ui64Start;
+  int res;
+
+  if (tmMode == NFCT_LIVE || pd == NULL)
+    return nfc_initiator_transceive_bytes(pnd, pbtTx, szTx, pbtRx, szRx, timeout);
+  if (tmMode == NFCT_SIMULATE)
+    return simulated(pd, pnsSim->transceive_bytes(pd->psim, pbtTx, szTx, pbtRx, szRx), timeout);
+  if (tmMode == NFCT_REPLAY) {
+    // Learned timeouts differ from run to run, they are not checked
+    ptr = replay(CALL_BYTES, pd, 0, false, pbtTx, szTx);
+    res = replayed_result(pd, ptr);
+    if (res > 0 && pbtRx != NULL)
+      memcpy(pbtRx, ptr->pbtRx, MIN(szRx, ptr->uiRxLen));
+    return res;
+  }
+  ui64Start = now_us();
+  res = nfc_initiator_transceive_bytes(pnd, pbtTx, szTx, pbtRx, szRx, timeout);
+  record(CALL_BYTES, pd, res, ui64Start, (uint32_t) timeout, pbtTx, szTx, pbtRx, (res > 0 && pbtRx != NULL) ? (size_t) res : 0);
+  return res;
+}
+
+int
+nfct_initiator_transceive_bits(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTxBits, const uint8_t *pbtTxPar, uint8_t *pbtRx, const size_t szRx, uint8_t *pbtRxPar)
+{
+  struct nfct_device *pd = device_of(pnd);
+  const struct trace_record *ptr;
+  uint64_t ui64Start;
+  int res;
+
+  if (tmMode == NFCT_LIVE || pd == NULL)
+    return nfc_initiator_transceive_bits(pnd, pbtTx, szTxBits, pbtTxPar, pbtRx, szRx, pbtRxPar);
+  // Parity is not simulated, the caller gets none
+  if (tmMode == NFCT_SIMULATE)
+    return simulated(pd, pnsSim->transceive_bits(pd->psim, pbtTx, szTxBits, pbtRx, szRx), 0);
+  if (tmMode == NFCT_REPLAY) {
+    ptr = replay(CALL_BITS, pd, szTxBits, true, pbtTx, (szTxBits + 7) / 8);
+    res = replayed_result(pd, ptr);
+    if (res > 0 && pbtRx != NULL)
+      memcpy(pbtRx, ptr->pbtRx, MIN(szRx, ptr->uiRxLen));
+    return res;
+  }
+  ui64Start = now_us();
+  res = nfc_initiator_transceive_bits(pnd, pbtTx, szTxBits, pbtTxPar, pbtRx, szRx, pbtRxPar);
+  record(CALL_BITS, pd, res, ui64Start, szTxBits, pbtTx, (szTxBits + 7) / 8, pbtRx, (res > 0 && pbtRx != NULL) ? (size_t)(res + 7) / 8 : 0);
+  return res;
+}
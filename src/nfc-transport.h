@@ -0,0 +1,95 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+
+/**
+ * @file nfc-transport.h
+ * @brief Reader I/O shim: pass through to libnfc, record a trace or replay one
+ *
+ * The tools talk to readers through these nfct_ functions only. By default
+ * they call libnfc directly. After nfct_record() every call and its outcome
+ * is also appended to a binary trace; after nfct_replay() no reader is used
+ * at all and each call is answered from a trace, so a session can be re-run
+ * offline, deterministically and as fast as the host allows. After
+ * nfct_simulate() the readers are software ones with a simulated MIFARE
+ * Classic card. The simulator is only linked into the tools that register
+ * it, see mfc_sim_install().
+ */
+
+#ifndef _NFC_TRANSPORT_H_
+#  define _NFC_TRANSPORT_H_
+
+#  include <stdbool.h>
+#  include <stddef.h>
+#  include <stdint.h>
+
+#  include <nfc/nfc.h>
+
+struct mfc_sim;
+
+// Entry points of a simulated reader, see mfc-sim.h
+typedef struct {
+  struct mfc_sim *(*open)(size_t szReader);
+  void    (*close)(struct mfc_sim *ps);
+  void    (*set_faults)(struct mfc_sim *ps, double dFailureRate, double dTimeoutRate, uint32_t uiSeed);
+  uint32_t (*air_time_us)(struct mfc_sim *ps);
+  int     (*set_property_bool)(struct mfc_sim *ps, const nfc_property property, const bool bEnable);
+  int     (*select_passive_target)(struct mfc_sim *ps, const nfc_modulation nm, const uint8_t *pbtInitData, const size_t szInitData, nfc_target *pnt);
+  int     (*transceive_bytes)(struct mfc_sim *ps, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx, const size_t szRx);
+  int     (*transceive_bits)(struct mfc_sim *ps, const uint8_t *pbtTx, const size_t szTxBits, uint8_t *pbtRx, const size_t szRx);
+} nfct_simulator;
+
+bool    nfct_record(const char *pcPath);
+bool    nfct_replay(const char *pcPath, bool bPaced);
+void    nfct_simulate(const nfct_simulator *pns, size_t szReaders);
+bool    nfct_simulate_link(const char *pcProfile);
+void    nfct_simulate_stats(uint64_t *pui64RoundTrips, uint64_t *pui64WaitUs);
+void    nfct_finish(void);
+
+size_t  nfct_list_devices(nfc_context *context, nfc_connstring connstrings[], size_t connstrings_len);
+nfc_device *nfct_open(nfc_context *context, const nfc_connstring connstring);
+nfc_device *nfct_open_cached(nfc_context *context, const char *pcDevice);
+void    nfct_close(nfc_device *pnd);
+const char *nfct_device_get_name(nfc_device *pnd);
+void    nfct_perror(const nfc_device *pnd, const char *pcString);
+
+int     nfct_initiator_init(nfc_device *pnd);
+int     nfct_device_set_property_bool(nfc_device *pnd, const nfc_property property, const bool bEnable);
+int     nfct_initiator_select_passive_target(nfc_device *pnd, const nfc_modulation nm, const uint8_t *pbtInitData, const size_t szInitData, nfc_target *pnt);
+int     nfct_initiator_transceive_bytes(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx, const size_t szRx, int timeout);
+int     nfct_initiator_transceive_bits(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTxBits, const uint8_t *pbtTxPar, uint8_t *pbtRx, const size_t szRx, uint8_t *pbtRxPar);
+
+#endif // _NFC_TRANSPORT_H_
@@ -59,6 +59,29 @@ oddparity_bytes_ts(const uint8_t *pbtData, const size_t szLen, uint8_t *pbtPar)
   }
 }
 
+uint64_t
+fnv1a64(const uint8_t *pbtData, const size_t szLen)
+{
+  // FNV-1a, cf http://www.isthe.com/chongo/tech/comp/fnv/
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t szPos = 0; szPos < szLen; szPos++) {
+    h ^= pbtData[szPos];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+size_t
+bit_count64(uint64_t ui64)
+{
+  size_t szBits = 0;
+
+  // Clear the lowest bit set until none is left
+  for (; ui64 != 0; ui64 &= ui64 - 1)
+    szBits++;
+  return szBits;
+}
+
 void
 print_hex(const uint8_t *pbtData, const size_t szBytes)
 {
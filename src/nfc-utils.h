@@ -95,6 +95,9 @@
 uint8_t  oddparity(const uint8_t bt);
 void    oddparity_bytes_ts(const uint8_t *pbtData, const size_t szLen, uint8_t *pbtPar);
 
+uint64_t fnv1a64(const uint8_t *pbtData, const size_t szLen);
+size_t  bit_count64(uint64_t ui64);
+
 void    print_hex(const uint8_t *pbtData, const size_t szLen);
 void    print_hex_bits(const uint8_t *pbtData, const size_t szBits);
 void    print_hex_par(const uint8_t *pbtData, const size_t szBits, const uint8_t *pbtDataPar);